@@ -27,6 +27,8 @@ Creation:
 
     v1 = vec::uniform_rnd(3);   // Vector of random numbers in (0,3)
     v1 = vec::normal_rnd(42);   // Gaussian noise vector with sigma = 42
+    pcg32 gen(seed);
+    v1 = vec::uniform_rnd(gen, 3);  // [0,3), drawn from a local generator
 
 Assignment:
     v1 = v2;
@@ -245,6 +247,25 @@ public:
 		return result;
 	}
 
+	// Versions drawing from a caller-owned generator (see mathutil.h)
+	template <class G>
+	static inline Vec<D,T> uniform_rnd(G &gen, T sigma = 1)
+	{
+		Vec result(VEC_UNINITIALIZED);
+		for (size_type i = 0; i < D; i++)
+			result[i] = ::trimesh::uniform_rnd(gen, sigma);
+		return result;
+	}
+
+	template <class G>
+	static inline Vec<D,T> normal_rnd(G &gen, T sigma = 1)
+	{
+		Vec result(VEC_UNINITIALIZED);
+		for (size_type i = 0; i < D; i++)
+			result[i] = ::trimesh::normal_rnd(gen, sigma);
+		return result;
+	}
+
 	// Assignment operator equivalents of the one-parameter constructors
 	template <class S>
 	inline typename ::std::enable_if< ::std::is_arithmetic<S>::value, Vec & >::type
@@ -0,0 +1,157 @@
+#include "aobake.h"
+#include "contenthash.h"
+#include "pathtracer.h"
+#include "parallel.h"
+#include "sampler.h"
+
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QFile>
+
+#include <atomic>
+#include <cmath>
+
+namespace {
+
+const quint32 aoMagic = 0x52524f41;     // "AORR"
+const quint32 aoVersion = 1;
+
+} // namespace
+
+unsigned long long AoBake::content_hash(const scene &s) const {
+    unsigned long long h = fnv1aBasis;
+    h = fnv1a(h, &settings.samples, sizeof(settings.samples));
+    h = fnv1a(h, &settings.maxDistance, sizeof(settings.maxDistance));
+    for (auto o : s.objects) {
+        for (auto v : o->get_vertices()) {
+            h = fnv1a(h, &v->position.x, 3 * sizeof(float));
+            h = fnv1a(h, &v->normal.x, 3 * sizeof(float));
+        }
+        // Topology too, since the faces decide what occludes
+        for (auto f : o->get_faces()) {
+            int ids[3] = { f->pEdge->pVertex->id, f->pEdge->pNext->pVertex->id,
+                f->pEdge->pNext->pNext->pVertex->id };
+            h = fnv1a(h, ids, sizeof(ids));
+        }
+    }
+    return h;
+}
+
+AoBakeStats AoBake::bake(const scene &s, const QString &cacheFile) {
+    AoBakeStats stats;
+    QElapsedTimer timer;
+    timer.start();
+
+    unsigned long long hash = 0;
+    if (!cacheFile.isEmpty()) {
+        hash = content_hash(s);
+        if (load(cacheFile, hash, s)) {
+            stats.cached = true;
+            stats.seconds = timer.nsecsElapsed() * 1e-9;
+            return stats;
+        }
+    }
+
+    // One flat index over the vertices of all objects, so that a scene of
+    // one big and several small meshes still balances across threads
+    std::vector<std::pair<int, vertex*>> jobs;
+    visibility.assign(s.objects.size(), std::vector<float>());
+    for (int i = 0; i < static_cast<int>(s.objects.size()); i++) {
+        std::vector<vertex*> vs = s.objects[i]->get_vertices();
+        visibility[i].assign(vs.size(), 1.f);
+        for (auto v : vs)
+            jobs.push_back(std::make_pair(i, v));
+    }
+
+    std::atomic<long long> rays(0);
+    double maxSquared = static_cast<double>(settings.maxDistance) * settings.maxDistance;
+    parallel_for(0, static_cast<int>(jobs.size()), [&](int j) {
+        int objectId = jobs[j].first;
+        const vertex *v = jobs[j].second;
+        Vector n(v->normal.x, v->normal.y, v->normal.z);
+        double len2 = n * n;
+        if (len2 <= 0)
+            return;
+        n = n / std::sqrt(len2);
+
+        // Off the surface, against self-intersection at the vertex
+        Point origin = Point(v->position.x, v->position.y, v->position.z) + n * 1e-4;
+        int open = 0;
+        for (int k = 0; k < settings.samples; k++) {
+            Sampler sampler(SOBOL_SAMPLER, v->id, objectId, static_cast<unsigned>(k));
+            float u1, u2;
+            sampler.get_2d(u1, u2);
+            Vector d = sample_cosine_hemisphere(n, u1, u2);
+            if (!s.occluded(Ray(origin, d), maxSquared))
+                open++;
+        }
+        visibility[objectId][v->id] = settings.samples > 0 ? static_cast<float>(open) / settings.samples : 1.f;
+        rays += settings.samples;
+    }, settings.numThreads, 64);
+
+    stats.rays = rays;
+    stats.seconds = timer.nsecsElapsed() * 1e-9;
+    if (!cacheFile.isEmpty())
+        save(cacheFile, hash);
+    return stats;
+}
+
+std::vector<float> AoBake::raw_stream(const scene &s) const {
+    std::vector<float> stream;
+    for (int i = 0; i < static_cast<int>(s.objects.size()); i++) {
+        for (const vertex &v : s.objects[i]->raw_data()) {
+            bool known = i < static_cast<int>(visibility.size()) && v.id >= 0
+                && v.id < static_cast<int>(visibility[i].size());
+            stream.push_back(known ? visibility[i][v.id] : 1.f);
+        }
+    }
+    return stream;
+}
+
+bool AoBake::load(const QString &fileName, unsigned long long hash, const scene &s) {
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream in(&file);
+    in.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    quint32 magic, version;
+    quint64 storedHash;
+    quint32 objectCount;
+    in >> magic >> version >> storedHash >> objectCount;
+    if (in.status() != QDataStream::Ok || magic != aoMagic || version != aoVersion || storedHash != hash
+        || objectCount != s.objects.size())
+        return false;
+
+    std::vector<std::vector<float>> loaded(objectCount);
+    for (quint32 i = 0; i < objectCount; i++) {
+        quint32 count;
+        in >> count;
+        if (count != s.objects[i]->get_vertices().size())
+            return false;
+        loaded[i].resize(count);
+        for (float &a : loaded[i])
+            in >> a;
+    }
+    if (in.status() != QDataStream::Ok)
+        return false;
+
+    visibility.swap(loaded);
+    return true;
+}
+
+bool AoBake::save(const QString &fileName, unsigned long long hash) const {
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    QDataStream out(&file);
+    out.setFloatingPointPrecision(QDataStream::SinglePrecision);
+    out << aoMagic << aoVersion << quint64(hash) << quint32(visibility.size());
+    for (const std::vector<float> &v : visibility) {
+        out << quint32(v.size());
+        for (float a : v)
+            out << a;
+    }
+    return out.status() == QDataStream::Ok;
+}
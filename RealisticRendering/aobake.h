@@ -0,0 +1,53 @@
+#pragma once
+
+#include "scene.h"
+
+#include <QString>
+
+#include <vector>
+
+struct AoBakeSettings {
+    int samples;            // hemisphere rays per vertex
+    float maxDistance;      // occluders farther away than this do not darken
+    int numThreads;         // 0 for all hardware threads
+
+    AoBakeSettings() : samples(64), maxDistance(1.f), numThreads(0) {}
+};
+
+struct AoBakeStats {
+    long long rays;         // 0 if the result came from the cache
+    double seconds;
+    bool cached;
+
+    AoBakeStats() : rays(0), seconds(0), cached(false) {}
+
+    double rays_per_second() const {
+        return seconds > 0 ? rays / seconds : 0;
+    }
+};
+
+// Ambient occlusion baked per vertex, for the raster path's ambient term.
+// Each vertex casts cosine-distributed shadow rays over the hemisphere of
+// its normal through the scene BVH, all vertices of all objects spread over
+// the worker threads; the result is the unoccluded fraction, 1 for open sky.
+//
+// With a cache file the result is stored there together with a hash of the
+// scene geometry and the settings, and later bakes of the same scene read
+// it back instead of tracing.
+class AoBake {
+public:
+    AoBakeSettings settings;
+    // visibility[objectId][vertexId]
+    std::vector<std::vector<float>> visibility;
+
+public:
+    AoBakeStats bake(const scene &s, const QString &cacheFile = QString());
+
+    // One value per vertex of o->raw_data(), for a vertex buffer
+    std::vector<float> raw_stream(const scene &s) const;
+
+private:
+    unsigned long long content_hash(const scene &s) const;
+    bool load(const QString &fileName, unsigned long long hash, const scene &s);
+    bool save(const QString &fileName, unsigned long long hash) const;
+};
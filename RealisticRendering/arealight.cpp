@@ -0,0 +1,87 @@
+#include "arealight.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const double pi = 3.14159265358979323846;
+
+Vector to_vector(const QVector3D &v) {
+    return Vector(v.x(), v.y(), v.z());
+}
+
+bool sample_rect(const Light &light, const Point &p, float u1, float u2, AreaLightSample &sample) {
+    Vector e1 = to_vector(light.Edge1), e2 = to_vector(light.Edge2);
+    Vector normal = CGAL::cross_product(e1, e2);
+    double area = std::sqrt(normal * normal);
+    if (area <= 0)
+        return false;
+    normal = normal / area;
+
+    Point q = Point(light.Position.x(), light.Position.y(), light.Position.z()) + (u1 - 0.5) * e1 + (u2 - 0.5) * e2;
+    Vector d = q - p;
+    double d2 = d * d;
+    if (d2 <= 0)
+        return false;
+    sample.direction = d / std::sqrt(d2);
+    double cosLight = -(sample.direction * normal);
+    if (cosLight <= 0)
+        return false;
+    sample.squaredDistance = d2;
+    sample.weight = static_cast<float>(area * cosLight / d2);
+    return true;
+}
+
+// Uniform over the cone of directions the sphere covers from p
+bool sample_sphere(const Light &light, const Point &p, float u1, float u2, AreaLightSample &sample) {
+    Point c(light.Position.x(), light.Position.y(), light.Position.z());
+    double r = light.Radius;
+    Vector toCenter = c - p;
+    double dc2 = toCenter * toCenter;
+    if (r <= 0 || dc2 <= r * r)
+        return false;
+
+    double dc = std::sqrt(dc2);
+    Vector w = toCenter / dc;
+    double sin2ThetaMax = r * r / dc2;
+    double cosThetaMax = std::sqrt(std::max(0.0, 1 - sin2ThetaMax));
+    // 1 - cosThetaMax loses everything to rounding for small spheres
+    double oneMinusCosMax = sin2ThetaMax < 1e-4 ? sin2ThetaMax / 2 : 1 - cosThetaMax;
+    double cosTheta = 1 - u1 * oneMinusCosMax;
+    double sinTheta = std::sqrt(std::max(0.0, 1 - cosTheta * cosTheta));
+    double phi = 2 * pi * u2;
+
+    // Orthonormal basis (Duff et al. 2017)
+    double sign = w.z() >= 0 ? 1.0 : -1.0;
+    double a = -1.0 / (sign + w.z());
+    double b = w.x() * w.y() * a;
+    Vector t(1 + sign * w.x() * w.x() * a, sign * b, -sign * w.x());
+    Vector s(b, sign + w.y() * w.y() * a, -w.y());
+    sample.direction = sinTheta * std::cos(phi) * t + sinTheta * std::sin(phi) * s + cosTheta * w;
+
+    // Nearest point on the sphere along the sampled direction
+    double proj = sample.direction * toCenter;
+    double tHit = proj - std::sqrt(std::max(0.0, proj * proj - (dc2 - r * r)));
+    sample.squaredDistance = tHit * tHit;
+    sample.weight = static_cast<float>(2 * pi * oneMinusCosMax);
+    return true;
+}
+
+} // namespace
+
+bool sample_area_light(const Light &light, const Point &p, float u1, float u2, AreaLightSample &sample) {
+    if (light.Type == RECT_LIGHT)
+        return sample_rect(light, p, u1, u2, sample);
+    if (light.Type == SPHERE_LIGHT)
+        return sample_sphere(light, p, u1, u2, sample);
+    return false;
+}
+
+float area_light_area(const Light &light) {
+    if (light.Type == RECT_LIGHT)
+        return QVector3D::crossProduct(light.Edge1, light.Edge2).length();
+    if (light.Type == SPHERE_LIGHT)
+        return static_cast<float>(4 * pi * light.Radius * light.Radius);
+    return 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "scene.h"
+#include "light.h"
+
+// One point on an area light, seen from a shading point
+struct AreaLightSample {
+    Vector direction;           // unit, from the shading point toward the sample
+    double squaredDistance;     // a shadow ray has to clear
+    // Turns the light's radiance into the intensity of a point light at the
+    // sample that lights the shading point the same: area * cos / d^2 for
+    // rectangles, which are sampled by area, and the subtended solid angle
+    // for spheres, which are sampled by direction
+    float weight;
+};
+
+// Sample of the light for shading p, from (u1, u2) in [0, 1)^2. Stratify
+// (u1, u2) to stratify over the light. False if the sample cannot light p,
+// e.g. it lies on the back of a rectangle or p is inside a sphere.
+bool sample_area_light(const Light &light, const Point &p, float u1, float u2, AreaLightSample &sample);
+
+// Surface area of a rectangle or sphere light
+float area_light_area(const Light &light);
@@ -0,0 +1,661 @@
+#include "bvh.h"
+#include "parallel.h"
+
+#include <cmath>
+
+namespace {
+
+// Depth past which splits go to the object median, which bounds the tree
+// depth (and the traversal stack) for any input
+const int sahDepthLimit = Bvh::maxDepth - 40;
+const int maxBins = 32;
+// Subtrees at least this large become tasks of their own
+const int taskSize = 4096;
+// Nodes at least this large are binned and partitioned with parallel loops
+const int parallelNodeSize = 1 << 15;
+const int chunkSize = 1 << 13;
+
+// Plain data so that a node's bins cost nothing to set up beyond reset()
+struct Bin {
+    float lo[3], hi[3];     // primitive bounds
+    float clo[3], chi[3];   // centroid bounds
+    int count;
+
+    void reset() {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = clo[a] = 1e30f;
+            hi[a] = chi[a] = -1e30f;
+        }
+        count = 0;
+    }
+    void grow(const BvhBox &b, const float c[3]) {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], b.lo[a]);
+            hi[a] = std::max(hi[a], b.hi[a]);
+            clo[a] = std::min(clo[a], c[a]);
+            chi[a] = std::max(chi[a], c[a]);
+        }
+        count++;
+    }
+    void add(const Bin &b) {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], b.lo[a]);
+            hi[a] = std::max(hi[a], b.hi[a]);
+            clo[a] = std::min(clo[a], b.clo[a]);
+            chi[a] = std::max(chi[a], b.chi[a]);
+        }
+        count += b.count;
+    }
+    float area() const {
+        if (count == 0)
+            return 0;
+        float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+    BvhBox bounds() const {
+        BvhBox b;
+        for (int a = 0; a < 3; a++) {
+            b.lo[a] = lo[a];
+            b.hi[a] = hi[a];
+        }
+        return b;
+    }
+    BvhBox centroids() const {
+        BvhBox b;
+        for (int a = 0; a < 3; a++) {
+            b.lo[a] = clo[a];
+            b.hi[a] = chi[a];
+        }
+        return b;
+    }
+};
+
+struct BinSet {
+    Bin bins[3][maxBins];
+
+    void reset(int binCount) {
+        for (int a = 0; a < 3; a++) {
+            for (int k = 0; k < binCount; k++)
+                bins[a][k].reset();
+        }
+    }
+    void add(const BinSet &o, int binCount) {
+        for (int a = 0; a < 3; a++) {
+            for (int k = 0; k < binCount; k++)
+                bins[a][k].add(o.bins[a][k]);
+        }
+    }
+};
+
+// State shared by all tasks of one build. Node pairs are handed out from an
+// atomic counter, so tasks never touch the same part of either array.
+class BvhBuild {
+public:
+    BvhBuild(const BvhSettings &settings, const std::vector<BvhBox> &primBounds,
+        std::vector<BvhNode> &nodes, std::vector<int> &prims)
+        : settings(settings), boxes(primBounds), nodes(nodes), prims(prims),
+        // Small trees are not worth starting threads for
+        scheduler(static_cast<int>(primBounds.size()) < taskSize ? 1 : settings.numThreads), nodeCount(1) {
+        binCount = std::max(2, std::min(maxBins, settings.binCount));
+        int n = static_cast<int>(boxes.size());
+        centroids.resize(3 * n);
+        parallel_for(0, n, [&](int i) {
+            for (int a = 0; a < 3; a++)
+                centroids[3 * i + a] = boxes[i].centroid(a);
+        }, scheduler.thread_count(), chunkSize);
+    }
+
+    void build_sah() {
+        int n = static_cast<int>(boxes.size());
+        BvhBox bounds, centroidBounds;
+        bounds_of(0, n, true, bounds, centroidBounds);
+        scheduler.spawn([=]() { sah_node(0, 0, n, 0, bounds, centroidBounds); });
+        scheduler.run();
+        nodes.resize(nodeCount);
+    }
+
+    void build_lbvh();
+
+private:
+    const BvhSettings &settings;
+    const std::vector<BvhBox> &boxes;
+    std::vector<BvhNode> &nodes;
+    std::vector<int> &prims;
+    std::vector<float> centroids;
+    std::vector<unsigned> codes;    // LBVH: Morton code of prims[i]
+    TaskScheduler scheduler;
+    std::atomic<int> nodeCount;
+    int binCount;
+
+    const float *centroid(int prim) const { return &centroids[3 * prim]; }
+
+    int allocate_pair() { return nodeCount.fetch_add(2); }
+
+    // Large ranges are only ever reduced near the root, where the other
+    // threads have nothing to do yet
+    bool parallel_range(int count, int depth) const {
+        return count >= parallelNodeSize && (1 << std::min(depth, 30)) < scheduler.thread_count();
+    }
+
+    void bounds_of(int begin, int end, bool parallel, BvhBox &bounds, BvhBox &centroidBounds) {
+        int chunks = (end - begin + chunkSize - 1) / chunkSize;
+        std::vector<BvhBox> b(chunks), cb(chunks);
+        parallel_for(0, chunks, [&](int k) {
+            int stop = std::min(end, begin + (k + 1) * chunkSize);
+            for (int i = begin + k * chunkSize; i < stop; i++) {
+                b[k].grow(boxes[prims[i]]);
+                cb[k].grow(centroid(prims[i]));
+            }
+        }, parallel ? scheduler.thread_count() : 1);
+        for (int k = 0; k < chunks; k++) {
+            bounds.grow(b[k]);
+            centroidBounds.grow(cb[k]);
+        }
+    }
+
+    int bin_index(int prim, int axis, const BvhBox &centroidBounds, float scale) const {
+        int k = static_cast<int>((centroid(prim)[axis] - centroidBounds.lo[axis]) * scale);
+        return std::max(0, std::min(binCount - 1, k));
+    }
+
+    void bin_range(int begin, int end, const BvhBox &centroidBounds, const float scale[3], BinSet &set) const {
+        for (int i = begin; i < end; i++) {
+            int p = prims[i];
+            for (int a = 0; a < 3; a++) {
+                if (scale[a] <= 0)
+                    continue;
+                set.bins[a][bin_index(p, a, centroidBounds, scale[a])].grow(boxes[p], centroid(p));
+            }
+        }
+    }
+
+    // Stable partition by pred; in parallel through a scratch copy. Both
+    // paths keep the order, so the tree does not depend on which one ran.
+    template <class Pred>
+    int partition(int begin, int end, bool parallel, Pred pred) {
+        if (!parallel)
+            return static_cast<int>(std::stable_partition(prims.begin() + begin, prims.begin() + end, pred) - prims.begin());
+
+        int chunks = (end - begin + chunkSize - 1) / chunkSize;
+        std::vector<int> leftCount(chunks + 1, 0);
+        parallel_for(0, chunks, [&](int k) {
+            int stop = std::min(end, begin + (k + 1) * chunkSize);
+            for (int i = begin + k * chunkSize; i < stop; i++)
+                leftCount[k + 1] += pred(prims[i]) ? 1 : 0;
+        }, scheduler.thread_count());
+        for (int k = 0; k < chunks; k++)
+            leftCount[k + 1] += leftCount[k];
+
+        int totalLeft = leftCount[chunks];
+        std::vector<int> scratch(prims.begin() + begin, prims.begin() + end);
+        parallel_for(0, chunks, [&](int k) {
+            int l = begin + leftCount[k];
+            int r = begin + totalLeft + (k * chunkSize - leftCount[k]);
+            int stop = std::min(end - begin, (k + 1) * chunkSize);
+            for (int i = k * chunkSize; i < stop; i++) {
+                if (pred(scratch[i]))
+                    prims[l++] = scratch[i];
+                else
+                    prims[r++] = scratch[i];
+            }
+        }, scheduler.thread_count());
+        return begin + totalLeft;
+    }
+
+    void set_bounds(int node, const BvhBox &b) {
+        for (int a = 0; a < 3; a++) {
+            nodes[node].lo[a] = b.lo[a];
+            nodes[node].hi[a] = b.hi[a];
+        }
+    }
+
+    void make_leaf(int node, int begin, int end) {
+        nodes[node].first = begin;
+        nodes[node].count = end - begin;
+    }
+
+    // Turns node into an interior node and builds its children, the larger
+    // ones as tasks
+    template <class Child>
+    void recurse(int node, int begin, int mid, int end, Child child) {
+        int pair = allocate_pair();
+        nodes[node].first = pair;
+        nodes[node].count = 0;
+        if (mid - begin >= taskSize)
+            scheduler.spawn([=]() { child(pair, begin, mid); });
+        else
+            child(pair, begin, mid);
+        child(pair + 1, mid, end);
+    }
+
+    void sah_node(int node, int begin, int end, int depth, const BvhBox &bounds, const BvhBox &centroidBounds);
+    void lbvh_node(int node, int begin, int end, int depth);
+};
+
+void BvhBuild::sah_node(int node, int begin, int end, int depth, const BvhBox &bounds, const BvhBox &centroidBounds) {
+    set_bounds(node, bounds);
+    int count = end - begin;
+    if (count == 1) {
+        make_leaf(node, begin, end);
+        return;
+    }
+
+    // Binned SAH (Wald 2007): binCount - 1 candidate planes on every axis,
+    // all three axes binned in one pass
+    float scale[3];
+    for (int a = 0; a < 3; a++) {
+        float extent = centroidBounds.hi[a] - centroidBounds.lo[a];
+        scale[a] = extent > 0 && depth < sahDepthLimit ? binCount / extent : 0;
+    }
+
+    bool parallel = parallel_range(count, depth);
+    BinSet bins;
+    bins.reset(binCount);
+    if (parallel) {
+        int chunks = (count + chunkSize - 1) / chunkSize;
+        std::vector<BinSet> partial(chunks);
+        parallel_for(0, chunks, [&](int k) {
+            partial[k].reset(binCount);
+            bin_range(begin + k * chunkSize, std::min(end, begin + (k + 1) * chunkSize), centroidBounds, scale, partial[k]);
+        }, scheduler.thread_count());
+        for (auto &p : partial)
+            bins.add(p, binCount);
+    }
+    else {
+        bin_range(begin, end, centroidBounds, scale, bins);
+    }
+
+    float bestCost = 1e30f;
+    int bestAxis = -1, bestSplit = 0;
+    for (int a = 0; a < 3; a++) {
+        if (scale[a] <= 0)
+            continue;
+
+        // Sweep from the right, then from the left
+        float rightArea[maxBins];
+        int rightCount[maxBins];
+        Bin acc;
+        acc.reset();
+        for (int k = binCount - 1; k > 0; k--) {
+            acc.add(bins.bins[a][k]);
+            rightArea[k] = acc.area();
+            rightCount[k] = acc.count;
+        }
+        acc.reset();
+        for (int k = 0; k < binCount - 1; k++) {
+            acc.add(bins.bins[a][k]);
+            if (acc.count == 0 || rightCount[k + 1] == 0)
+                continue;
+            float cost = acc.area() * acc.count + rightArea[k + 1] * rightCount[k + 1];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = a;
+                bestSplit = k + 1;
+            }
+        }
+    }
+
+    if (bestAxis < 0) {
+        if (count <= settings.maxLeafSize) {
+            make_leaf(node, begin, end);
+            return;
+        }
+
+        // All centroids coincide or the tree got too deep: split in half
+        int axis = 0;
+        for (int a = 1; a < 3; a++) {
+            if (centroidBounds.hi[a] - centroidBounds.lo[a] > centroidBounds.hi[axis] - centroidBounds.lo[axis])
+                axis = a;
+        }
+        // Ties go by primitive id, so each half gets the same primitives
+        int mid = begin + count / 2;
+        std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end, [&](int p, int q) {
+            float cp = centroid(p)[axis], cq = centroid(q)[axis];
+            return cp < cq || (cp == cq && p < q);
+        });
+
+        BvhBox lb, lcb, rb, rcb;
+        bounds_of(begin, mid, parallel, lb, lcb);
+        bounds_of(mid, end, parallel, rb, rcb);
+        recurse(node, begin, mid, end, [=](int child, int b, int e) {
+            sah_node(child, b, e, depth + 1, b == begin ? lb : rb, b == begin ? lcb : rcb);
+        });
+        return;
+    }
+
+    float area = bounds.area();
+    float splitCost = settings.traversalCost + settings.intersectionCost * (area > 0 ? bestCost / area : 0);
+    if (splitCost >= settings.intersectionCost * count && count <= settings.maxLeafSize) {
+        make_leaf(node, begin, end);
+        return;
+    }
+
+    // The children's boxes fall out of the bins
+    Bin left, right;
+    left.reset();
+    right.reset();
+    for (int k = 0; k < binCount; k++)
+        (k < bestSplit ? left : right).add(bins.bins[bestAxis][k]);
+
+    float s = scale[bestAxis];
+    int mid = partition(begin, end, parallel, [&](int p) {
+        return bin_index(p, bestAxis, centroidBounds, s) < bestSplit;
+    });
+    recurse(node, begin, mid, end, [=](int child, int b, int e) {
+        const Bin &side = b == begin ? left : right;
+        sah_node(child, b, e, depth + 1, side.bounds(), side.centroids());
+    });
+}
+
+// Spreads the lower 10 bits of x out to every third bit
+inline unsigned expand_bits(unsigned x) {
+    x = (x * 0x00010001u) & 0xff0000ffu;
+    x = (x * 0x00000101u) & 0x0f00f00fu;
+    x = (x * 0x00000011u) & 0xc30c30c3u;
+    x = (x * 0x00000005u) & 0x49249249u;
+    return x;
+}
+
+void BvhBuild::build_lbvh() {
+    int n = static_cast<int>(boxes.size());
+    BvhBox bounds, centroidBounds;
+    bounds_of(0, n, true, bounds, centroidBounds);
+
+    // 30-bit Morton codes of the centroids (Lauterbach et al. 2009)
+    std::vector<unsigned long long> keys(n);
+    parallel_for(0, n, [&](int i) {
+        unsigned code = 0;
+        for (int a = 0; a < 3; a++) {
+            float extent = centroidBounds.hi[a] - centroidBounds.lo[a];
+            float u = extent > 0 ? (centroid(i)[a] - centroidBounds.lo[a]) / extent : 0.5f;
+            unsigned q = static_cast<unsigned>(std::min(1023.f, std::max(0.f, u * 1024)));
+            code |= expand_bits(q) << (2 - a);
+        }
+        keys[i] = (static_cast<unsigned long long>(code) << 32) | static_cast<unsigned>(i);
+    }, scheduler.thread_count(), chunkSize);
+
+    // LSD radix sort on the code, 10 bits per pass
+    std::vector<unsigned long long> tmp(n);
+    for (int shift = 32; shift < 62; shift += 10) {
+        int histogram[1025] = {};
+        for (int i = 0; i < n; i++)
+            histogram[((keys[i] >> shift) & 1023) + 1]++;
+        for (int k = 0; k < 1024; k++)
+            histogram[k + 1] += histogram[k];
+        for (int i = 0; i < n; i++)
+            tmp[histogram[(keys[i] >> shift) & 1023]++] = keys[i];
+        keys.swap(tmp);
+    }
+
+    codes.resize(n);
+    for (int i = 0; i < n; i++) {
+        prims[i] = static_cast<int>(keys[i] & 0xffffffffu);
+        codes[i] = static_cast<unsigned>(keys[i] >> 32);
+    }
+
+    scheduler.spawn([=]() { lbvh_node(0, 0, n, 0); });
+    scheduler.run();
+    nodes.resize(nodeCount);
+}
+
+void BvhBuild::lbvh_node(int node, int begin, int end, int depth) {
+    int count = end - begin;
+    if (count <= settings.maxLeafSize) {
+        make_leaf(node, begin, end);
+        return;
+    }
+
+    // Split where the highest differing code bit flips (Karras 2012);
+    // identical codes are split in half
+    int mid = begin + count / 2;
+    unsigned first = codes[begin], last = codes[end - 1];
+    if (first != last && depth < sahDepthLimit) {
+        unsigned diff = first ^ last;
+        unsigned bit = 1u << 31;
+        while (!(diff & bit))
+            bit >>= 1;
+        mid = static_cast<int>(std::lower_bound(codes.begin() + begin, codes.begin() + end, bit,
+            [&](unsigned code, unsigned b) { return !(code & b); }) - codes.begin());
+    }
+
+    recurse(node, begin, mid, end, [=](int child, int b, int e) { lbvh_node(child, b, e, depth + 1); });
+}
+
+} // namespace
+
+Bvh &Bvh::operator=(const Bvh &other) {
+    settings = other.settings;
+    nodes = other.nodes;
+    primIndices = other.primIndices;
+    builtCost = other.builtCost;
+    if (other.attached()) {
+        pNodes = other.pNodes;
+        pPrims = other.pPrims;
+        nodeCount = other.nodeCount;
+        primCount = other.primCount;
+    }
+    else {
+        use_owned();
+    }
+    return *this;
+}
+
+void Bvh::use_owned() {
+    pNodes = nodes.data();
+    pPrims = primIndices.data();
+    nodeCount = static_cast<int>(nodes.size());
+    primCount = static_cast<int>(primIndices.size());
+}
+
+void Bvh::clear() {
+    nodes.clear();
+    primIndices.clear();
+    builtCost = 0;
+    use_owned();
+}
+
+void Bvh::attach(const BvhNode *nodeArray, int nodeArraySize, const int *prims, int primArraySize, float cost) {
+    nodes.clear();
+    primIndices.clear();
+    pNodes = nodeArray;
+    nodeCount = nodeArraySize;
+    pPrims = prims;
+    primCount = primArraySize;
+    builtCost = cost;
+}
+
+BvhBox Bvh::bounds() const {
+    BvhBox b;
+    if (nodeCount > 0) {
+        for (int a = 0; a < 3; a++) {
+            b.lo[a] = pNodes[0].lo[a];
+            b.hi[a] = pNodes[0].hi[a];
+        }
+    }
+    return b;
+}
+
+void Bvh::build(const std::vector<BvhBox> &primBounds) {
+    clear();
+    int n = static_cast<int>(primBounds.size());
+    if (n == 0)
+        return;
+
+    primIndices.resize(n);
+    for (int i = 0; i < n; i++)
+        primIndices[i] = i;
+    // A binary tree with at most n leaves
+    nodes.resize(2 * n - 1);
+
+    BvhBuild build(settings, primBounds, nodes, primIndices);
+    if (settings.builder == LBVH_BUILDER) {
+        build.build_lbvh();
+        // Morton order says nothing about the boxes
+        refit(primBounds);
+    }
+    else {
+        build.build_sah();
+    }
+    use_owned();
+    builtCost = sah_cost();
+}
+
+void Bvh::refit(const std::vector<BvhBox> &primBounds) {
+    if (attached()) {
+        nodes.assign(pNodes, pNodes + nodeCount);
+        primIndices.assign(pPrims, pPrims + primCount);
+        use_owned();
+    }
+
+    for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; i--) {
+        BvhNode &node = nodes[i];
+        BvhBox b;
+        if (node.is_leaf()) {
+            for (int j = node.first; j < node.first + node.count; j++)
+                b.grow(primBounds[primIndices[j]]);
+        }
+        else {
+            const BvhNode &left = nodes[node.first], &right = nodes[node.first + 1];
+            for (int a = 0; a < 3; a++) {
+                b.lo[a] = std::min(left.lo[a], right.lo[a]);
+                b.hi[a] = std::max(left.hi[a], right.hi[a]);
+            }
+        }
+        for (int a = 0; a < 3; a++) {
+            node.lo[a] = b.lo[a];
+            node.hi[a] = b.hi[a];
+        }
+    }
+}
+
+float Bvh::sah_cost() const {
+    if (nodeCount == 0)
+        return 0;
+
+    float rootArea = bounds().area();
+    if (rootArea <= 0)
+        return settings.intersectionCost * static_cast<float>(primCount);
+
+    double cost = 0;
+    for (int i = 0; i < nodeCount; i++) {
+        const BvhNode &node = pNodes[i];
+        BvhBox b;
+        for (int a = 0; a < 3; a++) {
+            b.lo[a] = node.lo[a];
+            b.hi[a] = node.hi[a];
+        }
+        float perNode = node.is_leaf() ? settings.intersectionCost * node.count : settings.traversalCost;
+        cost += perNode * b.area();
+    }
+    return static_cast<float>(cost / rootArea);
+}
+
+BvhBox BvhTriangle::bounds() const {
+    BvhBox b;
+    float v1[3], v2[3];
+    for (int a = 0; a < 3; a++) {
+        v1[a] = v0[a] + e1[a];
+        v2[a] = v0[a] + e2[a];
+    }
+    b.grow(v0);
+    b.grow(v1);
+    b.grow(v2);
+    return b;
+}
+
+float BvhTriangle::intersect(const BvhRay &ray, float tMax) const {
+    const float *d = ray.dir;
+    float p[3] = { d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0] };
+    float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    if (std::fabs(det) < 1e-12f)
+        return -1;
+
+    float inv = 1 / det;
+    float s[3] = { ray.org[0] - v0[0], ray.org[1] - v0[1], ray.org[2] - v0[2] };
+    float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv;
+    if (u < 0 || u > 1)
+        return -1;
+
+    float q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0] };
+    float v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inv;
+    if (v < 0 || u + v > 1)
+        return -1;
+
+    float t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv;
+    return t > 0 && t < tMax ? t : -1;
+}
+
+MeshBvh &MeshBvh::operator=(const MeshBvh &other) {
+    bvh = other.bvh;
+    triangles = other.triangles;
+    backing = other.backing;
+    if (backing) {
+        pTriangles = other.pTriangles;
+        triangleCount = other.triangleCount;
+    }
+    else {
+        use_owned();
+    }
+    return *this;
+}
+
+void MeshBvh::use_owned() {
+    pTriangles = triangles.data();
+    triangleCount = static_cast<int>(triangles.size());
+}
+
+std::vector<BvhBox> MeshBvh::primitive_bounds() const {
+    std::vector<BvhBox> bounds(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++)
+        bounds[i] = triangles[i].bounds();
+    return bounds;
+}
+
+void MeshBvh::build() {
+    use_owned();
+    bvh.build(primitive_bounds());
+    backing.reset();
+}
+
+bool MeshBvh::update() {
+    use_owned();
+    std::vector<BvhBox> bounds = primitive_bounds();
+    // Copies an attached tree out before the backing goes away
+    bvh.refit(bounds);
+    backing.reset();
+    if (!bvh.needs_rebuild())
+        return false;
+    bvh.build(bounds);
+    return true;
+}
+
+void MeshBvh::attach(const BvhNode *nodes, int nodeCount, const int *prims, int primCount, float builtCost,
+    const BvhTriangle *triangleArray, int triangleArraySize, std::shared_ptr<const void> keepAlive) {
+    bvh.attach(nodes, nodeCount, prims, primCount, builtCost);
+    std::vector<BvhTriangle>().swap(triangles);
+    pTriangles = triangleArray;
+    triangleCount = triangleArraySize;
+    backing = keepAlive;
+}
+
+bool MeshBvh::intersect(const BvhRay &ray, float &tMax, int &faceId) const {
+    bool found = false;
+    bvh.traverse(ray, tMax, [&](int prim, float &tClosest) {
+        RT_STAT_INC(STAT_PRIMITIVE_TESTS);
+        float t = pTriangles[prim].intersect(ray, tClosest);
+        if (t > 0) {
+            tClosest = t;
+            faceId = prim;
+            found = true;
+        }
+        return false;
+    });
+    return found;
+}
+
+bool MeshBvh::occluded(const BvhRay &ray, float tMax) const {
+    return bvh.traverse(ray, tMax, [&](int prim, float &tClosest) {
+        RT_STAT_INC(STAT_PRIMITIVE_TESTS);
+        return pTriangles[prim].intersect(ray, tClosest) > 0;
+    });
+}
@@ -0,0 +1,289 @@
+#pragma once
+
+#include "raystats.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+// Axis aligned box in single precision
+struct BvhBox {
+    float lo[3];
+    float hi[3];
+
+    BvhBox() { clear(); }
+
+    void clear() {
+        lo[0] = lo[1] = lo[2] = 1e30f;
+        hi[0] = hi[1] = hi[2] = -1e30f;
+    }
+    bool empty() const { return lo[0] > hi[0]; }
+
+    void grow(const float p[3]) {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], p[a]);
+            hi[a] = std::max(hi[a], p[a]);
+        }
+    }
+    void grow(const BvhBox &b) {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], b.lo[a]);
+            hi[a] = std::max(hi[a], b.hi[a]);
+        }
+    }
+
+    float centroid(int axis) const { return 0.5f * (lo[axis] + hi[axis]); }
+    float area() const {
+        if (empty())
+            return 0;
+        float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+        return 2 * (dx * dy + dy * dz + dz * dx);
+    }
+};
+
+// The two children of an interior node are stored next to each other and
+// after their parent, so a reverse sweep over the array visits children
+// before parents no matter in which order a parallel build created them.
+struct BvhNode {
+    float lo[3];
+    int first;      // leaf: first entry in Bvh::primIndices; interior: left child, right is first + 1
+    float hi[3];
+    int count;      // primitives in a leaf, 0 for interior nodes
+
+    bool is_leaf() const { return count > 0; }
+};
+
+struct BvhRay {
+    float org[3];
+    float dir[3];
+    float invDir[3];
+
+    BvhRay(const float o[3], const float d[3]) {
+        for (int a = 0; a < 3; a++) {
+            org[a] = o[a];
+            dir[a] = d[a];
+            invDir[a] = 1.f / d[a];
+        }
+    }
+};
+
+enum BvhBuilder {
+    SAH_BUILDER,            // binned SAH, best trees
+    LBVH_BUILDER            // Morton code order; builds several times faster, traces slower
+};
+
+struct BvhSettings {
+    BvhBuilder builder;
+    int maxLeafSize;        // leaves are never larger than this
+    int binCount;           // SAH candidate planes per axis, at most 32
+    float traversalCost;    // SAH cost of a node visit relative to...
+    float intersectionCost; // ...one primitive test
+    float rebuildRatio;     // rebuild once the SAH cost grows past this factor
+    int numThreads;         // build threads, 0 for all hardware threads
+
+    BvhSettings() : builder(SAH_BUILDER), maxLeafSize(8), binCount(16), traversalCost(1.f),
+        intersectionCost(1.f), rebuildRatio(1.5f), numThreads(0) {}
+};
+
+// Bounding volume hierarchy over primitives given only by their boxes.
+// Used both per mesh (triangles) and as the top level over object instances.
+//
+// Both builders run on a TaskScheduler: the top levels split their node's
+// primitives with parallel loops, and below that every large subtree becomes
+// a task that idle threads steal. The tree, and so every query, is the same
+// for any BvhSettings::numThreads; only where nodes land in the array is not.
+//
+// After the primitives move, refit() recomputes every node box bottom up in
+// linear time without changing the tree. That keeps rays correct, but the
+// tree gets looser the further things drift from where they were at build
+// time; sah_cost() measures by how much, and needs_rebuild() compares it to
+// the cost right after the last build.
+class Bvh {
+public:
+    static const int maxDepth = 128;
+
+    BvhSettings settings;
+    // Owned storage. Empty while the tree reads from external arrays (see
+    // attach()); always go through node_data()/prim_data() to read.
+    std::vector<BvhNode> nodes;     // the root comes first
+    std::vector<int> primIndices;   // primitive ids in leaf order
+
+public:
+    Bvh() : builtCost(0), pNodes(nullptr), pPrims(nullptr), nodeCount(0), primCount(0) {}
+    Bvh(const Bvh &other) { *this = other; }
+    Bvh &operator=(const Bvh &other);
+
+    void build(const std::vector<BvhBox> &primBounds);
+    // Copies an attached tree into owned storage first
+    void refit(const std::vector<BvhBox> &primBounds);
+    void clear();
+
+    // Reads the tree from arrays owned by someone else, e.g. a mapped
+    // snapshot, which must stay alive until the next build(), refit() or
+    // clear()
+    void attach(const BvhNode *nodes, int nodeCount, const int *prims, int primCount, float builtCost);
+    bool attached() const { return nodeCount > 0 && nodes.empty(); }
+
+    bool empty() const { return nodeCount == 0; }
+    int node_count() const { return nodeCount; }
+    int prim_count() const { return primCount; }
+    const BvhNode *node_data() const { return pNodes; }
+    const int *prim_data() const { return pPrims; }
+    BvhBox bounds() const;
+
+    // Expected cost of a random ray, relative to the surface area of the root
+    float sah_cost() const;
+    float built_cost() const { return builtCost; }
+    bool needs_rebuild() const { return !empty() && sah_cost() > settings.rebuildRatio * builtCost; }
+
+    // Visits the leaves the ray reaches before tMax, nearest box first.
+    // leaf(primId, tMax) tests one primitive, may lower tMax, and returns
+    // true to stop the traversal (e.g. for shadow rays). Returns true if a
+    // test stopped it. Safe to call from several threads.
+    template <class LeafTest>
+    bool traverse(const BvhRay &ray, float &tMax, LeafTest &&leaf) const;
+
+private:
+    float builtCost;
+    const BvhNode *pNodes;
+    const int *pPrims;
+    int nodeCount;
+    int primCount;
+
+    // Points the views at the owned vectors
+    void use_owned();
+};
+
+// Distance along the ray to the box, or a negative value if it is missed
+// or farther than tMax
+inline float bvh_ray_box(const BvhRay &ray, const float lo[3], const float hi[3], float tMax) {
+    float t0 = 0, t1 = tMax;
+    for (int a = 0; a < 3; a++) {
+        float tNear = (lo[a] - ray.org[a]) * ray.invDir[a];
+        float tFar = (hi[a] - ray.org[a]) * ray.invDir[a];
+        if (tNear > tFar)
+            std::swap(tNear, tFar);
+        // Written so that NaN from 0 * inf leaves the interval unchanged
+        t0 = tNear > t0 ? tNear : t0;
+        t1 = tFar < t1 ? tFar : t1;
+        if (t0 > t1)
+            return -1;
+    }
+    return t0;
+}
+
+template <class LeafTest>
+bool Bvh::traverse(const BvhRay &ray, float &tMax, LeafTest &&leaf) const {
+    if (nodeCount == 0)
+        return false;
+
+    const BvhNode *nodes = pNodes;
+    RT_STAT_INC(STAT_NODE_TESTS);
+    if (bvh_ray_box(ray, nodes[0].lo, nodes[0].hi, tMax) < 0)
+        return false;
+
+    int stack[maxDepth];
+    int top = 0;
+    int current = 0;
+    for (;;) {
+        const BvhNode &node = nodes[current];
+        if (node.is_leaf()) {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                if (leaf(pPrims[i], tMax))
+                    return true;
+            }
+        }
+        else {
+            int left = node.first, right = node.first + 1;
+            RT_STAT_ADD(STAT_NODE_TESTS, 2);
+            float tLeft = bvh_ray_box(ray, nodes[left].lo, nodes[left].hi, tMax);
+            float tRight = bvh_ray_box(ray, nodes[right].lo, nodes[right].hi, tMax);
+            if (tLeft >= 0 && tRight >= 0) {
+                // Nearer child first, so tMax shrinks before the other is tested
+                if (tRight < tLeft)
+                    std::swap(left, right);
+                stack[top++] = right;
+                current = left;
+                continue;
+            }
+            if (tLeft >= 0) {
+                current = left;
+                continue;
+            }
+            if (tRight >= 0) {
+                current = right;
+                continue;
+            }
+        }
+
+        // Pop until a node is still in front of the closest hit so far
+        for (;;) {
+            if (top == 0)
+                return false;
+            current = stack[--top];
+            if (bvh_ray_box(ray, nodes[current].lo, nodes[current].hi, tMax) >= 0)
+                break;
+        }
+    }
+}
+
+// Triangle as used by the ray test: first vertex and two edges
+struct BvhTriangle {
+    float v0[3];
+    float e1[3];
+    float e2[3];
+
+    BvhTriangle() {}
+    BvhTriangle(const float a[3], const float b[3], const float c[3]) {
+        for (int i = 0; i < 3; i++) {
+            v0[i] = a[i];
+            e1[i] = b[i] - a[i];
+            e2[i] = c[i] - a[i];
+        }
+    }
+
+    BvhBox bounds() const;
+    // Moller-Trumbore; t of the hit in (0, tMax), or a negative value
+    float intersect(const BvhRay &ray, float tMax) const;
+};
+
+// A triangle mesh and its BVH
+class MeshBvh {
+public:
+    Bvh bvh;
+    // Owned triangles, indexed by face id. Empty while attached; always go
+    // through triangle_data() to read.
+    std::vector<BvhTriangle> triangles;
+
+public:
+    MeshBvh() : pTriangles(nullptr), triangleCount(0) {}
+    MeshBvh(const MeshBvh &other) { *this = other; }
+    MeshBvh &operator=(const MeshBvh &other);
+
+    // Builds over the owned triangles
+    void build();
+    // Call after the owned triangles moved; refits and rebuilds only if the
+    // tree became too loose. Returns true if it rebuilt.
+    bool update();
+
+    // Takes tree and triangles from external arrays and releases the owned
+    // triangles; 'backing' is kept alive for as long as they are used
+    void attach(const BvhNode *nodes, int nodeCount, const int *prims, int primCount, float builtCost,
+        const BvhTriangle *triangles, int triangleCount, std::shared_ptr<const void> backing);
+
+    int triangle_count() const { return triangleCount; }
+    const BvhTriangle *triangle_data() const { return pTriangles; }
+
+    // Closest hit before tMax; faceId receives the triangle
+    bool intersect(const BvhRay &ray, float &tMax, int &faceId) const;
+    // Any hit before tMax
+    bool occluded(const BvhRay &ray, float tMax) const;
+
+private:
+    const BvhTriangle *pTriangles;
+    int triangleCount;
+    std::shared_ptr<const void> backing;
+
+    void use_owned();
+    std::vector<BvhBox> primitive_bounds() const;
+};
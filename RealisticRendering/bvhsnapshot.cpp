@@ -0,0 +1,202 @@
+#include "bvhsnapshot.h"
+#include "contenthash.h"
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFileInfo>
+#include <QDebug>
+
+#include <cstring>
+
+namespace {
+
+const char snapshotMagic[8] = { 'R', 'R', 'B', 'V', 'H', 0, 0, 0 };
+const quint32 endianTag = 0x01020304;
+const qint64 sectionAlignment = 64;
+
+struct SnapshotHeader {
+    char magic[8];
+    quint32 version;
+    quint32 endian;             // endianTag in the writer's byte order
+    quint32 nodeSize;           // sizeof the stored structs
+    quint32 triangleSize;
+    quint64 contentHash;
+    quint64 nodesOffset;        // from the start of the file
+    quint64 primsOffset;
+    quint64 trianglesOffset;
+    quint64 fileSize;
+    qint32 nodeCount;
+    qint32 primCount;
+    qint32 triangleCount;
+    float builtCost;
+};
+
+qint64 align_up(qint64 offset) {
+    return (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+}
+
+bool write_section(QFile &file, qint64 offset, const void *data, qint64 bytes) {
+    static const char zeros[sectionAlignment] = {};
+    qint64 padding = offset - file.pos();
+    if (padding > 0 && file.write(zeros, padding) != padding)
+        return false;
+    return bytes == 0 || file.write(static_cast<const char*>(data), bytes) == bytes;
+}
+
+} // namespace
+
+unsigned long long bvh_content_hash(const std::vector<BvhTriangle> &triangles, const BvhSettings &settings) {
+    unsigned long long h = fnv1aBasis;
+    quint32 shape[5] = { BvhSnapshot::version, static_cast<quint32>(settings.builder),
+        static_cast<quint32>(settings.maxLeafSize), static_cast<quint32>(settings.binCount),
+        static_cast<quint32>(triangles.size()) };
+    float costs[2] = { settings.traversalCost, settings.intersectionCost };
+    h = fnv1a(h, shape, sizeof(shape));
+    h = fnv1a(h, costs, sizeof(costs));
+    return fnv1a(h, triangles.data(), triangles.size() * sizeof(BvhTriangle));
+}
+
+BvhSnapshot::~BvhSnapshot() {
+    if (data)
+        file.unmap(const_cast<uchar*>(data));
+}
+
+bool BvhSnapshot::save(const QString &fileName, const MeshBvh &mesh, unsigned long long contentHash) {
+    const Bvh &bvh = mesh.bvh;
+    if (bvh.empty())
+        return false;
+
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+    header.version = version;
+    header.endian = endianTag;
+    header.nodeSize = sizeof(BvhNode);
+    header.triangleSize = sizeof(BvhTriangle);
+    header.contentHash = contentHash;
+    header.nodeCount = bvh.node_count();
+    header.primCount = bvh.prim_count();
+    header.triangleCount = mesh.triangle_count();
+    header.builtCost = bvh.built_cost();
+
+    qint64 nodeBytes = qint64(header.nodeCount) * sizeof(BvhNode);
+    qint64 primBytes = qint64(header.primCount) * sizeof(int);
+    qint64 triangleBytes = qint64(header.triangleCount) * sizeof(BvhTriangle);
+    header.nodesOffset = align_up(sizeof(SnapshotHeader));
+    header.primsOffset = align_up(header.nodesOffset + nodeBytes);
+    header.trianglesOffset = align_up(header.primsOffset + primBytes);
+    header.fileSize = header.trianglesOffset + triangleBytes;
+
+    // Unique per process so concurrent writers do not interleave
+    QString tempName = fileName + QString(".%1.tmp").arg(QCoreApplication::applicationPid());
+    QFile file(tempName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    bool ok = write_section(file, 0, &header, sizeof(header))
+        && write_section(file, header.nodesOffset, bvh.node_data(), nodeBytes)
+        && write_section(file, header.primsOffset, bvh.prim_data(), primBytes)
+        && write_section(file, header.trianglesOffset, mesh.triangle_data(), triangleBytes);
+    file.close();
+    if (!ok) {
+        QFile::remove(tempName);
+        return false;
+    }
+
+    // QFile::rename refuses to overwrite; another process may have just
+    // written the same snapshot, which is as good as ours
+    QFile::remove(fileName);
+    if (!QFile::rename(tempName, fileName)) {
+        QFile::remove(tempName);
+        return QFileInfo(fileName).exists();
+    }
+    return true;
+}
+
+std::shared_ptr<const BvhSnapshot> BvhSnapshot::map(const QString &fileName, unsigned long long contentHash) {
+    std::shared_ptr<BvhSnapshot> snapshot(new BvhSnapshot(fileName));
+    if (!snapshot->file.open(QIODevice::ReadOnly))
+        return nullptr;
+
+    qint64 size = snapshot->file.size();
+    if (size < static_cast<qint64>(sizeof(SnapshotHeader)))
+        return nullptr;
+    snapshot->data = snapshot->file.map(0, size);
+    if (!snapshot->data || !snapshot->validate(size, contentHash))
+        return nullptr;
+    return snapshot;
+}
+
+bool BvhSnapshot::validate(qint64 size, unsigned long long contentHash) {
+    SnapshotHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, snapshotMagic, sizeof(header.magic)) != 0 || header.version != version
+        || header.endian != endianTag || header.nodeSize != sizeof(BvhNode)
+        || header.triangleSize != sizeof(BvhTriangle) || header.contentHash != contentHash
+        || header.fileSize != static_cast<quint64>(size))
+        return false;
+
+    if (header.nodeCount <= 0 || header.primCount < 0 || header.triangleCount < 0)
+        return false;
+    quint64 nodeEnd = header.nodesOffset + quint64(header.nodeCount) * sizeof(BvhNode);
+    quint64 primEnd = header.primsOffset + quint64(header.primCount) * sizeof(int);
+    quint64 triangleEnd = header.trianglesOffset + quint64(header.triangleCount) * sizeof(BvhTriangle);
+    if (header.nodesOffset % sectionAlignment || header.primsOffset % sectionAlignment
+        || header.trianglesOffset % sectionAlignment || header.nodesOffset < sizeof(SnapshotHeader)
+        || nodeEnd > header.primsOffset || primEnd > header.trianglesOffset || triangleEnd > header.fileSize)
+        return false;
+
+    nodes = reinterpret_cast<const BvhNode*>(data + header.nodesOffset);
+    prims = reinterpret_cast<const int*>(data + header.primsOffset);
+    triangles = reinterpret_cast<const BvhTriangle*>(data + header.trianglesOffset);
+    nodeCount = header.nodeCount;
+    primCount = header.primCount;
+    triangleCount = header.triangleCount;
+    builtCost = header.builtCost;
+
+    // Traversal trusts the indices; check them once here instead. Children
+    // always come after their parent, which also rules out cycles, and so a
+    // node's depth is known by the time it is reached. Traversal keeps one
+    // stack entry per level, so trees Bvh::maxDepth deep would overflow it.
+    std::vector<int> depth(nodeCount, 0);
+    for (int i = 0; i < nodeCount; i++) {
+        const BvhNode &node = nodes[i];
+        if (node.is_leaf()) {
+            if (node.first < 0 || node.first > primCount - node.count)
+                return false;
+        }
+        else if (node.count < 0 || node.first <= i || node.first > nodeCount - 2 || depth[i] + 1 >= Bvh::maxDepth) {
+            return false;
+        }
+        else {
+            depth[node.first] = std::max(depth[node.first], depth[i] + 1);
+            depth[node.first + 1] = std::max(depth[node.first + 1], depth[i] + 1);
+        }
+    }
+    for (int i = 0; i < primCount; i++) {
+        if (prims[i] < 0 || prims[i] >= triangleCount)
+            return false;
+    }
+    return true;
+}
+
+void BvhSnapshot::attach(const std::shared_ptr<const BvhSnapshot> &snapshot, MeshBvh &mesh) {
+    mesh.attach(snapshot->nodes, snapshot->nodeCount, snapshot->prims, snapshot->primCount,
+        snapshot->builtCost, snapshot->triangles, snapshot->triangleCount, snapshot);
+}
+
+bool load_or_build_bvh(MeshBvh &mesh, const QString &cacheDir) {
+    unsigned long long hash = bvh_content_hash(mesh.triangles, mesh.bvh.settings);
+    QString fileName = QDir(cacheDir).filePath(QString("%1.bvh").arg(hash, 16, 16, QChar('0')));
+
+    std::shared_ptr<const BvhSnapshot> snapshot = BvhSnapshot::map(fileName, hash);
+    if (snapshot) {
+        BvhSnapshot::attach(snapshot, mesh);
+        return true;
+    }
+
+    mesh.build();
+    if (!QDir().mkpath(cacheDir) || !BvhSnapshot::save(fileName, mesh, hash))
+        qDebug() << "Could not write BVH snapshot" << fileName;
+    return false;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "bvh.h"
+
+#include <QFile>
+#include <QString>
+
+#include <memory>
+
+// Identifies a mesh and the settings that shape its tree; word-wise FNV-1a
+// over the triangle data, so equal meshes hash equal in every process
+unsigned long long bvh_content_hash(const std::vector<BvhTriangle> &triangles, const BvhSettings &settings);
+
+// A built MeshBvh stored as one binary blob: a fixed header followed by the
+// node array, the primitive order and the triangles, each section 64-byte
+// aligned and addressed by its offset from the start of the file, so the
+// blob is valid wherever it is mapped. Loading maps the file read-only;
+// processes that load the same snapshot share its pages through the OS
+// file cache instead of building and holding a private copy each.
+//
+// The header records a format version, the byte order and the sizes of the
+// stored structs; a snapshot written by a different build or machine fails
+// validation and is rebuilt rather than misread.
+class BvhSnapshot {
+public:
+    static const unsigned version = 1;
+
+public:
+    // Writes a built mesh under fileName, via a temporary file and a rename
+    // so readers never see a partial snapshot
+    static bool save(const QString &fileName, const MeshBvh &mesh, unsigned long long contentHash);
+    // Null if the file is missing, invalid or holds a different mesh
+    static std::shared_ptr<const BvhSnapshot> map(const QString &fileName, unsigned long long contentHash);
+
+    // Makes mesh read from the mapping; the mapping lives as long as mesh uses it
+    static void attach(const std::shared_ptr<const BvhSnapshot> &snapshot, MeshBvh &mesh);
+
+    ~BvhSnapshot();
+
+private:
+    QFile file;
+    const uchar *data;
+    const BvhNode *nodes;
+    const int *prims;
+    const BvhTriangle *triangles;
+    int nodeCount;
+    int primCount;
+    int triangleCount;
+    float builtCost;
+
+    BvhSnapshot(const QString &fileName) : file(fileName), data(nullptr) {}
+    bool validate(qint64 size, unsigned long long contentHash);
+};
+
+// Builds the tree over mesh.triangles, or loads it from the snapshot cache
+// in cacheDir when a snapshot of the same mesh and settings exists there;
+// a fresh build is added to the cache. Returns true if it loaded.
+bool load_or_build_bvh(MeshBvh &mesh, const QString &cacheDir);
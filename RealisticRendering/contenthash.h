@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+
+// 64-bit FNV-1a, byte by byte, for the content hashes that key files on
+// disk (BVH snapshots, AO bakes). Start from fnv1aBasis and chain calls to
+// hash several arrays.
+const unsigned long long fnv1aBasis = 0xcbf29ce484222325ull;
+
+inline unsigned long long fnv1a(unsigned long long h, const void *data, size_t bytes) {
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < bytes; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
@@ -0,0 +1,196 @@
+#include "denoiser.h"
+#include "parallel.h"
+#include "simd.h"
+
+#include <algorithm>
+
+using namespace simd;
+
+namespace {
+
+const float kernel[5] = { 1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16 };
+const float albedoEpsilon = 1e-3f;
+
+// Loads SIMD_WIDTH consecutive values of a row starting at column x.
+// Columns outside [0, width) are clamped to the border.
+inline vfloat load_row(const float *row, int x, int width) {
+    if (x >= 0 && x + SIMD_WIDTH <= width)
+        return load(row + x);
+
+    SIMD_ALIGN float tmp[SIMD_WIDTH];
+    for (int k = 0; k < SIMD_WIDTH; k++)
+        tmp[k] = row[std::max(0, std::min(width - 1, x + k))];
+    return load(tmp);
+}
+
+inline void store_row(float *row, int x, int width, vfloat v) {
+    if (x + SIMD_WIDTH <= width) {
+        store(row + x, v);
+        return;
+    }
+
+    SIMD_ALIGN float tmp[SIMD_WIDTH];
+    store(tmp, v);
+    for (int k = 0; x + k < width; k++)
+        row[x + k] = tmp[k];
+}
+
+struct Planes {
+    const float *c[3];
+    const float *n[3];
+    const float *a[3];
+    const float *d;
+    const float *colorScale;    // 1 / (sigma^2 * local variance) per pixel
+};
+
+inline vfloat luminance(const vfloat c[3]) {
+    return c[0] * vfloat(0.2126f) + c[1] * vfloat(0.7152f) + c[2] * vfloat(0.0722f);
+}
+
+// One A-Trous iteration over row y: src -> dst with taps 'step' pixels apart
+void filter_row(const Planes &p, float *const dst[3], int y, int width, int height,
+    int step, float invSigmaNormal2, float invSigmaDepth2, float invSigmaAlbedo2) {
+
+    // Dammertz et al. halve the color sigma on every iteration
+    vfloat colorStep(static_cast<float>(step * step));
+    vfloat depthStep(1.f / static_cast<float>(step * step));
+
+    for (int x = 0; x < width; x += SIMD_WIDTH) {
+        int center = y * width;
+        vfloat cc[3], nc[3], ac[3];
+        for (int k = 0; k < 3; k++) {
+            cc[k] = load_row(p.c[k] + center, x, width);
+            nc[k] = load_row(p.n[k] + center, x, width);
+            ac[k] = load_row(p.a[k] + center, x, width);
+        }
+        vfloat lc = luminance(cc);
+        vfloat dc = load_row(p.d + center, x, width);
+        vfloat colorScale = load_row(p.colorScale + center, x, width) * colorStep;
+        // Depth differences are judged relative to the center depth
+        vfloat depthScale = vfloat(invSigmaDepth2) * depthStep / max(dc * dc, vfloat(1e-8f));
+
+        vfloat sumW(0.f), sum[3] = { vfloat(0.f), vfloat(0.f), vfloat(0.f) };
+
+        for (int j = 0; j < 5; j++) {
+            int yy = std::max(0, std::min(height - 1, y + (j - 2) * step));
+            int row = yy * width;
+            for (int i = 0; i < 5; i++) {
+                int xx = x + (i - 2) * step;
+
+                vfloat cq[3];
+                vfloat distNormal(0.f), distAlbedo(0.f);
+                for (int k = 0; k < 3; k++) {
+                    cq[k] = load_row(p.c[k] + row, xx, width);
+                    vfloat dn = load_row(p.n[k] + row, xx, width) - nc[k];
+                    distNormal += dn * dn;
+                    vfloat da = load_row(p.a[k] + row, xx, width) - ac[k];
+                    distAlbedo += da * da;
+                }
+                vfloat dl = luminance(cq) - lc;
+                vfloat dd = load_row(p.d + row, xx, width) - dc;
+
+                vfloat dist = dl * dl * colorScale
+                    + distNormal * vfloat(invSigmaNormal2)
+                    + distAlbedo * vfloat(invSigmaAlbedo2)
+                    + dd * dd * depthScale;
+                // Clamp well above the denormal range; such taps are
+                // negligible anyway and denormals would stall the FPU
+                vfloat w = fast_exp(-min(dist, vfloat(60.f))) * vfloat(kernel[i] * kernel[j]);
+
+                sumW += w;
+                for (int k = 0; k < 3; k++)
+                    sum[k] += w * cq[k];
+            }
+        }
+
+        // The center tap always has weight kernel[2]^2 > 0, so sumW > 0
+        vfloat invW = vfloat(1.f) / sumW;
+        for (int k = 0; k < 3; k++)
+            store_row(dst[k] + y * width, x, width, sum[k] * invW);
+    }
+}
+
+} // namespace
+
+void Denoiser::denoise(FrameBuffer &fb) {
+    int width = fb.width, height = fb.height;
+    if (width <= 0 || height <= 0 || fb.passes <= 0)
+        return;
+
+    size_t n = static_cast<size_t>(width) * height;
+    float invPasses = 1.f / fb.passes;
+
+    for (int k = 0; k < 3; k++) {
+        illum[k].resize(n);
+        scratch[k].resize(n);
+    }
+
+    // Demodulate albedo so that texture detail is not blurred away
+    parallel_for(0, height, [&](int y) {
+        for (int x = 0; x < width; x++) {
+            int i = y * width + x;
+            for (int k = 0; k < 3; k++)
+                illum[k][i] = fb.color[k][i] * invPasses / (fb.albedo[k][i] + albedoEpsilon);
+        }
+    }, settings.numThreads, 8);
+
+    // Low sample counts give noise far larger than any feature we want to
+    // keep, so the color weight is normalized by the local luminance variance
+    // of the input (3x3 window) instead of using one global sigma.
+    float invSigmaColor2 = 1.f / (settings.sigmaColor * settings.sigmaColor);
+    colorScale.resize(n);
+    parallel_for(0, height, [&](int y) {
+        for (int x = 0; x < width; x++) {
+            float sum = 0.f, sum2 = 0.f;
+            for (int dy = -1; dy <= 1; dy++) {
+                int yy = std::max(0, std::min(height - 1, y + dy));
+                for (int dx = -1; dx <= 1; dx++) {
+                    int xx = std::max(0, std::min(width - 1, x + dx));
+                    int i = yy * width + xx;
+                    float l = 0.2126f * illum[0][i] + 0.7152f * illum[1][i] + 0.0722f * illum[2][i];
+                    sum += l;
+                    sum2 += l * l;
+                }
+            }
+            float mean = sum / 9.f;
+            float variance = std::max(0.f, sum2 / 9.f - mean * mean);
+            colorScale[y * width + x] = invSigmaColor2 / (variance + 1e-4f);
+        }
+    }, settings.numThreads, 8);
+
+    float invSigmaNormal2 = 1.f / (settings.sigmaNormal * settings.sigmaNormal);
+    float invSigmaDepth2 = 1.f / (settings.sigmaDepth * settings.sigmaDepth);
+    float invSigmaAlbedo2 = 1.f / (settings.sigmaAlbedo * settings.sigmaAlbedo);
+
+    std::vector<float> *src = illum, *dst = scratch;
+    for (int it = 0; it < settings.iterations; it++) {
+        int step = 1 << it;
+
+        Planes p;
+        for (int k = 0; k < 3; k++) {
+            p.c[k] = src[k].data();
+            p.n[k] = fb.normal[k].data();
+            p.a[k] = fb.albedo[k].data();
+        }
+        p.d = fb.depth.data();
+        p.colorScale = colorScale.data();
+        float *const out[3] = { dst[0].data(), dst[1].data(), dst[2].data() };
+
+        parallel_for(0, height, [&](int y) {
+            filter_row(p, out, y, width, height, step,
+                invSigmaNormal2, invSigmaDepth2, invSigmaAlbedo2);
+        }, settings.numThreads, 4);
+
+        std::swap(src, dst);
+    }
+
+    // Remodulate and write back as a single pass
+    parallel_for(0, height, [&](int y) {
+        for (int x = 0; x < width; x++) {
+            int i = y * width + x;
+            for (int k = 0; k < 3; k++)
+                fb.color[k][i] = src[k][i] * (fb.albedo[k][i] + albedoEpsilon);
+        }
+    }, settings.numThreads, 8);
+    fb.passes = 1;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "framebuffer.h"
+
+// Edge-avoiding A-Trous wavelet filter (Dammertz et al. 2010).
+// The illumination (color divided by first-hit albedo) is smoothed with a
+// 5x5 B3-spline kernel whose taps are spread 2^i pixels apart on iteration i.
+// Each tap is weighted down when its color, normal, depth or albedo differ
+// from the center pixel, so geometric and texture edges survive.
+struct DenoiseSettings {
+    int iterations;         // filter footprint is 4 * 2^iterations pixels
+    float sigmaColor;       // in units of local standard deviation, halved per iteration
+    float sigmaNormal;
+    float sigmaDepth;       // relative to the center depth
+    float sigmaAlbedo;
+    int numThreads;         // 0 for all hardware threads
+
+    DenoiseSettings() : iterations(5), sigmaColor(4.f), sigmaNormal(0.3f),
+        sigmaDepth(0.02f), sigmaAlbedo(0.1f), numThreads(0) {}
+};
+
+class Denoiser {
+public:
+    DenoiseSettings settings;
+
+public:
+    Denoiser() {}
+    explicit Denoiser(const DenoiseSettings &s) : settings(s) {}
+
+    // Replaces the accumulated color of fb by the filtered average.
+    // Afterwards fb.passes is 1, so copy the buffer first if more passes are
+    // going to be accumulated into it.
+    void denoise(FrameBuffer &fb);
+
+private:
+    std::vector<float> illum[3];
+    std::vector<float> scratch[3];
+    std::vector<float> colorScale;
+};
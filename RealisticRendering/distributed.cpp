@@ -0,0 +1,416 @@
+#include "distributed.h"
+#include "raytracer.h"
+#include "pathtracer.h"
+#include "mipmap.h"
+
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QtEndian>
+#include <QDebug>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+namespace {
+
+enum {
+    MSG_HELLO,          // worker -> coordinator, first message
+    MSG_JOB,            // coordinator -> worker: RenderJob
+    MSG_TILE_REQUEST,   // worker -> coordinator: ready for a tile
+    MSG_TILE,           // coordinator -> worker: id, x, y, w, h
+    MSG_TILE_RESULT,    // worker -> coordinator: id, x, y, w, h, RGB floats
+    MSG_DONE            // coordinator -> worker: image complete, exit
+};
+
+struct Tile {
+    int x, y, w, h;
+};
+
+// Every message is a 32-bit big endian length followed by the payload
+void send_message(QTcpSocket *socket, const QByteArray &payload) {
+    uchar size[4];
+    qToBigEndian<quint32>(static_cast<quint32>(payload.size()), size);
+    socket->write(reinterpret_cast<const char*>(size), 4);
+    socket->write(payload);
+}
+
+bool take_message(QByteArray &buffer, QByteArray &message) {
+    if (buffer.size() < 4)
+        return false;
+    quint32 size = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(buffer.constData()));
+    if (static_cast<quint32>(buffer.size()) - 4 < size)
+        return false;
+    message = buffer.mid(4, static_cast<int>(size));
+    buffer.remove(0, static_cast<int>(size) + 4);
+    return true;
+}
+
+void setup_stream(QDataStream &s) {
+    s.setVersion(QDataStream::Qt_5_0);
+    s.setFloatingPointPrecision(QDataStream::SinglePrecision);
+}
+
+QByteArray simple_message(quint8 type) {
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    setup_stream(out);
+    out << type;
+    return payload;
+}
+
+void write_job(QDataStream &out, const RenderJob &job) {
+    out << job.sceneFile << job.textureFile << qint32(job.width) << qint32(job.height) << qint32(job.spp)
+        << job.pathTracing << job.irradianceCache << job.deterministic << qint32(job.maxDepth) << qint32(job.causticPhotons) << job.eye << job.target << job.fov
+        << job.light.La << job.light.Ld << job.light.Ls
+        << job.light.Position << job.light.Direction << qint32(job.light.Type);
+}
+
+void read_job(QDataStream &in, RenderJob &job) {
+    qint32 width, height, spp, maxDepth, causticPhotons, lightType;
+    in >> job.sceneFile >> job.textureFile >> width >> height >> spp
+        >> job.pathTracing >> job.irradianceCache >> job.deterministic >> maxDepth >> causticPhotons >> job.eye >> job.target >> job.fov
+        >> job.light.La >> job.light.Ld >> job.light.Ls
+        >> job.light.Position >> job.light.Direction >> lightType;
+    job.width = width;
+    job.height = height;
+    job.spp = spp;
+    job.maxDepth = maxDepth;
+    job.causticPhotons = causticPhotons;
+    job.light.Type = lightType;
+}
+
+} // namespace
+
+RayCamera RenderJob::camera() const {
+    Camera3D camera;
+    camera.setTranslation(eye);
+    // Camera3D looks down its local -z axis
+    QVector3D back = eye - target;
+    if (back.lengthSquared() > 0)
+        camera.setRotation(QQuaternion::fromDirection(back.normalized(), QVector3D(0, 1, 0)));
+    return RayCamera(camera, width, height, fov);
+}
+
+bool load_job_scene(const RenderJob &job, scene &s) {
+    if (s.read_scene_file(job.sceneFile.toStdString()) != 0 || s.objects.empty())
+        return false;
+    s.assign_default_materials();
+
+    if (!job.textureFile.isEmpty()) {
+        std::shared_ptr<const MipTexture> texture = load_mip_texture(job.textureFile);
+        if (!texture)
+            return false;
+        s.set_diffuse_texture(texture);
+    }
+    return true;
+}
+
+void build_job_caustics(const RenderJob &job, const scene &s, int numThreads, PhotonMap &caustics) {
+    caustics.clear();
+    if (job.pathTracing || job.causticPhotons <= 0)
+        return;
+    caustics.settings.photons = job.causticPhotons;
+    caustics.settings.numThreads = numThreads;
+    caustics.build(s, job.light);
+}
+
+void render_tile(const RenderJob &job, const scene &s, int numThreads,
+    int x0, int y0, int w, int h, FrameBuffer &fb, IrradianceCache *cache, const PhotonMap *caustics) {
+    fb.resize(w, h);
+    RayCamera camera = job.camera();
+
+    if (job.pathTracing) {
+        PathTracer tracer(&s, job.irradianceCache ? cache : nullptr);
+        tracer.settings.numThreads = numThreads;
+        tracer.settings.deterministic = job.deterministic;
+        if (job.maxDepth >= 0)
+            tracer.settings.maxDepth = job.maxDepth;
+        for (int pass = 0; pass < job.spp; pass++)
+            tracer.render_pass(camera, job.light, fb, x0, y0);
+    }
+    else {
+        RayTracer tracer(&s, caustics != nullptr && !caustics->empty() ? caustics : nullptr);
+        tracer.settings.numThreads = numThreads;
+        if (job.maxDepth >= 0)
+            tracer.settings.maxDepth = job.maxDepth;
+        for (int pass = 0; pass < job.spp; pass++)
+            tracer.render(camera, job.light, fb, x0, y0);
+    }
+}
+
+bool RenderCoordinator::listen(quint16 port) {
+    return server.isListening() || server.listen(QHostAddress::Any, port);
+}
+
+bool RenderCoordinator::run(FrameBuffer &result) {
+    if (!server.isListening())
+        return false;
+
+    std::vector<Tile> tiles;
+    int tileSize = std::max(1, settings.tileSize);
+    for (int y = 0; y < job.height; y += tileSize) {
+        for (int x = 0; x < job.width; x += tileSize) {
+            Tile t = { x, y, std::min(tileSize, job.width - x), std::min(tileSize, job.height - y) };
+            tiles.push_back(t);
+        }
+    }
+    int tileCount = static_cast<int>(tiles.size());
+
+    result.resize(job.width, job.height);
+    result.passes = 1;
+    if (tileCount == 0)
+        return true;
+
+    std::deque<int> pending;
+    for (int i = 0; i < tileCount; i++)
+        pending.push_back(i);
+    std::vector<char> done(tileCount, 0);
+    std::vector<qint64> issuedAt(tileCount, -1);
+    int doneCount = 0;
+
+    struct Worker {
+        QByteArray buffer;
+        int tile;           // tile being rendered, -1 if none
+        bool idle;          // asked for work while none was left
+    };
+    std::map<QTcpSocket*, Worker> workers;
+
+    QByteArray jobMessage;
+    {
+        QDataStream out(&jobMessage, QIODevice::WriteOnly);
+        setup_stream(out);
+        out << quint8(MSG_JOB);
+        write_job(out, job);
+    }
+
+    QElapsedTimer clock;
+    clock.start();
+    QEventLoop loop;
+
+    auto pick_tile = [&]() {
+        while (!pending.empty()) {
+            int t = pending.front();
+            pending.pop_front();
+            if (!done[t])
+                return t;
+        }
+        // Nothing queued: duplicate the oldest straggler, if any
+        int oldest = -1;
+        for (int i = 0; i < tileCount; i++) {
+            if (done[i] || issuedAt[i] < 0 || clock.elapsed() - issuedAt[i] < settings.stragglerMs)
+                continue;
+            if (oldest < 0 || issuedAt[i] < issuedAt[oldest])
+                oldest = i;
+        }
+        return oldest;
+    };
+
+    auto assign = [&](QTcpSocket *socket) {
+        Worker &w = workers[socket];
+        int t = pick_tile();
+        w.tile = t;
+        w.idle = t < 0;
+        if (t < 0)
+            return;
+
+        issuedAt[t] = clock.elapsed();
+        QByteArray payload;
+        QDataStream out(&payload, QIODevice::WriteOnly);
+        setup_stream(out);
+        out << quint8(MSG_TILE) << qint32(t) << qint32(tiles[t].x) << qint32(tiles[t].y)
+            << qint32(tiles[t].w) << qint32(tiles[t].h);
+        send_message(socket, payload);
+    };
+
+    auto serve_idle = [&]() {
+        for (auto &w : workers) {
+            if (w.second.idle)
+                assign(w.first);
+        }
+    };
+
+    auto finish = [&]() {
+        QByteArray bye = simple_message(MSG_DONE);
+        for (auto &w : workers) {
+            send_message(w.first, bye);
+            w.first->flush();
+        }
+        loop.quit();
+    };
+
+    auto receive = [&](QTcpSocket *socket) {
+        auto it = workers.find(socket);
+        if (it == workers.end())
+            return;
+        Worker &w = it->second;
+        w.buffer.append(socket->readAll());
+
+        QByteArray message;
+        while (doneCount < tileCount && take_message(w.buffer, message)) {
+            QDataStream in(message);
+            setup_stream(in);
+            quint8 type;
+            in >> type;
+
+            if (type == MSG_HELLO) {
+                send_message(socket, jobMessage);
+            }
+            else if (type == MSG_TILE_REQUEST) {
+                assign(socket);
+            }
+            else if (type == MSG_TILE_RESULT) {
+                qint32 id, x, y, tw, th;
+                in >> id >> x >> y >> tw >> th;
+                if (id < 0 || id >= tileCount || x != tiles[id].x || y != tiles[id].y
+                    || tw != tiles[id].w || th != tiles[id].h) {
+                    qWarning() << "Discarding malformed tile from" << socket->peerAddress().toString();
+                    socket->abort();
+                    return;
+                }
+
+                if (!done[id]) {
+                    for (int row = 0; row < th; row++) {
+                        for (int col = 0; col < tw; col++) {
+                            int i = result.index(x + col, y + row);
+                            in >> result.color[0][i] >> result.color[1][i] >> result.color[2][i];
+                        }
+                    }
+                    done[id] = 1;
+                    doneCount++;
+                    if (doneCount % std::max(1, tileCount / 20) == 0 || doneCount == tileCount)
+                        qDebug() << "Tiles" << doneCount << "/" << tileCount << "from" << workers.size() << "workers";
+                }
+                w.tile = -1;
+
+                if (doneCount == tileCount)
+                    finish();
+                else
+                    assign(socket);
+            }
+        }
+    };
+
+    QObject::connect(&server, &QTcpServer::newConnection, [&]() {
+        while (QTcpSocket *socket = server.nextPendingConnection()) {
+            Worker w;
+            w.tile = -1;
+            w.idle = false;
+            workers[socket] = w;
+            QObject::connect(socket, &QTcpSocket::readyRead, [&, socket]() { receive(socket); });
+            QObject::connect(socket, &QTcpSocket::disconnected, [&, socket]() {
+                auto it = workers.find(socket);
+                if (it == workers.end())
+                    return;
+                // Whatever it was working on goes back to the front of the queue
+                int t = it->second.tile;
+                if (t >= 0 && !done[t])
+                    pending.push_front(t);
+                workers.erase(it);
+                socket->deleteLater();
+                if (doneCount < tileCount) {
+                    qWarning() << "Worker lost," << workers.size() << "left";
+                    serve_idle();
+                }
+            });
+        }
+    });
+
+    // Idle workers may pick up stragglers once they are old enough
+    QTimer stragglerTimer;
+    QObject::connect(&stragglerTimer, &QTimer::timeout, serve_idle);
+    stragglerTimer.start(1000);
+
+    loop.exec();
+
+    // Let the goodbyes go out; no more callbacks into this frame from here on
+    QObject::disconnect(&server, nullptr, nullptr, nullptr);
+    server.close();
+    for (auto &w : workers) {
+        QObject::disconnect(w.first, nullptr, nullptr, nullptr);
+        w.first->waitForBytesWritten(1000);
+        w.first->disconnectFromHost();
+    }
+    return true;
+}
+
+int run_render_worker(const QString &host, quint16 port, int numThreads, const QString &bvhCacheDir) {
+    QTcpSocket socket;
+    socket.connectToHost(host, port);
+    if (!socket.waitForConnected(10000)) {
+        qWarning() << "Cannot reach coordinator at" << host << port << socket.errorString();
+        return 1;
+    }
+
+    QByteArray buffer, message;
+    auto next_message = [&]() {
+        while (!take_message(buffer, message)) {
+            if (!socket.waitForReadyRead(-1))
+                return false;
+            buffer.append(socket.readAll());
+        }
+        return true;
+    };
+    auto send = [&](const QByteArray &payload) {
+        send_message(&socket, payload);
+        socket.waitForBytesWritten(-1);
+    };
+
+    send(simple_message(MSG_HELLO));
+
+    RenderJob job;
+    scene s;
+    s.bvhCacheDir = bvhCacheDir;
+    FrameBuffer fb;
+    // Tiles of a worker share its cache; records near tile borders are
+    // reused by whichever tile the worker gets next. In deterministic mode
+    // that would make a tile depend on which tiles came before it, so every
+    // tile starts from an empty cache.
+    IrradianceCache cache;
+    PhotonMap caustics;
+    while (next_message()) {
+        QDataStream in(message);
+        setup_stream(in);
+        quint8 type;
+        in >> type;
+
+        if (type == MSG_JOB) {
+            read_job(in, job);
+            if (!load_job_scene(job, s)) {
+                qWarning() << "Worker cannot load scene" << job.sceneFile << job.textureFile;
+                return 2;
+            }
+            build_job_caustics(job, s, numThreads, caustics);
+            send(simple_message(MSG_TILE_REQUEST));
+        }
+        else if (type == MSG_TILE) {
+            qint32 id, x, y, w, h;
+            in >> id >> x >> y >> w >> h;
+            if (job.deterministic)
+                cache.clear();
+            render_tile(job, s, numThreads, x, y, w, h, fb, &cache, &caustics);
+
+            QByteArray payload;
+            QDataStream out(&payload, QIODevice::WriteOnly);
+            setup_stream(out);
+            out << quint8(MSG_TILE_RESULT) << id << x << y << w << h;
+            for (int row = 0; row < h; row++) {
+                for (int col = 0; col < w; col++) {
+                    QVector3D c = fb.resolved(col, row);
+                    out << c.x() << c.y() << c.z();
+                }
+            }
+            send(payload);
+        }
+        else if (type == MSG_DONE) {
+            return 0;
+        }
+    }
+
+    qWarning() << "Lost connection to coordinator";
+    return 1;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "scene.h"
+#include "light.h"
+#include "raycamera.h"
+#include "framebuffer.h"
+#include "irradiancecache.h"
+#include "photonmap.h"
+
+#include <QString>
+#include <QTcpServer>
+#include <QVector3D>
+
+// Everything a process needs to render any part of one image
+struct RenderJob {
+    QString sceneFile;      // absolute, so that workers can open it too
+    QString textureFile;    // diffuse texture for the ray tracer, absolute; empty for none
+    int width;
+    int height;
+    int spp;
+    bool pathTracing;       // path tracer instead of the Whitted tracer
+    bool irradianceCache;   // path tracer only
+    bool deterministic;     // bit for bit the same image on any thread and worker count
+    int maxDepth;           // -1 for the tracer's default
+    int causticPhotons;     // Whitted tracer only: photons for the caustic map, 0 for none
+    QVector3D eye;
+    QVector3D target;
+    float fov;              // vertical, in degrees
+    Light light;
+
+    RenderJob() : width(960), height(640), spp(1), pathTracing(false), irradianceCache(false), deterministic(false),
+        maxDepth(-1), causticPhotons(0), eye(0, 0, 5), target(0, 0, 0), fov(45.f) {}
+
+    RayCamera camera() const;
+};
+
+// Loads job.sceneFile into s with the default materials and job.textureFile.
+// False if either cannot be read.
+bool load_job_scene(const RenderJob &job, scene &s);
+
+// Fills caustics for job.causticPhotons, or clears it if there are none.
+// The map does not depend on the thread count, so every worker builds the
+// same one.
+void build_job_caustics(const RenderJob &job, const scene &s, int numThreads, PhotonMap &caustics);
+
+// Renders the w x h tile whose left top pixel is (x0, y0) into fb, which is
+// resized to the tile, accumulating job.spp passes. If job.irradianceCache
+// is set, cache is used and filled; pass the same one for every tile and
+// frame of a static scene. caustics comes from build_job_caustics().
+void render_tile(const RenderJob &job, const scene &s, int numThreads,
+    int x0, int y0, int w, int h, FrameBuffer &fb, IrradianceCache *cache = nullptr,
+    const PhotonMap *caustics = nullptr);
+
+// Tile-parallel rendering across processes.
+// Workers connect to the coordinator over TCP, load the scene once and then
+// pull one tile at a time; every result doubles as the request for the next
+// tile. Tiles of a worker that disconnects go back to the queue. Once the
+// queue is empty, idle workers also get copies of tiles that have been out
+// for longer than stragglerMs, so a hung worker cannot stall the image;
+// whichever copy arrives first wins.
+struct CoordinatorSettings {
+    int tileSize;
+    int stragglerMs;
+
+    CoordinatorSettings() : tileSize(64), stragglerMs(15000) {}
+};
+
+class RenderCoordinator {
+public:
+    CoordinatorSettings settings;
+
+public:
+    explicit RenderCoordinator(const RenderJob &job) : job(job) {}
+
+    // Opens the port; false if it cannot be. Workers may connect from here
+    // on and wait until run() serves them, so start them after this.
+    bool listen(quint16 port);
+    // Serves tiles until all of them are back and then tells the workers to
+    // quit. False if listen() did not succeed.
+    bool run(FrameBuffer &result);
+
+private:
+    RenderJob job;
+    QTcpServer server;
+};
+
+// Connects to a coordinator and renders tiles until it reports the image
+// complete. Returns 0 on success, non-zero if the connection or the scene
+// failed. Workers on one machine given the same bvhCacheDir map one shared
+// copy of each object's BVH instead of building their own.
+int run_render_worker(const QString &host, quint16 port, int numThreads, const QString &bvhCacheDir = QString());
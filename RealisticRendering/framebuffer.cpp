@@ -0,0 +1,88 @@
+#include "framebuffer.h"
+#include <algorithm>
+#include <cstring>
+
+void FrameBuffer::resize(int w, int h) {
+    width = w;
+    height = h;
+    size_t n = static_cast<size_t>(w) * h;
+    for (int c = 0; c < 3; c++) {
+        color[c].assign(n, 0.f);
+        albedo[c].assign(n, 0.f);
+        normal[c].assign(n, 0.f);
+    }
+    depth.assign(n, 0.f);
+    passes = 0;
+}
+
+void FrameBuffer::clear() {
+    for (int c = 0; c < 3; c++) {
+        std::fill(color[c].begin(), color[c].end(), 0.f);
+        std::fill(albedo[c].begin(), albedo[c].end(), 0.f);
+        std::fill(normal[c].begin(), normal[c].end(), 0.f);
+    }
+    std::fill(depth.begin(), depth.end(), 0.f);
+    passes = 0;
+}
+
+void FrameBuffer::add_color(int x, int y, const QVector3D &c) {
+    int i = index(x, y);
+    color[0][i] += c.x();
+    color[1][i] += c.y();
+    color[2][i] += c.z();
+}
+
+void FrameBuffer::set_aov(int x, int y, const QVector3D &a, const QVector3D &n, float d) {
+    int i = index(x, y);
+    albedo[0][i] = a.x();
+    albedo[1][i] = a.y();
+    albedo[2][i] = a.z();
+    normal[0][i] = n.x();
+    normal[1][i] = n.y();
+    normal[2][i] = n.z();
+    depth[i] = d;
+}
+
+QVector3D FrameBuffer::resolved(int x, int y) const {
+    int i = index(x, y);
+    float inv = passes > 0 ? 1.f / passes : 1.f;
+    return QVector3D(color[0][i] * inv, color[1][i] * inv, color[2][i] * inv);
+}
+
+QImage FrameBuffer::to_image() const {
+    QImage result(width, height, QImage::Format_ARGB32);
+    auto toByte = [](float v) {
+        return static_cast<int>(std::max(0.f, std::min(1.f, v)) * 255.f + 0.5f);
+    };
+
+    for (int y = 0; y < height; y++) {
+        QRgb *line = reinterpret_cast<QRgb*>(result.scanLine(y));
+        for (int x = 0; x < width; x++) {
+            QVector3D c = resolved(x, y);
+            line[x] = qRgb(toByte(c.x()), toByte(c.y()), toByte(c.z()));
+        }
+    }
+    return result;
+}
+
+unsigned long long FrameBuffer::hash() const {
+    unsigned long long h = 14695981039346656037ull;
+    auto add = [&h](unsigned v) {
+        for (int b = 0; b < 4; b++) {
+            h ^= (v >> (8 * b)) & 0xFF;
+            h *= 1099511628211ull;
+        }
+    };
+    add(static_cast<unsigned>(width));
+    add(static_cast<unsigned>(height));
+    add(static_cast<unsigned>(passes));
+    for (const std::vector<float> *plane : { &color[0], &color[1], &color[2], &albedo[0], &albedo[1], &albedo[2],
+        &normal[0], &normal[1], &normal[2], &depth }) {
+        for (float f : *plane) {
+            unsigned v;
+            std::memcpy(&v, &f, sizeof(v));
+            add(v);
+        }
+    }
+    return h;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include <QVector3D>
+#include <QImage>
+
+// First-hit data of a primary ray, used to guide the denoiser
+struct PixelAov {
+    QVector3D albedo;
+    QVector3D normal;
+    float depth;
+
+    PixelAov() : depth(0.f) {}
+};
+
+// Float image the CPU tracer accumulates into.
+// Every channel is a separate plane (structure of arrays) so the filters can
+// stream through rows with vector loads.
+class FrameBuffer {
+public:
+    int width;
+    int height;
+    int passes;                 // number of sample passes summed into color
+
+    std::vector<float> color[3];    // summed radiance
+    // Auxiliary buffers written by the first hit of each primary ray
+    std::vector<float> albedo[3];
+    std::vector<float> normal[3];
+    std::vector<float> depth;       // distance to first hit, 0 if nothing was hit
+
+public:
+    FrameBuffer() : width(0), height(0), passes(0) {}
+    FrameBuffer(int w, int h) : passes(0) { resize(w, h); }
+
+    void resize(int w, int h);
+    void clear();
+
+    int index(int x, int y) const { return y * width + x; }
+
+    void add_color(int x, int y, const QVector3D &c);
+    void set_aov(int x, int y, const QVector3D &a, const QVector3D &n, float d);
+
+    // Average of the accumulated passes at (x, y)
+    QVector3D resolved(int x, int y) const;
+    // Tone-clamped 8-bit copy of the averaged color
+    QImage to_image() const;
+    // FNV-1a over the bits of every plane and the pass count, to tell
+    // whether two renders came out bit for bit the same
+    unsigned long long hash() const;
+};
@@ -0,0 +1,33 @@
+#include "gbuffer.h"
+#include "parallel.h"
+
+#include <algorithm>
+
+void decode_gbuffer(const scene &s, const float *texels, int width, int height, const QVector3D &eye,
+    std::vector<SceneHit> &hits) {
+    // First primitive index of every object
+    std::vector<int> firstFace(s.aabbTrees.size() + 1, 0);
+    for (size_t i = 0; i < s.aabbTrees.size(); i++)
+        firstFace[i + 1] = firstFace[i] + static_cast<int>(s.aabbTrees[i]->triangles.size());
+
+    hits.assign(static_cast<size_t>(width) * height, SceneHit());
+    Point eyePoint(eye.x(), eye.y(), eye.z());
+    parallel_for(0, height, [&](int y) {
+        const float *row = texels + static_cast<size_t>(height - 1 - y) * width * GBUFFER_CHANNELS;
+        for (int x = 0; x < width; x++) {
+            const float *texel = row + x * GBUFFER_CHANNELS;
+            int primitive = static_cast<int>(texel[3] + 0.5f) - 1;
+            if (primitive < 0 || primitive >= firstFace.back())
+                continue;
+
+            int objectId = static_cast<int>(std::upper_bound(firstFace.begin(), firstFace.end(), primitive)
+                - firstFace.begin()) - 1;
+            SceneHit &hit = hits[static_cast<size_t>(y) * width + x];
+            Point p(texel[0], texel[1], texel[2]);
+            if (s.surface_at(objectId, primitive - firstFace[objectId], p, hit))
+                hit.squaredDistance = CGAL::squared_distance(eyePoint, p);
+            else
+                hit = SceneHit();
+        }
+    });
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "scene.h"
+
+#include <QVector3D>
+
+#include <vector>
+
+// G-buffer of the raster path's hybrid mode: one RGBA32F texel per pixel
+// with the world space position of the closest surface in rgb and its
+// primitive index plus one in a, zero where nothing was drawn. Primitive
+// indices count the triangles of scene::objects in order, the way the
+// raster path concatenates their faces into one vertex buffer.
+//
+// Floats hold primitive indices exactly up to 2^24 triangles.
+const int GBUFFER_CHANNELS = 4;
+
+// Turns G-buffer texels, bottom row first as glReadPixels returns them,
+// into the primary hits of an image seen from eye, top row first. The
+// surface attributes come from the scene's triangles, so the hits are the
+// ones scene::intersect would have returned for rays from eye.
+void decode_gbuffer(const scene &s, const float *texels, int width, int height, const QVector3D &eye,
+    std::vector<SceneHit> &hits);
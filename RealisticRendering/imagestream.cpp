@@ -0,0 +1,222 @@
+#include "imagestream.h"
+
+#include <QFileInfo>
+#include <QSysInfo>
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+const unsigned adlerModulus = 65521;
+const int adlerBlock = 5552;        // bytes that can be summed before b may overflow
+const int maxStoredBlock = 65535;   // deflate stored block payload
+
+unsigned crc32(const char *data, int size, unsigned crc = 0) {
+    static const std::vector<unsigned> table = []() {
+        std::vector<unsigned> t(256);
+        for (unsigned n = 0; n < 256; n++) {
+            unsigned c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+
+    crc = ~crc;
+    for (int i = 0; i < size; i++)
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+void append_be32(QByteArray &out, unsigned v) {
+    out.append(static_cast<char>(v >> 24));
+    out.append(static_cast<char>(v >> 16));
+    out.append(static_cast<char>(v >> 8));
+    out.append(static_cast<char>(v));
+}
+
+unsigned char to_byte(float v) {
+    return static_cast<unsigned char>(std::max(0.f, std::min(1.f, v)) * 255.f + 0.5f);
+}
+
+} // namespace
+
+ImageStreamWriter::ImageStreamWriter(int maxQueuedBands) :
+    maxQueued(std::max(1, maxQueuedBands)), pfm(false), dataOffset(0), width(0), height(0), rowsQueued(0),
+    closing(false), failed(false), rowsWritten(0), adlerA(1), adlerB(0) {}
+
+ImageStreamWriter::~ImageStreamWriter() {
+    close();
+}
+
+bool ImageStreamWriter::open(const QString &fileName, int w, int h) {
+    close();
+    if (w <= 0 || h <= 0)
+        return false;
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+
+    pfm = QFileInfo(fileName).suffix().toLower() == "pfm";
+    width = w;
+    height = h;
+    rowsQueued = 0;
+    rowsWritten = 0;
+    adlerA = 1;
+    adlerB = 0;
+    closing = false;
+    failed = false;
+
+    bool ok;
+    if (pfm) {
+        // The sign of the scale gives the byte order of the floats
+        QByteArray header = QString("PF\n%1 %2\n%3\n").arg(width).arg(height)
+            .arg(QSysInfo::ByteOrder == QSysInfo::LittleEndian ? "-1.0" : "1.0").toLatin1();
+        dataOffset = header.size();
+        ok = file.write(header) == header.size();
+    }
+    else {
+        static const char signature[8] = { '\x89', 'P', 'N', 'G', '\r', '\n', '\x1A', '\n' };
+        QByteArray ihdr;
+        append_be32(ihdr, width);
+        append_be32(ihdr, height);
+        ihdr.append('\x08');    // bits per channel
+        ihdr.append('\x02');    // RGB
+        ihdr.append(3, '\0');   // deflate, no filter method, not interlaced
+        ok = file.write(signature, 8) == 8 && write_png_chunk("IHDR", ihdr);
+    }
+    if (!ok) {
+        file.close();
+        return false;
+    }
+
+    encoder = std::thread([this]() { encode(); });
+    return true;
+}
+
+void ImageStreamWriter::write_band(FrameBuffer band) {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this]() { return static_cast<int>(queue.size()) < maxQueued; });
+    if (!file.isOpen() || band.width != width || rowsQueued + band.height > height) {
+        failed = true;
+        return;
+    }
+    rowsQueued += band.height;
+    queue.push_back(std::move(band));
+    changed.notify_all();
+}
+
+bool ImageStreamWriter::close() {
+    if (!file.isOpen())
+        return false;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    changed.notify_all();
+    encoder.join();
+
+    bool ok = !failed && rowsWritten == height;
+    if (!pfm) {
+        // An empty final stored block ends the deflate stream
+        QByteArray end("\x01\x00\x00\xFF\xFF", 5);
+        append_be32(end, adlerB << 16 | adlerA);
+        ok = write_png_chunk("IDAT", end) && write_png_chunk("IEND", QByteArray()) && ok;
+    }
+    file.close();
+    return ok && file.error() == QFileDevice::NoError;
+}
+
+void ImageStreamWriter::encode() {
+    for (;;) {
+        FrameBuffer band;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this]() { return !queue.empty() || closing; });
+            if (queue.empty())
+                return;
+            band = std::move(queue.front());
+            queue.pop_front();
+        }
+        changed.notify_all();
+
+        bool ok = pfm ? write_pfm_band(band) : write_png_band(band);
+        rowsWritten += band.height;
+        if (!ok) {
+            std::lock_guard<std::mutex> lock(mutex);
+            failed = true;
+        }
+    }
+}
+
+// PFM rows go from the bottom up, so every row is placed at its own offset
+bool ImageStreamWriter::write_pfm_band(const FrameBuffer &band) {
+    std::vector<float> row(3 * static_cast<size_t>(width));
+    qint64 rowBytes = static_cast<qint64>(row.size() * sizeof(float));
+    for (int y = 0; y < band.height; y++) {
+        for (int x = 0; x < width; x++) {
+            QVector3D c = band.resolved(x, y);
+            row[3 * x] = c.x();
+            row[3 * x + 1] = c.y();
+            row[3 * x + 2] = c.z();
+        }
+        qint64 offset = dataOffset + (height - 1 - (rowsWritten + y)) * rowBytes;
+        if (!file.seek(offset) || file.write(reinterpret_cast<const char*>(&row[0]), rowBytes) != rowBytes)
+            return false;
+    }
+    return true;
+}
+
+// One IDAT chunk per band, holding its scanlines as stored deflate blocks;
+// the zlib header goes in front of the first one
+bool ImageStreamWriter::write_png_band(const FrameBuffer &band) {
+    int rowBytes = 1 + 3 * width;
+    QByteArray scanline(rowBytes, '\0');    // filter type 0, none
+    QByteArray data;
+    if (rowsWritten == 0)
+        data.append("\x78\x01", 2);
+
+    for (int y = 0; y < band.height; y++) {
+        unsigned char *p = reinterpret_cast<unsigned char*>(scanline.data()) + 1;
+        for (int x = 0; x < width; x++) {
+            QVector3D c = band.resolved(x, y);
+            p[3 * x] = to_byte(c.x());
+            p[3 * x + 1] = to_byte(c.y());
+            p[3 * x + 2] = to_byte(c.z());
+        }
+
+        const unsigned char *bytes = reinterpret_cast<const unsigned char*>(scanline.constData());
+        for (int begin = 0; begin < rowBytes; begin += adlerBlock) {
+            int end = std::min(rowBytes, begin + adlerBlock);
+            for (int i = begin; i < end; i++) {
+                adlerA += bytes[i];
+                adlerB += adlerA;
+            }
+            adlerA %= adlerModulus;
+            adlerB %= adlerModulus;
+        }
+
+        for (int begin = 0; begin < rowBytes; begin += maxStoredBlock) {
+            int length = std::min(maxStoredBlock, rowBytes - begin);
+            data.append('\0');      // not final, stored
+            data.append(static_cast<char>(length & 0xFF));
+            data.append(static_cast<char>(length >> 8));
+            data.append(static_cast<char>(~length & 0xFF));
+            data.append(static_cast<char>((~length >> 8) & 0xFF));
+            data.append(scanline.constData() + begin, length);
+        }
+    }
+    return write_png_chunk("IDAT", data);
+}
+
+bool ImageStreamWriter::write_png_chunk(const char type[4], const QByteArray &data) {
+    QByteArray head;
+    append_be32(head, data.size());
+    head.append(type, 4);
+    unsigned crc = crc32(data.constData(), data.size(), crc32(type, 4));
+    QByteArray tail;
+    append_be32(tail, crc);
+    return file.write(head) == head.size() && file.write(data) == data.size() && file.write(tail) == tail.size();
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "framebuffer.h"
+
+#include <QFile>
+#include <QString>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+// Writes an image band by band as the bands are rendered, so that an image
+// of any size never has to be in memory at once. Bands are encoded and
+// written on a thread of their own while the next ones render; at most
+// maxQueuedBands wait for it, after which write_band() blocks.
+//
+// A .pfm file gets the averaged color as 32-bit floats; anything else gets
+// an 8-bit RGB PNG clamped like FrameBuffer::to_image(). The PNG is written
+// row by row into uncompressed deflate blocks, since compression would need
+// zlib, so it is about as large as the raw pixels.
+//
+// Only the CLI streams (--band-rows); the interactive view renders at the
+// widget size into a whole FrameBuffer.
+class ImageStreamWriter {
+public:
+    explicit ImageStreamWriter(int maxQueuedBands = 2);
+    // close()s the file
+    ~ImageStreamWriter();
+
+    // False if the file cannot be created
+    bool open(const QString &fileName, int width, int height);
+    // The next band of rows, top to bottom, the full width of the image
+    void write_band(FrameBuffer band);
+    // Waits for the bands written so far. False if writing failed or the
+    // bands did not add up to the image.
+    bool close();
+
+private:
+    int maxQueued;
+    QFile file;
+    bool pfm;
+    qint64 dataOffset;          // of the first pixel, past the header
+    int width, height;
+    int rowsQueued;             // by write_band()
+
+    // Shared with the encoder
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<FrameBuffer> queue;
+    bool closing;
+    bool failed;
+    std::thread encoder;
+
+    // Encoder thread only
+    int rowsWritten;
+    unsigned adlerA, adlerB;    // running Adler-32 of the PNG's raw scanlines
+
+    void encode();
+    bool write_pfm_band(const FrameBuffer &band);
+    bool write_png_band(const FrameBuffer &band);
+    bool write_png_chunk(const char type[4], const QByteArray &data);
+};
@@ -0,0 +1,115 @@
+#include "irradiancecache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+namespace {
+
+inline int cell_coord(float v, float cellSize) {
+    return static_cast<int>(std::floor(v / cellSize));
+}
+
+} // namespace
+
+IrradianceCache::IrradianceCache() : recordCount(0) {
+    cellSize = settings.maxSpacing;
+}
+
+unsigned long long IrradianceCache::cell_key(int x, int y, int z) {
+    // 21 bits per axis, enough for two million cells in every direction
+    const unsigned long long mask = (1ull << 21) - 1;
+    return (static_cast<unsigned long long>(x) & mask)
+        | ((static_cast<unsigned long long>(y) & mask) << 21)
+        | ((static_cast<unsigned long long>(z) & mask) << 42);
+}
+
+int IrradianceCache::shard_index(unsigned long long key) {
+    // Fibonacci hashing so that neighbouring cells land in different shards
+    return static_cast<int>((key * 0x9e3779b97f4a7c15ull) >> 58) % shardCount;
+}
+
+bool IrradianceCache::lookup(const QVector3D &p, const QVector3D &n, QVector3D &irradiance,
+    const std::vector<IrradianceRecord> *pending) const {
+    float a = settings.accuracy;
+    QVector3D sum(0, 0, 0);
+    float weightSum = 0;
+    auto accumulate = [&](const IrradianceRecord &r) {
+        QVector3D d = p - r.position;
+        float cosn = QVector3D::dotProduct(n, r.normal);
+        if (cosn <= 0)
+            return;
+
+        // Ward's error estimate from distance and normal divergence
+        float error = d.length() / r.radius + std::sqrt(std::max(0.f, 1 - cosn));
+        if (error >= a)
+            return;
+        // Records in front of p see light p does not (Ward's d_i test)
+        if (QVector3D::dotProduct(d, r.normal + n) * 0.5f < -0.05f * a * r.radius)
+            return;
+
+        // Falls to zero at the edge of the footprint, so there are no seams
+        // where records enter or leave the interpolation
+        float w = 1 / std::max(error, 1e-6f) - 1 / a;
+        sum += r.irradiance * w;
+        weightSum += w;
+    };
+
+    unsigned long long key = cell_key(cell_coord(p.x(), cellSize), cell_coord(p.y(), cellSize),
+        cell_coord(p.z(), cellSize));
+    const Shard &shard = shards[shard_index(key)];
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mutex);
+        auto cell = shard.cells.find(key);
+        if (cell != shard.cells.end()) {
+            for (const IrradianceRecord &r : cell->second)
+                accumulate(r);
+        }
+    }
+    if (pending != nullptr) {
+        for (const IrradianceRecord &r : *pending)
+            accumulate(r);
+    }
+
+    if (weightSum <= 0)
+        return false;
+    irradiance = sum / weightSum;
+    return true;
+}
+
+void IrradianceCache::clamp_radius(IrradianceRecord &record) const {
+    float a = settings.accuracy;
+    // Keep the footprint within one cell so a single cell lookup finds it
+    record.radius = std::max(settings.minSpacing / a, std::min(record.radius, cellSize / a));
+}
+
+void IrradianceCache::insert(IrradianceRecord record) {
+    clamp_radius(record);
+    float footprint = settings.accuracy * record.radius;
+
+    const QVector3D &p = record.position;
+    int x0 = cell_coord(p.x() - footprint, cellSize), x1 = cell_coord(p.x() + footprint, cellSize);
+    int y0 = cell_coord(p.y() - footprint, cellSize), y1 = cell_coord(p.y() + footprint, cellSize);
+    int z0 = cell_coord(p.z() - footprint, cellSize), z1 = cell_coord(p.z() + footprint, cellSize);
+
+    for (int z = z0; z <= z1; z++) {
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                unsigned long long key = cell_key(x, y, z);
+                Shard &shard = shards[shard_index(key)];
+                std::lock_guard<std::shared_timed_mutex> lock(shard.mutex);
+                shard.cells[key].push_back(record);
+            }
+        }
+    }
+    recordCount++;
+}
+
+void IrradianceCache::clear() {
+    for (Shard &shard : shards) {
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mutex);
+        shard.cells.clear();
+    }
+    cellSize = settings.maxSpacing;
+    recordCount = 0;
+}
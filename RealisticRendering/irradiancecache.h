@@ -0,0 +1,75 @@
+#pragma once
+
+#include <QVector3D>
+
+#include <atomic>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+// One cached indirect lighting sample
+struct IrradianceRecord {
+    QVector3D position;
+    QVector3D normal;
+    QVector3D irradiance;   // mean incident indirect radiance over the cosine lobe
+    float radius;           // harmonic mean distance to the surrounding geometry
+};
+
+struct IrradianceCacheSettings {
+    float accuracy;         // Ward's a: larger reuses records further away
+    float minSpacing;       // bounds on the radius a record is reused over
+    float maxSpacing;
+    int samples;            // hemisphere samples per new record
+
+    IrradianceCacheSettings() : accuracy(0.3f), minSpacing(0.02f), maxSpacing(0.5f), samples(64) {}
+};
+
+// Irradiance cache (Ward et al. 1988) for diffuse interreflection.
+// Records live in a spatial hash with maxSpacing sized cells; each record is
+// stored in every cell its footprint touches, so a lookup only has to scan
+// the cell of the query point. Cells are spread over independently locked
+// shards: lookups take a shared lock and insertions an exclusive one, so
+// any number of tracing threads can fill and query the cache at once.
+//
+// Records are in world space and stay valid while the scene and the light
+// are unchanged, so one cache can serve many passes and camera positions.
+// Which thread creates a record first depends on scheduling, so images
+// rendered with a cache are not bit-for-bit reproducible across runs unless
+// the records are held back and inserted in a fixed order, as the path
+// tracer does with PathTracerSettings::deterministic.
+class IrradianceCache {
+public:
+    IrradianceCacheSettings settings;
+
+public:
+    IrradianceCache();
+
+    // Weighted interpolation of the records valid at p with unit normal n,
+    // together with those in pending, which are not inserted yet. False if
+    // there are none and a new record should be computed.
+    bool lookup(const QVector3D &p, const QVector3D &n, QVector3D &irradiance,
+        const std::vector<IrradianceRecord> *pending = nullptr) const;
+    void insert(IrradianceRecord record);
+    // Limits record.radius the way insert() does; for records kept pending
+    void clamp_radius(IrradianceRecord &record) const;
+
+    // Drop all records; also required after changing settings. Only call
+    // while no tracing is in flight.
+    void clear();
+    int size() const { return recordCount; }
+
+private:
+    static const int shardCount = 64;
+
+    struct Shard {
+        mutable std::shared_timed_mutex mutex;
+        std::unordered_map<unsigned long long, std::vector<IrradianceRecord>> cells;
+    };
+
+    Shard shards[shardCount];
+    float cellSize;
+    std::atomic<int> recordCount;
+
+    static unsigned long long cell_key(int x, int y, int z);
+    static int shard_index(unsigned long long key);
+};
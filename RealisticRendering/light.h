@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QVector3D>
+
+#include <algorithm>
+
+enum {
+    POINT_LIGHT,
+    DIRECTIONAL_LIGHT,
+    RECT_LIGHT,         // one-sided rectangle
+    SPHERE_LIGHT
+};
+
+struct Light {
+    float La;       // Ambient light intensity
+    float Ld;       // Diffuse light intensity
+    float Ls;       // Specular light intensity
+    QVector3D Position;
+    QVector3D Direction;
+    int Type;           // Point, directional or area light
+    bool Falloff;       // Point light intensity drops with the squared distance (scene file lights)
+    // Area lights are centered on Position and the intensities are their
+    // radiance. A rectangle spans Position +- Edge1 / 2 +- Edge2 / 2 and
+    // emits on the side Edge1 x Edge2 points to.
+    QVector3D Edge1, Edge2;
+    float Radius;       // of a sphere light
+
+    Light() : La(1.0), Ld(1.0), Ls(1.0), 
+        Position(QVector3D(0.0, 3.0, 0.0)), Type(POINT_LIGHT), Falloff(false), Radius(0)  {}
+};
+
+inline bool is_area_light(const Light &light) {
+    return light.Type == RECT_LIGHT || light.Type == SPHERE_LIGHT;
+}
+
+// Share of a light's intensity that reaches a point squaredDistance away
+inline float light_falloff(const Light &light, double squaredDistance) {
+    if (!light.Falloff || light.Type != POINT_LIGHT)
+        return 1.f;
+    return static_cast<float>(1 / std::max(squaredDistance, 1e-8));
+}
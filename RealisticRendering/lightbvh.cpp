@@ -0,0 +1,268 @@
+#include "lightbvh.h"
+#include "arealight.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const float pi = 3.14159265f;
+
+float safe_sqrt(float x) {
+    return std::sqrt(std::max(0.f, x));
+}
+
+float safe_acos(float x) {
+    return std::acos(std::max(-1.f, std::min(1.f, x)));
+}
+
+float dot(const float a[3], const float b[3]) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// cos(max(0, A - B)) and sin(max(0, A - B)) from the sines and cosines of
+// two angles in [0, pi]
+float cos_sub_clamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 1 : cosA * cosB + sinA * sinB;
+}
+
+float sin_sub_clamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 0 : sinA * cosB - cosA * sinB;
+}
+
+// Area lights emit their radiance like Lambertian surfaces, pi * L per unit
+// area, and a rectangle only toward its front
+LightBounds light_bounds(const Light &light) {
+    LightBounds b;
+    QVector3D c = light.Position;
+    b.cosThetaO = -1;
+    b.cosThetaE = 0;
+    if (light.Type == RECT_LIGHT) {
+        for (int i = 0; i < 4; i++) {
+            QVector3D corner = c + (i & 1 ? 0.5f : -0.5f) * light.Edge1 + (i & 2 ? 0.5f : -0.5f) * light.Edge2;
+            float p[3] = { corner.x(), corner.y(), corner.z() };
+            b.box.grow(p);
+        }
+        QVector3D normal = QVector3D::crossProduct(light.Edge1, light.Edge2).normalized();
+        b.axis[0] = normal.x();
+        b.axis[1] = normal.y();
+        b.axis[2] = normal.z();
+        b.cosThetaO = 1;
+        b.power = pi * light.Ld * area_light_area(light);
+    }
+    else if (light.Type == SPHERE_LIGHT) {
+        float lo[3] = { c.x() - light.Radius, c.y() - light.Radius, c.z() - light.Radius };
+        float hi[3] = { c.x() + light.Radius, c.y() + light.Radius, c.z() + light.Radius };
+        b.box.grow(lo);
+        b.box.grow(hi);
+        b.power = pi * light.Ld * area_light_area(light);
+    }
+    else {
+        float p[3] = { c.x(), c.y(), c.z() };
+        b.box.grow(p);
+        b.power = 4 * pi * light.Ld;
+    }
+    return b;
+}
+
+} // namespace
+
+float LightBounds::importance(const float p[3], const float n[3]) const {
+    if (power <= 0)
+        return 0;
+
+    float center[3], wi[3], halfDiagonal2 = 0;
+    for (int a = 0; a < 3; a++) {
+        center[a] = box.centroid(a);
+        wi[a] = p[a] - center[a];
+        float h = 0.5f * (box.hi[a] - box.lo[a]);
+        halfDiagonal2 += h * h;
+    }
+    float d2 = dot(wi, wi);
+    float invD = d2 > 0 ? 1 / std::sqrt(d2) : 0;
+    for (int a = 0; a < 3; a++)
+        wi[a] *= invD;
+    // Points inside or next to the box should not blow up
+    d2 = std::max(d2, halfDiagonal2);
+    d2 = std::max(d2, 1e-8f);
+
+    // Angle between the cone axis and p, less the cone's spread and the
+    // angle the box subtends from p
+    float cosThetaW = dot(axis, wi);
+    float sinThetaW = safe_sqrt(1 - cosThetaW * cosThetaW);
+    float cosThetaB = halfDiagonal2 >= d2 ? -1 : safe_sqrt(1 - halfDiagonal2 / d2);
+    float sinThetaB = safe_sqrt(1 - cosThetaB * cosThetaB);
+    float sinThetaO = safe_sqrt(1 - cosThetaO * cosThetaO);
+    float cosThetaX = cos_sub_clamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float sinThetaX = sin_sub_clamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+    float cosThetaP = cos_sub_clamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+    if (cosThetaP <= cosThetaE)
+        return 0;
+
+    float result = power * cosThetaP / d2;
+    if (dot(n, n) > 0) {
+        // Light arriving at a grazing angle is worth less
+        float cosThetaI = std::fabs(dot(wi, n));
+        float sinThetaI = safe_sqrt(1 - cosThetaI * cosThetaI);
+        result *= cos_sub_clamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+    }
+    return std::max(result, 0.f);
+}
+
+LightBounds LightBounds::merge(const LightBounds &a, const LightBounds &b) {
+    if (a.power <= 0)
+        return b;
+    if (b.power <= 0)
+        return a;
+
+    LightBounds m;
+    m.box = a.box;
+    m.box.grow(b.box);
+    m.power = a.power + b.power;
+    m.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+
+    // Smallest cone around both cones
+    float thetaA = safe_acos(a.cosThetaO), thetaB = safe_acos(b.cosThetaO);
+    float thetaD = safe_acos(dot(a.axis, b.axis));
+    if (std::min(thetaD + thetaB, pi) <= thetaA) {
+        std::copy(a.axis, a.axis + 3, m.axis);
+        m.cosThetaO = a.cosThetaO;
+        return m;
+    }
+    if (std::min(thetaD + thetaA, pi) <= thetaB) {
+        std::copy(b.axis, b.axis + 3, m.axis);
+        m.cosThetaO = b.cosThetaO;
+        return m;
+    }
+
+    float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+    float r[3] = { a.axis[1] * b.axis[2] - a.axis[2] * b.axis[1],
+        a.axis[2] * b.axis[0] - a.axis[0] * b.axis[2],
+        a.axis[0] * b.axis[1] - a.axis[1] * b.axis[0] };
+    float rLen2 = dot(r, r);
+    if (thetaO >= pi || rLen2 < 1e-12f) {
+        m.cosThetaO = -1;
+        return m;
+    }
+
+    // Turn a's axis toward b's by thetaO - thetaA, around their common normal
+    float invR = 1 / std::sqrt(rLen2);
+    for (int i = 0; i < 3; i++)
+        r[i] *= invR;
+    float t[3] = { r[1] * a.axis[2] - r[2] * a.axis[1],
+        r[2] * a.axis[0] - r[0] * a.axis[2],
+        r[0] * a.axis[1] - r[1] * a.axis[0] };
+    float thetaR = thetaO - thetaA;
+    for (int i = 0; i < 3; i++)
+        m.axis[i] = a.axis[i] * std::cos(thetaR) + t[i] * std::sin(thetaR);
+    m.cosThetaO = std::cos(thetaO);
+    return m;
+}
+
+void LightBvh::clear() {
+    lights.clear();
+    nodes.clear();
+    directional.clear();
+}
+
+void LightBvh::build(const std::vector<Light> &sceneLights) {
+    clear();
+    lights = sceneLights;
+
+    std::vector<LightBounds> bounds(lights.size());
+    std::vector<int> order;
+    for (int i = 0; i < static_cast<int>(lights.size()); i++) {
+        if (lights[i].Type == DIRECTIONAL_LIGHT) {
+            directional.push_back(i);
+        }
+        else {
+            bounds[i] = light_bounds(lights[i]);
+            order.push_back(i);
+        }
+    }
+    if (order.empty())
+        return;
+
+    nodes.reserve(2 * order.size() - 1);
+    nodes.push_back(LightBvhNode());
+    build_node(0, bounds, order, 0, static_cast<int>(order.size()));
+}
+
+// Splits at the median along the widest axis of the light positions. Light
+// counts are small next to triangle counts, so a balanced tree is enough.
+void LightBvh::build_node(int node, std::vector<LightBounds> &bounds, std::vector<int> &order,
+    int begin, int end) {
+    if (end - begin == 1) {
+        nodes[node].bounds = bounds[order[begin]];
+        nodes[node].first = order[begin];
+        nodes[node].leaf = true;
+        return;
+    }
+
+    BvhBox centers;
+    for (int i = begin; i < end; i++) {
+        float c[3] = { bounds[order[i]].box.centroid(0), bounds[order[i]].box.centroid(1),
+            bounds[order[i]].box.centroid(2) };
+        centers.grow(c);
+    }
+    int axis = 0;
+    for (int a = 1; a < 3; a++) {
+        if (centers.hi[a] - centers.lo[a] > centers.hi[axis] - centers.lo[axis])
+            axis = a;
+    }
+    int mid = (begin + end) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+        return bounds[a].box.centroid(axis) < bounds[b].box.centroid(axis);
+    });
+
+    int left = static_cast<int>(nodes.size());
+    nodes.push_back(LightBvhNode());
+    nodes.push_back(LightBvhNode());
+    build_node(left, bounds, order, begin, mid);
+    build_node(left + 1, bounds, order, mid, end);
+    nodes[node].bounds = LightBounds::merge(nodes[left].bounds, nodes[left + 1].bounds);
+    nodes[node].first = left;
+    nodes[node].leaf = false;
+}
+
+int LightBvh::sample(const float p[3], const float n[3], float u, float &probability) const {
+    probability = 0;
+    int directionalCount = static_cast<int>(directional.size());
+    float pDirectional = directionalCount > 0 ?
+        directionalCount / static_cast<float>(directionalCount + (nodes.empty() ? 0 : 1)) : 0.f;
+    if (u < pDirectional) {
+        int i = std::min(static_cast<int>(u / pDirectional * directionalCount), directionalCount - 1);
+        probability = pDirectional / directionalCount;
+        return directional[i];
+    }
+    if (nodes.empty())
+        return -1;
+
+    // Reuse what is left of u at every level
+    const float oneMinusEpsilon = 0.99999994f;
+    u = std::min((u - pDirectional) / (1 - pDirectional), oneMinusEpsilon);
+    float pmf = 1 - pDirectional;
+    int node = 0;
+    while (!nodes[node].leaf) {
+        int left = nodes[node].first;
+        float importanceLeft = nodes[left].bounds.importance(p, n);
+        float importanceRight = nodes[left + 1].bounds.importance(p, n);
+        if (importanceLeft <= 0 && importanceRight <= 0)
+            return -1;
+        float pLeft = importanceLeft / (importanceLeft + importanceRight);
+        if (u < pLeft) {
+            node = left;
+            u = std::min(u / pLeft, oneMinusEpsilon);
+            pmf *= pLeft;
+        }
+        else {
+            node = left + 1;
+            u = std::min((u - pLeft) / (1 - pLeft), oneMinusEpsilon);
+            pmf *= 1 - pLeft;
+        }
+    }
+    if (nodes[node].bounds.importance(p, n) <= 0)
+        return -1;
+    probability = pmf;
+    return nodes[node].first;
+}
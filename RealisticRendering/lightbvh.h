@@ -0,0 +1,71 @@
+#pragma once
+
+#include "light.h"
+#include "bvh.h"
+
+#include <vector>
+
+// Where a group of lights is and where it sends its light: a box around the
+// emitters and a cone around the directions of their emitting normals,
+// widened by how far past a normal light still leaves (Conty Estevez and
+// Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting",
+// 2018). Point and sphere lights emit everywhere, so their cone is the
+// whole sphere; a rectangle's is its normal, widened by 90 degrees.
+struct LightBounds {
+    BvhBox box;
+    float axis[3];          // unit
+    float cosThetaO;        // emitting normals lie within this angle of axis; -1 for all directions
+    float cosThetaE;        // light leaves at most this far past a normal
+    float power;
+
+    LightBounds() : cosThetaO(1), cosThetaE(1), power(0) {
+        axis[0] = axis[1] = 0;
+        axis[2] = 1;
+    }
+
+    // Estimate of how much light reaches p on a surface with normal n (on
+    // either side; the zero vector for no surface). Zero only where none
+    // of the lights can reach.
+    float importance(const float p[3], const float n[3]) const;
+
+    static LightBounds merge(const LightBounds &a, const LightBounds &b);
+};
+
+// Children of an interior node are stored next to each other, after it
+struct LightBvhNode {
+    LightBounds bounds;
+    int first;      // leaf: light index; interior: left child, right is first + 1
+    bool leaf;
+};
+
+// Picks lights in proportion to how much they are likely to add at a
+// shading point, so that a few shadow rays per point serve scenes with
+// hundreds of lights.
+//
+// Point and area lights go into a binary tree over LightBounds. A pick walks down
+// from the root and chooses each child with probability proportional to its
+// importance; the probability of the light is the product of those choices.
+// Directional lights have no position, so they are picked uniformly, with
+// the tree as a whole counting as one more of them.
+class LightBvh {
+public:
+    LightBvh() {}
+
+    // Replaces the tree; keeps its own copy of the lights
+    void build(const std::vector<Light> &lights);
+    void clear();
+    bool empty() const { return lights.empty(); }
+    int size() const { return static_cast<int>(lights.size()); }
+    const Light &light(int i) const { return lights[i]; }
+
+    // Index of a light for shading p with normal n, picked with u in
+    // [0, 1), and the probability of that pick; -1 if no light reaches p
+    int sample(const float p[3], const float n[3], float u, float &probability) const;
+
+private:
+    std::vector<Light> lights;          // as given to build()
+    std::vector<LightBvhNode> nodes;    // over the point and area lights
+    std::vector<int> directional;       // indices of the directional lights
+
+    void build_node(int node, std::vector<LightBounds> &bounds, std::vector<int> &order, int begin, int end);
+};
@@ -0,0 +1,515 @@
+#include "lightmap.h"
+#include "pathtracer.h"
+#include "parallel.h"
+#include "sampler.h"
+
+#include <QElapsedTimer>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <map>
+
+namespace {
+
+// Charts stop growing here, which bounds the overlap tests
+const int maxChartTriangles = 128;
+
+// A triangle laid flat in its chart's plane, corners in face order, with
+// its bounding rectangle
+struct FlatTriangle {
+    float p[3][2];
+    float lo[2], hi[2];
+
+    void update_bounds() {
+        for (int a = 0; a < 2; a++) {
+            lo[a] = std::min(p[0][a], std::min(p[1][a], p[2][a]));
+            hi[a] = std::max(p[0][a], std::max(p[1][a], p[2][a]));
+        }
+    }
+};
+
+struct Chart {
+    std::vector<int> triangles;     // into the packed triangle list
+    float lo[2], hi[2];             // bounds in the chart's plane
+    int x, y, w, h;                 // rectangle in the atlas, including the gutter
+};
+
+void triangle_corners(const BvhTriangle &t, QVector3D v[3]) {
+    v[0] = QVector3D(t.v0[0], t.v0[1], t.v0[2]);
+    v[1] = v[0] + QVector3D(t.e1[0], t.e1[1], t.e1[2]);
+    v[2] = v[0] + QVector3D(t.e2[0], t.e2[1], t.e2[2]);
+}
+
+// Corner k of a face is the vertex k half-edges on from f->pEdge, like in
+// fill_triangles() and object::raw_data()
+half_edge *corner_edge(const face *f, int k) {
+    half_edge *e = f->pEdge;
+    for (int i = 0; i < k; i++)
+        e = e->pNext;
+    return e;
+}
+
+// The chart's first triangle: corner 'first' at the origin, the next corner
+// on the positive x axis and the last one above it
+FlatTriangle flatten(const BvhTriangle &t) {
+    QVector3D v[3];
+    triangle_corners(t, v);
+
+    // The longest edge as the base keeps the bounding rectangle tight
+    int first = 0;
+    float longest = -1;
+    for (int k = 0; k < 3; k++) {
+        float len = (v[(k + 1) % 3] - v[k]).length();
+        if (len > longest) {
+            longest = len;
+            first = k;
+        }
+    }
+    int second = (first + 1) % 3, third = (first + 2) % 3;
+    QVector3D base = v[second] - v[first], side = v[third] - v[first];
+    QVector3D axis = longest > 0 ? base / longest : QVector3D(1, 0, 0);
+    float cx = QVector3D::dotProduct(side, axis);
+    float cy = (side - axis * cx).length();
+
+    FlatTriangle f;
+    f.p[first][0] = 0;
+    f.p[first][1] = 0;
+    f.p[second][0] = longest;
+    f.p[second][1] = 0;
+    f.p[third][0] = cx;
+    f.p[third][1] = cy;
+    f.update_bounds();
+    return f;
+}
+
+// Unfolds a neighbour across the edge from its corner a to corner b, which
+// are already placed in the chart: the remaining corner keeps its distances
+// to them and goes to the other side of the edge from 'across', the placed
+// triangle's own third corner
+FlatTriangle unfold(const QVector3D v[3], int a, int b, const float pa[2], const float pb[2],
+    const float across[2]) {
+    int c = 3 - a - b;
+    QVector3D edge = v[b] - v[a];
+    float len = edge.length();
+    float along = QVector3D::dotProduct(v[c] - v[a], edge) / len;
+    float height = (v[c] - v[a] - edge * (along / len)).length();
+
+    float dx = (pb[0] - pa[0]) / len, dy = (pb[1] - pa[1]) / len;
+    float nx = -dy, ny = dx;
+    if ((across[0] - pa[0]) * nx + (across[1] - pa[1]) * ny > 0) {
+        nx = -nx;
+        ny = -ny;
+    }
+
+    FlatTriangle f;
+    for (int k = 0; k < 2; k++) {
+        f.p[a][k] = pa[k];
+        f.p[b][k] = pb[k];
+    }
+    f.p[c][0] = pa[0] + dx * along + nx * height;
+    f.p[c][1] = pa[1] + dy * along + ny * height;
+    f.update_bounds();
+    return f;
+}
+
+// True if the insides of two triangles overlap by more than eps; triangles
+// that only share an edge or a corner do not
+bool overlaps(const FlatTriangle &s, const FlatTriangle &t, float eps) {
+    for (int a = 0; a < 2; a++) {
+        if (s.hi[a] <= t.lo[a] + eps || t.hi[a] <= s.lo[a] + eps)
+            return false;
+    }
+    for (const FlatTriangle *e : { &s, &t }) {
+        for (int k = 0; k < 3; k++) {
+            const float *p = e->p[k], *q = e->p[(k + 1) % 3];
+            float ax = q[1] - p[1], ay = p[0] - q[0];
+            float norm = std::sqrt(ax * ax + ay * ay);
+            if (norm <= 0)
+                continue;
+            float sLo = 1e30f, sHi = -1e30f, tLo = 1e30f, tHi = -1e30f;
+            for (int i = 0; i < 3; i++) {
+                float ps = (s.p[i][0] * ax + s.p[i][1] * ay) / norm;
+                float pt = (t.p[i][0] * ax + t.p[i][1] * ay) / norm;
+                sLo = std::min(sLo, ps);
+                sHi = std::max(sHi, ps);
+                tLo = std::min(tLo, pt);
+                tHi = std::max(tHi, pt);
+            }
+            if (sHi <= tLo + eps || tHi <= sLo + eps)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Barycentrics of q with respect to the 2D triangle, clamped onto it
+void closest_barycentrics(const float c[3][2], float qx, float qy, float &b1, float &b2) {
+    float e1x = c[1][0] - c[0][0], e1y = c[1][1] - c[0][1];
+    float e2x = c[2][0] - c[0][0], e2y = c[2][1] - c[0][1];
+    float px = qx - c[0][0], py = qy - c[0][1];
+    float det = e1x * e2y - e1y * e2x;
+    if (std::fabs(det) < 1e-12f) {
+        b1 = b2 = 1.f / 3;
+        return;
+    }
+    b1 = (px * e2y - py * e2x) / det;
+    b2 = (e1x * py - e1y * px) / det;
+
+    // Outside: clamp, then renormalize onto the far edge if needed
+    b1 = std::max(0.f, b1);
+    b2 = std::max(0.f, b2);
+    float sum = b1 + b2;
+    if (sum > 1) {
+        b1 /= sum;
+        b2 /= sum;
+    }
+}
+
+// Squared distance from q to the 2D triangle
+float squared_distance(const float c[3][2], float qx, float qy) {
+    float b1, b2;
+    closest_barycentrics(c, qx, qy, b1, b2);
+    float nx = (1 - b1 - b2) * c[0][0] + b1 * c[1][0] + b2 * c[2][0];
+    float ny = (1 - b1 - b2) * c[0][1] + b1 * c[1][1] + b2 * c[2][1];
+    return (nx - qx) * (nx - qx) + (ny - qy) * (ny - qy);
+}
+
+} // namespace
+
+void Lightmap::clear() {
+    triangles.clear();
+    texelTriangle.clear();
+    texels.clear();
+    width = height = 0;
+}
+
+bool Lightmap::pack(const scene &s, LightmapStats *stats) {
+    QElapsedTimer timer;
+    timer.start();
+
+    std::vector<ChartTriangle> layout;
+    std::vector<FlatTriangle> flat;
+    std::vector<Chart> charts;
+    float minCosine = std::cos(settings.chartAngle * M_PI_180f);
+    double area = 0;
+    for (int i = 0; i < static_cast<int>(s.aabbTrees.size()); i++) {
+        const MeshBvh &mesh = s.aabbTrees[i]->mesh;
+        std::vector<face*> faces = s.objects[i]->get_faces();
+        int count = std::min(mesh.triangle_count(), static_cast<int>(faces.size()));
+        int base = static_cast<int>(layout.size());
+        std::map<const face*, int> faceIds;
+        std::vector<QVector3D> normals(count);
+        for (int f = 0; f < count; f++) {
+            const BvhTriangle &t = mesh.triangle_data()[f];
+            ChartTriangle c;
+            c.objectId = i;
+            c.faceId = f;
+
+            // Same orientation test as the raster normals
+            const face *fc = faces[f];
+            vec3f n = fc->pEdge->pVertex->normal + fc->pEdge->pNext->pVertex->normal
+                + fc->pEdge->pNext->pNext->pVertex->normal;
+            QVector3D geometric = QVector3D::crossProduct(QVector3D(t.e1[0], t.e1[1], t.e1[2]),
+                QVector3D(t.e2[0], t.e2[1], t.e2[2]));
+            c.flip = QVector3D::dotProduct(geometric, QVector3D(n.x, n.y, n.z)) < 0;
+
+            layout.push_back(c);
+            flat.push_back(FlatTriangle());
+            faceIds[fc] = f;
+            normals[f] = geometric.normalized();
+        }
+
+        // Grow charts breadth first from the first face not in one yet
+        std::vector<bool> placed(count, false);
+        for (int seed = 0; seed < count; seed++) {
+            if (placed[seed])
+                continue;
+            Chart chart;
+            flat[base + seed] = flatten(mesh.triangle_data()[seed]);
+            placed[seed] = true;
+            chart.triangles.push_back(base + seed);
+
+            for (size_t next = 0; next < chart.triangles.size()
+                && static_cast<int>(chart.triangles.size()) < maxChartTriangles; next++) {
+                int f = chart.triangles[next] - base;
+                if (faces[f]->valence != 3)
+                    continue;
+                for (int k = 0; k < 3 && static_cast<int>(chart.triangles.size()) < maxChartTriangles; k++) {
+                    // The half-edge into corner k runs from corner k + 2
+                    const half_edge *e = corner_edge(faces[f], k);
+                    if (e->pOppo == nullptr || e->pOppo->pFace == nullptr)
+                        continue;
+                    auto it = faceIds.find(e->pOppo->pFace);
+                    if (it == faceIds.end() || placed[it->second] || faces[it->second]->valence != 3)
+                        continue;
+                    int g = it->second;
+                    if (QVector3D::dotProduct(normals[g], normals[seed]) < minCosine)
+                        continue;
+
+                    int a = -1, b = -1;
+                    for (int j = 0; j < 3; j++) {
+                        const vertex *v = corner_edge(faces[g], j)->pVertex;
+                        if (v == e->pVertex)
+                            a = j;
+                        else if (v == e->pPrev->pVertex)
+                            b = j;
+                    }
+                    if (a < 0 || b < 0)
+                        continue;
+
+                    QVector3D v[3];
+                    triangle_corners(mesh.triangle_data()[g], v);
+                    if ((v[b] - v[a]).lengthSquared() <= 0)
+                        continue;
+                    const FlatTriangle &from = flat[base + f];
+                    FlatTriangle t = unfold(v, a, b, from.p[k], from.p[(k + 2) % 3], from.p[(k + 1) % 3]);
+
+                    float eps = 1e-4f * std::max(t.hi[0] - t.lo[0], t.hi[1] - t.lo[1]);
+                    bool free = true;
+                    for (int other : chart.triangles) {
+                        if (overlaps(t, flat[other], eps)) {
+                            free = false;
+                            break;
+                        }
+                    }
+                    if (!free)
+                        continue;
+                    flat[base + g] = t;
+                    placed[g] = true;
+                    chart.triangles.push_back(base + g);
+                }
+            }
+
+            for (int a = 0; a < 2; a++) {
+                chart.lo[a] = 1e30f;
+                chart.hi[a] = -1e30f;
+            }
+            for (int t : chart.triangles) {
+                for (int a = 0; a < 2; a++) {
+                    chart.lo[a] = std::min(chart.lo[a], flat[t].lo[a]);
+                    chart.hi[a] = std::max(chart.hi[a], flat[t].hi[a]);
+                }
+            }
+            area += (chart.hi[0] - chart.lo[0]) * (chart.hi[1] - chart.lo[1]);
+            charts.push_back(std::move(chart));
+        }
+    }
+    clear();
+    if (layout.empty() || area <= 0)
+        return false;
+
+    // Grow the atlas while the charts' minimum size alone would fill half of it
+    int pad = settings.padding;
+    int res = settings.resolution;
+    double minTexels = static_cast<double>(charts.size()) * (2 * pad + 2) * (2 * pad + 2);
+    while (res * 2 <= settings.maxResolution && minTexels > 0.5 * res * res)
+        res *= 2;
+
+    // Tallest first, so that every shelf is filled with similar heights
+    std::vector<int> order(charts.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = static_cast<int>(i);
+
+    double density = std::sqrt(0.8 * res * res / area);
+    for (int attempt = 0; attempt < 64; attempt++, density *= 0.9) {
+        for (Chart &c : charts) {
+            c.w = static_cast<int>(std::ceil((c.hi[0] - c.lo[0]) * density)) + 2 * pad + 1;
+            c.h = static_cast<int>(std::ceil((c.hi[1] - c.lo[1]) * density)) + 2 * pad + 1;
+        }
+        std::sort(order.begin(), order.end(), [&](int a, int b) { return charts[a].h > charts[b].h; });
+
+        int x = 0, y = 0, shelf = 0;
+        bool fits = true;
+        for (int i : order) {
+            Chart &c = charts[i];
+            if (x + c.w > res) {
+                x = 0;
+                y += shelf;
+                shelf = 0;
+            }
+            if (c.w > res || y + c.h > res) {
+                fits = false;
+                break;
+            }
+            c.x = x;
+            c.y = y;
+            x += c.w;
+            shelf = std::max(shelf, c.h);
+        }
+        if (fits)
+            break;
+        if (attempt == 63)
+            return false;
+    }
+
+    for (const Chart &c : charts) {
+        for (int t : c.triangles) {
+            for (int k = 0; k < 3; k++) {
+                layout[t].corner[k][0] = static_cast<float>(c.x + pad + 0.5 + (flat[t].p[k][0] - c.lo[0]) * density);
+                layout[t].corner[k][1] = static_cast<float>(c.y + pad + 0.5 + (flat[t].p[k][1] - c.lo[1]) * density);
+            }
+        }
+    }
+
+    // Every texel of a chart goes to its nearest triangle, as far out as
+    // bilinear filtering reaches into the gutter
+    triangles.swap(layout);
+    width = height = res;
+    texelTriangle.assign(static_cast<size_t>(res) * res, -1);
+    float reach = pad + 0.75f;
+    std::vector<float> nearest;
+    for (const Chart &c : charts) {
+        nearest.assign(static_cast<size_t>(c.w) * c.h, reach * reach);
+        for (int t : c.triangles) {
+            const float (*corner)[2] = triangles[t].corner;
+            float lo[2], hi[2];
+            for (int a = 0; a < 2; a++) {
+                lo[a] = std::min(corner[0][a], std::min(corner[1][a], corner[2][a])) - reach;
+                hi[a] = std::max(corner[0][a], std::max(corner[1][a], corner[2][a])) + reach;
+            }
+            int x0 = std::max(c.x, static_cast<int>(std::floor(lo[0])));
+            int x1 = std::min(c.x + c.w, static_cast<int>(std::ceil(hi[0])));
+            int y0 = std::max(c.y, static_cast<int>(std::floor(lo[1])));
+            int y1 = std::min(c.y + c.h, static_cast<int>(std::ceil(hi[1])));
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    float d = squared_distance(corner, x + 0.5f, y + 0.5f);
+                    float &best = nearest[static_cast<size_t>(y - c.y) * c.w + (x - c.x)];
+                    if (d <= best) {
+                        best = d;
+                        texelTriangle[static_cast<size_t>(y) * res + x] = t;
+                    }
+                }
+            }
+        }
+    }
+    texels.assign(texelTriangle.size() * 4, 0.f);
+
+    if (stats != nullptr) {
+        stats->charts = static_cast<int>(charts.size());
+        stats->packSeconds = timer.nsecsElapsed() * 1e-9;
+    }
+    return true;
+}
+
+void Lightmap::bake_texel(const scene &s, const Light &light, int x, int y, float rgba[4]) const {
+    const ChartTriangle &c = triangles[texelTriangle[y * width + x]];
+
+    const TreeandTri *tree = s.aabbTrees[c.objectId];
+    const BvhTriangle &t = tree->mesh.triangle_data()[c.faceId];
+    QVector3D v0(t.v0[0], t.v0[1], t.v0[2]), e1(t.e1[0], t.e1[1], t.e1[2]), e2(t.e2[0], t.e2[1], t.e2[2]);
+    QVector3D normal = QVector3D::crossProduct(e1, e2).normalized();
+    if (c.flip)
+        normal = -normal;
+    if (tree->moved)
+        normal = tree->motion.mapVector(normal).normalized();
+    Vector n(normal.x(), normal.y(), normal.z());
+
+    // Sample positions jitter over the texel's share of the triangle
+    auto position = [&](float jx, float jy) {
+        float pb1, pb2;
+        closest_barycentrics(c.corner, x + jx, y + jy, pb1, pb2);
+        QVector3D p = v0 + e1 * pb1 + e2 * pb2;
+        if (tree->moved)
+            p = tree->motion.map(p);
+        // Off the surface, against self-intersection
+        return Point(p.x(), p.y(), p.z()) + n * 1e-4;
+    };
+
+    float direct = 0, visible = 0;
+    for (int k = 0; k < settings.directSamples; k++) {
+        Sampler sampler(SOBOL_SAMPLER, x, y, static_cast<unsigned>(k));
+        float jx, jy;
+        sampler.get_2d(jx, jy);
+        Point p = position(jx, jy);
+
+        Vector l;
+        double maxSquared;
+        if (light.Type == DIRECTIONAL_LIGHT) {
+            l = Vector(-light.Direction.x(), -light.Direction.y(), -light.Direction.z());
+            maxSquared = 1e30;
+        }
+        else {
+            l = Point(light.Position.x(), light.Position.y(), light.Position.z()) - p;
+            maxSquared = l * l;
+        }
+        double len2 = l * l;
+        if (len2 <= 0)
+            continue;
+        double cosine = (l * n) / std::sqrt(len2);
+        if (cosine <= 0 || s.occluded(Ray(p, l), maxSquared))
+            continue;
+        direct += static_cast<float>(cosine);
+        visible += 1;
+    }
+    if (settings.directSamples > 0) {
+        direct *= light.Ld / settings.directSamples;
+        visible /= settings.directSamples;
+    }
+
+    QVector3D indirect(0, 0, 0);
+    if (settings.indirectSamples > 0) {
+        PathTracer tracer(&s);
+        tracer.settings.maxDepth = settings.maxDepth;
+        for (int k = 0; k < settings.indirectSamples; k++) {
+            // Own sample indices, past the direct ones
+            Sampler sampler(SOBOL_SAMPLER, x, y, static_cast<unsigned>(settings.directSamples + k));
+            float jx, jy, u1, u2;
+            sampler.get_2d(jx, jy);
+            sampler.get_2d(u1, u2);
+            Ray ray(position(jx, jy), sample_cosine_hemisphere(n, u1, u2));
+            indirect += tracer.radiance(ray, light, sampler, nullptr);
+        }
+        indirect /= static_cast<float>(settings.indirectSamples);
+    }
+
+    rgba[0] = direct + indirect.x();
+    rgba[1] = direct + indirect.y();
+    rgba[2] = direct + indirect.z();
+    rgba[3] = visible;
+}
+
+void Lightmap::bake(const scene &s, const Light &light, LightmapStats *stats) {
+    if (triangles.empty())
+        return;
+
+    QElapsedTimer timer;
+    timer.start();
+    std::atomic<long long> baked(0);
+    parallel_for(0, height, [&](int y) {
+        long long rowTexels = 0;
+        for (int x = 0; x < width; x++) {
+            float *rgba = &texels[4 * (static_cast<size_t>(y) * width + x)];
+            if (texelTriangle[y * width + x] >= 0) {
+                bake_texel(s, light, x, y, rgba);
+                rowTexels++;
+            }
+        }
+        baked += rowTexels;
+    }, settings.numThreads);
+
+    if (stats != nullptr) {
+        stats->texels = baked;
+        stats->bakeSeconds = timer.nsecsElapsed() * 1e-9;
+    }
+}
+
+std::vector<float> Lightmap::raw_uvs(const scene &s) const {
+    // Triangles are in object and face order, which is also the order of
+    // the raw vertices
+    std::vector<float> uvs;
+    uvs.reserve(triangles.size() * 6);
+    for (const ChartTriangle &c : triangles) {
+        for (int k = 0; k < 3; k++) {
+            uvs.push_back(c.corner[k][0] / width);
+            uvs.push_back(c.corner[k][1] / height);
+        }
+    }
+
+    size_t rawCount = 0;
+    for (auto o : s.objects)
+        rawCount += o->get_faces().size() * 3;
+    uvs.resize(2 * rawCount, 0.f);
+    return uvs;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "scene.h"
+#include "light.h"
+
+#include <vector>
+
+struct LightmapSettings {
+    int resolution;         // atlas edge length in texels, at least
+    int maxResolution;      // how far pack() may grow the atlas for many charts
+    float chartAngle;       // degrees a chart's triangles may turn away from its first one
+    int padding;            // gutter texels around every chart, against bilinear bleeding
+    int directSamples;      // shadow rays per texel, jittered over its area
+    int indirectSamples;    // path traced hemisphere samples per texel, 0 for direct light only
+    int maxDepth;           // bounces of the indirect paths
+    int numThreads;         // 0 for all hardware threads
+
+    LightmapSettings() : resolution(1024), maxResolution(4096), chartAngle(45), padding(1), directSamples(4),
+        indirectSamples(32), maxDepth(3), numThreads(0) {}
+};
+
+struct LightmapStats {
+    int charts;
+    long long texels;       // texels that were baked
+    double packSeconds;
+    double bakeSeconds;
+
+    LightmapStats() : charts(0), texels(0), packSeconds(0), bakeSeconds(0) {}
+};
+
+// Baked lighting for static scenes, sampled by the raster path instead of
+// the per-frame shadow map.
+//
+// pack() lays out a single atlas shared by all objects. A chart starts at
+// a triangle laid flat with its longest edge as the base and grows over
+// shared edges: every neighbour is unfolded into the chart's plane as long
+// as it stays within settings.chartAngle of the first triangle and does not
+// overlap the others, so that smooth or flat regions of a mesh share one
+// gutter. The bounding rectangles are shelf packed at one texel density for
+// the whole scene, shrunk until they fit. The resulting second UV set is one
+// pair per face corner, in the order of object::raw_data().
+//
+// Every chart needs at least (2 * padding + 2)^2 texels, so the atlas
+// doubles from settings.resolution, up to settings.maxResolution, while the
+// charts' minimum would fill more than half of it. Scenes with more charts
+// than that still fit at a texel or so per triangle, and past
+// maxResolution^2 / (2 * padding + 2)^2 charts pack() fails.
+//
+// bake() fills every chart texel near its triangle with the irradiance the
+// path tracer sees there: direct light with jittered shadow rays plus the
+// mean incident indirect radiance over the cosine lobe, so that a surface
+// is lit as albedo * rgb. Alpha holds the light's visibility, for the
+// specular term. Texels are spread over threads by atlas row.
+class Lightmap {
+public:
+    LightmapSettings settings;
+    int width;
+    int height;
+    std::vector<float> texels;      // RGBA, row 0 at v = 0
+
+public:
+    Lightmap() : width(0), height(0) {}
+
+    // Lays out the charts; call again after the geometry changed. False if
+    // they do not fit into settings.maxResolution.
+    bool pack(const scene &s, LightmapStats *stats = nullptr);
+    // Bakes with the objects' current motion; pack() first
+    void bake(const scene &s, const Light &light, LightmapStats *stats = nullptr);
+    bool empty() const { return triangles.empty(); }
+    void clear();
+
+    // Two floats per vertex of o->raw_data() over all objects, for a vertex buffer
+    std::vector<float> raw_uvs(const scene &s) const;
+
+private:
+    struct ChartTriangle {
+        int objectId;
+        int faceId;
+        bool flip;              // geometric normal points away from the vertex normals
+        float corner[3][2];     // triangle corners in atlas texels
+    };
+
+    std::vector<ChartTriangle> triangles;   // in object and face order
+    std::vector<int> texelTriangle;         // nearest triangle of the chart under each texel, -1 for none
+
+    // Radiance-weighted lighting of one texel of texelTriangle
+    void bake_texel(const scene &s, const Light &light, int x, int y, float rgba[4]) const;
+};
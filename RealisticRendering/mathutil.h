@@ -22,6 +22,9 @@ Defines the following GLSL-inspired functions:
 	radians, degrees, fract, clamp, mix, step, smoothstep
 Defines fast, portable random number generators:
 	xorshift_rnd, uniform_rnd, normal_rnd
+Defines thread-safe generators with no global state:
+	pcg32, philox4x32, philox_rnd, hash_rnd, hash_rnd_batch,
+	plus uniform_rnd(gen, n) and normal_rnd(gen, sigma) taking a generator
 Defines TRIMESH_STATIC_CHECK to do static asserts in pre-11 C++
 Defines TRIMESH_DEPRECATED to annotate functions as deprecated in pre-14 C++
 */
@@ -55,6 +58,12 @@ Defines TRIMESH_DEPRECATED to annotate functions as deprecated in pre-14 C++
 #include <algorithm>
 #include <utility>
 
+// SSE2 is part of every x64 target; used by the batch random generators
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+# include <emmintrin.h>
+# define TRIMESH_HAVE_SSE2
+#endif
+
 
 // Force inlining, even when compiling without optimization.
 #if defined(_MSC_VER)
@@ -366,6 +375,251 @@ static inline float normal_rnd()
 }
 
 
+// The generators above share hidden static state, so they are neither
+// thread-safe nor reproducible once several threads draw from them.
+// Everything below keeps its state in the caller's hands instead.
+
+
+// PCG32 (O'Neill 2014): 64-bit LCG state with a permuted 32-bit output.
+// Each instance is an independent generator; distinct streams never overlap.
+// Models the standard UniformRandomBitGenerator concept.
+class pcg32 {
+public:
+	typedef unsigned result_type;
+
+private:
+	unsigned long long state, inc;
+
+public:
+	explicit pcg32(unsigned long long seed_ = 0x853c49e6748fea9bULL,
+	               unsigned long long stream = 0xda3e39cb94b95bdbULL)
+		{ seed(seed_, stream); }
+
+	void seed(unsigned long long seed_, unsigned long long stream = 0xda3e39cb94b95bdbULL)
+	{
+		state = 0;
+		inc = (stream << 1) | 1u;
+		(*this)();
+		state += seed_;
+		(*this)();
+	}
+
+	static result_type min() { return 0; }
+	static result_type max() { return 0xffffffffu; }
+
+	result_type operator () ()
+	{
+		unsigned long long old = state;
+		state = old * 6364136223846793005ULL + inc;
+		unsigned xorshifted = unsigned(((old >> 18) ^ old) >> 27);
+		unsigned rot = unsigned(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+	}
+
+	// Skip ahead by delta outputs in O(log delta)
+	void advance(unsigned long long delta)
+	{
+		unsigned long long mult = 6364136223846793005ULL, plus = inc;
+		unsigned long long acc_mult = 1, acc_plus = 0;
+		while (delta) {
+			if (delta & 1) {
+				acc_mult *= mult;
+				acc_plus = acc_plus * mult + plus;
+			}
+			plus = (mult + 1) * plus;
+			mult *= mult;
+			delta >>= 1;
+		}
+		state = acc_mult * state + acc_plus;
+	}
+};
+
+
+// Philox4x32-10 (Salmon et al. 2011): a counter-based generator.
+// Maps a 128-bit counter and 64-bit key to 128 random bits with no state,
+// so any sample can be computed directly from its coordinates.
+static inline void philox4x32(const unsigned ctr[4], const unsigned key[2],
+                              unsigned out[4])
+{
+	unsigned c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+	unsigned k0 = key[0], k1 = key[1];
+	for (int round = 0; round < 10; round++) {
+		unsigned long long p0 = 0xD2511F53ULL * c0;
+		unsigned long long p1 = 0xCD9E8D57ULL * c2;
+		unsigned hi0 = unsigned(p0 >> 32), lo0 = unsigned(p0);
+		unsigned hi1 = unsigned(p1 >> 32), lo1 = unsigned(p1);
+		c0 = hi1 ^ c1 ^ k0;
+		c1 = lo1;
+		c2 = hi0 ^ c3 ^ k1;
+		c3 = lo0;
+		k0 += 0x9E3779B9u;
+		k1 += 0xBB67AE85u;
+	}
+	out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+
+// Generator view of Philox keyed by (pixel, sample).  Successive calls walk
+// through the dimensions of that sample, so dimension d of a given pixel
+// sample is the same no matter which thread evaluates it or in what order.
+class philox_rnd {
+public:
+	typedef unsigned result_type;
+
+private:
+	unsigned ctr[4], key[2];
+	unsigned buf[4];
+	unsigned dim;
+
+public:
+	philox_rnd(unsigned pixel, unsigned sample, unsigned first_dim = 0,
+	           unsigned seed = 0)
+	{
+		ctr[0] = 0; ctr[1] = pixel; ctr[2] = sample; ctr[3] = 0;
+		key[0] = seed; key[1] = 0x5bd1e995u;
+		dim = first_dim;
+		refill();
+	}
+
+	static result_type min() { return 0; }
+	static result_type max() { return 0xffffffffu; }
+
+	result_type operator () ()
+	{
+		unsigned r = buf[dim & 3];
+		dim++;
+		if (!(dim & 3))
+			refill();
+		return r;
+	}
+
+private:
+	void refill()
+	{
+		ctr[0] = dim >> 2;
+		philox4x32(ctr, key, buf);
+	}
+};
+
+
+// Cheap stateless hash generator keyed by (pixel, sample, dimension).
+// Lower quality than Philox but a handful of integer ops.
+static inline unsigned hash_mix(unsigned x)
+{
+	// "lowbias32" from Chris Wellons' hash prospector
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static inline unsigned hash_rnd(unsigned pixel, unsigned sample, unsigned dim,
+                                unsigned seed = 0)
+{
+	return hash_mix(pixel ^ hash_mix(sample ^ hash_mix(dim ^ hash_mix(seed))));
+}
+
+
+// Uniform floats in [0, 1) for n consecutive pixels starting at pixel0,
+// identical to hash_rnd(pixel0 + i, sample, dim, seed) * 2^-32 with the low
+// 8 bits dropped.  Four lanes at a time with SSE2.
+static inline void hash_rnd_batch(unsigned pixel0, unsigned sample, unsigned dim,
+                                  size_t n, float *out, unsigned seed = 0)
+{
+	const unsigned key = hash_mix(sample ^ hash_mix(dim ^ hash_mix(seed)));
+	const float scale = 1.0f / 16777216.0f;
+	size_t i = 0;
+#ifdef TRIMESH_HAVE_SSE2
+	struct sse {
+		static __m128i mullo(__m128i a, __m128i b)
+		{
+			__m128i even = _mm_mul_epu32(a, b);
+			__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+			return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+			                          _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+		}
+		static __m128i mix(__m128i x)
+		{
+			x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+			x = mullo(x, _mm_set1_epi32(int(0x7feb352du)));
+			x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+			x = mullo(x, _mm_set1_epi32(int(0x846ca68bu)));
+			x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+			return x;
+		}
+	};
+	const __m128i vkey = _mm_set1_epi32(int(key));
+	const __m128 vscale = _mm_set1_ps(scale);
+	__m128i pix = _mm_add_epi32(_mm_set1_epi32(int(pixel0)), _mm_set_epi32(3, 2, 1, 0));
+	for (; i + 4 <= n; i += 4) {
+		__m128i h = sse::mix(_mm_xor_si128(pix, vkey));
+		// Top 24 bits convert to float exactly, and stay below 1
+		__m128 f = _mm_cvtepi32_ps(_mm_srli_epi32(h, 8));
+		_mm_storeu_ps(out + i, _mm_mul_ps(f, vscale));
+		pix = _mm_add_epi32(pix, _mm_set1_epi32(4));
+	}
+#endif
+	for (; i < n; i++)
+		out[i] = float(hash_mix(unsigned(pixel0 + i) ^ key) >> 8) * scale;
+}
+
+
+// Uniform numbers from a caller-owned generator G (anything whose
+// operator() returns 32 random bits, e.g. pcg32 or philox_rnd).
+// Unlike the global versions above, the range is [0, n) for n > 0 and
+// [-n, n) for n < 0, which is what sampling code usually wants.
+template <class G, class T>
+static inline
+typename ::std::enable_if< ::std::is_floating_point<T>::value, T >::type
+uniform_rnd(G &gen, T n)
+{
+	// 24 bits for float, 32 for wider types; never rounds up to 1
+	const int bits = (sizeof(T) == sizeof(float)) ? 24 : 32;
+	const T scale = T(1) / T(1ULL << bits);
+	T u = T(unsigned(gen()) >> (32 - bits)) * scale;
+	if (n < 0)
+		return (2 * u - 1) * -n;
+	return u * n;
+}
+
+// Integral version: [0, n) for n > 0, [-n, n] for n < 0
+template <class G, class T>
+static inline
+typename ::std::enable_if< ::std::is_integral<T>::value, T >::type
+uniform_rnd(G &gen, T n)
+{
+	if (n > 0)
+		return T(unsigned(gen()) % unsigned(n));
+	else if (n < 0)
+		return T(unsigned(gen()) % unsigned(-2 * n + 1)) + n;
+	else
+		return 0;
+}
+
+
+// Normal-distributed numbers from a caller-owned generator.  Polar
+// Box-Muller without the saved second value, so there is no hidden state.
+template <class G, class T>
+static inline
+typename ::std::enable_if< ::std::is_floating_point<T>::value, T >::type
+normal_rnd(G &gen, T sigma)
+{
+	if (sigma == 0)
+		return 0;
+
+	T x, y, r2;
+	do {
+		x = uniform_rnd(gen, T(-1));
+		y = uniform_rnd(gen, T(-1));
+		r2 = sqr(x) + sqr(y);
+	} while (r2 >= T(1) || r2 == T(0));
+
+	return sigma * y * sqrt(T(-2) * log(r2) / r2);
+}
+
+
 // Boost-like compile-time assertion checking
 template <bool X> struct STATIC_ASSERTION_FAILURE;
 template <> struct STATIC_ASSERTION_FAILURE<true>
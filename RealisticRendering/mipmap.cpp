@@ -0,0 +1,147 @@
+#include "mipmap.h"
+
+#include <emmintrin.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+// Texels per cache line
+const size_t lineTexels = 64 / sizeof(uint32_t);
+
+inline int wrap(int i, int n) {
+    i %= n;
+    return i < 0 ? i + n : i;
+}
+
+// RGBA8 to four floats in [0, 255], one channel per lane
+inline __m128 unpack_texel(uint32_t t) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i bytes = _mm_cvtsi32_si128(static_cast<int>(t));
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+}
+
+} // namespace
+
+MipTexture::MipTexture(const QImage &image) {
+    if (image.isNull())
+        return;
+    // Row 0 is the bottom of the picture, like the raster path's upload
+    QImage rgba = image.convertToFormat(QImage::Format_RGBA8888).mirrored();
+
+    // Lay out every level up front, each padded to whole tiles
+    size_t total = 0;
+    for (int w = rgba.width(), h = rgba.height(); ; w = std::max(1, w / 2), h = std::max(1, h / 2)) {
+        Level level;
+        level.width = w;
+        level.height = h;
+        level.tilesX = (w + tileSize - 1) / tileSize;
+        level.first = total;
+        levels.push_back(level);
+        total += static_cast<size_t>(level.tilesX) * ((h + tileSize - 1) / tileSize) * tileSize * tileSize;
+        if (w == 1 && h == 1)
+            break;
+    }
+
+    // Over-allocate so that tiles can start on a cache line
+    storage.resize(total + lineTexels);
+    size_t misalign = (reinterpret_cast<uintptr_t>(storage.data()) / sizeof(uint32_t)) % lineTexels;
+    size_t shift = misalign == 0 ? 0 : lineTexels - misalign;
+    for (Level &level : levels)
+        level.first += shift;
+
+    const Level &base = levels[0];
+    for (int y = 0; y < base.height; y++) {
+        const uchar *row = rgba.constScanLine(y);
+        for (int x = 0; x < base.width; x++) {
+            const uchar *p = row + 4 * x;
+            texel(base, x, y) = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+        }
+    }
+
+    // Box filter over the source texels each destination texel covers:
+    // 2x2, or 2x3 and 3x3 where a size is odd, so no row or column is lost
+    for (size_t i = 1; i < levels.size(); i++) {
+        const Level &src = levels[i - 1], &dst = levels[i];
+        for (int y = 0; y < dst.height; y++) {
+            int y0 = y * src.height / dst.height, y1 = std::max(y0 + 1, (y + 1) * src.height / dst.height);
+            for (int x = 0; x < dst.width; x++) {
+                int x0 = x * src.width / dst.width, x1 = std::max(x0 + 1, (x + 1) * src.width / dst.width);
+                __m128 sum = _mm_setzero_ps();
+                for (int sy = y0; sy < y1; sy++) {
+                    for (int sx = x0; sx < x1; sx++)
+                        sum = _mm_add_ps(sum, unpack_texel(texel(src, sx, sy)));
+                }
+                __m128i rounded = _mm_cvtps_epi32(_mm_mul_ps(sum, _mm_set1_ps(1.f / ((x1 - x0) * (y1 - y0)))));
+                rounded = _mm_packs_epi32(rounded, rounded);
+                texel(dst, x, y) = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(rounded, rounded)));
+            }
+        }
+    }
+}
+
+uint32_t &MipTexture::texel(const Level &level, int x, int y) {
+    int tile = (y / tileSize) * level.tilesX + x / tileSize;
+    return storage[level.first + tile * tileSize * tileSize + (y % tileSize) * tileSize + x % tileSize];
+}
+
+const uint32_t &MipTexture::texel(const Level &level, int x, int y) const {
+    int tile = (y / tileSize) * level.tilesX + x / tileSize;
+    return storage[level.first + tile * tileSize * tileSize + (y % tileSize) * tileSize + x % tileSize];
+}
+
+QVector3D MipTexture::bilinear(const Level &level, float u, float v) const {
+    float fx = u * level.width - 0.5f, fy = v * level.height - 0.5f;
+    float floorX = std::floor(fx), floorY = std::floor(fy);
+    float tx = fx - floorX, ty = fy - floorY;
+    // Wrap in double so that huge coordinates do not overflow the int
+    int x0 = wrap(static_cast<int>(std::fmod(static_cast<double>(floorX), level.width)), level.width);
+    int y0 = wrap(static_cast<int>(std::fmod(static_cast<double>(floorY), level.height)), level.height);
+    int x1 = x0 + 1 == level.width ? 0 : x0 + 1;
+    int y1 = y0 + 1 == level.height ? 0 : y0 + 1;
+
+    __m128 top = _mm_add_ps(_mm_mul_ps(unpack_texel(texel(level, x0, y0)), _mm_set1_ps(1 - tx)),
+        _mm_mul_ps(unpack_texel(texel(level, x1, y0)), _mm_set1_ps(tx)));
+    __m128 bottom = _mm_add_ps(_mm_mul_ps(unpack_texel(texel(level, x0, y1)), _mm_set1_ps(1 - tx)),
+        _mm_mul_ps(unpack_texel(texel(level, x1, y1)), _mm_set1_ps(tx)));
+    __m128 c = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(top, _mm_set1_ps(1 - ty)), _mm_mul_ps(bottom, _mm_set1_ps(ty))),
+        _mm_set1_ps(1 / 255.f));
+
+    float rgba[4];
+    _mm_storeu_ps(rgba, c);
+    return QVector3D(rgba[0], rgba[1], rgba[2]);
+}
+
+QVector3D MipTexture::sample_level(float u, float v, float level) const {
+    if (levels.empty())
+        return QVector3D(1, 1, 1);
+
+    level = std::max(0.f, std::min(level, static_cast<float>(levels.size() - 1)));
+    int lower = static_cast<int>(level);
+    float t = level - lower;
+    QVector3D c = bilinear(levels[lower], u, v);
+    if (t > 0 && lower + 1 < static_cast<int>(levels.size()))
+        c = c * (1 - t) + bilinear(levels[lower + 1], u, v) * t;
+    return c;
+}
+
+QVector3D MipTexture::sample(float u, float v, float dudx, float dvdx, float dudy, float dvdy) const {
+    if (levels.empty())
+        return QVector3D(1, 1, 1);
+
+    // Footprint of one pixel in level 0 texels, along its longer axis
+    float w = static_cast<float>(levels[0].width), h = static_cast<float>(levels[0].height);
+    float lx2 = dudx * dudx * w * w + dvdx * dvdx * h * h;
+    float ly2 = dudy * dudy * w * w + dvdy * dvdy * h * h;
+    float footprint2 = std::max(lx2, ly2);
+    float level = footprint2 > 1 ? 0.5f * std::log2(footprint2) : 0.f;
+    return sample_level(u, v, level);
+}
+
+std::shared_ptr<const MipTexture> load_mip_texture(const QString &fileName) {
+    QImage image(fileName);
+    if (image.isNull())
+        return nullptr;
+    return std::make_shared<MipTexture>(image);
+}
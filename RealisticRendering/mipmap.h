@@ -0,0 +1,56 @@
+#pragma once
+
+#include <QImage>
+#include <QString>
+#include <QVector3D>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Read-only color texture for the CPU tracers, with a box filtered mip
+// pyramid built once at load time.
+//
+// Texels are RGBA8 in 4x4 tiles, so one tile is a single 64-byte cache line
+// and a bilinear footprint touches one to four lines, where a row-major
+// image would need two rows that are a full image width apart. Levels are
+// chosen from the screen-space derivatives of the texture coordinates, so a
+// minified texture is read from a level about as small as its footprint
+// and the memory touched per pixel stays bounded however far away it is.
+//
+// Coordinates wrap like GL_REPEAT and v runs bottom up, the same as the
+// OpenGL texture the raster path samples, so both put the image in the same
+// place. Safe to sample from several threads.
+class MipTexture {
+public:
+    explicit MipTexture(const QImage &image);
+
+    int width() const { return levels.empty() ? 0 : levels[0].width; }
+    int height() const { return levels.empty() ? 0 : levels[0].height; }
+    int level_count() const { return static_cast<int>(levels.size()); }
+
+    // Trilinear lookup; the derivatives of (u, v) across one pixel pick the level
+    QVector3D sample(float u, float v, float dudx, float dvdx, float dudy, float dvdy) const;
+    // Bilinear lookup at a fractional level, 0 being the full resolution
+    QVector3D sample_level(float u, float v, float level) const;
+
+private:
+    static const int tileSize = 4;
+
+    struct Level {
+        int width;
+        int height;
+        int tilesX;
+        size_t first;           // index of texel (0, 0) in storage, 64-byte aligned
+    };
+
+    std::vector<Level> levels;
+    std::vector<uint32_t> storage;
+
+    uint32_t &texel(const Level &level, int x, int y);
+    const uint32_t &texel(const Level &level, int x, int y) const;
+    QVector3D bilinear(const Level &level, float u, float v) const;
+};
+
+// Null if the image cannot be read
+std::shared_ptr<const MipTexture> load_mip_texture(const QString &fileName);
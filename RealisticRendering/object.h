@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <map>
+#include <memory>
 #include <QVector3D>
 #include "Vec.h"
 
@@ -115,6 +116,8 @@ enum {
     REFLECTION
 };
 
+class MipTexture;
+
 struct Material {
     float Kd;           // Diffuse reflectivity
     float Ks;           // Specular reflectivity
@@ -122,6 +125,7 @@ struct Material {
     float ior;
     int Type;
     QVector3D diffColor;
+    std::shared_ptr<const MipTexture> diffTexture;  // modulates diffColor in the ray tracer, may be null
 
     Material() : ior(1.3), Kd(0.8), Ks(0.4), Shininess(50.f)
         , Type(DIFFUSE_AND_GLOSSY), diffColor(QVector3D(0.7, 0.3, 0.2)) {}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of threads to use when the caller asks for "all of them" (0).
+inline int resolve_thread_count(int numThreads) {
+    if (numThreads > 0)
+        return numThreads;
+    unsigned n = std::thread::hardware_concurrency();
+    return n > 0 ? static_cast<int>(n) : 1;
+}
+
+// Task parallelism for recursive work such as tree builds.
+// Every thread owns a deque of tasks: it pushes and pops at the back, so it
+// works depth first on what it just split off, and when its deque runs dry
+// it steals from the front of another thread's deque, where the oldest and
+// usually largest pieces of work sit. Tasks spawn children with spawn().
+class TaskScheduler {
+public:
+    typedef std::function<void()> Task;
+
+    explicit TaskScheduler(int numThreads = 0) : pending(0) {
+        int n = resolve_thread_count(numThreads);
+        for (int i = 0; i < n; i++)
+            queues.emplace_back(new Queue);
+    }
+
+    int thread_count() const { return static_cast<int>(queues.size()); }
+
+    // Call before run() or from inside a running task
+    void spawn(Task task) {
+        int index = worker_index();
+        if (index < 0 || index >= thread_count())
+            index = 0;
+        pending++;
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+
+    // Returns once every task, including those spawned meanwhile, is done.
+    // The calling thread takes part in the work.
+    void run() {
+        auto worker = [this](int index) {
+            int saved = worker_index();
+            TaskScheduler *savedScheduler = current();
+            worker_index() = index;
+            current() = this;
+            Task task;
+            while (pending > 0) {
+                if (take(index, task)) {
+                    task();
+                    task = nullptr;
+                    pending--;
+                }
+                else {
+                    std::this_thread::yield();
+                }
+            }
+            worker_index() = saved;
+            current() = savedScheduler;
+        };
+
+        std::vector<std::thread> threads;
+        for (int t = 1; t < thread_count(); t++)
+            threads.emplace_back(worker, t);
+        worker(0);
+        for (auto &t : threads)
+            t.join();
+    }
+
+    // The scheduler whose task is running on this thread, if any
+    static TaskScheduler *&current() {
+        thread_local TaskScheduler *scheduler = nullptr;
+        return scheduler;
+    }
+
+    // From inside a running task: runs work on this thread and as up to
+    // 'helpers' more tasks, and returns once all of them are done. Meanwhile
+    // this thread also runs whatever else is queued, rather than waiting.
+    template <class Work>
+    void run_nested(const Work &work, int helpers) {
+        std::atomic<int> running(std::max(0, std::min(helpers, thread_count() - 1)));
+        for (int i = running; i > 0; i--) {
+            spawn([&work, &running]() {
+                work();
+                running--;
+            });
+        }
+        work();
+
+        int index = worker_index();
+        Task task;
+        while (running > 0) {
+            if (take(index, task)) {
+                task();
+                task = nullptr;
+                pending--;
+            }
+            else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::atomic<int> pending;   // spawned but not finished
+
+    static int &worker_index() {
+        thread_local int index = -1;
+        return index;
+    }
+
+    bool take(int index, Task &task) {
+        {
+            Queue &own = *queues[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (int i = 1; i < thread_count(); i++) {
+            Queue &victim = *queues[(index + i) % thread_count()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Run body(i) for every i in [begin, end) on numThreads threads.
+// Indices are handed out in chunks of `grain` through a shared atomic counter,
+// so rows of very different cost still balance across threads.
+// The calling thread takes part in the work. Called from a TaskScheduler
+// task, the loop runs on that scheduler's threads instead of new ones, which
+// would only compete with them for the cores.
+template <class Body>
+void parallel_for(int begin, int end, const Body &body, int numThreads = 0, int grain = 1) {
+    if (end <= begin)
+        return;
+
+    grain = std::max(grain, 1);
+    int chunks = (end - begin + grain - 1) / grain;
+    numThreads = std::min(resolve_thread_count(numThreads), chunks);
+
+    std::atomic<int> next(begin);
+    auto worker = [&]() {
+        for (;;) {
+            int start = next.fetch_add(grain);
+            if (start >= end)
+                break;
+            int stop = std::min(start + grain, end);
+            for (int i = start; i < stop; i++)
+                body(i);
+        }
+    };
+
+    if (numThreads <= 1) {
+        worker();
+        return;
+    }
+    if (TaskScheduler *scheduler = TaskScheduler::current()) {
+        scheduler->run_nested(worker, numThreads - 1);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    threads.reserve(numThreads - 1);
+    for (int t = 1; t < numThreads; t++)
+        threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads)
+        t.join();
+}
@@ -0,0 +1,349 @@
+#include "pathtracer.h"
+#include "parallel.h"
+#include "mathutil.h"
+#include "arealight.h"
+
+#include <algorithm>
+#include <cmath>
+#include <QElapsedTimer>
+
+namespace {
+
+const double bias = 1e-4;
+const double pi = 3.14159265358979323846;
+
+Vector unit(const Vector &v) {
+    double len2 = v * v;
+    return len2 > 0 ? v / std::sqrt(len2) : v;
+}
+
+Vector reflect(const Vector &I, const Vector &N) {
+    return I - 2 * (I * N) * N;
+}
+
+// Refraction of I through a surface with normal N (either side), or the
+// zero vector on total internal reflection
+Vector refract(const Vector &I, const Vector &N, float ior) {
+    double cosi = std::max(-1.0, std::min(1.0, I * N));
+    double etai = 1, etat = ior;
+    Vector n = N;
+    if (cosi < 0) {
+        cosi = -cosi;
+    }
+    else {
+        std::swap(etai, etat);
+        n = -N;
+    }
+
+    double eta = etai / etat;
+    double k = 1 - eta * eta * (1 - cosi * cosi);
+    if (k < 0)
+        return Vector(0, 0, 0);
+    return eta * I + (eta * cosi - std::sqrt(k)) * n;
+}
+
+// Fraction of light reflected for unpolarized light
+float fresnel(const Vector &I, const Vector &N, float ior) {
+    double cosi = std::max(-1.0, std::min(1.0, I * N));
+    double etai = 1, etat = ior;
+    if (cosi > 0)
+        std::swap(etai, etat);
+
+    double sint = etai / etat * std::sqrt(std::max(0.0, 1 - cosi * cosi));
+    if (sint >= 1)
+        return 1.f;
+
+    double cost = std::sqrt(std::max(0.0, 1 - sint * sint));
+    cosi = std::fabs(cosi);
+    double Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
+    double Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
+    return static_cast<float>((Rs * Rs + Rp * Rp) / 2);
+}
+
+inline QVector3D to_qvector(const Vector &v) {
+    return QVector3D(v.x(), v.y(), v.z());
+}
+
+// Phong light from one light at the diffuse point p, or zero if the shadow
+// ray from origin is blocked. Area lights are sampled once, at (u1, u2).
+// Scaled by light.La for both terms, like the Whitted tracer's
+// light_contribution(). The Lambertian BRDF would be albedo / pi; that pi is
+// left in the light's intensity, as in the Phong model the intensities come
+// from, so a light of La 1 lights a facing white surface to 1.
+QVector3D direct_light(const scene &s, const Light &light, const Point &p, const Point &origin,
+    const Vector &facing, const Vector &rayDir, const Material &material, const QVector3D &albedo,
+    float u1, float u2) {
+    Vector lightDir;
+    double lightSquareDistance;
+    float scale;
+    if (is_area_light(light)) {
+        AreaLightSample sample;
+        if (!sample_area_light(light, p, u1, u2, sample))
+            return QVector3D(0, 0, 0);
+        lightDir = sample.direction;
+        lightSquareDistance = sample.squaredDistance;
+        scale = sample.weight;
+    }
+    else if (light.Type == DIRECTIONAL_LIGHT) {
+        lightDir = unit(-Vector(light.Direction.x(), light.Direction.y(), light.Direction.z()));
+        lightSquareDistance = 1e30;
+    }
+    else {
+        Point lightCoord(light.Position.x(), light.Position.y(), light.Position.z());
+        lightDir = lightCoord - p;
+        lightSquareDistance = lightDir * lightDir;
+        lightDir = unit(lightDir);
+    }
+    if (!is_area_light(light))
+        scale = light_falloff(light, lightSquareDistance);
+
+    double LdotN = lightDir * facing;
+    if (LdotN <= 0 || s.occluded(Ray(origin, lightDir), lightSquareDistance))
+        return QVector3D(0, 0, 0);
+
+    Vector reflectDir = unit(reflect(-lightDir, facing));
+    float spec = powf(std::max(0.f, static_cast<float>(-(reflectDir * rayDir))), material.Shininess);
+    QVector3D direct = albedo * (light.La * static_cast<float>(LdotN))
+        + QVector3D(1, 1, 1) * (light.La * material.Ks * spec);
+    return direct * scale;
+}
+
+} // namespace
+
+// Cosine-weighted direction around n. The pdf cos/pi cancels against the
+// Lambertian BRDF, so the path throughput is simply multiplied by albedo.
+Vector sample_cosine_hemisphere(const Vector &n, float u1, float u2) {
+    // Orthonormal basis (Duff et al. 2017)
+    double sign = n.z() >= 0 ? 1.0 : -1.0;
+    double a = -1.0 / (sign + n.z());
+    double b = n.x() * n.y() * a;
+    Vector t(1 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+    Vector s(b, sign + n.y() * n.y() * a, -n.y());
+
+    double r = std::sqrt(u1);
+    double phi = 2 * pi * u2;
+    double x = r * std::cos(phi), y = r * std::sin(phi);
+    double z = std::sqrt(std::max(0.0, 1.0 - u1));
+    return unit(x * t + y * s + z * n);
+}
+
+QVector3D PathTracer::radiance(const Ray &ray, const Light &light, Sampler &sampler, PixelAov *aov) const {
+    return trace_path(ray, light, sampler, aov, pCache != nullptr, nullptr);
+}
+
+QVector3D PathTracer::cached_indirect(const Point &p, const Vector &n, const Light &light,
+    std::vector<IrradianceRecord> *pending) const {
+    QVector3D position(p.x(), p.y(), p.z()), normal = to_qvector(n);
+    QVector3D irradiance;
+    if (pCache->lookup(position, normal, irradiance, pending))
+        return irradiance;
+
+    // One Sobol sequence per record, addressed by a hash of its position,
+    // so the hemisphere samples of a record are stratified
+    unsigned h = trimesh::hash_mix(static_cast<unsigned>(static_cast<int>(std::floor(p.x() * 4096)))
+        ^ trimesh::hash_mix(static_cast<unsigned>(static_cast<int>(std::floor(p.y() * 4096)))
+        ^ trimesh::hash_mix(static_cast<unsigned>(static_cast<int>(std::floor(p.z() * 4096))))));
+    int samples = std::max(1, pCache->settings.samples);
+
+    QVector3D sum(0, 0, 0);
+    double inverseDistanceSum = 0;
+    Point origin = p + n * bias;
+    for (int i = 0; i < samples; i++) {
+        Sampler sampler(SOBOL_SAMPLER, h & 0xffff, h >> 16, static_cast<unsigned>(i));
+        float u1, u2;
+        sampler.get_2d(u1, u2);
+
+        double distance = -1;
+        sum += trace_path(Ray(origin, sample_cosine_hemisphere(n, u1, u2)), light, sampler,
+            nullptr, false, &distance);
+        if (distance > 0)
+            inverseDistanceSum += 1 / distance;
+    }
+
+    IrradianceRecord record;
+    record.position = position;
+    record.normal = normal;
+    record.irradiance = sum / static_cast<float>(samples);
+    // Open surroundings get the largest radius insert() allows
+    record.radius = inverseDistanceSum > 0 ? static_cast<float>(samples / inverseDistanceSum) : 1e30f;
+    if (pending != nullptr) {
+        pCache->clamp_radius(record);
+        pending->push_back(record);
+    }
+    else {
+        pCache->insert(record);
+    }
+    return record.irradiance;
+}
+
+QVector3D PathTracer::trace_path(const Ray &primary, const Light &light, Sampler &sampler, PixelAov *aov,
+    bool useCache, double *firstHitDistance, std::vector<IrradianceRecord> *pending) const {
+    QVector3D result(0, 0, 0), throughput(1, 1, 1);
+    Ray ray = primary;
+
+    for (int depth = 0; depth <= settings.maxDepth; depth++) {
+        if (ray.is_degenerate())
+            break;
+
+        // Every bounce takes the same seven dimensions whether it uses them
+        // or not, so dimension d always means the same thing across samples
+        float uBranch = sampler.get_1d();
+        float uDir1, uDir2;
+        sampler.get_2d(uDir1, uDir2);
+        float uRoulette = sampler.get_1d();
+        float uLight = sampler.get_1d();
+        float uArea1, uArea2;
+        sampler.get_2d(uArea1, uArea2);
+
+        SceneHit hit;
+        if (!pScene->intersect(ray, hit)) {
+            if (depth == 0 && firstHitDistance != nullptr)
+                *firstHitDistance = -1;
+            break;
+        }
+        if (depth == 0 && firstHitDistance != nullptr)
+            *firstHitDistance = std::sqrt(hit.squaredDistance);
+
+        const Material &material = hit.hitObject->material;
+        Vector rayDir = unit(ray.to_vector());
+        Vector n = hit.normal;
+        // Normal on the side the ray arrives from
+        Vector facing = (rayDir * n) < 0 ? n : -n;
+
+        if (depth == 0 && aov != nullptr) {
+            aov->albedo = material.Type == DIFFUSE_AND_GLOSSY ?
+                material.diffColor : QVector3D(1, 1, 1);
+            aov->normal = to_qvector(n);
+            aov->depth = static_cast<float>(std::sqrt(hit.squaredDistance));
+        }
+
+        Vector nextDir;
+        Point nextOrigin;
+
+        switch (material.Type) {
+        case REFLECTION_AND_REFRACTION: {
+            // Pick one branch with probability equal to its Fresnel weight,
+            // which leaves the throughput unchanged
+            float kr = fresnel(rayDir, n, material.ior);
+            if (uBranch < kr) {
+                nextDir = unit(reflect(rayDir, n));
+                nextOrigin = hit.point + facing * bias;
+            }
+            else {
+                nextDir = unit(refract(rayDir, n, material.ior));
+                nextOrigin = hit.point - facing * bias;
+            }
+            break;
+        }
+        case REFLECTION: {
+            nextDir = unit(reflect(rayDir, n));
+            nextOrigin = hit.point + facing * bias;
+            break;
+        }
+        default: {
+            QVector3D albedo = material.diffColor * material.Kd;
+            nextOrigin = hit.point + facing * bias;
+
+            // Next event estimation toward the light, or toward one light
+            // picked from the scene's light list
+            if (pScene->lightBvh.empty()) {
+                result += throughput * direct_light(*pScene, light, hit.point, nextOrigin, facing, rayDir,
+                    material, albedo, uArea1, uArea2);
+            }
+            else {
+                const float p[3] = { static_cast<float>(hit.point.x()), static_cast<float>(hit.point.y()),
+                    static_cast<float>(hit.point.z()) };
+                const float nf[3] = { static_cast<float>(facing.x()), static_cast<float>(facing.y()),
+                    static_cast<float>(facing.z()) };
+                float probability;
+                int index = pScene->lightBvh.sample(p, nf, uLight, probability);
+                if (index >= 0) {
+                    result += throughput * direct_light(*pScene, pScene->lightBvh.light(index), hit.point,
+                        nextOrigin, facing, rayDir, material, albedo, uArea1, uArea2) / probability;
+                }
+            }
+
+            if (useCache) {
+                result += throughput * albedo * cached_indirect(hit.point, facing, light, pending);
+                return result;
+            }
+
+            nextDir = sample_cosine_hemisphere(facing, uDir1, uDir2);
+            throughput *= albedo;
+            break;
+        }
+        }
+
+        if (depth >= settings.rouletteDepth) {
+            float p = std::min(0.95f, std::max(throughput.x(), std::max(throughput.y(), throughput.z())));
+            if (uRoulette >= p)
+                break;
+            throughput /= p;
+        }
+
+        ray = Ray(nextOrigin, nextDir);
+    }
+
+    return result;
+}
+
+PathTraceStats PathTracer::render_pass(const RayCamera &camera, const Light &light, FrameBuffer &fb, int x0, int y0) const {
+    PathTraceStats stats;
+    if (pScene == nullptr)
+        return stats;
+
+    int width = fb.width, height = fb.height;
+    int pass = fb.passes;
+    bool writeAov = pass == 0;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    auto shade = [&](int x, int y, std::vector<IrradianceRecord> *pending) {
+        // Addressed by pixel and pass only: the image does not depend on
+        // which thread happened to pick up the pixel
+        int px = x0 + x, py = y0 + y;
+        Sampler sampler(settings.sampler, px, py, static_cast<unsigned>(pass));
+        float jx, jy;
+        sampler.get_2d(jx, jy);
+        Ray prim = camera.primary_ray(px + jx - 0.5f, py + jy - 0.5f);
+
+        PixelAov aov;
+        fb.add_color(x, y, trace_path(prim, light, sampler, writeAov ? &aov : nullptr, pCache != nullptr,
+            nullptr, pending));
+        if (writeAov)
+            fb.set_aov(x, y, aov.albedo, aov.normal, aov.depth);
+    };
+
+    if (settings.deterministic && pCache != nullptr) {
+        // Fixed sizes, so the records a path sees do not depend on the
+        // thread count either
+        const int bandRows = 16, segmentWidth = 32;
+        int segments = (width + segmentWidth - 1) / segmentWidth;
+        for (int band = 0; band < height; band += bandRows) {
+            int rows = std::min(bandRows, height - band);
+            std::vector<std::vector<IrradianceRecord>> made(static_cast<size_t>(rows) * segments);
+            parallel_for(0, rows * segments, [&](int i) {
+                int y = band + i / segments, begin = i % segments * segmentWidth;
+                for (int x = begin; x < std::min(begin + segmentWidth, width); x++)
+                    shade(x, y, &made[i]);
+            }, settings.numThreads);
+            for (const auto &records : made) {
+                for (const IrradianceRecord &r : records)
+                    pCache->insert(r);
+            }
+        }
+    }
+    else {
+        parallel_for(0, height, [&](int y) {
+            for (int x = 0; x < width; x++)
+                shade(x, y, nullptr);
+        }, settings.numThreads);
+    }
+    fb.passes++;
+
+    stats.samples = static_cast<long long>(width) * height;
+    stats.seconds = timer.nsecsElapsed() * 1e-9;
+    stats.threads = std::min(resolve_thread_count(settings.numThreads), std::max(height, 1));
+    return stats;
+}
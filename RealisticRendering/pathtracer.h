@@ -0,0 +1,87 @@
+#pragma once
+
+#include "scene.h"
+#include "light.h"
+#include "raycamera.h"
+#include "framebuffer.h"
+#include "sampler.h"
+#include "irradiancecache.h"
+
+struct PathTracerSettings {
+    int maxDepth;           // maximum number of bounces
+    int rouletteDepth;      // bounces before Russian roulette kicks in
+    int numThreads;         // 0 for all hardware threads
+    SamplerType sampler;
+    bool deterministic;     // the same image on any number of threads, also with an irradiance cache
+
+    PathTracerSettings() : maxDepth(8), rouletteDepth(3), numThreads(0), sampler(SOBOL_SAMPLER),
+        deterministic(false) {}
+};
+
+struct PathTraceStats {
+    long long samples;      // camera paths traced
+    double seconds;
+    int threads;
+
+    PathTraceStats() : samples(0), seconds(0), threads(1) {}
+
+    double samples_per_second_per_core() const {
+        return seconds > 0 ? samples / seconds / threads : 0;
+    }
+};
+
+// Cosine-weighted unit direction around the unit normal n, from two uniform
+// numbers in [0, 1)
+Vector sample_cosine_hemisphere(const Vector &n, float u1, float u2);
+
+// Monte Carlo path tracer over the same scene as the Whitted tracer.
+// Diffuse surfaces bounce with cosine-weighted sampling and take next event
+// estimation toward the light. The direct term is the Whitted tracer's Phong
+// term, scaled by Light::La with pi folded into the intensity (see
+// direct_light() in pathtracer.cpp), so both integrators agree on it.
+// When the scene file lists lights, every diffuse vertex instead takes one
+// light picked from the scene's light BVH, weighted by its probability.
+// Area lights get one shadow ray toward a point sampled on them.
+//
+// With an irradiance cache, the first diffuse vertex of each path takes its
+// indirect light from the cache instead of continuing the path. The cache is
+// owned by the caller so it can outlive the tracer across passes and camera
+// moves; clear it when the scene or the light changes.
+//
+// Samples are addressed by pixel and pass and each pixel sums its passes in
+// order, so without a cache the image never depends on the thread count.
+// With one it does, through which records exist when a path looks; in
+// deterministic mode rows are traced in bands of a fixed height, paths only
+// see the records of earlier bands and of earlier pixels in their own row
+// segment, and each band's new records are inserted in pixel order once it
+// is done. That costs some reuse inside a band.
+class PathTracer {
+public:
+    PathTracerSettings settings;
+
+public:
+    explicit PathTracer(const scene *s, IrradianceCache *cache = nullptr) : pScene(s), pCache(cache) {}
+
+    // Traces one sample per pixel and adds it to fb as a new pass.
+    // The first pass also fills the denoiser AOVs. fb may be a tile of the
+    // camera image whose left top pixel is (x0, y0).
+    PathTraceStats render_pass(const RayCamera &camera, const Light &light, FrameBuffer &fb,
+        int x0 = 0, int y0 = 0) const;
+
+    QVector3D radiance(const Ray &ray, const Light &light, Sampler &sampler, PixelAov *aov) const;
+
+private:
+    const scene *pScene;
+    IrradianceCache *pCache;
+
+    // useCache is off for the paths that compute new cache records.
+    // firstHitDistance, if given, receives the distance to the first hit or
+    // a negative value if the ray escapes.
+    // pending, if given, holds new cache records instead of the cache.
+    QVector3D trace_path(const Ray &ray, const Light &light, Sampler &sampler, PixelAov *aov,
+        bool useCache, double *firstHitDistance, std::vector<IrradianceRecord> *pending = nullptr) const;
+    // Indirect radiance arriving at a diffuse point, from the cache or from
+    // a new record
+    QVector3D cached_indirect(const Point &p, const Vector &n, const Light &light,
+        std::vector<IrradianceRecord> *pending) const;
+};
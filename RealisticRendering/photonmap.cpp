@@ -0,0 +1,332 @@
+#include "photonmap.h"
+#include "parallel.h"
+#include "sampler.h"
+#include "shadingkernels.h"
+
+#include <QElapsedTimer>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const double bias = 1e-4;
+const double pi = 3.14159265358979323846;
+const int batchSize = 1 << 14;     // photons per parallel work item
+const int taskSize = 1 << 15;      // smaller kd subtrees are balanced without a new task
+
+Vector unit(const Vector &v) {
+    double len2 = v * v;
+    return len2 > 0 ? v / std::sqrt(len2) : v;
+}
+
+// Cone of directions from the light that covers a specular object's
+// bounding sphere; the whole sphere of directions if the light is inside
+struct Target {
+    Vector axis;
+    Vector u, v;            // completes axis to an orthonormal frame
+    double cosMax;
+    double solidAngle;
+};
+
+bool make_target(const BvhBox &box, const Point &lightPos, Target &t) {
+    if (box.empty())
+        return false;
+    Point center(box.centroid(0), box.centroid(1), box.centroid(2));
+    double radius = 0.5 * std::sqrt(
+        static_cast<double>(box.hi[0] - box.lo[0]) * (box.hi[0] - box.lo[0])
+        + static_cast<double>(box.hi[1] - box.lo[1]) * (box.hi[1] - box.lo[1])
+        + static_cast<double>(box.hi[2] - box.lo[2]) * (box.hi[2] - box.lo[2]));
+    Vector toCenter = center - lightPos;
+    double dist = std::sqrt(toCenter * toCenter);
+
+    if (dist <= radius) {
+        t.axis = Vector(0, 1, 0);
+        t.cosMax = -1;
+    }
+    else {
+        t.axis = toCenter / dist;
+        double sinMax = radius / dist;
+        t.cosMax = std::sqrt(std::max(0.0, 1 - sinMax * sinMax));
+    }
+    t.solidAngle = 2 * pi * (1 - t.cosMax);
+
+    Vector helper = std::fabs(t.axis.x()) > 0.9 ? Vector(0, 1, 0) : Vector(1, 0, 0);
+    t.u = unit(CGAL::cross_product(helper, t.axis));
+    t.v = CGAL::cross_product(t.axis, t.u);
+    return true;
+}
+
+// Nodes in the left subtree of a left-balanced tree of n nodes
+int left_size(int n) {
+    if (n <= 1)
+        return 0;
+    int levels = 0;
+    while ((2 << levels) <= n)
+        levels++;
+    int full = (1 << levels) - 1;       // nodes above the last, partly filled level
+    int last = n - full;
+    return (full - 1) / 2 + std::min(last, 1 << (levels - 1));
+}
+
+// Moves median photons from src into heap order in dst. Every subtree is
+// split at its widest axis; the median index is chosen so that the tree
+// stays left-balanced.
+struct KdBalance {
+    Photon *src;
+    Photon *dst;
+    TaskScheduler &scheduler;
+
+    KdBalance(Photon *src, Photon *dst, TaskScheduler &scheduler) : src(src), dst(dst), scheduler(scheduler) {}
+
+    void node(int index, int begin, int end) {
+        while (begin < end) {
+            float lo[3] = { 1e30f, 1e30f, 1e30f }, hi[3] = { -1e30f, -1e30f, -1e30f };
+            for (int i = begin; i < end; i++) {
+                for (int a = 0; a < 3; a++) {
+                    lo[a] = std::min(lo[a], src[i].position[a]);
+                    hi[a] = std::max(hi[a], src[i].position[a]);
+                }
+            }
+            int axis = 0;
+            for (int a = 1; a < 3; a++) {
+                if (hi[a] - lo[a] > hi[axis] - lo[axis])
+                    axis = a;
+            }
+
+            int median = begin + left_size(end - begin);
+            std::nth_element(src + begin, src + median, src + end, [axis](const Photon &a, const Photon &b) {
+                return a.position[axis] < b.position[axis];
+            });
+            dst[index] = src[median];
+            dst[index].axis = static_cast<unsigned char>(axis);
+
+            int left = 2 * index + 1;
+            if (median - begin >= taskSize)
+                scheduler.spawn([=]() { node(left, begin, median); });
+            else
+                node(left, begin, median);
+
+            // The right subtree continues in this task
+            index = left + 1;
+            begin = median + 1;
+        }
+    }
+};
+
+} // namespace
+
+void PhotonMap::build(const scene &s, const Light &light, PhotonMapStats *stats) {
+    photons.clear();
+
+    QElapsedTimer timer;
+    timer.start();
+
+    Point lightPos(light.Position.x(), light.Position.y(), light.Position.z());
+    std::vector<Target> targets;
+    double totalSolidAngle = 0;
+    int targetCount = light.Type == POINT_LIGHT ? static_cast<int>(std::min(s.objects.size(), s.instanceBounds.size())) : 0;
+    for (int i = 0; i < targetCount; i++) {
+        Target t;
+        if (s.objects[i]->material.Type != DIFFUSE_AND_GLOSSY && make_target(s.instanceBounds[i], lightPos, t)) {
+            targets.push_back(t);
+            totalSolidAngle += t.solidAngle;
+        }
+    }
+
+    long long emitted = targets.empty() ? 0 : std::max(0, settings.photons);
+    int batchCount = static_cast<int>((emitted + batchSize - 1) / batchSize);
+    std::vector<std::vector<Photon>> batches(batchCount);
+
+    parallel_for(0, batchCount, [&](int batch) {
+        std::vector<Photon> &out = batches[batch];
+        long long first = static_cast<long long>(batch) * batchSize;
+        long long last = std::min(emitted, first + batchSize);
+        for (long long index = first; index < last; index++) {
+            Sampler sampler(SOBOL_SAMPLER, 0, 0, static_cast<unsigned>(index));
+
+            // Pick a target by its solid angle, then a direction in its cone
+            double pick = sampler.get_1d() * totalSolidAngle;
+            int target = 0;
+            while (target + 1 < static_cast<int>(targets.size()) && pick >= targets[target].solidAngle) {
+                pick -= targets[target].solidAngle;
+                target++;
+            }
+            const Target &t = targets[target];
+            float u1, u2;
+            sampler.get_2d(u1, u2);
+            double cosTheta = 1 - u1 * (1 - t.cosMax);
+            double sinTheta = std::sqrt(std::max(0.0, 1 - cosTheta * cosTheta));
+            double phi = 2 * pi * u2;
+            Vector dir = unit(cosTheta * t.axis + sinTheta * std::cos(phi) * t.u + sinTheta * std::sin(phi) * t.v);
+
+            // Cones overlap where objects are behind each other; the
+            // direction density is the number of cones containing it over
+            // the total solid angle
+            int covering = 0;
+            for (const Target &other : targets) {
+                if (dir * other.axis >= other.cosMax - 1e-9)
+                    covering++;
+            }
+            double power = light.Ld * totalSolidAngle / (static_cast<double>(emitted) * std::max(covering, 1));
+
+            Ray ray(lightPos, dir);
+            for (int bounce = 0; bounce <= settings.maxBounces; bounce++) {
+                SceneHit hit;
+                if (!s.intersect(ray, hit))
+                    break;
+                if (bounce == 0) {
+                    // Undo the inverse square falloff along the first
+                    // segment: the tracers' light does not fall off
+                    power *= hit.squaredDistance;
+                }
+
+                const Material &material = hit.hitObject->material;
+                Vector rayDir = unit(ray.to_vector());
+                Vector n = hit.normal;
+                Vector facing = (rayDir * n) < 0 ? n : -n;
+
+                if (material.Type == DIFFUSE_AND_GLOSSY) {
+                    // Direct light is the tracers' job
+                    if (bounce > 0) {
+                        Photon p;
+                        p.position[0] = static_cast<float>(hit.point.x());
+                        p.position[1] = static_cast<float>(hit.point.y());
+                        p.position[2] = static_cast<float>(hit.point.z());
+                        p.power = static_cast<float>(power);
+                        for (int a = 0; a < 3; a++)
+                            p.direction[a] = static_cast<signed char>(std::lround(rayDir[a] * 127));
+                        p.axis = 0;
+                        out.push_back(p);
+                    }
+                    break;
+                }
+
+                // Pick reflection or refraction with probability equal to its
+                // Fresnel weight, which leaves the power unchanged. The
+                // tracers' own optics, so photons bend the way rays do.
+                if (material.Type == REFLECTION_AND_REFRACTION
+                    && sampler.get_1d() >= shading::fresnel(rayDir, n, material.ior)) {
+                    ray = Ray(hit.point - facing * bias, unit(shading::refract(rayDir, n, material.ior)));
+                }
+                else {
+                    ray = Ray(hit.point + facing * bias, unit(shading::reflect(rayDir, n)));
+                }
+            }
+        }
+    }, settings.numThreads);
+
+    // Concatenated in batch order, so the map does not depend on scheduling
+    std::vector<Photon> stored;
+    size_t total = 0;
+    for (const std::vector<Photon> &b : batches)
+        total += b.size();
+    stored.reserve(total);
+    for (std::vector<Photon> &b : batches) {
+        stored.insert(stored.end(), b.begin(), b.end());
+        std::vector<Photon>().swap(b);
+    }
+
+    double emitSeconds = timer.nsecsElapsed() * 1e-9;
+    timer.restart();
+    balance(stored, settings.numThreads);
+
+    if (stats != nullptr) {
+        stats->emitted = emitted;
+        stats->stored = static_cast<long long>(photons.size());
+        stats->emitSeconds = emitSeconds;
+        stats->buildSeconds = timer.nsecsElapsed() * 1e-9;
+    }
+}
+
+void PhotonMap::balance(std::vector<Photon> &stored, int numThreads) {
+    int n = static_cast<int>(stored.size());
+    photons.resize(n);
+    if (n == 0)
+        return;
+
+    TaskScheduler scheduler(numThreads);
+    KdBalance kd(stored.data(), photons.data(), scheduler);
+    scheduler.spawn([&kd, n]() { kd.node(0, 0, n); });
+    scheduler.run();
+    std::vector<Photon>().swap(stored);
+}
+
+float PhotonMap::irradiance(const Point &p, const Vector &n) const {
+    int count = size();
+    if (count == 0)
+        return 0;
+
+    int k = std::max(1, std::min(settings.gatherCount, static_cast<int>(maxGather)));
+    float q[3] = { static_cast<float>(p.x()), static_cast<float>(p.y()), static_cast<float>(p.z()) };
+    float nq[3] = { static_cast<float>(n.x()), static_cast<float>(n.y()), static_cast<float>(n.z()) };
+    float r2 = settings.maxRadius * settings.maxRadius;
+
+    // Max-heap on distance of the nearest photons so far; once it is full,
+    // its top bounds the search radius
+    std::pair<float, int> nearest[maxGather];
+    int found = 0;
+    auto closer = [](const std::pair<float, int> &a, const std::pair<float, int> &b) { return a.first < b.first; };
+
+    // Far children with the squared distance to their splitting plane; a
+    // heap ordered tree has at most 31 levels
+    std::pair<int, float> stack[64];
+    int top = 0;
+    int i = 0;
+    for (;;) {
+        while (i < count) {
+            const Photon &photon = photons[i];
+            int left = 2 * i + 1;
+            int next = count;
+            if (left < count) {
+                int axis = photon.axis;
+                float d = q[axis] - photon.position[axis];
+                int nearChild = d < 0 ? left : left + 1;
+                int farChild = d < 0 ? left + 1 : left;
+                if (farChild < count)
+                    stack[top++] = std::make_pair(farChild, d * d);
+                next = nearChild;
+            }
+
+            float dx = photon.position[0] - q[0], dy = photon.position[1] - q[1], dz = photon.position[2] - q[2];
+            float d2 = dx * dx + dy * dy + dz * dz;
+            // Only photons arriving on the side being shaded
+            float incoming = photon.direction[0] * nq[0] + photon.direction[1] * nq[1] + photon.direction[2] * nq[2];
+            if (d2 < r2 && incoming < 0) {
+                if (found < k) {
+                    nearest[found++] = std::make_pair(d2, i);
+                    std::push_heap(nearest, nearest + found, closer);
+                }
+                else {
+                    std::pop_heap(nearest, nearest + found, closer);
+                    nearest[found - 1] = std::make_pair(d2, i);
+                    std::push_heap(nearest, nearest + found, closer);
+                }
+                if (found == k)
+                    r2 = nearest[0].first;
+            }
+            i = next;
+        }
+
+        i = count;
+        while (top > 0) {
+            std::pair<int, float> entry = stack[--top];
+            if (entry.second < r2) {
+                i = entry.first;
+                break;
+            }
+        }
+        if (i == count)
+            break;
+    }
+
+    if (found == 0 || r2 <= 0)
+        return 0;
+
+    // Cone filter with weight 1 - d / r; its normalization is 3 instead of 1
+    float r = std::sqrt(r2);
+    double sum = 0;
+    for (int j = 0; j < found; j++)
+        sum += photons[nearest[j].second].power * (1 - std::sqrt(nearest[j].first) / r);
+    return static_cast<float>(3 * sum / (pi * r2));
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "scene.h"
+#include "light.h"
+
+#include <vector>
+
+struct PhotonMapSettings {
+    int photons;            // photons emitted toward the specular objects
+    int gatherCount;        // nearest photons in a density estimate, at most PhotonMap::maxGather
+    float maxRadius;        // farthest a gathered photon may be
+    int maxBounces;         // specular bounces a photon may take before it is dropped
+    int numThreads;         // 0 for all hardware threads
+
+    PhotonMapSettings() : photons(1000000), gatherCount(64), maxRadius(0.25f), maxBounces(8), numThreads(0) {}
+};
+
+struct PhotonMapStats {
+    long long emitted;
+    long long stored;
+    double emitSeconds;
+    double buildSeconds;
+
+    PhotonMapStats() : emitted(0), stored(0), emitSeconds(0), buildSeconds(0) {}
+
+    double photons_per_second() const {
+        return emitSeconds > 0 ? emitted / emitSeconds : 0;
+    }
+};
+
+// 20 bytes. Caustic paths only pass white glass and mirrors, so the power
+// stays the same for all three channels.
+struct Photon {
+    float position[3];
+    float power;
+    signed char direction[3];   // unit direction of travel, times 127
+    unsigned char axis;         // kd-tree split axis
+};
+
+// Caustic photon map for the Whitted tracer, which cannot find light paths
+// that reach a diffuse surface through glass or a mirror.
+//
+// build() shoots photons from the light only toward the bounding spheres of
+// the REFLECTION_AND_REFRACTION and REFLECTION objects, follows them through
+// those with the same Fresnel choice the path tracer makes, and keeps the
+// ones that land on a diffuse surface after at least one bounce. Photons are
+// traced in fixed batches on all threads, each from its own sample index,
+// so the map does not depend on the thread count. Only point lights cast
+// caustics; like in RayTracer their intensity does not fall off, and photon
+// powers are scaled to match.
+//
+// The photons are then stored as a left-balanced kd-tree in one array in
+// heap order (Jensen, "Realistic Image Synthesis Using Photon Mapping"):
+// the children of photon i are 2i + 1 and 2i + 2, so no pointers are stored
+// and a lookup walks down a contiguous array.
+class PhotonMap {
+public:
+    static const int maxGather = 256;
+
+    PhotonMapSettings settings;
+
+public:
+    PhotonMap() {}
+
+    // Replaces the map; uses the objects' current motion
+    void build(const scene &s, const Light &light, PhotonMapStats *stats = nullptr);
+    bool empty() const { return photons.empty(); }
+    int size() const { return static_cast<int>(photons.size()); }
+    void clear() { photons.clear(); }
+
+    // Irradiance at p on a surface facing n, estimated from the nearest
+    // settings.gatherCount photons that arrive from the side n points to,
+    // with a cone filter. Shade as albedo * irradiance, like direct light.
+    float irradiance(const Point &p, const Vector &n) const;
+
+private:
+    std::vector<Photon> photons;    // kd-tree in heap order
+
+    void balance(std::vector<Photon> &stored, int numThreads);
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "scene.h"
+#include "camera3D.h"
+
+#include <cmath>
+
+// Rays through the neighbouring pixels to the right and below, traced
+// alongside a ray to estimate the footprint it covers (Igehy 1999)
+struct RayDifferential {
+    Point rxOrigin;
+    Point ryOrigin;
+    Vector rxDirection;
+    Vector ryDirection;
+};
+
+// Pinhole camera for the CPU tracers, built from the interactive Camera3D.
+// All per-frame math is done once here so that primary rays can be generated
+// from any number of threads. fovVertical is the full top to bottom angle in
+// degrees; the default matches the raster projection.
+struct RayCamera {
+    QVector3D position;
+    QVector3D forward;      // scaled to the near plane distance
+    QVector3D right;        // scaled to one pixel
+    QVector3D up;           // scaled to one pixel
+    int width;
+    int height;
+
+    RayCamera() : width(0), height(0) {}
+
+    RayCamera(Camera3D camera, int w, int h, float fovVertical = 45.f)
+        : width(w), height(h) {
+        float nearPlane = 0.1f;
+        QMatrix4x4 camMat = camera.toMatrix().inverted();
+        position = QVector3D(camMat(0, 3), camMat(1, 3), camMat(2, 3));
+
+        forward = camera.forward();
+        forward.normalize();
+        forward *= nearPlane;
+        right = camera.right();
+        up = camera.up();
+        right.normalize();
+        up.normalize();
+        float pixelSize = 2 * nearPlane * std::tan(0.5f * fovVertical * M_PI_180f) / h;
+        right *= pixelSize;
+        up *= pixelSize;
+    }
+
+    // Ray through image position (x, y); (0, 0) is left top and integer
+    // coordinates hit the same spots the original per-pixel tracer used.
+    Ray primary_ray(float x, float y) const {
+        int centerX = width / 2, centerY = height / 2;
+        QVector3D pixel = position + forward
+            + right * (x - centerX)
+            + up * (centerY - y);
+
+        Point camP(position.x(), position.y(), position.z());
+        Point pixelP(pixel.x(), pixel.y(), pixel.z());
+        return Ray(camP, pixelP);
+    }
+
+    RayDifferential primary_differential(float x, float y) const {
+        Ray rx = primary_ray(x + 1, y), ry = primary_ray(x, y + 1);
+        RayDifferential diff;
+        diff.rxOrigin = rx.start();
+        diff.ryOrigin = ry.start();
+        diff.rxDirection = rx.to_vector();
+        diff.ryDirection = ry.to_vector();
+        return diff;
+    }
+};
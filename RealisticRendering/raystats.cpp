@@ -0,0 +1,114 @@
+#include "raystats.h"
+
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+void RayStats::clear() {
+    std::fill(counters, counters + STAT_COUNTER_COUNT, 0LL);
+    std::fill(depthHistogram, depthHistogram + STAT_DEPTH_BUCKETS, 0LL);
+}
+
+void RayStats::merge(const RayStats &other) {
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++)
+        counters[i] += other.counters[i];
+    for (int i = 0; i < STAT_DEPTH_BUCKETS; i++)
+        depthHistogram[i] += other.depthHistogram[i];
+}
+
+long long RayStats::rays() const {
+    return counters[STAT_PRIMARY_RAYS] + counters[STAT_REFLECTION_RAYS]
+        + counters[STAT_REFRACTION_RAYS] + counters[STAT_SHADOW_RAYS];
+}
+
+const char *RayStats::counter_name(int counter) {
+    static const char *names[STAT_COUNTER_COUNT] = {
+        "primary", "reflection", "refraction", "shadow",
+        "object tests", "node tests", "primitive tests"
+    };
+    return counter >= 0 && counter < STAT_COUNTER_COUNT ? names[counter] : "?";
+}
+
+std::string RayStats::summary(double seconds) const {
+    std::string s;
+    char buf[64];
+
+    std::snprintf(buf, sizeof(buf), "%.3f s, %.0f rays/s", seconds, seconds > 0 ? rays() / seconds : 0.0);
+    s += buf;
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++) {
+        std::snprintf(buf, sizeof(buf), ", %s %lld", counter_name(i), counters[i]);
+        s += buf;
+    }
+
+    int last = STAT_DEPTH_BUCKETS - 1;
+    while (last > 0 && depthHistogram[last] == 0)
+        last--;
+    s += ", depth [";
+    for (int i = 0; i <= last; i++) {
+        std::snprintf(buf, sizeof(buf), i == 0 ? "%lld" : " %lld", depthHistogram[i]);
+        s += buf;
+    }
+    s += "]";
+    return s;
+}
+
+#if RT_STATS
+
+namespace raystats {
+
+namespace {
+
+// The mutex is only taken when a thread starts or ends and at frame end,
+// never on the counting path
+struct Registry {
+    std::mutex mutex;
+    std::vector<RayStats*> live;
+    RayStats retired;
+};
+
+Registry &registry() {
+    static Registry r;
+    return r;
+}
+
+struct ThreadBlock {
+    RayStats stats;
+
+    ThreadBlock() {
+        Registry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.live.push_back(&stats);
+    }
+
+    // parallel_for threads are short-lived; keep their counts when they exit
+    ~ThreadBlock() {
+        Registry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.retired.merge(stats);
+        r.live.erase(std::find(r.live.begin(), r.live.end(), &stats));
+    }
+};
+
+} // namespace
+
+RayStats &local() {
+    thread_local ThreadBlock block;
+    return block.stats;
+}
+
+RayStats collect_and_reset() {
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    RayStats total = r.retired;
+    r.retired.clear();
+    for (auto s : r.live) {
+        total.merge(*s);
+        s->clear();
+    }
+    return total;
+}
+
+} // namespace raystats
+
+#endif
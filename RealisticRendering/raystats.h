@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+
+// Tracer instrumentation. Counters are on in debug builds and compile to
+// nothing when NDEBUG is defined; define RT_STATS to 0 or 1 to override.
+#ifndef RT_STATS
+#ifdef NDEBUG
+#define RT_STATS 0
+#else
+#define RT_STATS 1
+#endif
+#endif
+
+enum {
+    STAT_PRIMARY_RAYS,
+    STAT_REFLECTION_RAYS,
+    STAT_REFRACTION_RAYS,
+    STAT_SHADOW_RAYS,
+    STAT_OBJECT_TESTS,      // per-object acceleration structure queries
+    STAT_NODE_TESTS,        // ray-box tests inside the tracer's own BVH
+    STAT_PRIMITIVE_TESTS,   // ray-triangle tests inside the tracer's own BVH
+    STAT_COUNTER_COUNT
+};
+
+const int STAT_DEPTH_BUCKETS = 16;  // the last bucket collects deeper rays
+
+struct RayStats {
+    long long counters[STAT_COUNTER_COUNT];
+    long long depthHistogram[STAT_DEPTH_BUCKETS];   // rays traced per recursion depth
+
+    RayStats() { clear(); }
+
+    void clear();
+    void merge(const RayStats &other);
+
+    long long rays() const;     // primary + secondary + shadow rays
+    // One-line report, e.g. for qDebug
+    std::string summary(double seconds) const;
+
+    static const char *counter_name(int counter);
+};
+
+#if RT_STATS
+
+namespace raystats {
+
+// Counter block of the calling thread. Plain increments, no atomics:
+// each block is only ever written by its own thread.
+RayStats &local();
+
+// Sum of all blocks, including those of threads that have exited since the
+// last call, and reset them. Only call while no tracing is in flight.
+RayStats collect_and_reset();
+
+}
+
+#define RT_STAT_ADD(counter, n) (raystats::local().counters[counter] += (n))
+#define RT_STAT_INC(counter) RT_STAT_ADD(counter, 1)
+#define RT_STAT_DEPTH(depth) (raystats::local().depthHistogram[std::min<int>((depth), STAT_DEPTH_BUCKETS - 1)]++)
+
+#else
+
+#define RT_STAT_ADD(counter, n) ((void)0)
+#define RT_STAT_INC(counter) ((void)0)
+#define RT_STAT_DEPTH(depth) ((void)0)
+
+#endif
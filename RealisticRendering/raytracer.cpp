@@ -0,0 +1,316 @@
+#include "raytracer.h"
+#include "parallel.h"
+#include "sampler.h"
+#include "shadingkernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <QElapsedTimer>
+
+namespace {
+
+using namespace shading;
+
+// Buffers of one wavefront batch, reused across its depth levels
+struct Wavefront {
+    std::vector<ShadeRay> rays;
+    std::vector<ShadeRay> next;
+    std::vector<SceneHit> hits;
+    std::vector<int> slot;          // material slot per ray, -1 for a miss
+    std::vector<int> order;         // ray indices grouped by slot
+    ShadeScratch scratch;
+    long long secondaryRays;        // past the first level
+
+    Wavefront() : secondaryRays(0) {}
+};
+
+// Traces wave.rays and everything they spawn, one depth level at a time.
+// The hits of a level are counting-sorted by material, so every kernel runs
+// once per level over all of its hits. Returns the time spent in kernels.
+// If firstHits is given, it holds the hits of wave.rays, which are then not
+// intersected again; otherwise, if saveHits is given, they are stored there.
+template <int LightType>
+double trace_wavefront(const ShadeContext &base, Wavefront &wave, const SceneHit *firstHits, SceneHit *saveHits) {
+    static const KernelTable<LightType> table((ShadedMaterials()));
+
+    ShadeContext ctx = base;
+    ctx.next = &wave.next;
+    ctx.scratch = &wave.scratch;
+    double shadeSeconds = 0;
+    for (bool first = true; !wave.rays.empty(); first = false) {
+        int count = static_cast<int>(wave.rays.size());
+        if (!first)
+            wave.secondaryRays += count;
+        wave.hits.resize(count);
+        wave.slot.resize(count);
+        wave.order.resize(count);
+
+        int groupSize[materialSlots] = {};
+        for (int i = 0; i < count; i++) {
+            RT_STAT_DEPTH(wave.rays[i].depth);
+            if (first && firstHits != nullptr) {
+                wave.hits[i] = firstHits[i];
+            }
+            else {
+                wave.hits[i] = SceneHit();
+                ctx.pScene->intersect(wave.rays[i].ray, wave.hits[i]);
+                if (first && saveHits != nullptr)
+                    saveHits[i] = wave.hits[i];
+            }
+            if (wave.hits[i].hitObject != nullptr) {
+                wave.slot[i] = material_slot(wave.hits[i].hitObject->material.Type);
+                groupSize[wave.slot[i]]++;
+            }
+            else {
+                wave.slot[i] = -1;
+            }
+        }
+
+        int groupStart[materialSlots];
+        int offset = 0;
+        for (int m = 0; m < materialSlots; m++) {
+            groupStart[m] = offset;
+            offset += groupSize[m];
+        }
+        int fill[materialSlots];
+        std::copy(groupStart, groupStart + materialSlots, fill);
+        for (int i = 0; i < count; i++) {
+            if (wave.slot[i] >= 0)
+                wave.order[fill[wave.slot[i]]++] = i;
+        }
+
+        wave.next.clear();
+        auto shadeStart = std::chrono::steady_clock::now();
+        for (int m = 0; m < materialSlots; m++) {
+            if (groupSize[m] > 0)
+                table.kernels[m](ctx, wave.rays.data(), wave.hits.data(), wave.order.data() + groupStart[m], groupSize[m]);
+        }
+        shadeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - shadeStart).count();
+        wave.rays.swap(wave.next);
+    }
+    return shadeSeconds;
+}
+
+// The light type is dispatched here, once per batch
+double trace_wavefront(const ShadeContext &ctx, Wavefront &wave, const SceneHit *firstHits = nullptr,
+    SceneHit *saveHits = nullptr) {
+    if (ctx.light->Type == DIRECTIONAL_LIGHT)
+        return trace_wavefront<DIRECTIONAL_LIGHT>(ctx, wave, firstHits, saveHits);
+    return trace_wavefront<POINT_LIGHT>(ctx, wave, firstHits, saveHits);
+}
+
+const LightBvh *scene_lights(const scene *s) {
+    return s->lightBvh.empty() ? nullptr : &s->lightBvh;
+}
+
+int grid_size(int samples) {
+    return std::max(1, static_cast<int>(std::lround(std::sqrt(static_cast<double>(samples)))));
+}
+
+// Everything but the image position and the output buffers
+ShadeContext shade_context(const scene *s, const PhotonMap *caustics, const Light &light,
+    const RayTracerSettings &settings) {
+    ShadeContext ctx = { s, caustics, &light, scene_lights(s), settings.lightSamples,
+        grid_size(settings.areaLightSamples), grid_size(settings.shadowTestSamples), 0, 0, 0,
+        settings.maxDepth, nullptr, nullptr, nullptr, nullptr };
+    return ctx;
+}
+
+} // namespace
+
+void PrimaryHitCache::clear() {
+    pScene = nullptr;
+    hits.clear();
+}
+
+bool PrimaryHitCache::matches(const scene *s, const RayCamera &c, int x, int y, int w, int h) const {
+    return !hits.empty() && pScene == s && geometryVersion == s->geometry_version()
+        && x0 == x && y0 == y && width == w && height == h
+        && camera.width == c.width && camera.height == c.height && camera.position == c.position
+        && camera.forward == c.forward && camera.right == c.right && camera.up == c.up;
+}
+
+void PrimaryHitCache::reset(const scene *s, const RayCamera &c, int x, int y, int w, int h) {
+    pScene = s;
+    geometryVersion = s->geometry_version();
+    camera = c;
+    x0 = x;
+    y0 = y;
+    width = w;
+    height = h;
+    hits.assign(static_cast<size_t>(w) * h, SceneHit());
+}
+
+QVector3D RayTracer::trace(const Ray ray, int depth, const Light &light, PixelAov *aov,
+    const RayDifferential *diff) const {
+    if (depth > settings.maxDepth || pScene == nullptr || ray.is_degenerate())
+        return QVector3D(0, 0, 0);
+
+    QVector3D color(0, 0, 0);
+    ShadeContext ctx = shade_context(pScene, pCaustics, light, settings);
+    ctx.color = &color;
+    ctx.aov = depth == 0 ? aov : nullptr;
+
+    Wavefront wave;
+    ShadeRay r;
+    r.ray = ray;
+    r.depth = depth;
+    r.hasDiff = diff != nullptr;
+    if (diff != nullptr)
+        r.diff = *diff;
+    wave.rays.push_back(r);
+    trace_wavefront(ctx, wave);
+    return color;
+}
+
+RayTraceStats RayTracer::render(const RayCamera &camera, const Light &light, FrameBuffer &fb, int x0, int y0) const {
+    RayTraceStats stats;
+    if (pScene == nullptr)
+        return stats;
+
+    int width = fb.width, height = fb.height;
+    int pass = fb.passes;
+
+#if RT_STATS
+    // Drop whatever other passes counted since the last report
+    raystats::collect_and_reset();
+#endif
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // Later passes jitter their primary rays, so only first passes are cached
+    const SceneHit *cachedHits = nullptr;
+    SceneHit *savedHits = nullptr;
+    if (pPrimaryHits != nullptr && pass == 0) {
+        if (pPrimaryHits->matches(pScene, camera, x0, y0, width, height)) {
+            cachedHits = pPrimaryHits->hits.data();
+            stats.reusedPrimaryHits = true;
+        }
+        else {
+            pPrimaryHits->reset(pScene, camera, x0, y0, width, height);
+            savedHits = pPrimaryHits->hits.data();
+        }
+    }
+
+    // One batch per row: its primary rays and everything they spawn
+    std::atomic<long long> shadeNanoseconds(0), secondaryRays(0);
+    parallel_for(0, height, [&](int y) {
+        Wavefront wave;
+        std::vector<QVector3D> color(width, QVector3D(0, 0, 0));
+        std::vector<PixelAov> aov(pass == 0 ? width : 0);
+        ShadeContext ctx = shade_context(pScene, pCaustics, light, settings);
+        ctx.x0 = x0;
+        ctx.y = y0 + y;
+        ctx.pass = static_cast<unsigned>(pass);
+        ctx.color = color.data();
+        ctx.aov = pass == 0 ? aov.data() : nullptr;
+
+        wave.rays.resize(width);
+        for (int x = 0; x < width; x++) {
+            // The first pass goes through pixel centers like the original
+            // tracer; later ones jitter inside the pixel for antialiasing
+            int px = x0 + x, py = y0 + y;
+            float jx = 0.f, jy = 0.f;
+            if (pass > 0) {
+                Sampler sampler(SOBOL_SAMPLER, px, py, static_cast<unsigned>(pass));
+                sampler.get_2d(jx, jy);
+                jx -= 0.5f;
+                jy -= 0.5f;
+            }
+            ShadeRay &r = wave.rays[x];
+            r.ray = camera.primary_ray(px + jx, py + jy);
+            r.diff = camera.primary_differential(px + jx, py + jy);
+            r.hasDiff = true;
+            r.pixel = x;
+            RT_STAT_INC(STAT_PRIMARY_RAYS);
+        }
+        size_t row = static_cast<size_t>(y) * width;
+        shadeNanoseconds += static_cast<long long>(trace_wavefront(ctx, wave,
+            cachedHits != nullptr ? cachedHits + row : nullptr, savedHits != nullptr ? savedHits + row : nullptr) * 1e9);
+        secondaryRays += wave.secondaryRays;
+
+        for (int x = 0; x < width; x++) {
+            fb.add_color(x, y, color[x]);
+            if (pass == 0)
+                fb.set_aov(x, y, aov[x].albedo, aov[x].normal, aov[x].depth);
+        }
+    }, settings.numThreads);
+    fb.passes++;
+
+    stats.seconds = timer.nsecsElapsed() * 1e-9;
+    stats.shadeSeconds = shadeNanoseconds * 1e-9;
+    stats.primaryRays = static_cast<long long>(width) * height;
+    stats.secondaryRays = secondaryRays;
+    stats.threads = std::min(resolve_thread_count(settings.numThreads), std::max(height, 1));
+#if RT_STATS
+    stats.rays = raystats::collect_and_reset();
+#endif
+    return stats;
+}
+
+RayTraceStats RayTracer::shade(const QVector3D &eye, const std::vector<SceneHit> &hits, const Light &light,
+    FrameBuffer &fb) const {
+    RayTraceStats stats;
+    int width = fb.width, height = fb.height;
+    if (pScene == nullptr || hits.size() != static_cast<size_t>(width) * height)
+        return stats;
+    int pass = fb.passes;
+
+#if RT_STATS
+    raystats::collect_and_reset();
+#endif
+
+    QElapsedTimer timer;
+    timer.start();
+
+    // Same batches as render(), minus the pixels that see nothing
+    Point eyePoint(eye.x(), eye.y(), eye.z());
+    std::atomic<long long> shadeNanoseconds(0), covered(0), secondaryRays(0);
+    parallel_for(0, height, [&](int y) {
+        Wavefront wave;
+        std::vector<SceneHit> rowHits;
+        std::vector<QVector3D> color(width, QVector3D(0, 0, 0));
+        std::vector<PixelAov> aov(pass == 0 ? width : 0);
+        ShadeContext ctx = shade_context(pScene, pCaustics, light, settings);
+        ctx.y = y;
+        ctx.pass = static_cast<unsigned>(pass);
+        ctx.color = color.data();
+        ctx.aov = pass == 0 ? aov.data() : nullptr;
+
+        for (int x = 0; x < width; x++) {
+            const SceneHit &hit = hits[static_cast<size_t>(y) * width + x];
+            if (hit.hitObject == nullptr)
+                continue;
+            ShadeRay r;
+            r.ray = Ray(eyePoint, hit.point);
+            r.hasDiff = false;
+            r.pixel = x;
+            wave.rays.push_back(r);
+            rowHits.push_back(hit);
+        }
+        covered += static_cast<long long>(rowHits.size());
+        shadeNanoseconds += static_cast<long long>(trace_wavefront(ctx, wave, rowHits.data()) * 1e9);
+        secondaryRays += wave.secondaryRays;
+
+        for (int x = 0; x < width; x++) {
+            fb.add_color(x, y, color[x]);
+            if (pass == 0)
+                fb.set_aov(x, y, aov[x].albedo, aov[x].normal, aov[x].depth);
+        }
+    }, settings.numThreads);
+    fb.passes++;
+
+    stats.seconds = timer.nsecsElapsed() * 1e-9;
+    stats.shadeSeconds = shadeNanoseconds * 1e-9;
+    stats.primaryRays = covered;
+    stats.secondaryRays = secondaryRays;
+    stats.reusedPrimaryHits = true;
+    stats.threads = std::min(resolve_thread_count(settings.numThreads), std::max(height, 1));
+#if RT_STATS
+    stats.rays = raystats::collect_and_reset();
+#endif
+    return stats;
+}
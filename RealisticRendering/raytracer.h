@@ -0,0 +1,132 @@
+#pragma once
+
+#include "scene.h"
+#include "light.h"
+#include "raycamera.h"
+#include "framebuffer.h"
+#include "raystats.h"
+
+class PhotonMap;
+
+struct RayTracerSettings {
+    int maxDepth;           // deepest bounce level still traced
+    int numThreads;         // 0 for all hardware threads
+    int lightSamples;       // lights per diffuse hit when the scene has a light list
+    int areaLightSamples;   // per area light and diffuse hit, rounded to a square grid
+    int shadowTestSamples;  // of those, traced first; if they agree the rest are not
+
+    RayTracerSettings() : maxDepth(5), numThreads(0), lightSamples(4), areaLightSamples(16),
+        shadowTestSamples(4) {}
+};
+
+struct RayTraceStats {
+    double seconds;
+    double shadeSeconds;    // inside the shading kernels, summed over threads
+    int threads;
+    long long primaryRays;
+    long long secondaryRays;    // mirror and glass bounces, intersected even when the primary hits are reused
+    bool reusedPrimaryHits;     // the primary hits came from a PrimaryHitCache
+    RayStats rays;              // per-type counts, only filled when RT_STATS is on
+
+    RayTraceStats() : seconds(0), shadeSeconds(0), threads(1), primaryRays(0), secondaryRays(0),
+        reusedPrimaryHits(false) {}
+
+    double primary_rays_per_second() const {
+        return seconds > 0 ? primaryRays / seconds : 0;
+    }
+};
+
+// First hits of the camera rays of the last first-pass render, kept by the
+// caller from one render to the next. Editing lights, materials or textures
+// leaves them as they were, so a render with the same camera, image and
+// scene geometry skips the primary intersections and only shades. Hits
+// refer to objects by pointer, so material edits show up in the reused
+// hits; anything that changes geometry bumps scene::geometry_version(),
+// which invalidates the cache.
+//
+// Only the camera rays are cached: reflected and refracted rays depend on
+// the same geometry but are intersected again on every render, as are all
+// shadow rays, so the saving is largest for mostly diffuse views.
+// RayTraceStats::secondaryRays says how much tracing was left.
+class PrimaryHitCache {
+public:
+    PrimaryHitCache() : pScene(nullptr), geometryVersion(0), x0(0), y0(0), width(0), height(0) {}
+
+    void clear();
+    bool empty() const { return hits.empty(); }
+
+private:
+    friend class RayTracer;
+
+    const scene *pScene;
+    unsigned geometryVersion;
+    RayCamera camera;
+    int x0, y0, width, height;      // the tile of the camera image, like in RayTracer::render
+    std::vector<SceneHit> hits;     // width * height, row by row; hitObject is null for a miss
+
+    bool matches(const scene *s, const RayCamera &c, int x, int y, int w, int h) const;
+    void reset(const scene *s, const RayCamera &c, int x, int y, int w, int h);
+};
+
+// Whitted-style ray tracer: one ray per pixel, perfect mirror and glass
+// objects, Phong shading with a hard shadow on diffuse ones.
+// Has no widget dependencies so that it can run headless.
+//
+// Every image row is traced as a wavefront batch, one bounce level at a
+// time, through the per-material shading kernels of shadingkernels.h.
+//
+// Rays carry differentials through mirror and glass bounces; diffuse
+// textures are filtered over the footprint they give.
+//
+// With a caustic photon map, diffuse surfaces also get the light that
+// reached them through glass and mirrors, which the shadow ray misses.
+//
+// If the scene file lists lights, those replace the light passed to render()
+// and trace(), and each diffuse hit shades settings.lightSamples of them
+// picked from the scene's light BVH.
+//
+// Rectangle and sphere lights cast soft shadows from settings.areaLightSamples
+// stratified samples each. settings.shadowTestSamples of them, spread over
+// the light, are traced first, and where they are all blocked or all clear
+// the rest are taken to be the same; only hits in a penumbra trace them all.
+// This can miss a thin occluder that falls between the test samples.
+// Area lights are not visible to camera rays.
+//
+// With a PrimaryHitCache, first passes reuse the primary hits of the
+// previous one when nothing they depend on changed, which makes light and
+// material edits cost only shading and secondary rays.
+class RayTracer {
+public:
+    RayTracerSettings settings;
+
+public:
+    // caustics must be built for the same scene and light, or be null.
+    // primaryHits may be null; it is owned by the caller.
+    explicit RayTracer(const scene *s, const PhotonMap *caustics = nullptr, PrimaryHitCache *primaryHits = nullptr)
+        : pScene(s), pCaustics(caustics), pPrimaryHits(primaryHits) {}
+
+    // Traces every pixel of fb once and adds the result as a new pass.
+    // The first pass fills the denoiser AOVs; further passes jitter the
+    // primary rays, so accumulating several of them antialiases the image.
+    // fb may be a tile of the camera image whose left top pixel is (x0, y0).
+    RayTraceStats render(const RayCamera &camera, const Light &light, FrameBuffer &fb,
+        int x0 = 0, int y0 = 0) const;
+
+    // Like render(), but the primary hits are given: hits has one entry per
+    // pixel of fb, row by row, with a null hitObject where the camera ray at
+    // eye misses. Only secondary and shadow rays are traced, e.g. from a
+    // raster G-buffer (see gbuffer.h). Textures are sampled without ray
+    // differentials and later passes are not jittered.
+    RayTraceStats shade(const QVector3D &eye, const std::vector<SceneHit> &hits, const Light &light,
+        FrameBuffer &fb) const;
+
+    // Without a differential textures are sampled at full resolution. Light
+    // list picks always use the seed of pixel (0, 0) in the first pass.
+    QVector3D trace(const Ray ray, int depth, const Light &light, PixelAov *aov = nullptr,
+        const RayDifferential *diff = nullptr) const;
+
+private:
+    const scene *pScene;
+    const PhotonMap *pCaustics;
+    PrimaryHitCache *pPrimaryHits;
+};
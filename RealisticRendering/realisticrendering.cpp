@@ -20,8 +20,28 @@ void RealisticRendering::createRenderArea() {
 void RealisticRendering::initOptions() {
     ui.phong->setChecked(true);
     ui.perspective->setChecked(true);
+    ui.denoise->setChecked(true);
+    ui.irradianceCache->setChecked(true);
 
     //TODO: connect signals
+    connect(ui.phong, &QRadioButton::clicked, this, [&]() {
+        render.set_hybrid(false);
+    });
+    connect(ui.hybrid, &QRadioButton::clicked, this, [&]() {
+        render.set_hybrid(true);
+    });
+    connect(ui.lightmap, &QCheckBox::toggled, this, [&](bool checked) {
+        render.set_lightmap(checked);
+    });
+    connect(ui.caustics, &QCheckBox::toggled, this, [&](bool checked) {
+        render.set_caustics(checked);
+    });
+    connect(ui.denoise, &QCheckBox::toggled, this, [&](bool checked) {
+        render.set_denoise(checked);
+    });
+    connect(ui.irradianceCache, &QCheckBox::toggled, this, [&](bool checked) {
+        render.set_irradiance_cache(checked);
+    });
     connect(ui.perspective, &QRadioButton::clicked, this, [&]() {
         render.set_proj_type(PERSPECTIVE);
     });
@@ -39,6 +59,10 @@ void RealisticRendering::initOptions() {
         Light l;
         render.renderObjectRayTracing(l);
     });
+    connect(ui.pathTracing, &QPushButton::clicked, this, [&]() {
+        Light l;
+        render.renderObjectPathTracing(l);
+    });
 }
 
 void RealisticRendering::initActions() {
@@ -1,5 +1,10 @@
 #include "renderingwidget.h"
 #include "input.h"
+#include "parallel.h"
+#include "mipmap.h"
+#include "aobake.h"
+
+#include <QOpenGLExtraFunctions>
 
 RenderingWidget::RenderingWidget(QWidget *parent) 
     : QOpenGLWidget(parent), 
@@ -7,10 +12,32 @@ RenderingWidget::RenderingWidget(QWidget *parent)
     mProgram(nullptr),
     mTexture(nullptr),
     mDisplacement(nullptr),
+    mLightmap(nullptr),
+    lightmapEnabled(false),
+    lightmapBaked(false),
     //mFBO(nullptr),
     projType(PERSPECTIVE),
     orthoRange(1.5f),
-    drawArraySize(0) {
+    drawArraySize(0),
+    rtDenoise(true),
+    rtCausticsEnabled(false),
+    rtCausticsBuilt(false),
+    rtPasses(16),
+    rtBudgetSeconds(2.0),
+    ptPassesPerClick(4),
+    ptUseCache(true),
+    hybridEnabled(false),
+    mGBuffer(nullptr),
+    gBufferFrame(0),
+    gBufferWidth(0),
+    gBufferHeight(0),
+    gBufferFramebuffer(0),
+    gBufferTexture(0),
+    gBufferDepth(0),
+    hybridFramebuffer(0),
+    hybridTexture(0),
+    hybridTraced(false),
+    hybridShown(false) {
     
     this->grabKeyboard();
 
@@ -21,16 +48,21 @@ RenderingWidget::RenderingWidget(QWidget *parent)
 }
 
 RenderingWidget::~RenderingWidget() {
+    stop_render_job();
     if (pScene != nullptr)
         delete pScene;
 }
 
 void RenderingWidget::read_scene_file(QString fileName) {
+    stop_render_job();
     if (pScene != nullptr)
         delete pScene;
 
     pScene = new scene;
     pScene->read_scene_file(fileName.toStdString());
+    // Cached lighting and accumulated samples belong to the old scene
+    ptCache.clear();
+    ptFrame.clear();
 
     rawData.clear();
     for (auto o : pScene->objects) {
@@ -58,13 +90,29 @@ void RenderingWidget::read_scene_file(QString fileName) {
     mObjectShadow.release();
     mVertexShadow.release();
 
-    for (int i = 0; i < pScene->objects.size(); i++) {
-        if (i < pScene->objects.size() - 1)
-            pScene->objects[i]->material.Type = REFLECTION_AND_REFRACTION;
-        else
-            pScene->objects[i]->material.Type = DIFFUSE_AND_GLOSSY;
-        
-    }
+    // Baked once per scene; the cache next to the scene file makes reloads free
+    AoBake ao;
+    AoBakeStats aoStats = ao.bake(*pScene, fileName + ".ao");
+    if (aoStats.cached)
+        qDebug() << "Ambient occlusion loaded from cache in" << aoStats.seconds * 1e3 << "ms";
+    else
+        qDebug() << "Ambient occlusion baked:" << aoStats.rays << "rays in" << aoStats.seconds << "s,"
+            << aoStats.rays_per_second() * 1e-6 << "Mrays/s";
+    std::vector<float> occlusion = ao.raw_stream(*pScene);
+    mOcclusion.bind();
+    mOcclusion.allocate(&occlusion[0], static_cast<int>(occlusion.size() * sizeof(float)));
+    mOcclusion.release();
+
+    pScene->assign_default_materials();
+    pScene->set_diffuse_texture(rtTexture);
+
+    lightmap.clear();
+    lightmapBaked = false;
+    rtCaustics.clear();
+    rtCausticsBuilt = false;
+    rtPrimaryHits.clear();
+    if (lightmapEnabled)
+        bake_lightmap();
 }
 
 void RenderingWidget::initializeGL() {
@@ -104,6 +152,21 @@ void RenderingWidget::initializeGL() {
     mProgram->enableAttributeArray(1);
     mProgram->enableAttributeArray(2);
 
+    // Baked ambient occlusion, one float per vertex in its own buffer
+    mOcclusion.create();
+    mOcclusion.bind();
+    mOcclusion.setUsagePattern(QOpenGLBuffer::StaticDraw);
+    mProgram->setAttributeBuffer(3, GL_FLOAT, 0, 1, sizeof(float));
+    mProgram->enableAttributeArray(3);
+    mOcclusion.release();
+
+    mLightmapUV.create();
+    mLightmapUV.bind();
+    mLightmapUV.setUsagePattern(QOpenGLBuffer::StaticDraw);
+    mProgram->setAttributeBuffer(4, GL_FLOAT, 0, 2, 2 * sizeof(float));
+    mProgram->enableAttributeArray(4);
+    mLightmapUV.release();
+
     // Load Texture
     load_texture("texture/marble.jpg");
     load_displacement("texture/rock/Rock_DISPLACEMENT.png");
@@ -129,6 +192,28 @@ void RenderingWidget::initializeGL() {
     mObjectShadow.release();
     mVertexShadow.release();
     mShadow->release();
+
+    // G-buffer of the hybrid mode, drawn from the same vertices
+    mGBuffer = new QOpenGLShaderProgram();
+    mGBuffer->addShaderFromSourceFile(QOpenGLShader::Vertex, "shaders/gbuffer.vert");
+    mGBuffer->addShaderFromSourceFile(QOpenGLShader::Fragment, "shaders/gbuffer.frag");
+    mGBuffer->link();
+    mGBuffer->bind();
+    mVertex.bind();
+    mObjectGBuffer.create();
+    mObjectGBuffer.bind();
+    mGBuffer->setAttributeBuffer(0, GL_FLOAT, offsetof(vertex, position), 3, sizeof(vertex));
+    mGBuffer->enableAttributeArray(0);
+    mObjectGBuffer.release();
+    mVertex.release();
+    mGBuffer->release();
+
+    for (QOpenGLBuffer &pbo : mGBufferPbo) {
+        pbo = QOpenGLBuffer(QOpenGLBuffer::PixelPackBuffer);
+        pbo.create();
+        pbo.setUsagePattern(QOpenGLBuffer::StreamRead);
+    }
+    gBufferPending[0] = gBufferPending[1] = false;
 }
 
 void RenderingWidget::resizeGL(int w, int h) {
@@ -146,13 +231,31 @@ void RenderingWidget::resizeGL(int w, int h) {
 }
 
 void RenderingWidget::paintGL() {
-    renderShadow();
+    // Baked lighting already contains the shadows
+    if (!lightmap_current())
+        renderShadow();
     renderObject();
+    if (hybridEnabled && pScene != nullptr && drawArraySize > 0)
+        renderHybrid();
 }
 
 void RenderingWidget::teardownGL() {
     mObject.destroy();
     mVertex.destroy();
+    mObjectGBuffer.destroy();
+    for (QOpenGLBuffer &pbo : mGBufferPbo)
+        pbo.destroy();
+    glDeleteFramebuffers(1, &gBufferFramebuffer);
+    glDeleteFramebuffers(1, &hybridFramebuffer);
+    glDeleteRenderbuffers(1, &gBufferDepth);
+    glDeleteTextures(1, &gBufferTexture);
+    glDeleteTextures(1, &hybridTexture);
+    if (mGBuffer != nullptr)
+        delete mGBuffer;
+    mOcclusion.destroy();
+    mLightmapUV.destroy();
+    if (mLightmap != nullptr)
+        delete mLightmap;
     if (mProgram != nullptr)
         delete mProgram;
 }
@@ -236,10 +339,19 @@ void RenderingWidget::renderObject() {
     mTexture->bind(0);
     mDisplacement->bind(1);
     
-    glBindTexture(GL_TEXTURE_2D, shadowMap);
+    // Select the unit before binding, or the shadow map replaces the
+    // displacement map on unit 1
     glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, shadowMap);
     mProgram->setUniformValue("shadowUnit", 2);
 
+    bool baked = lightmap_current();
+    if (baked) {
+        mLightmap->bind(3);
+        mProgram->setUniformValue("lightmapUnit", 3);
+    }
+    mProgram->setUniformValue("useLightmap", baked);
+
     mProgram->setUniformValue("viewMat", mCamera.toMatrix());
     mProgram->setUniformValue("projection", mProjection);
     mProgram->setUniformValue("normalMat", mTransform.toMatrix().normalMatrix());
@@ -261,274 +373,249 @@ void RenderingWidget::renderObject() {
 
     mTexture->release();
     mDisplacement->release();
+    if (baked)
+        mLightmap->release(3);
     mVertex.release();
     mProgram->release();
 }
 
-Vector normalize(Vector v) {
-    float mag2 = v.x() * v.x() + v.y() * v.y() + v.z() * v.z();
-    if (mag2 > 0) {
-        float invMag = 1 / sqrtf(mag2);
-        return Vector(v.x() * invMag, v.y() * invMag, v.z() * invMag);
+void RenderingWidget::resize_gbuffer(int w, int h) {
+    if (w == gBufferWidth && h == gBufferHeight)
+        return;
+    gBufferWidth = w;
+    gBufferHeight = h;
+    gBufferPending[0] = gBufferPending[1] = false;
+    hybridShown = false;
+
+    if (gBufferFramebuffer == 0) {
+        glGenFramebuffers(1, &gBufferFramebuffer);
+        glGenTextures(1, &gBufferTexture);
+        glGenRenderbuffers(1, &gBufferDepth);
+        glGenFramebuffers(1, &hybridFramebuffer);
+        glGenTextures(1, &hybridTexture);
     }
-    return v;
-};
-
-#define MAX_RAY_TRACING_DEPTH 5
-QColor RenderingWidget::trace(const Ray ray, int depth, Light light) {
-    if (depth > MAX_RAY_TRACING_DEPTH)
-        return Qt::black;
-    
-    if (pScene == nullptr)
-        return Qt::black;
 
-    if (ray.is_degenerate())
-        return Qt::black;
+    glBindTexture(GL_TEXTURE_2D, gBufferTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glBindRenderbuffer(GL_RENDERBUFFER, gBufferDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+    glBindFramebuffer(GL_FRAMEBUFFER, gBufferFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gBufferTexture, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, gBufferDepth);
+
+    glBindTexture(GL_TEXTURE_2D, hybridTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, hybridFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hybridTexture, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+
+    int bytes = w * h * GBUFFER_CHANNELS * static_cast<int>(sizeof(float));
+    for (QOpenGLBuffer &pbo : mGBufferPbo) {
+        pbo.bind();
+        pbo.allocate(bytes);
+        pbo.release();
+    }
+}
 
-    QColor result;
+void RenderingWidget::renderHybrid() {
+    int w = this->width(), h = this->height();
+    resize_gbuffer(w, h);
+    sync_object_motion();
+    QOpenGLExtraFunctions *gl = context()->extraFunctions();
 
-    float minDist = 1e10;
-    
-    object *hitObject = nullptr;
-    TreeandTri *hitT;
-    Point hitCoord;
-    Vector hitNormal;
-    int hitFaceId = -1;
-    
-    Point rayStart = ray.start();
-    Vector rayDir = normalize(ray.to_vector());
-
-    auto squareDistance = [](Point a, Point b) {
-        return (a.x() - b.x()) * (a.x() - b.x())
-            + (a.y() - b.y()) * (a.y() - b.y())
-            + (a.z() - b.z()) * (a.z() - b.z());
-    };
-
-    for (int i = 0; i < pScene->aabbTrees.size(); i++) {
-        auto t = pScene->aabbTrees[i];
-        if (t->tree.do_intersect(ray)) {
-            Ray_intersection intersec = t->tree.first_intersection(ray);
-            Point *pointIntersec = boost::get<Point>(&(intersec->first));
-            int faceId = std::distance(t->triangles.begin(), intersec->second);
-            float dist = squareDistance(rayStart, *pointIntersec);
-            if (dist < minDist) {
-                minDist = dist;
-                hitT = t;
-                hitCoord = *(pointIntersec);
-                hitFaceId = faceId;
-                hitObject = pScene->objects[i];
-            }
+    // This frame's G-buffer
+    glBindFramebuffer(GL_FRAMEBUFFER, gBufferFramebuffer);
+    glViewport(0, 0, w, h);
+    glClearColor(0, 0, 0, 0);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    mGBuffer->bind();
+    mGBuffer->setUniformValue("modelMat", mTransform.toMatrix());
+    mGBuffer->setUniformValue("viewMat", mCamera.toMatrix());
+    mGBuffer->setUniformValue("projection", mProjection);
+    mObjectGBuffer.bind();
+    glDrawArrays(GL_TRIANGLES, 0, drawArraySize);
+    mObjectGBuffer.release();
+    mGBuffer->release();
+
+    // Start copying it into a PBO; glReadPixels returns at once and the
+    // copy finishes while this frame is traced and presented
+    int current = gBufferFrame % 2, previous = 1 - current;
+    gl->glReadBuffer(GL_COLOR_ATTACHMENT0);
+    mGBufferPbo[current].bind();
+    glReadPixels(0, 0, w, h, GL_RGBA, GL_FLOAT, nullptr);
+    mGBufferPbo[current].release();
+    QMatrix4x4 camMat = mCamera.toMatrix().inverted();
+    gBufferEye[current] = QVector3D(camMat(0, 3), camMat(1, 3), camMat(2, 3));
+    gBufferPending[current] = true;
+    gBufferFrame++;
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+
+    // A finished trace replaces the overlay; rows go bottom up in GL
+    if (hybridTraced) {
+        hybridTrace.join();
+        hybridTraced = false;
+        if (hybridFrame.width == w && hybridFrame.height == h) {
+            QImage image = hybridFrame.to_image().convertToFormat(QImage::Format_RGBA8888).mirrored();
+            glBindTexture(GL_TEXTURE_2D, hybridTexture);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, image.constBits());
+            hybridShown = true;
         }
+#if RT_STATS
+        qDebug() << "Hybrid frame:" << hybridStats.rays.summary(hybridStats.seconds).c_str();
+#endif
     }
 
-    // No intersection
-    if (hitFaceId == -1) {
-        return Qt::black;
-    }
-
-    auto calcNormal = [] (Triangle t) {
-        Vector v2v1(t[1], t[0]), v2v3(t[1], t[2]);
-        Vector result = CGAL::cross_product(v2v3, v2v1);
-        return CGAL::cross_product(v2v3, v2v1);
-    };
-
-    hitNormal = normalize(calcNormal(hitT->triangles[hitFaceId]));
-    
-    float bias = 1e-4;
-    
-    auto reflect = [](Vector I, Vector N) {
-        return I - 2 * (I * N) * N;
-    };
-    auto clamp = [](float lo, float hi, float n) {
-        return std::max(lo, std::min(hi, n));
-    };
-    auto refract = [&](Vector I, Vector N, float ior) {
-        float cosi = clamp(-1, 1, (I * N));
-        float etai = 1, etat = ior;
-        Vector n = N;
-        if (cosi < 0) { 
-            cosi = -cosi; 
-        }
-        else { 
-            std::swap(etai, etat); 
-            n = -N; 
-        }
-        
-        float eta = etai / etat;
-        float k = 1 - eta * eta * (1 - cosi * cosi);
-        
-        if (k < 0) {
-            return Vector(0, 0, 0);
-        }
-        else {
-            return eta * I + (eta * cosi - sqrtf(k)) * n;
-        }
-       
-    };
-    auto fresnel = [&] (Vector I, Vector N, const float &ior, float &kr)
-    {
-        float cosi = clamp(-1, 1, (I * N));
-        float etai = 1, etat = ior;
-        if (cosi > 0) { std::swap(etai, etat); }
-        // Compute sini using Snell's law
-        float sint = etai / etat * sqrtf(std::max(0.f, 1 - cosi * cosi));
-        // Total internal reflection
-        if (sint >= 1) {
-            kr = 1;
-        }
-        else {
-            float cost = sqrtf(std::max(0.f, 1 - sint * sint));
-            cosi = fabsf(cosi);
-            float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
-            float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
-            kr = (Rs * Rs + Rp * Rp) / 2;
+    // Trace from the last frame's copy, which has had a frame to arrive,
+    // unless the trace before is still running
+    if (gBufferPending[previous] && !hybridTrace.joinable()) {
+        mGBufferPbo[previous].bind();
+        const float *texels = static_cast<const float *>(mGBufferPbo[previous].mapRange(0,
+            w * h * GBUFFER_CHANNELS * static_cast<int>(sizeof(float)), QOpenGLBuffer::RangeRead));
+        if (texels != nullptr) {
+            decode_gbuffer(*pScene, texels, w, h, gBufferEye[previous], hybridHits);
+            mGBufferPbo[previous].unmap();
         }
-        // As a consequence of the conservation of energy, transmittance is given by:
-        // kt = 1 - kr;
-    };
-
-    switch (hitObject->material.Type) {
-    case REFLECTION_AND_REFRACTION: {
-        Vector reflectDir = normalize(reflect(rayDir, hitNormal));
-        Vector refractDir = normalize(refract(rayDir, hitNormal, hitObject->material.ior));
-        Point reflectCoord = (reflectDir * hitNormal) < 0 ? 
-            hitCoord - hitNormal * bias : 
-            hitCoord + hitNormal * bias;
-        Point refractCoord = (refractDir * hitNormal) < 0 ? 
-            hitCoord - hitNormal * bias :
-            hitCoord + hitNormal * bias;
-        QColor reflectColor = trace(Ray(reflectCoord, reflectDir), depth + 1, light);
-        QColor refractionColor = trace(Ray(refractCoord, refractDir), depth + 1, light);
-        
-        float kr;
-        fresnel(rayDir, hitNormal, hitObject->material.ior, kr);
-        
-        float resultRed = reflectColor.redF() * kr + refractionColor.redF() * (1 - kr);
-        float resultGreen = reflectColor.greenF() * kr + refractionColor.greenF() * (1 - kr);
-        float resultBlue = reflectColor.blueF() * kr + refractionColor.blueF() * (1 - kr);
-        result.setRedF(resultRed);
-        result.setGreenF(resultGreen);
-        result.setBlueF(resultBlue);
-        break;
-    }
-    case REFLECTION: {
-        float kr;
-        fresnel(rayDir, hitNormal, hitObject->material.ior, kr);
-        Vector reflectDir = normalize(reflect(rayDir, hitNormal));
-        Point reflectCoord = (reflectDir * hitNormal) < 0 ?
-            hitCoord - hitNormal * bias :
-            hitCoord + hitNormal * bias;
-        QColor reflectColor = trace(Ray(reflectCoord, reflectDir), depth + 1, light);
-        float resultRed = reflectColor.redF();
-        float resultGreen = reflectColor.greenF();
-        float resultBlue = reflectColor.blueF();
-        result.setRedF(resultRed);
-        result.setGreenF(resultGreen);
-        result.setBlueF(resultBlue);
-        break;
-    }
-    default: {
-        Vector lightAmt(0, 0, 0), specularColor(0, 0, 0);
-        Point shadowCoord = (rayDir * hitNormal) < 0 ?
-            hitCoord + hitNormal * bias :
-            hitCoord - hitNormal * bias;
-        
-        Point lightCoord(light.Position.x(), light.Position.y(), light.Position.z());
-        Vector lightDir = lightCoord - hitCoord;
-        // square of the distance between hitPoint and the light
-        float lightSquareDistance = lightDir * lightDir;
-        lightDir = normalize(lightDir);
-        float LdotN = std::max(0.f, static_cast<float>(lightDir * hitNormal));
-        
-        object *shadowHitObject = nullptr;
-        bool inShadow = false;
-        Ray shadow(shadowCoord, lightDir);
-
-        // is the point in shadow, and is the nearest occluding object closer to the object than the light itself?
-        for (int i = 0; i < pScene->aabbTrees.size(); i++) {
-            auto t = pScene->aabbTrees[i];
-            if (t->tree.do_intersect(shadow)) {
-                Ray_intersection intersec = t->tree.first_intersection(shadow);
-                Point *pointIntersec = boost::get<Point>(&(intersec->first));
-                int faceId = std::distance(t->triangles.begin(), intersec->second);
-                float dist = squareDistance(shadowCoord, *pointIntersec);
-                if (dist < lightSquareDistance) {
-                    inShadow = true;
-                }
-            }
+        mGBufferPbo[previous].release();
+
+        if (texels != nullptr) {
+            // The raster path's light, as in bake_lightmap()
+            Light light;
+            light.Position = lightPosition.toVector3D();
+            QVector3D eye = gBufferEye[previous];
+            hybridTrace = std::thread([this, light, eye, w, h]() {
+                hybridFrame = FrameBuffer(w, h);
+                RayTracer tracer(pScene);
+                hybridStats = tracer.shade(eye, hybridHits, light, hybridFrame);
+                hybridTraced = true;
+            });
         }
-        
-        Vector lightIntensity(light.La, light.La, light.La);
-        lightAmt += (1 - inShadow) * lightIntensity * LdotN;
-        Vector reflectDir = normalize(reflect(-lightDir, hitNormal));
-        specularColor += powf(std::max(0.f, static_cast<float>(-(reflectDir * rayDir))), hitObject->material.Shininess) * lightIntensity;
-        
-        
-        Vector diffColor(lightAmt.x() * hitObject->material.diffColor.x(),
-            lightAmt.y() * hitObject->material.diffColor.y(),
-            lightAmt.z() * hitObject->material.diffColor.z());
-        Vector res = diffColor* hitObject->material.Kd + specularColor * hitObject->material.Ks;
-        
-        result.setRedF(res.x());
-        result.setGreenF(res.y());
-        result.setBlueF(res.z());
-        break;
     }
+    gBufferPending[previous] = false;
+
+    if (!hybridShown)
+        return;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, hybridFramebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, defaultFramebufferObject());
+    gl->glBlitFramebuffer(0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, defaultFramebufferObject());
+}
+
+void RenderingWidget::sync_object_motion() {
+    // The rasterizer applies mTransform to every object; the tracers see it
+    // as a rigid motion of each instance, which only refits the top level
+    QMatrix4x4 model = mTransform.toMatrix();
+    if (!pScene->aabbTrees.empty() && pScene->aabbTrees[0]->motion != model)
+        stop_render_job();
+    for (int i = 0; i < static_cast<int>(pScene->aabbTrees.size()); i++)
+        pScene->set_object_motion(i, model);
+}
+
+void RenderingWidget::stop_render_job() {
+    if (hybridTrace.joinable()) {
+        hybridTrace.join();
+        hybridTraced = false;
     }
-    return result;
+    if (rtJob == nullptr)
+        return;
+    rtJob->cancel();
+    rtJob->wait();
+    rtJob.reset();
 }
 
+// Queues the render and returns; update() saves it once it is done. A
+// click while the last one is still refining replaces it.
 void RenderingWidget::renderObjectRayTracing(Light light) {
+    if (pScene == nullptr)
+        return;
+    stop_render_job();
+    sync_object_motion();
+
     int imageWidth = this->width(), imageHeight = this->height();
-    QImage result(imageWidth, imageHeight, QImage::Format_ARGB32);
+    RayCamera camera(mCamera, imageWidth, imageHeight);
+
+    // Photons only depend on the light and the objects, not on the camera
+    QMatrix4x4 model = mTransform.toMatrix();
+    if (rtCausticsEnabled && (!rtCausticsBuilt || model != rtCausticsModel || light.Position != rtCausticsLight)) {
+        PhotonMapStats photonStats;
+        rtCaustics.build(*pScene, light, &photonStats);
+        rtCausticsBuilt = true;
+        rtCausticsModel = model;
+        rtCausticsLight = light.Position;
+        qDebug() << "Caustics:" << photonStats.stored << "of" << photonStats.emitted << "photons stored, emit"
+            << static_cast<int>(photonStats.emitSeconds * 1e3) << "ms, kd-tree"
+            << static_cast<int>(photonStats.buildSeconds * 1e3) << "ms";
+    }
 
-    Camera3D camera = mCamera;
-    float fovVertical = 135.f;
+    RenderRequest request;
+    request.passes = rtPasses;
+    request.budgetSeconds = rtBudgetSeconds;
+    request.priority = INTERACTIVE_PRIORITY;
+    request.caustics = rtCausticsEnabled ? &rtCaustics : nullptr;
+    // Safe to share between clicks: the last job was stopped above
+    request.primaryHits = &rtPrimaryHits;
+    rtJob = rtQueue.submit(pScene, camera, light, request);
+}
 
-    auto calcPrimaryRay = [&](int x, int y) {
-        // (0, 0) is left top
-        float nearPlane = 0.1f;
-        QMatrix4x4 camMat = camera.toMatrix().inverted();
-        QVector3D cam(camMat(0, 3), camMat(1, 3), camMat(2, 3));
-        
-        QVector3D camForward = camera.forward();
-        camForward.normalize();
-        camForward *= nearPlane;
-        QVector3D camRight = camera.right(), camUp = camera.up();
-        camRight.normalize();
-        camUp.normalize();
-        float pixelSize = (2 * nearPlane * tan(fovVertical / 360) / imageHeight);
-        camRight *= pixelSize;
-        camUp *= pixelSize;
-
-        int centerX = imageWidth / 2, centerY = imageHeight / 2;
-
-        camRight *= (x - centerX);
-        camUp *= (centerY - y);
-
-        QVector3D pixel = cam + camForward + camRight + camUp;
-        
-        Point camP(cam.x(), cam.y(), cam.z());
-        Point pixelP(pixel.x(), pixel.y(), pixel.z());
-        
-        return Ray(camP, pixelP);
-    };
+void RenderingWidget::renderObjectPathTracing(Light light) {
+    if (pScene == nullptr)
+        return;
+    sync_object_motion();
 
-    for (int x = 0; x < imageWidth; x++) {
-        for (int y = 0; y < imageHeight; y++) {
-            Ray prim = calcPrimaryRay(x, y);
-            result.setPixelColor(x, y, trace(prim, 0, light));
-        }
+    int imageWidth = this->width(), imageHeight = this->height();
+    RayCamera camera(mCamera, imageWidth, imageHeight);
+
+    // Keep refining the previous image while nothing it depends on changed
+    QMatrix4x4 view = mCamera.toMatrix();
+    QMatrix4x4 model = mTransform.toMatrix();
+    bool sameLight = light.Type == ptLight.Type && light.Position == ptLight.Position
+        && light.Direction == ptLight.Direction && light.Ld == ptLight.Ld && light.Ls == ptLight.Ls;
+    if (ptFrame.width != imageWidth || ptFrame.height != imageHeight
+        || view != ptView || model != ptModel || !sameLight) {
+        ptFrame.resize(imageWidth, imageHeight);
+        ptView = view;
+        // The irradiance cache is in world space and survives camera moves
+        if (!sameLight || model != ptModel)
+            ptCache.clear();
+        ptLight = light;
+        ptModel = model;
     }
 
-    result.save("rt.jpg", "JPG");
+    PathTracer tracer(pScene, ptUseCache ? &ptCache : nullptr);
+    PathTraceStats total;
+    for (int i = 0; i < ptPassesPerClick; i++) {
+        PathTraceStats stats = tracer.render_pass(camera, light, ptFrame);
+        total.samples += stats.samples;
+        total.seconds += stats.seconds;
+        total.threads = stats.threads;
+    }
+
+    qDebug() << "Path tracing" << ptPassesPerClick << "spp in" << total.seconds << "s,"
+        << ptFrame.passes << "spp accumulated,"
+        << total.samples_per_second_per_core() << "samples/s per core on" << total.threads << "threads";
+    if (ptUseCache)
+        qDebug() << "Irradiance cache:" << ptCache.size() << "records";
+
+    FrameBuffer result = ptFrame;
+    if (rtDenoise)
+        mDenoiser.denoise(result);
+    result.to_image().save("pt.jpg", "JPG");
 }
 
 void RenderingWidget::load_texture(QString fileName) {
+    stop_render_job();
     if (mTexture != nullptr)
         delete mTexture;
 
-    mTexture = new QOpenGLTexture(QImage(fileName).mirrored());
+    // The ray tracer samples its own mip-mapped copy of the same image
+    QImage image(fileName);
+    mTexture = new QOpenGLTexture(image.mirrored());
+    rtTexture = image.isNull() ? nullptr : std::make_shared<MipTexture>(image);
+    if (pScene != nullptr)
+        pScene->set_diffuse_texture(rtTexture);
     mTexture->setMinificationFilter(QOpenGLTexture::Linear);
     mTexture->setMagnificationFilter(QOpenGLTexture::Linear);
     mTexture->setWrapMode(QOpenGLTexture::Repeat);
@@ -636,11 +723,8 @@ void RenderingWidget::update() {
         
         bool isColliding = false;
 
-        for (auto t : pScene->aabbTrees) {
-            double distance = t->tree.squared_distance(cam);
-            if (distance <= 0.3)
-                isColliding = true;
-        }
+        if (pScene->squared_distance(cam) <= 0.3)
+            isColliding = true;
         
         
         if (!isColliding) {
@@ -651,6 +735,18 @@ void RenderingWidget::update() {
     //mCamera.translate(transSpeed * translation);
     //mTransform.rotate(1.0f, QVector3D(0.4f, 0.3f, 0.3f));
 
+    if (rtJob != nullptr && rtJob->done()) {
+        FrameBuffer frame = rtJob->wait();
+        qDebug() << "Ray tracing" << (rtJob->status() == RENDER_FINISHED ? "finished" : "ran out of time at")
+            << static_cast<int>(rtJob->progress() * 100 + 0.5f) << "% of" << rtPasses << "passes,"
+            << rtJob->reused_primary_hits() << "of" << rtPrimaryHits.size() << "tiles reused primary hits,"
+            << rtJob->secondary_rays() << "secondary rays traced";
+        if (rtDenoise)
+            mDenoiser.denoise(frame);
+        frame.to_image().save("rt.jpg", "JPG");
+        rtJob.reset();
+    }
+
     QOpenGLWidget::update();
 }
 
@@ -682,6 +778,83 @@ void RenderingWidget::mouseReleaseEvent(QMouseEvent *event) {
     Input::registerMouseRelease(event->button());
 }
 
+void RenderingWidget::set_denoise(bool enable) {
+    rtDenoise = enable;
+}
+
+void RenderingWidget::set_caustics(bool enable) {
+    rtCausticsEnabled = enable;
+}
+
+void RenderingWidget::set_hybrid(bool enable) {
+    if (!enable && hybridTrace.joinable()) {
+        hybridTrace.join();
+        hybridTraced = false;
+    }
+    hybridEnabled = enable;
+    gBufferPending[0] = gBufferPending[1] = false;
+    hybridShown = false;
+}
+
+void RenderingWidget::set_irradiance_cache(bool enable) {
+    if (enable != ptUseCache)
+        ptFrame.clear();
+    ptUseCache = enable;
+}
+
+void RenderingWidget::set_lightmap(bool enable) {
+    lightmapEnabled = enable;
+    if (enable && !lightmap_current())
+        bake_lightmap();
+}
+
+bool RenderingWidget::lightmap_current() {
+    return lightmapEnabled && lightmapBaked && mLightmap != nullptr
+        && lightmapModel == mTransform.toMatrix() && lightmapLight == lightPosition;
+}
+
+void RenderingWidget::bake_lightmap() {
+    if (pScene == nullptr || pScene->objects.empty())
+        return;
+    sync_object_motion();
+
+    // The raster path's light
+    Light light;
+    light.Position = lightPosition.toVector3D();
+    light.Ld = 1.f;
+    light.Type = POINT_LIGHT;
+
+    LightmapStats stats;
+    if (lightmap.empty() && !lightmap.pack(*pScene, &stats)) {
+        qDebug() << "Lightmap charts do not fit into" << lightmap.settings.maxResolution << "texels";
+        return;
+    }
+    lightmap.bake(*pScene, light, &stats);
+    qDebug() << "Lightmap baked:" << stats.texels << "texels in" << stats.bakeSeconds << "s";
+
+    makeCurrent();
+    std::vector<float> uvs = lightmap.raw_uvs(*pScene);
+    mLightmapUV.bind();
+    mLightmapUV.allocate(&uvs[0], static_cast<int>(uvs.size() * sizeof(float)));
+    mLightmapUV.release();
+
+    if (mLightmap != nullptr)
+        delete mLightmap;
+    mLightmap = new QOpenGLTexture(QOpenGLTexture::Target2D);
+    mLightmap->setSize(lightmap.width, lightmap.height);
+    mLightmap->setFormat(QOpenGLTexture::RGBA32F);
+    mLightmap->allocateStorage();
+    mLightmap->setData(QOpenGLTexture::RGBA, QOpenGLTexture::Float32, lightmap.texels.data());
+    mLightmap->setMinificationFilter(QOpenGLTexture::Linear);
+    mLightmap->setMagnificationFilter(QOpenGLTexture::Linear);
+    mLightmap->setWrapMode(QOpenGLTexture::ClampToEdge);
+    doneCurrent();
+
+    lightmapBaked = true;
+    lightmapModel = mTransform.toMatrix();
+    lightmapLight = lightPosition;
+}
+
 void RenderingWidget::set_proj_type(int type) {
     projType = type;
     int w = this->width(), h = this->height();
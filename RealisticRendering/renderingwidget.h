@@ -3,6 +3,16 @@
 #include "scene.h"
 #include "transform3D.h"
 #include "camera3D.h"
+#include "light.h"
+#include "framebuffer.h"
+#include "denoiser.h"
+#include "raycamera.h"
+#include "pathtracer.h"
+#include "raytracer.h"
+#include "lightmap.h"
+#include "photonmap.h"
+#include "gbuffer.h"
+#include "renderqueue.h"
 
 #include <QOpenGLWidget>
 #include <QOpenGLFunctions>
@@ -17,6 +27,9 @@
 #include <QKeyEvent>
 #include <QMouseEvent>
 
+#include <atomic>
+#include <thread>
+
 class QOpenGLShaderProgram;
 
 enum {
@@ -24,23 +37,6 @@ enum {
     PERSPECTIVE
 };
 
-enum {
-    POINT_LIGHT,
-    DIRECTIONAL_LIGHT
-};
-
-struct Light {
-    float La;       // Ambient light intensity
-    float Ld;       // Diffuse light intensity
-    float Ls;       // Specular light intensity
-    QVector3D Position;
-    QVector3D Direction;
-    int Type;           // Point or directional light
-
-    Light() : La(1.0), Ld(1.0), Ls(1.0), 
-        Position(QVector3D(0.0, 3.0, 0.0)), Type(POINT_LIGHT)  {}
-};
-
 
 class RenderingWidget : public QOpenGLWidget, 
     protected QOpenGLFunctions {
@@ -64,6 +60,17 @@ protected:
 
     void renderShadow();
     void renderObject();
+    // Hybrid mode: rasterizes the G-buffer and traces the frame before
+    // from its read back copy, over the raster image
+    void renderHybrid();
+    void resize_gbuffer(int w, int h);
+    void sync_object_motion();
+    // Cancels the queued ray tracing render and waits for it and the hybrid
+    // trace to let go of the scene; call before changing anything they read
+    void stop_render_job();
+    void bake_lightmap();
+    // The lightmap matches the current light and model transform
+    bool lightmap_current();
 
     void keyPressEvent(QKeyEvent *event);
     void keyReleaseEvent(QKeyEvent *event);
@@ -78,9 +85,19 @@ public slots:
     void load_texture(QString fileName);
     void load_displacement(QString fileName);
     void load_FBO();
+    void set_denoise(bool enable);
+    void set_irradiance_cache(bool enable);
+    // Static lighting: bake a lightmap now and draw with it instead of the
+    // shadow map while the light and the model stay where they were
+    void set_lightmap(bool enable);
+    // Photon-mapped caustics in the Whitted tracer
+    void set_caustics(bool enable);
+    // Every frame: primary visibility from the rasterizer, reflections,
+    // refractions and shadows from the ray tracer
+    void set_hybrid(bool enable);
 
-    QColor trace(Ray ray, int depth, Light light);
     void renderObjectRayTracing(Light light);
+    void renderObjectPathTracing(Light light);
 
 private:
     scene *pScene;
@@ -88,6 +105,8 @@ private:
     int drawArraySize;
 
     QOpenGLBuffer mVertex;
+    QOpenGLBuffer mOcclusion;           // baked ambient occlusion per vertex of rawData
+    QOpenGLBuffer mLightmapUV;          // lightmap coordinates per vertex of rawData
     QOpenGLVertexArrayObject mObject;
     QOpenGLShaderProgram *mProgram;
 
@@ -96,7 +115,15 @@ private:
     QOpenGLShaderProgram *mShadow;
     
     QOpenGLTexture *mTexture;
+    std::shared_ptr<const MipTexture> rtTexture;    // mTexture for the ray tracer
     QOpenGLTexture *mDisplacement;
+    QOpenGLTexture *mLightmap;
+
+    Lightmap lightmap;
+    bool lightmapEnabled;
+    bool lightmapBaked;
+    QMatrix4x4 lightmapModel;           // mTransform and light position at bake time
+    QVector4D lightmapLight;
     
     //QOpenGLFramebufferObject *mFBO;
     GLuint shadowMap;
@@ -109,4 +136,48 @@ private:
     QMatrix4x4 mProjection;
     Camera3D mCamera;
     Transform3D mTransform;
+
+    Denoiser mDenoiser;
+    bool rtDenoise;
+
+    PhotonMap rtCaustics;
+    bool rtCausticsEnabled;
+    bool rtCausticsBuilt;
+    QMatrix4x4 rtCausticsModel;         // mTransform and light at build time
+    QVector3D rtCausticsLight;
+    RenderQueue rtQueue;
+    std::shared_ptr<RenderHandle> rtJob;    // the last ray tracing click, saved by update() once done
+    std::vector<PrimaryHitCache> rtPrimaryHits; // per tile of rtJob, lets light and material edits skip primary visibility
+    int rtPasses;                       // jittered passes per click, refined until rtBudgetSeconds
+    double rtBudgetSeconds;
+
+    // Hybrid mode. The G-buffer of frame n is copied into PBO n % 2 without
+    // waiting and mapped in frame n + 1, then shaded on hybridTrace while
+    // the GUI thread goes on drawing. The overlay shows the last finished
+    // trace; G-buffers that arrive while one is running are skipped.
+    bool hybridEnabled;
+    QOpenGLShaderProgram *mGBuffer;
+    QOpenGLVertexArrayObject mObjectGBuffer;
+    QOpenGLBuffer mGBufferPbo[2];
+    QVector3D gBufferEye[2];            // camera position of the G-buffer in each PBO
+    bool gBufferPending[2];             // a copy was started and not read yet
+    int gBufferFrame;
+    int gBufferWidth, gBufferHeight;
+    GLuint gBufferFramebuffer, gBufferTexture, gBufferDepth;
+    GLuint hybridFramebuffer, hybridTexture;    // the traced image, blitted into the viewport
+    std::vector<SceneHit> hybridHits;   // input of hybridTrace, only written while none runs
+    std::thread hybridTrace;
+    std::atomic<bool> hybridTraced;     // hybridFrame is done, hybridTrace can be joined
+    FrameBuffer hybridFrame;
+    RayTraceStats hybridStats;
+    bool hybridShown;                   // hybridTexture holds a trace of the current size
+
+    // Progressive path tracing state
+    FrameBuffer ptFrame;
+    QMatrix4x4 ptView;
+    QMatrix4x4 ptModel;
+    Light ptLight;
+    int ptPassesPerClick;
+    IrradianceCache ptCache;
+    bool ptUseCache;
 };
\ No newline at end of file
@@ -0,0 +1,240 @@
+#include "renderqueue.h"
+#include "pathtracer.h"
+#include "parallel.h"
+
+#include <algorithm>
+
+RenderStatus RenderHandle::status() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return state;
+}
+
+float RenderHandle::progress() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return totalPasses > 0 ? static_cast<float>(passesDone) / totalPasses : 1.f;
+}
+
+int RenderHandle::reused_primary_hits() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return reusedTiles;
+}
+
+long long RenderHandle::secondary_rays() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return secondaryRays;
+}
+
+bool RenderHandle::done() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return state >= RENDER_FINISHED;
+}
+
+void RenderHandle::cancel() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (state >= RENDER_FINISHED)
+        return;
+    cancelled = true;
+    if (idle())
+        finish();
+}
+
+FrameBuffer RenderHandle::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    stopped.wait(lock, [this]() { return state >= RENDER_FINISHED; });
+    return result;
+}
+
+// The tile with the fewest passes that is free to take one more, or -1.
+// Once the budget is spent only tiles without any pass are left.
+int RenderHandle::next_tile() const {
+    if (cancelled || state >= RENDER_FINISHED)
+        return -1;
+    int passes = std::max(request.passes, 1);
+    if (request.budgetSeconds > 0 && std::chrono::steady_clock::now() >= deadline)
+        passes = 1;
+
+    int best = -1;
+    for (int i = 0; i < static_cast<int>(tiles.size()); i++) {
+        const Tile &t = tiles[i];
+        if (!t.busy && t.fb.passes < passes && (best < 0 || t.fb.passes < tiles[best].fb.passes))
+            best = i;
+    }
+    return best;
+}
+
+bool RenderHandle::idle() const {
+    for (const Tile &t : tiles) {
+        if (t.busy)
+            return false;
+    }
+    return true;
+}
+
+void RenderHandle::finish() {
+    int width = camera.width, height = camera.height;
+    result.resize(width, height);
+    result.passes = 1;
+    bool complete = true;
+    for (const Tile &t : tiles) {
+        complete = complete && t.fb.passes >= std::max(request.passes, 1);
+        if (t.fb.passes == 0)
+            continue;
+        for (int y = 0; y < t.fb.height; y++) {
+            for (int x = 0; x < t.fb.width; x++) {
+                int from = t.fb.index(x, y), to = result.index(t.x0 + x, t.y0 + y);
+                QVector3D c = t.fb.resolved(x, y);
+                for (int k = 0; k < 3; k++) {
+                    result.color[k][to] = c[k];
+                    result.albedo[k][to] = t.fb.albedo[k][from];
+                    result.normal[k][to] = t.fb.normal[k][from];
+                }
+                result.depth[to] = t.fb.depth[from];
+            }
+        }
+    }
+    state = cancelled ? RENDER_CANCELLED : complete ? RENDER_FINISHED : RENDER_OUT_OF_TIME;
+    tiles.clear();
+    stopped.notify_all();
+}
+
+RenderQueue::RenderQueue(int numThreads) : quitting(false) {
+    int n = resolve_thread_count(numThreads);
+    for (int i = 0; i < n; i++)
+        workers.emplace_back([this]() { work(); });
+}
+
+RenderQueue::~RenderQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quitting = true;
+        for (auto &job : jobs)
+            job->cancel();
+    }
+    wake.notify_all();
+    for (auto &t : workers)
+        t.join();
+}
+
+std::shared_ptr<RenderHandle> RenderQueue::submit(const scene *s, const RayCamera &camera, const Light &light,
+    const RenderRequest &request) {
+    std::shared_ptr<RenderHandle> job(new RenderHandle);
+    job->pScene = s;
+    job->camera = camera;
+    job->light = light;
+    job->request = request;
+    job->deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(request.budgetSeconds));
+    job->state = RENDER_QUEUED;
+    job->cancelled = false;
+    job->passesDone = 0;
+    job->reusedTiles = 0;
+    job->secondaryRays = 0;
+
+    int tileSize = std::max(1, request.tileSize);
+    int tileCount = ((camera.width + tileSize - 1) / tileSize) * ((camera.height + tileSize - 1) / tileSize);
+    if (request.primaryHits != nullptr && !request.pathTracing)
+        request.primaryHits->resize(std::max(tileCount, 0));
+    for (int y = 0; y < camera.height; y += tileSize) {
+        for (int x = 0; x < camera.width; x += tileSize) {
+            RenderHandle::Tile t;
+            t.x0 = x;
+            t.y0 = y;
+            t.fb.resize(std::min(tileSize, camera.width - x), std::min(tileSize, camera.height - y));
+            t.busy = false;
+            t.primaryHits = request.primaryHits != nullptr && !request.pathTracing ?
+                &(*request.primaryHits)[job->tiles.size()] : nullptr;
+            job->tiles.push_back(std::move(t));
+        }
+    }
+    job->totalPasses = static_cast<int>(job->tiles.size()) * std::max(request.passes, 1);
+    if (s == nullptr || job->tiles.empty()) {
+        std::lock_guard<std::mutex> lock(job->mutex);
+        job->finish();
+        return job;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(job);
+    }
+    wake.notify_all();
+    return job;
+}
+
+bool RenderQueue::take(std::shared_ptr<RenderHandle> &job, int &tile) {
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(),
+        [](const std::shared_ptr<RenderHandle> &j) { return j->done(); }), jobs.end());
+    // Stable, so first come first served within a priority
+    std::stable_sort(jobs.begin(), jobs.end(),
+        [](const std::shared_ptr<RenderHandle> &a, const std::shared_ptr<RenderHandle> &b) {
+        return a->request.priority > b->request.priority;
+    });
+
+    for (auto &j : jobs) {
+        std::lock_guard<std::mutex> lock(j->mutex);
+        int i = j->next_tile();
+        if (i < 0) {
+            // Out of time or cancelled with nothing in flight: done now
+            if (j->state < RENDER_FINISHED && j->idle())
+                j->finish();
+            continue;
+        }
+        j->tiles[i].busy = true;
+        j->state = RENDER_RUNNING;
+        job = j;
+        tile = i;
+        return true;
+    }
+    return false;
+}
+
+void RenderQueue::work() {
+    for (;;) {
+        std::shared_ptr<RenderHandle> job;
+        int tile = -1;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!quitting && !take(job, tile))
+                wake.wait(lock);
+            if (job == nullptr)
+                return;
+        }
+
+        // The tile is ours while busy, so it is rendered unlocked
+        RenderHandle::Tile *t;
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            t = &job->tiles[tile];
+        }
+        RayTraceStats stats = render(*job, *t);
+
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            t->busy = false;
+            if (stats.reusedPrimaryHits)
+                job->reusedTiles++;
+            job->secondaryRays += stats.secondaryRays;
+            job->passesDone++;
+            if (job->next_tile() < 0 && job->idle())
+                job->finish();
+        }
+        wake.notify_all();
+    }
+}
+
+RayTraceStats RenderQueue::render(const RenderHandle &job, RenderHandle::Tile &tile) {
+    const RenderRequest &request = job.request;
+    if (request.pathTracing) {
+        PathTracer tracer(job.pScene);
+        tracer.settings.numThreads = 1;
+        if (request.maxDepth >= 0)
+            tracer.settings.maxDepth = request.maxDepth;
+        tracer.render_pass(job.camera, job.light, tile.fb, tile.x0, tile.y0);
+        return RayTraceStats();
+    }
+    RayTracer tracer(job.pScene, request.caustics, tile.primaryHits);
+    tracer.settings.numThreads = 1;
+    if (request.maxDepth >= 0)
+        tracer.settings.maxDepth = request.maxDepth;
+    return tracer.render(job.camera, job.light, tile.fb, tile.x0, tile.y0);
+}
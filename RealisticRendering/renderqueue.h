@@ -0,0 +1,133 @@
+#pragma once
+
+#include "scene.h"
+#include "light.h"
+#include "raycamera.h"
+#include "framebuffer.h"
+#include "raytracer.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class PhotonMap;
+
+enum RenderPriority {
+    BACKGROUND_PRIORITY,        // stills
+    INTERACTIVE_PRIORITY        // previews; served before any background work
+};
+
+enum RenderStatus {
+    RENDER_QUEUED,
+    RENDER_RUNNING,
+    RENDER_FINISHED,            // every pass of every tile
+    RENDER_OUT_OF_TIME,         // the budget ran out first
+    RENDER_CANCELLED
+};
+
+struct RenderRequest {
+    int passes;                 // Whitted passes after the first jitter the primary rays; path tracer passes are samples per pixel
+    bool pathTracing;           // path tracer instead of the Whitted tracer
+    int maxDepth;               // -1 for the tracer's default
+    double budgetSeconds;       // wall clock from submission, 0 for none; the first pass always completes
+    RenderPriority priority;
+    int tileSize;
+    const PhotonMap *caustics;  // Whitted tracer only, may be null
+    // Whitted tracer only, may be null: one cache per tile, resized by
+    // submit(), so that the first pass of a job with the same camera,
+    // tiles and geometry as the last one only shades. Owned by the caller;
+    // only one running job may use it at a time.
+    std::vector<PrimaryHitCache> *primaryHits;
+
+    RenderRequest() : passes(1), pathTracing(false), maxDepth(-1), budgetSeconds(0),
+        priority(BACKGROUND_PRIORITY), tileSize(32), caustics(nullptr), primaryHits(nullptr) {}
+};
+
+// What a RenderQueue hands back for a job: its progress, a way to cancel
+// it and, once it stops, its image.
+class RenderHandle {
+public:
+    RenderStatus status() const;
+    // Passes done over passes asked for, summed over the tiles
+    float progress() const;
+    // Tiles whose first pass reused the hits in request.primaryHits
+    int reused_primary_hits() const;
+    // Mirror and glass rays of the Whitted tiles, which no cache saves
+    long long secondary_rays() const;
+    bool done() const;
+    // Tiles being rendered finish their pass; nothing new is started
+    void cancel();
+
+    // Blocks until the job stops. Every tile holds the average of the
+    // passes it finished, which is all of them unless the job ran out of
+    // time or was cancelled; a tile cancelled before its first pass is black.
+    FrameBuffer wait();
+
+private:
+    friend class RenderQueue;
+
+    struct Tile {
+        int x0, y0;
+        FrameBuffer fb;
+        bool busy;
+        PrimaryHitCache *primaryHits;   // may be null
+    };
+
+    // Set at submission
+    const scene *pScene;
+    RayCamera camera;
+    Light light;
+    RenderRequest request;
+    std::chrono::steady_clock::time_point deadline;
+    int totalPasses;            // passes asked for, summed over the tiles
+
+    mutable std::mutex mutex;
+    std::condition_variable stopped;
+    RenderStatus state;
+    bool cancelled;
+    std::vector<Tile> tiles;
+    int passesDone;             // summed over the tiles
+    int reusedTiles;
+    long long secondaryRays;
+    FrameBuffer result;
+
+    // Under mutex
+    int next_tile() const;
+    bool idle() const;
+    void finish();
+};
+
+// Render jobs sharing one set of worker threads. The work of a job is cut
+// into one pass over one tile at a time, and a free thread always takes
+// the next such piece from the job with the highest priority, oldest
+// first. An interactive preview therefore gets every thread as soon as the
+// pieces already running finish, and a background still continues once the
+// preview is done. Passes are spread over the whole image one after the
+// other, so a job that runs out of time stops with an evenly refined image.
+class RenderQueue {
+public:
+    explicit RenderQueue(int numThreads = 0);
+    // Cancels the jobs still running and waits for the pieces in flight
+    ~RenderQueue();
+
+    // s, and request.caustics, must stay alive and unchanged until the
+    // job is done
+    std::shared_ptr<RenderHandle> submit(const scene *s, const RayCamera &camera, const Light &light,
+        const RenderRequest &request);
+
+private:
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<std::shared_ptr<RenderHandle>> jobs;    // in submission order
+    std::vector<std::thread> workers;
+    bool quitting;
+
+    void work();
+    // Under mutex: the next piece of work, if any
+    bool take(std::shared_ptr<RenderHandle> &job, int &tile);
+    // Empty stats for the path tracer
+    static RayTraceStats render(const RenderHandle &job, RenderHandle::Tile &tile);
+};
@@ -0,0 +1,212 @@
+#include "sampler.h"
+#include "mathutil.h"
+
+#include <cmath>
+#include <vector>
+
+namespace {
+
+const float oneMinusEpsilon = 0.99999994f;
+
+inline unsigned reverse_bits(unsigned x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// First two Sobol dimensions as 32-bit fixed point fractions
+inline unsigned sobol(unsigned index, int d) {
+    if (d == 0)
+        return reverse_bits(index);
+
+    unsigned result = 0;
+    for (unsigned v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1)
+            result ^= v;
+    }
+    return result;
+}
+
+// Hash that only lets bits flow from low to high (Laine and Karras 2011,
+// constants from Burley 2020)
+inline unsigned laine_karras_permutation(unsigned x, unsigned seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+// Owen scrambling: every bit is flipped depending on the bits above it
+inline unsigned nested_uniform_scramble(unsigned x, unsigned seed) {
+    return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+inline float to_unit(unsigned x) {
+    return std::min(oneMinusEpsilon, (x >> 8) * (1.f / 16777216.f));
+}
+
+// Scrambled Sobol point of the given sample; the dimension pair selects the
+// shuffle and scramble seeds.
+inline unsigned owen_sobol(unsigned sample, int d, unsigned pairSeed) {
+    unsigned index = nested_uniform_scramble(sample, pairSeed);
+    return nested_uniform_scramble(sobol(index, d), trimesh::hash_mix(pairSeed + d + 1));
+}
+
+// 64x64 blue-noise dither mask by void-and-cluster (Ulichney 1993) with a
+// Gaussian energy filter on the torus. Built once on first use.
+std::vector<float> build_blue_noise_mask() {
+    const int size = Sampler::blueNoiseSize;
+    const int n = size * size;
+    const float sigma = 1.9f;
+
+    // Toroidal Gaussian, indexed by wrapped offset
+    std::vector<float> kernel(n);
+    for (int dy = 0; dy < size; dy++) {
+        for (int dx = 0; dx < size; dx++) {
+            int wx = std::min(dx, size - dx), wy = std::min(dy, size - dy);
+            kernel[dy * size + dx] = std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+        }
+    }
+
+    std::vector<char> pattern(n, 0);
+    std::vector<float> energy(n, 0.f);
+    auto splat = [&](int p, float sign) {
+        int px = p % size, py = p / size;
+        for (int y = 0; y < size; y++) {
+            const float *k = &kernel[((y - py + size) % size) * size];
+            float *e = &energy[y * size];
+            for (int x = 0; x < size; x++)
+                e[x] += sign * k[(x - px + size) % size];
+        }
+    };
+    auto tightest_cluster = [&]() {
+        int best = -1;
+        for (int i = 0; i < n; i++) {
+            if (pattern[i] && (best < 0 || energy[i] > energy[best]))
+                best = i;
+        }
+        return best;
+    };
+    auto largest_void = [&]() {
+        int best = -1;
+        for (int i = 0; i < n; i++) {
+            if (!pattern[i] && (best < 0 || energy[i] < energy[best]))
+                best = i;
+        }
+        return best;
+    };
+
+    // Initial binary pattern: random points, relaxed by moving the tightest
+    // cluster into the largest void until that no longer changes anything
+    trimesh::pcg32 rng(0x5eed);
+    int initial = n / 10;
+    for (int placed = 0; placed < initial;) {
+        int p = static_cast<int>(rng() % n);
+        if (!pattern[p]) {
+            pattern[p] = 1;
+            splat(p, 1.f);
+            placed++;
+        }
+    }
+    for (int iter = 0; iter < 4 * n; iter++) {
+        int c = tightest_cluster();
+        pattern[c] = 0;
+        splat(c, -1.f);
+        int v = largest_void();
+        pattern[v] = 1;
+        splat(v, 1.f);
+        if (v == c)
+            break;
+    }
+
+    std::vector<int> rank(n, 0);
+    std::vector<char> initialPattern = pattern;
+    std::vector<float> initialEnergy = energy;
+
+    // Phase 1: rank the initial points by removing clusters
+    for (int r = initial - 1; r >= 0; r--) {
+        int c = tightest_cluster();
+        pattern[c] = 0;
+        splat(c, -1.f);
+        rank[c] = r;
+    }
+
+    // Phase 2: fill the remaining voids in order
+    pattern = initialPattern;
+    energy = initialEnergy;
+    for (int r = initial; r < n; r++) {
+        int v = largest_void();
+        pattern[v] = 1;
+        splat(v, 1.f);
+        rank[v] = r;
+    }
+
+    std::vector<float> mask(n);
+    for (int i = 0; i < n; i++)
+        mask[i] = (rank[i] + 0.5f) / n;
+    return mask;
+}
+
+} // namespace
+
+float Sampler::blue_noise(int x, int y) {
+    // Thread-safe lazy construction (C++11 static initialization)
+    static const std::vector<float> mask = build_blue_noise_mask();
+    const int m = blueNoiseSize - 1;
+    return mask[(y & m) * blueNoiseSize + (x & m)];
+}
+
+Sampler::Sampler(SamplerType type, int x, int y, unsigned sampleIndex, unsigned seed)
+    : type(type), px(x), py(y), sample(sampleIndex), seed(seed), dim(0) {
+    pixel = trimesh::hash_mix(static_cast<unsigned>(x) * 0x8da6b343u ^ static_cast<unsigned>(y) * 0xd8163841u);
+}
+
+// Toroidal shift by the blue-noise mask. Each dimension reads the tile at a
+// different offset (R2 sequence) so that dimensions are not correlated.
+float Sampler::shift(float u, int d) const {
+    int ox = static_cast<int>(d * 0.7548776662f * blueNoiseSize);
+    int oy = static_cast<int>(d * 0.5698402910f * blueNoiseSize);
+    u += blue_noise(px + ox, py + oy);
+    u -= std::floor(u);
+    return std::min(u, oneMinusEpsilon);
+}
+
+float Sampler::get_1d() {
+    int d = dim++;
+    switch (type) {
+    case SOBOL_SAMPLER:
+        return to_unit(owen_sobol(sample, 0, trimesh::hash_rnd(pixel, d, 0, seed)));
+    case BLUE_NOISE_SAMPLER:
+        return shift(to_unit(owen_sobol(sample, 0, trimesh::hash_rnd(0, d, 0, seed))), d);
+    default:
+        return to_unit(trimesh::hash_rnd(pixel, sample, d, seed));
+    }
+}
+
+void Sampler::get_2d(float &u, float &v) {
+    int d = dim;
+    dim += 2;
+    switch (type) {
+    case SOBOL_SAMPLER: {
+        unsigned pairSeed = trimesh::hash_rnd(pixel, d, 0, seed);
+        u = to_unit(owen_sobol(sample, 0, pairSeed));
+        v = to_unit(owen_sobol(sample, 1, pairSeed));
+        break;
+    }
+    case BLUE_NOISE_SAMPLER: {
+        unsigned pairSeed = trimesh::hash_rnd(0, d, 0, seed);
+        u = shift(to_unit(owen_sobol(sample, 0, pairSeed)), d);
+        v = shift(to_unit(owen_sobol(sample, 1, pairSeed)), d + 1);
+        break;
+    }
+    default:
+        u = to_unit(trimesh::hash_rnd(pixel, sample, d, seed));
+        v = to_unit(trimesh::hash_rnd(pixel, sample, d + 1, seed));
+        break;
+    }
+}
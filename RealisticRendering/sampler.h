@@ -0,0 +1,43 @@
+#pragma once
+
+// Sample generators for the CPU tracers.
+// Every value is a pure function of (pixel, sample index, dimension), so a
+// sample comes out the same no matter which thread computes it or when.
+
+enum SamplerType {
+    RANDOM_SAMPLER,         // independent hashed random numbers
+    SOBOL_SAMPLER,          // Owen-scrambled Sobol, decorrelated per pixel
+    BLUE_NOISE_SAMPLER      // Sobol shared by all pixels, shifted by a blue-noise mask
+};
+
+// Sample source for one pixel sample. Dimensions are consumed in call order:
+// the caller must ask for them in the same order for every sample of a pixel
+// (e.g. lens jitter first, then per bounce) to benefit from stratification.
+//
+// Sobol dimensions are padded in pairs: every get_2d() uses the first two
+// Sobol dimensions with an independent shuffle and Owen scramble (Burley,
+// "Practical Hash-based Owen Scrambling", 2020), which keeps 2D projections
+// well stratified without needing high-dimensional direction numbers.
+class Sampler {
+public:
+    Sampler(SamplerType type, int x, int y, unsigned sampleIndex, unsigned seed = 0);
+
+    float get_1d();
+    void get_2d(float &u, float &v);
+
+    int dimension() const { return dim; }
+
+    // Value of the tiled blue-noise mask at (x, y), in (0, 1)
+    static float blue_noise(int x, int y);
+    static const int blueNoiseSize = 64;
+
+private:
+    SamplerType type;
+    int px, py;
+    unsigned pixel;
+    unsigned sample;
+    unsigned seed;
+    int dim;
+
+    float shift(float u, int d) const;
+};
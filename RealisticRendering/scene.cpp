@@ -1,5 +1,8 @@
 #include "scene.h"
+#include "raystats.h"
+#include "bvhsnapshot.h"
 #include <QString>
+#include <cmath>
 #include <fstream>
 #include <sstream>
 
@@ -24,6 +27,11 @@ void scene::clear_all() {
     objects.clear();
     aabbTrees.clear();
     transMatrices.clear();
+    geometryVersion++;
+    instanceBvh.clear();
+    instanceBounds.clear();
+    lights.clear();
+    lightBvh.clear();
 }
 
 std::string get_path(std::string fileName) {
@@ -52,6 +60,12 @@ int scene::read_scene_file(std::string fileName) {
     // O for obj file name (in double quotes)
     // S for size restriction
     // T for transformation matrix
+    // L P x y z intensity for a point light at (x, y, z), falling off with
+    //   the squared distance
+    // L D x y z intensity for a directional light shining along (x, y, z)
+    // L R x y z e1x e1y e1z e2x e2y e2z radiance for a rectangle light
+    //   centered on (x, y, z) with edges e1 and e2, lit on the e1 x e2 side
+    // L S x y z r radiance for a sphere light
     clear_all();
 
     std::ifstream fileIn(fileName, std::ios::in);
@@ -131,6 +145,39 @@ int scene::read_scene_file(std::string fileName) {
                     continue;
                 transMatrices.insert(std::make_pair(tempObject, trans));
             }
+            else if (res[0] == "L") {
+                Light light;
+                if (res.size() == 6 && (res[1] == "P" || res[1] == "D")) {
+                    QVector3D v(std::stof(res[2]), std::stof(res[3]), std::stof(res[4]));
+                    light.La = light.Ld = light.Ls = std::stof(res[5]);
+                    if (res[1] == "P") {
+                        light.Type = POINT_LIGHT;
+                        light.Position = v;
+                        light.Falloff = true;
+                    }
+                    else {
+                        light.Type = DIRECTIONAL_LIGHT;
+                        light.Direction = v;
+                    }
+                }
+                else if (res.size() == 12 && res[1] == "R") {
+                    light.Type = RECT_LIGHT;
+                    light.Position = QVector3D(std::stof(res[2]), std::stof(res[3]), std::stof(res[4]));
+                    light.Edge1 = QVector3D(std::stof(res[5]), std::stof(res[6]), std::stof(res[7]));
+                    light.Edge2 = QVector3D(std::stof(res[8]), std::stof(res[9]), std::stof(res[10]));
+                    light.La = light.Ld = light.Ls = std::stof(res[11]);
+                }
+                else if (res.size() == 7 && res[1] == "S") {
+                    light.Type = SPHERE_LIGHT;
+                    light.Position = QVector3D(std::stof(res[2]), std::stof(res[3]), std::stof(res[4]));
+                    light.Radius = std::stof(res[5]);
+                    light.La = light.Ld = light.Ls = std::stof(res[6]);
+                }
+                else {
+                    throw std::length_error("light error");
+                }
+                lights.push_back(light);
+            }
         }
     }
     catch (...) {
@@ -154,35 +201,335 @@ int scene::read_scene_file(std::string fileName) {
     qDebug() << "Calculate transform over.";
 
     build_aabb_trees();
+    build_light_bvh();
 
     return 0;
 }
 
+object *scene::add_object(std::string fileName, float size, const QMatrix4x4 &trans) {
+    object *o = new object();
+    if (o->read_obj_file(fileName) == -1) {
+        delete o;
+        return nullptr;
+    }
+    if (size > 0)
+        o->normalize(size);
+
+    for (auto v : o->get_vertices()) {
+        QVector4D coor(v->position.x, v->position.y, v->position.z, 1.0);
+        QVector4D afterTrans = trans * coor;
+        v->position = vec3f(afterTrans.x(), afterTrans.y(), afterTrans.z());
+    }
+
+    objects.push_back(o);
+    transMatrices.insert(std::make_pair(o, trans));
+    return o;
+}
+
+void scene::build_light_bvh() {
+    lightBvh.build(lights);
+}
+
+void scene::assign_default_materials() {
+    for (int i = 0; i < objects.size(); i++) {
+        if (i < objects.size() - 1)
+            objects[i]->material.Type = REFLECTION_AND_REFRACTION;
+        else
+            objects[i]->material.Type = DIFFUSE_AND_GLOSSY;
+    }
+}
+
+void scene::set_diffuse_texture(std::shared_ptr<const MipTexture> texture) {
+    for (auto o : objects)
+        o->material.diffTexture = texture;
+}
+
+namespace {
+
+// Copies the current vertex positions of o into both triangle lists, and
+// the texture coordinates alongside
+void fill_triangles(object *o, TreeandTri *t) {
+    std::vector<face*> fs = o->get_faces();
+    t->triangles.clear();
+    t->triangles.reserve(fs.size());
+    t->mesh.triangles.clear();
+    t->mesh.triangles.reserve(fs.size());
+    t->texCoords.clear();
+    t->texCoords.reserve(6 * fs.size());
+    for (auto f : fs) {
+        vertex* v1 = f->pEdge->pVertex,
+            *v2 = f->pEdge->pNext->pVertex,
+            *v3 = f->pEdge->pNext->pNext->pVertex;
+        Point p1(v1->position.x, v1->position.y, v1->position.z);
+        Point p2(v2->position.x, v2->position.y, v2->position.z);
+        Point p3(v3->position.x, v3->position.y, v3->position.z);
+        t->triangles.push_back(Triangle(p1, p2, p3));
+
+        float a[3] = { v1->position.x, v1->position.y, v1->position.z };
+        float b[3] = { v2->position.x, v2->position.y, v2->position.z };
+        float c[3] = { v3->position.x, v3->position.y, v3->position.z };
+        t->mesh.triangles.push_back(BvhTriangle(a, b, c));
+
+        for (vertex *v : { v1, v2, v3 }) {
+            t->texCoords.push_back(v->texCoord.x);
+            t->texCoords.push_back(v->texCoord.y);
+        }
+    }
+    // The CGAL tree points into the triangle list
+    t->treeBuilt = false;
+}
+
+// World bounds of a possibly moved object: the box around its local box's
+// transformed corners
+BvhBox instance_bounds(const TreeandTri *t) {
+    BvhBox local = t->mesh.bvh.bounds();
+    if (!t->moved || local.empty())
+        return local;
+
+    BvhBox world;
+    for (int i = 0; i < 8; i++) {
+        QVector3D corner(i & 1 ? local.hi[0] : local.lo[0],
+            i & 2 ? local.hi[1] : local.lo[1],
+            i & 4 ? local.hi[2] : local.lo[2]);
+        QVector3D p = t->motion.map(corner);
+        float w[3] = { p.x(), p.y(), p.z() };
+        world.grow(w);
+    }
+    return world;
+}
+
+BvhRay to_bvh_ray(const Ray &ray) {
+    Point o = ray.start();
+    Vector d = ray.to_vector();
+    float org[3] = { static_cast<float>(o.x()), static_cast<float>(o.y()), static_cast<float>(o.z()) };
+    float dir[3] = { static_cast<float>(d.x()), static_cast<float>(d.y()), static_cast<float>(d.z()) };
+    return BvhRay(org, dir);
+}
+
+// The direction is not renormalized, so t means the same in both spaces
+BvhRay to_object_space(const BvhRay &ray, const TreeandTri *t) {
+    QVector3D o = t->inverseMotion.map(QVector3D(ray.org[0], ray.org[1], ray.org[2]));
+    QVector3D d = t->inverseMotion.mapVector(QVector3D(ray.dir[0], ray.dir[1], ray.dir[2]));
+    float org[3] = { o.x(), o.y(), o.z() };
+    float dir[3] = { d.x(), d.y(), d.z() };
+    return BvhRay(org, dir);
+}
+
+} // namespace
+
 void scene::build_aabb_trees() {
+    for (auto t : aabbTrees)
+        delete t;
+    aabbTrees.clear();
+    geometryVersion++;
+
+    instanceBounds.clear();
     for (auto o : objects) {
         TreeandTri *t = new TreeandTri;
+        fill_triangles(o, t);
+        t->mesh.bvh.settings = bvhSettings;
+        bool loaded = false;
+        if (bvhCacheDir.isEmpty())
+            t->mesh.build();
+        else
+            loaded = load_or_build_bvh(t->mesh, bvhCacheDir);
+        aabbTrees.push_back(t);
+        instanceBounds.push_back(instance_bounds(t));
+
+        qDebug() << (loaded ? "Load object bvh snapshot over." : "Build object bvh over.");
+    }
+
+    // A handful of objects: one per leaf
+    instanceBvh.settings.maxLeafSize = 1;
+    instanceBvh.build(instanceBounds);
+}
 
-        t->triangles.resize(o->get_faces().size());
-        std::vector<face*> fs = o->get_faces();
-        for (auto f : fs) {
-            Point p1, p2, p3;
-            vertex* v1 = f->pEdge->pVertex,
-                *v2 = f->pEdge->pNext->pVertex,
-                *v3 = f->pEdge->pNext->pNext->pVertex;
-            p1 = Point(v1->position.x, v1->position.y, v1->position.z);
-            p2 = Point(v2->position.x, v2->position.y, v2->position.z);
-            p3 = Point(v3->position.x, v3->position.y, v3->position.z);
-            Triangle tri(p1, p2, p3);
-            t->triangles.push_back(tri);
+void scene::set_object_motion(int objectId, const QMatrix4x4 &motion) {
+    TreeandTri *t = aabbTrees[objectId];
+    if (t->motion == motion)
+        return;
+
+    t->motion = motion;
+    t->inverseMotion = motion.inverted();
+    t->moved = !motion.isIdentity();
+    instanceBounds[objectId] = instance_bounds(t);
+    geometryVersion++;
+
+    instanceBvh.refit(instanceBounds);
+    if (instanceBvh.needs_rebuild())
+        instanceBvh.build(instanceBounds);
+}
+
+void scene::update_object_geometry(int objectId) {
+    TreeandTri *t = aabbTrees[objectId];
+    fill_triangles(objects[objectId], t);
+    t->mesh.update();
+    geometryVersion++;
+
+    instanceBounds[objectId] = instance_bounds(t);
+    instanceBvh.refit(instanceBounds);
+    if (instanceBvh.needs_rebuild())
+        instanceBvh.build(instanceBounds);
+}
+
+double scene::squared_distance(const Point &p) {
+    double best = -1;
+    for (auto t : aabbTrees) {
+        if (t->triangles.empty())
+            continue;
+        if (!t->treeBuilt) {
+            t->tree.rebuild(t->triangles.begin(), t->triangles.end());
+            t->tree.accelerate_distance_queries();
+            t->treeBuilt = true;
         }
 
-        
-        t->tree.rebuild(t->triangles.begin(), t->triangles.end());
-        t->tree.accelerate_distance_queries();
+        // Rigid motions preserve distances
+        Point q = p;
+        if (t->moved) {
+            QVector3D local = t->inverseMotion.map(QVector3D(p.x(), p.y(), p.z()));
+            q = Point(local.x(), local.y(), local.z());
+        }
+        double d = t->tree.squared_distance(q);
+        if (best < 0 || d < best)
+            best = d;
+    }
+    return best < 0 ? 1e30 : best;
+}
 
-        aabbTrees.push_back(t);
+bool scene::intersect(const Ray &ray, SceneHit &hit) const {
+    BvhRay worldRay = to_bvh_ray(ray);
+    float tMax = 1e30f;
+    bool found = false;
+
+    instanceBvh.traverse(worldRay, tMax, [&](int i, float &tClosest) {
+        RT_STAT_INC(STAT_OBJECT_TESTS);
+        const TreeandTri *t = aabbTrees[i];
+        int faceId = -1;
+        bool hitObject = t->moved ? t->mesh.intersect(to_object_space(worldRay, t), tClosest, faceId)
+            : t->mesh.intersect(worldRay, tClosest, faceId);
+        if (hitObject) {
+            found = true;
+            hit.objectId = i;
+            hit.faceId = faceId;
+        }
+        return false;
+    });
 
-        qDebug() << "Build object aabb tree over.";
+    if (!found)
+        return false;
+
+    Vector d = ray.to_vector();
+    hit.squaredDistance = static_cast<double>(tMax) * tMax * (d * d);
+    return surface_at(hit.objectId, hit.faceId, ray.start() + static_cast<double>(tMax) * d, hit);
+}
+
+bool scene::surface_at(int objectId, int faceId, const Point &p, SceneHit &hit) const {
+    if (objectId < 0 || objectId >= static_cast<int>(aabbTrees.size()))
+        return false;
+    const TreeandTri *t = aabbTrees[objectId];
+    if (faceId < 0 || faceId >= static_cast<int>(t->triangles.size()))
+        return false;
+    hit.hitObject = objects[objectId];
+    hit.objectId = objectId;
+    hit.faceId = faceId;
+    hit.point = p;
+
+    const Triangle &tri = t->triangles[faceId];
+    Vector v2v1(tri[1], tri[0]), v2v3(tri[1], tri[2]);
+    Vector n = CGAL::cross_product(v2v3, v2v1);
+    if (t->moved) {
+        QVector3D m = t->motion.mapVector(QVector3D(n.x(), n.y(), n.z()));
+        n = Vector(m.x(), m.y(), m.z());
+    }
+    double len2 = n * n;
+    hit.normal = len2 > 0 ? n / std::sqrt(len2) : n;
+
+    // Barycentrics of p from the object space triangle
+    const BvhTriangle &bt = t->mesh.triangle_data()[faceId];
+    QVector3D local(p.x(), p.y(), p.z());
+    if (t->moved)
+        local = t->inverseMotion.map(local);
+    float q[3], d00 = 0, d01 = 0, d11 = 0, d20 = 0, d21 = 0;
+    for (int a = 0; a < 3; a++) {
+        q[a] = local[a] - bt.v0[a];
+        d00 += bt.e1[a] * bt.e1[a];
+        d01 += bt.e1[a] * bt.e2[a];
+        d11 += bt.e2[a] * bt.e2[a];
+        d20 += q[a] * bt.e1[a];
+        d21 += q[a] * bt.e2[a];
+    }
+    float denom = d00 * d11 - d01 * d01;
+    float b1 = denom != 0 ? (d11 * d20 - d01 * d21) / denom : 0;
+    float b2 = denom != 0 ? (d00 * d21 - d01 * d20) / denom : 0;
+
+    const float *uv = &t->texCoords[6 * faceId];
+    float du1 = uv[2] - uv[0], dv1 = uv[3] - uv[1];
+    float du2 = uv[4] - uv[0], dv2 = uv[5] - uv[1];
+    hit.texU = uv[0] + b1 * du1 + b2 * du2;
+    hit.texV = uv[1] + b1 * dv1 + b2 * dv2;
+
+    // Solve e1 = dpdu du1 + dpdv dv1, e2 = dpdu du2 + dpdv dv2
+    float det = du1 * dv2 - dv1 * du2;
+    if (std::fabs(det) > 1e-12f) {
+        QVector3D e1(bt.e1[0], bt.e1[1], bt.e1[2]), e2(bt.e2[0], bt.e2[1], bt.e2[2]);
+        QVector3D dpdu = (e1 * dv2 - e2 * dv1) / det, dpdv = (e2 * du1 - e1 * du2) / det;
+        if (t->moved) {
+            dpdu = t->motion.mapVector(dpdu);
+            dpdv = t->motion.mapVector(dpdv);
+        }
+        hit.dpdu = Vector(dpdu.x(), dpdu.y(), dpdu.z());
+        hit.dpdv = Vector(dpdv.x(), dpdv.y(), dpdv.z());
     }
+    return true;
+}
+
+bool scene::occluded(const Ray &ray, double maxSquaredDistance) const {
+    BvhRay worldRay = to_bvh_ray(ray);
+    Vector d = ray.to_vector();
+    double len2 = d * d;
+    if (len2 <= 0)
+        return false;
+    float tMax = static_cast<float>(std::min(1e30, std::sqrt(maxSquaredDistance / len2)));
+
+    return instanceBvh.traverse(worldRay, tMax, [&](int i, float &tClosest) {
+        return instance_occluded(i, worldRay, tClosest);
+    });
+}
+
+int scene::occluded(const Ray *rays, const double *maxSquaredDistances, int count, unsigned char *blocked) const {
+    // Rays of one query leave from the same point toward nearby targets, so
+    // whatever blocked the last one is likely to block the next: it is tried
+    // before the traversal starts
+    int lastBlocker = -1;
+    int blockedCount = 0;
+    for (int r = 0; r < count; r++) {
+        blocked[r] = 0;
+        BvhRay worldRay = to_bvh_ray(rays[r]);
+        Vector d = rays[r].to_vector();
+        double len2 = d * d;
+        if (len2 <= 0)
+            continue;
+        float tMax = static_cast<float>(std::min(1e30, std::sqrt(maxSquaredDistances[r] / len2)));
+
+        float tCached = tMax;
+        bool hit = lastBlocker >= 0 && instance_occluded(lastBlocker, worldRay, tCached);
+        if (!hit) {
+            hit = instanceBvh.traverse(worldRay, tMax, [&](int i, float &tClosest) {
+                if (i == lastBlocker || !instance_occluded(i, worldRay, tClosest))
+                    return false;
+                lastBlocker = i;
+                return true;
+            });
+        }
+        blocked[r] = hit ? 1 : 0;
+        blockedCount += hit ? 1 : 0;
+    }
+    return blockedCount;
+}
 
+bool scene::instance_occluded(int objectId, const BvhRay &worldRay, float &tMax) const {
+    RT_STAT_INC(STAT_OBJECT_TESTS);
+    const TreeandTri *t = aabbTrees[objectId];
+    return t->moved ? t->mesh.occluded(to_object_space(worldRay, t), tMax)
+        : t->mesh.occluded(worldRay, tMax);
 }
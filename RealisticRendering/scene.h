@@ -1,9 +1,12 @@
 #pragma once
 #include "object.h"
+#include "bvh.h"
+#include "lightbvh.h"
 #include <vector>
 #include <map>
 
 #include <QMatrix4x4>
+#include <QString>
 
 #include <CGAL/Simple_cartesian.h>
 #include <CGAL/AABB_tree.h>
@@ -35,7 +38,30 @@ typedef boost::optional< Tree::Intersection_and_primitive_id<Ray>::Type > Ray_in
 
 struct TreeandTri {
     std::vector<Triangle> triangles;
-    Tree tree;
+    Tree tree;                  // distance queries only, built on first use
+    bool treeBuilt;
+    MeshBvh mesh;               // ray queries
+    std::vector<float> texCoords;   // u, v at the three corners of every face
+    QMatrix4x4 motion;          // rigid motion on top of the baked vertices
+    QMatrix4x4 inverseMotion;
+    bool moved;                 // motion is not the identity
+
+    TreeandTri() : treeBuilt(false), moved(false) {}
+};
+
+// Closest intersection of a ray with the scene
+struct SceneHit {
+    object *hitObject;
+    int objectId;           // index into scene::objects / scene::aabbTrees
+    int faceId;             // index into the object's triangle list
+    Point point;
+    Vector normal;          // unit geometric normal, not flipped toward the ray
+    double squaredDistance; // from the ray origin
+    float texU, texV;       // interpolated texture coordinates
+    Vector dpdu, dpdv;      // change of the world position along u and v, zero if the face has no mapping
+
+    SceneHit() : hitObject(nullptr), objectId(-1), faceId(-1), squaredDistance(0), texU(0), texV(0),
+        dpdu(0, 0, 0), dpdv(0, 0, 0) {}
 };
 
 
@@ -44,12 +70,60 @@ public:
     std::vector<object*> objects;
     std::map<object*, QMatrix4x4> transMatrices;
     std::vector<TreeandTri*> aabbTrees;
+    Bvh instanceBvh;                    // top level, over the objects' world bounds
+    std::vector<BvhBox> instanceBounds;
+    BvhSettings bvhSettings;            // for the per-object trees
+    QString bvhCacheDir;                // BVH snapshots are loaded from and saved here; empty to always build
+    std::vector<Light> lights;          // from the scene file; when empty the tracers use the light they are given
+    LightBvh lightBvh;                  // over lights, see build_light_bvh()
 
 public:
-    scene() {}
+    scene() : geometryVersion(0) {}
     ~scene();
     
     void clear_all();
     int read_scene_file(std::string fileName);
+    // Loads an obj file, scales it to 'size' (if positive) and bakes 'trans'
+    // into its vertices. Call build_aabb_trees() once all objects are added.
+    object *add_object(std::string fileName, float size, const QMatrix4x4 &trans);
+    // Every object is glass except the last one (the floor), which is diffuse
+    void assign_default_materials();
+    // Gives every object's material this texture, like the raster path's
+    // texture unit; null removes it
+    void set_diffuse_texture(std::shared_ptr<const MipTexture> texture);
     void build_aabb_trees();
+    // Call after changing lights
+    void build_light_bvh();
+
+    // Moves an object rigidly; 'motion' replaces the previous one and is
+    // relative to the placement the object was loaded with. Only the top
+    // level bounds are refit, so this is cheap enough for every frame.
+    void set_object_motion(int objectId, const QMatrix4x4 &motion);
+    // Call after changing the vertex positions of objects[objectId].
+    // Refits the object's BVH and rebuilds it only if its SAH cost has
+    // grown past BvhSettings::rebuildRatio of the cost at build time.
+    void update_object_geometry(int objectId);
+    // Changes whenever something above moves or replaces geometry, so that
+    // results cached per ray (e.g. a PrimaryHitCache) can tell they are stale
+    unsigned geometry_version() const { return geometryVersion; }
+
+    // Squared distance from p to the closest surface (e.g. for collisions)
+    double squared_distance(const Point &p);
+
+    // Safe to call from several threads once the trees are built
+    bool intersect(const Ray &ray, SceneHit &hit) const;
+    // Fills hit (all but squaredDistance) for point p on face faceId of
+    // objects[objectId], as intersect() would; false if there is no such face
+    bool surface_at(int objectId, int faceId, const Point &p, SceneHit &hit) const;
+    // True if anything is hit closer than sqrt(maxSquaredDistance)
+    bool occluded(const Ray &ray, double maxSquaredDistance) const;
+    // Shadow rays from one point as a single query, e.g. toward the samples
+    // of an area light: blocked[i] is set to whether rays[i] is occluded
+    // within sqrt(maxSquaredDistances[i]). Returns how many are.
+    int occluded(const Ray *rays, const double *maxSquaredDistances, int count, unsigned char *blocked) const;
+
+private:
+    unsigned geometryVersion;
+
+    bool instance_occluded(int objectId, const BvhRay &worldRay, float &tMax) const;
 };
\ No newline at end of file
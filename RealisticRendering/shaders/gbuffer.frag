@@ -0,0 +1,10 @@
+#version 440
+
+in vec3 worldPosition;
+
+layout(location = 0) out vec4 gBuffer;
+
+// World position and primitive index + 1; the clear color 0 marks background
+void main() {
+  gBuffer = vec4(worldPosition, float(gl_PrimitiveID + 1));
+}
\ No newline at end of file
@@ -0,0 +1,15 @@
+#version 440
+layout(location = 0) in vec3 position;
+
+uniform mat4 modelMat;
+uniform mat4 viewMat;
+uniform mat4 projection;
+
+out vec3 worldPosition;
+
+// No displacement: the G-buffer has to match the ray tracer's geometry
+void main() {
+  vec4 world = modelMat * vec4(position, 1.0);
+  worldPosition = world.xyz;
+  gl_Position = projection * viewMat * world;
+}
\ No newline at end of file
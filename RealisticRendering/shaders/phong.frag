@@ -20,9 +20,13 @@ in vec3 eyeNorm;
 in vec4 eyePosition;
 in vec4 shadowCoord;
 in vec2 texC;
+in float ambientOcclusion;  // baked, 1 where nothing blocks the sky
+in vec2 lightmapC;
 
 uniform sampler2D texUnit;
 uniform sampler2D shadowUnit;
+uniform sampler2D lightmapUnit;
+uniform bool useLightmap;   // static lighting is baked; no shadow map was rendered
 
 float unpack(vec4 colour) {
   const vec4 bitShifts = vec4(1.0 / (256.0 * 256.0 * 256.0),
@@ -63,7 +67,13 @@ vec3 phongModel(vec4 pos, vec3 norm, vec4 shadowC) {
 
   vec3 texColor = vec3(texture2D(texUnit, texC));
   vec3 diffColor = diffuse * texColor;
-  vec3 ambColor = ambient * texColor;
+  vec3 ambColor = ambient * texColor * ambientOcclusion;
+
+  if (useLightmap) {
+    // rgb: direct (with shadows and N.L) plus indirect light, a: light visibility
+    vec4 baked = texture2D(lightmapUnit, lightmapC);
+    return ambColor + material.Kd * texColor * baked.rgb + spec * baked.a;
+  }
   
   float shadow = 1.0;
   if (shadowC.w > 0.0) {
@@ -2,11 +2,15 @@
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 normal;
 layout(location = 2) in vec3 texCoord;
+layout(location = 3) in float occlusion;
+layout(location = 4) in vec2 lightmapCoord;
 
 out vec3 eyeNorm;
 out vec4 eyePosition;
 out vec4 shadowCoord;
 out vec2 texC;
+out float ambientOcclusion;
+out vec2 lightmapC;
 
 uniform sampler2D dispUnit;
 
@@ -25,6 +29,8 @@ void main()
 {
   getEyeSpace(eyeNorm, eyePosition);
   texC = vec2(texCoord);
+  ambientOcclusion = occlusion;
+  lightmapC = lightmapCoord;
   shadowCoord = lightViewProjMat * modelMat * vec4(position, 1.0);
   vec4 disp = texture2D(dispUnit, texC);
   disp = normalize(disp * 2.0 - 1.0);
@@ -0,0 +1,640 @@
+#pragma once
+
+#include "scene.h"
+#include "light.h"
+#include "raycamera.h"
+#include "framebuffer.h"
+#include "raystats.h"
+#include "mipmap.h"
+#include "photonmap.h"
+#include "simdshading.h"
+#include "lightbvh.h"
+#include "arealight.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Shading kernels of the Whitted tracer.
+//
+// RayTracer traces rays in wavefronts: every ray of a batch is intersected
+// first, the hits are grouped by material type, and each group runs through
+// one kernel instantiated for that material and for the light type of the
+// frame. Inside a kernel both are compile-time constants, so nothing is
+// decided per hit that could be decided per batch, and work a material does
+// not need (texture footprints on glass, Fresnel terms on mirrors, shadow
+// rays for surfaces facing away from the light) is never done.
+//
+// The diffuse and glass kernels get their Phong and Fresnel terms for the
+// whole group at once from simdshading.h; only texturing, shadow rays and
+// spawning stay per hit.
+//
+// A new material type needs a MaterialKernel specialization and an entry in
+// ShadedMaterials; nothing else looks at material.Type.
+namespace shading {
+
+const float bias = 1e-4f;
+
+// The secondary rays of a hit
+enum RayBranch {
+    REFLECTED_RAY,
+    REFRACTED_RAY
+};
+
+// One ray of a wavefront
+struct ShadeRay {
+    Ray ray;
+    QVector3D weight;       // share of the ray's radiance in its pixel
+    int pixel;              // index into ShadeContext::color
+    int depth;
+    unsigned path;          // in the pixel's ray tree: 1 for the camera ray, 2 * path + RayBranch for a child
+    bool hasDiff;
+    RayDifferential diff;
+
+    ShadeRay() : weight(1, 1, 1), pixel(0), depth(0), path(1), hasDiff(false) {}
+};
+
+struct ShadeScratch;
+
+// Shared by every kernel call of one batch
+struct ShadeContext {
+    const scene *pScene;
+    const PhotonMap *caustics;      // null without caustics
+    const Light *light;             // the frame's light, unless there is a light list
+    const LightBvh *lights;         // the scene's light list, or null
+    int lightSamples;               // lights picked per diffuse hit from the list
+    int areaStrata;                 // area lights take areaStrata^2 stratified samples...
+    int testStrata;                 // ...of which testStrata^2 are tested for shadow first
+    int x0, y;                      // image position of pixel 0
+    unsigned pass;                  // seeds the light picks along with x0 and y
+    int maxDepth;                   // deepest level still traced
+    QVector3D *color;               // radiance per pixel of the batch
+    PixelAov *aov;                  // per pixel, filled by the primary hits; may be null
+    std::vector<ShadeRay> *next;    // receives the secondary rays
+    ShadeScratch *scratch;          // owned by the batch, reused by every group
+};
+
+// Buffers for the vectorized terms of one material group
+struct ShadeScratch {
+    std::vector<int> order;         // rays of the group that get the terms
+    HitBatch batch;
+    ShadeMaterials materials;
+    PhongTerms phong;
+    FresnelTerms fresnel;
+
+    // Area light samples of one hit
+    std::vector<QVector3D> lightTerms;      // unshadowed, zero for samples that need no shadow ray
+    std::vector<Ray> sampleRays;
+    std::vector<double> sampleDistances;
+    std::vector<unsigned char> traced;      // sample already has a shadow ray
+    std::vector<int> shadowSample;          // sample of every queued shadow ray
+    std::vector<Ray> shadowRays;            // the queued rays, for scene::occluded
+    std::vector<double> shadowDistances;
+    std::vector<unsigned char> blocked;
+};
+
+inline Vector normalize(const Vector &v) {
+    float mag2 = v.x() * v.x() + v.y() * v.y() + v.z() * v.z();
+    if (mag2 > 0) {
+        float invMag = 1 / sqrtf(mag2);
+        return Vector(v.x() * invMag, v.y() * invMag, v.z() * invMag);
+    }
+    return v;
+}
+
+inline Vector reflect(const Vector &I, const Vector &N) {
+    return I - 2 * (I * N) * N;
+}
+
+// Refraction of I through a surface with normal N (either side), or the
+// zero vector on total internal reflection
+inline Vector refract(const Vector &I, const Vector &N, float ior) {
+    float cosi = std::max(-1.f, std::min(1.f, static_cast<float>(I * N)));
+    float etai = 1, etat = ior;
+    Vector n = N;
+    if (cosi < 0) {
+        cosi = -cosi;
+    }
+    else {
+        std::swap(etai, etat);
+        n = -N;
+    }
+
+    float eta = etai / etat;
+    float k = 1 - eta * eta * (1 - cosi * cosi);
+    if (k < 0)
+        return Vector(0, 0, 0);
+    return eta * I + (eta * cosi - sqrtf(k)) * n;
+}
+
+// Fraction of light reflected for unpolarized light
+inline float fresnel(const Vector &I, const Vector &N, float ior) {
+    float cosi = std::max(-1.f, std::min(1.f, static_cast<float>(I * N)));
+    float etai = 1, etat = ior;
+    if (cosi > 0)
+        std::swap(etai, etat);
+    // Compute sini using Snell's law
+    float sint = etai / etat * sqrtf(std::max(0.f, 1 - cosi * cosi));
+    // Total internal reflection
+    if (sint >= 1)
+        return 1;
+
+    float cost = sqrtf(std::max(0.f, 1 - sint * sint));
+    cosi = fabsf(cosi);
+    float Rs = ((etat * cosi) - (etai * cost)) / ((etat * cosi) + (etai * cost));
+    float Rp = ((etai * cosi) - (etat * cost)) / ((etai * cosi) + (etat * cost));
+    return (Rs * Rs + Rp * Rp) / 2;
+}
+
+// Offset from p to where the ray (o, d) meets the plane through p with normal n
+inline bool plane_offset(const Point &o, const Vector &d, const Point &p, const Vector &n, Vector &offset) {
+    double dn = d * n;
+    if (std::fabs(dn) < 1e-12)
+        return false;
+    double t = ((p - o) * n) / dn;
+    offset = (o + t * d) - p;
+    return true;
+}
+
+// Footprint of the pixel on the surface, from where the offset rays meet
+// the hit's plane
+struct Footprint {
+    Vector dpdx, dpdy;
+    bool valid;
+
+    Footprint(const ShadeRay &r, const SceneHit &hit) : dpdx(0, 0, 0), dpdy(0, 0, 0) {
+        valid = r.hasDiff
+            && plane_offset(r.diff.rxOrigin, r.diff.rxDirection, hit.point, hit.normal, dpdx)
+            && plane_offset(r.diff.ryOrigin, r.diff.ryDirection, hit.point, hit.normal, dpdy);
+    }
+};
+
+// Texture space footprint of a pixel, from the world space one: least
+// squares solution of dp = dpdu du + dpdv dv
+inline void texture_derivatives(const SceneHit &hit, const Footprint &fp,
+    float &dudx, float &dvdx, float &dudy, float &dvdy) {
+    double a00 = hit.dpdu * hit.dpdu, a01 = hit.dpdu * hit.dpdv, a11 = hit.dpdv * hit.dpdv;
+    double det = a00 * a11 - a01 * a01;
+    if (!fp.valid || std::fabs(det) < 1e-20) {
+        dudx = dvdx = dudy = dvdy = 0;
+        return;
+    }
+    double bx0 = hit.dpdu * fp.dpdx, bx1 = hit.dpdv * fp.dpdx;
+    double by0 = hit.dpdu * fp.dpdy, by1 = hit.dpdv * fp.dpdy;
+    dudx = static_cast<float>((a11 * bx0 - a01 * bx1) / det);
+    dvdx = static_cast<float>((a00 * bx1 - a01 * bx0) / det);
+    dudy = static_cast<float>((a11 * by0 - a01 * by1) / det);
+    dvdy = static_cast<float>((a00 * by1 - a01 * by0) / det);
+}
+
+// Offset rays of a mirror or glass bounce: they leave from the footprint
+// corners and bend at the same flat face as the main ray
+inline bool bounce_differential(const ShadeRay &r, const SceneHit &hit, const Footprint &fp,
+    bool refracted, float ior, RayDifferential &out) {
+    if (!fp.valid)
+        return false;
+    out.rxOrigin = hit.point + fp.dpdx;
+    out.ryOrigin = hit.point + fp.dpdy;
+    Vector rx = normalize(r.diff.rxDirection), ry = normalize(r.diff.ryDirection);
+    out.rxDirection = refracted ? refract(rx, hit.normal, ior) : reflect(rx, hit.normal);
+    out.ryDirection = refracted ? refract(ry, hit.normal, ior) : reflect(ry, hit.normal);
+    // Total internal reflection of an offset ray
+    return out.rxDirection * out.rxDirection > 0 && out.ryDirection * out.ryDirection > 0;
+}
+
+inline void write_aov(const ShadeContext &ctx, const ShadeRay &r, const SceneHit &hit, const QVector3D &albedo) {
+    if (r.depth != 0 || ctx.aov == nullptr)
+        return;
+    PixelAov &aov = ctx.aov[r.pixel];
+    aov.albedo = albedo;
+    aov.normal = QVector3D(hit.normal.x(), hit.normal.y(), hit.normal.z());
+    aov.depth = sqrtf(hit.squaredDistance);
+}
+
+// Queues a secondary ray, unless it would not be traced or cannot add anything
+inline void spawn(const ShadeContext &ctx, const ShadeRay &parent, RayBranch branch, int counter, const Point &origin,
+    const Vector &dir, float weight, const RayDifferential *diff) {
+    if (weight <= 0 || dir * dir == 0)
+        return;
+    RT_STAT_INC(counter);
+    (void)counter;
+    ShadeRay r;
+    r.ray = Ray(origin, dir);
+    r.weight = parent.weight * weight;
+    r.pixel = parent.pixel;
+    r.depth = parent.depth + 1;
+    r.path = 2 * parent.path + branch;
+    r.hasDiff = diff != nullptr;
+    if (diff != nullptr)
+        r.diff = *diff;
+    ctx.next->push_back(r);
+}
+
+// Fills scratch.batch with the hits of scratch.order. Consecutive hits on
+// the same material share a table entry.
+inline void gather_hits(ShadeScratch &scratch, const ShadeRay *rays, const SceneHit *hits) {
+    int count = static_cast<int>(scratch.order.size());
+    scratch.batch.resize(count);
+    scratch.materials.clear();
+    const Material *last = nullptr;
+    for (int i = 0; i < count; i++) {
+        const ShadeRay &r = rays[scratch.order[i]];
+        const SceneHit &hit = hits[scratch.order[i]];
+        const Material &material = hit.hitObject->material;
+        if (&material != last) {
+            scratch.materials.add(material.Kd, material.Ks, material.Shininess, material.ior);
+            last = &material;
+        }
+        Vector d = normalize(r.ray.to_vector());
+        const float p[3] = { static_cast<float>(hit.point.x()), static_cast<float>(hit.point.y()),
+            static_cast<float>(hit.point.z()) };
+        const float n[3] = { static_cast<float>(hit.normal.x()), static_cast<float>(hit.normal.y()),
+            static_cast<float>(hit.normal.z()) };
+        const float dir[3] = { static_cast<float>(d.x()), static_cast<float>(d.y()), static_cast<float>(d.z()) };
+        scratch.batch.set(i, p, n, dir, static_cast<int>(scratch.materials.Kd.size()) - 1);
+    }
+}
+
+// Where a light comes from, per light type
+template <int LightType>
+struct LightModel;
+
+template <>
+struct LightModel<POINT_LIGHT> {
+    // Unit direction from p toward the light, and the squared distance a
+    // shadow ray has to clear
+    static Vector toward(const Light &light, const Point &p, double &maxSquaredDistance) {
+        Point lightCoord(light.Position.x(), light.Position.y(), light.Position.z());
+        Vector lightDir = lightCoord - p;
+        maxSquaredDistance = lightDir * lightDir;
+        return normalize(lightDir);
+    }
+};
+
+template <>
+struct LightModel<DIRECTIONAL_LIGHT> {
+    static Vector toward(const Light &light, const Point &, double &maxSquaredDistance) {
+        maxSquaredDistance = 1e30;
+        return normalize(-Vector(light.Direction.x(), light.Direction.y(), light.Direction.z()));
+    }
+};
+
+// Either light type, decided at run time
+inline Vector toward_light(const Light &light, const Point &p, double &maxSquaredDistance) {
+    if (light.Type == DIRECTIONAL_LIGHT)
+        return LightModel<DIRECTIONAL_LIGHT>::toward(light, p, maxSquaredDistance);
+    return LightModel<POINT_LIGHT>::toward(light, p, maxSquaredDistance);
+}
+
+// shade_group<LightType>(ctx, rays, hits, order, count) adds the contribution
+// of every ray in order to its pixel and spawns their secondary rays
+template <int MaterialType>
+struct MaterialKernel;
+
+// Phong shading with a hard shadow; the end of every path.
+// With a light list every hit picks ctx.lightSamples lights from the light
+// BVH, or takes all of them if there are no more, and casts shadow rays only
+// toward those.
+//
+// Area lights give soft shadows from stratified samples. A few samples
+// spread over the light are tested first; if they all agree, the hit is
+// taken to be fully lit or fully shadowed and the other samples need no
+// shadow rays, so only penumbrae pay for all of them.
+template <>
+struct MaterialKernel<DIFFUSE_AND_GLOSSY> {
+    template <int LightType>
+    static void shade_group(const ShadeContext &ctx, const ShadeRay *rays, const SceneHit *hits,
+        const int *order, int count) {
+        if (ctx.lights != nullptr || is_area_light(*ctx.light)) {
+            for (int i = 0; i < count; i++)
+                shade_sampled(ctx, rays[order[i]], hits[order[i]]);
+            return;
+        }
+
+        ShadeScratch &scratch = *ctx.scratch;
+        scratch.order.assign(order, order + count);
+        gather_hits(scratch, rays, hits);
+        shade_phong<LightType>(scratch.batch, scratch.materials, *ctx.light, scratch.phong);
+        for (int i = 0; i < count; i++)
+            shade(ctx, rays[order[i]], hits[order[i]], scratch.phong, i);
+    }
+
+private:
+    static QVector3D diffuse_color(const ShadeContext &ctx, const ShadeRay &r, const SceneHit &hit) {
+        const Material &material = hit.hitObject->material;
+        QVector3D diffColor = material.diffColor;
+        if (material.diffTexture) {
+            float dudx, dvdx, dudy, dvdy;
+            texture_derivatives(hit, Footprint(r, hit), dudx, dvdx, dudy, dvdy);
+            diffColor *= material.diffTexture->sample(hit.texU, hit.texV, dudx, dvdx, dudy, dvdy);
+        }
+        write_aov(ctx, r, hit, diffColor);
+        return diffColor;
+    }
+
+    static QVector3D caustics(const ShadeContext &ctx, const SceneHit &hit, const Vector &rayDir,
+        const QVector3D &diffColor) {
+        if (ctx.caustics == nullptr)
+            return QVector3D(0, 0, 0);
+        const Vector &n = hit.normal;
+        Vector facing = (rayDir * n) < 0 ? n : -n;
+        return diffColor * hit.hitObject->material.Kd * ctx.caustics->irradiance(hit.point, facing);
+    }
+
+    static void shade(const ShadeContext &ctx, const ShadeRay &r, const SceneHit &hit,
+        const PhongTerms &terms, int i) {
+        Vector rayDir = normalize(r.ray.to_vector());
+        const Vector &n = hit.normal;
+        QVector3D diffColor = diffuse_color(ctx, r, hit);
+        float falloff = light_falloff(*ctx.light, terms.lightDistance2[i]);
+
+        // A surface facing away gets no diffuse light, shadowed or not
+        float diffuse = 0;
+        if (terms.diffuse[i] > 0) {
+            Vector lightDir(terms.lx[i], terms.ly[i], terms.lz[i]);
+            Point shadowCoord = (rayDir * n) < 0 ? hit.point + n * bias : hit.point - n * bias;
+            RT_STAT_INC(STAT_SHADOW_RAYS);
+            if (!ctx.pScene->occluded(Ray(shadowCoord, lightDir), terms.lightDistance2[i]))
+                diffuse = terms.diffuse[i];
+        }
+
+        QVector3D result = (diffColor * diffuse + QVector3D(1, 1, 1) * terms.specular[i]) * falloff;
+        result += caustics(ctx, hit, rayDir, diffColor);
+        ctx.color[r.pixel] += r.weight * result;
+    }
+
+    static void shade_sampled(const ShadeContext &ctx, const ShadeRay &r, const SceneHit &hit) {
+        Vector rayDir = normalize(r.ray.to_vector());
+        const Vector &n = hit.normal;
+        QVector3D diffColor = diffuse_color(ctx, r, hit);
+        Point shadowCoord = (rayDir * n) < 0 ? hit.point + n * bias : hit.point - n * bias;
+        // Keyed by the path, so that the reflection and refraction off the
+        // same hit pick their lights independently
+        Sampler sampler(RANDOM_SAMPLER, ctx.x0 + r.pixel, ctx.y, ctx.pass, r.path);
+
+        QVector3D result(0, 0, 0);
+        if (ctx.lights == nullptr) {
+            result = light_contribution(ctx, hit, *ctx.light, 1, rayDir, shadowCoord, diffColor, sampler);
+        }
+        else {
+            const LightBvh &lights = *ctx.lights;
+            const float p[3] = { static_cast<float>(hit.point.x()), static_cast<float>(hit.point.y()),
+                static_cast<float>(hit.point.z()) };
+            const float nf[3] = { static_cast<float>(n.x()), static_cast<float>(n.y()), static_cast<float>(n.z()) };
+            bool everyLight = lights.size() <= ctx.lightSamples;
+            int samples = everyLight ? lights.size() : ctx.lightSamples;
+            for (int s = 0; s < samples; s++) {
+                int index = s;
+                float weight = 1;
+                if (!everyLight) {
+                    float probability;
+                    index = lights.sample(p, nf, sampler.get_1d(), probability);
+                    if (index < 0)
+                        continue;
+                    weight = 1 / (probability * samples);
+                }
+                result += light_contribution(ctx, hit, lights.light(index), weight, rayDir, shadowCoord,
+                    diffColor, sampler);
+            }
+        }
+        result += caustics(ctx, hit, rayDir, diffColor);
+        ctx.color[r.pixel] += r.weight * result;
+    }
+
+    // Phong light from one light, times weight. Like in the original tracer
+    // the highlight of a point or directional light is not shadowed; an area
+    // light's is.
+    static QVector3D light_contribution(const ShadeContext &ctx, const SceneHit &hit, const Light &light,
+        float weight, const Vector &rayDir, const Point &shadowCoord, const QVector3D &diffColor, Sampler &sampler) {
+        if (is_area_light(light))
+            return area_light(ctx, hit, light, weight, rayDir, shadowCoord, diffColor, sampler);
+
+        const Material &material = hit.hitObject->material;
+        const Vector &n = hit.normal;
+        double lightSquareDistance;
+        Vector lightDir = toward_light(light, hit.point, lightSquareDistance);
+        float intensity = light.La * light_falloff(light, lightSquareDistance) * weight;
+        QVector3D result(0, 0, 0);
+        float LdotN = std::max(0.f, static_cast<float>(lightDir * n));
+        if (LdotN > 0) {
+            RT_STAT_INC(STAT_SHADOW_RAYS);
+            if (!ctx.pScene->occluded(Ray(shadowCoord, lightDir), lightSquareDistance))
+                result += diffColor * (intensity * LdotN * material.Kd);
+        }
+        Vector reflectDir = normalize(reflect(-lightDir, n));
+        float specular = powf(std::max(0.f, static_cast<float>(-(reflectDir * rayDir))), material.Shininess);
+        return result + QVector3D(1, 1, 1) * (specular * intensity * material.Ks);
+    }
+
+    static QVector3D area_light(const ShadeContext &ctx, const SceneHit &hit, const Light &light, float weight,
+        const Vector &rayDir, const Point &shadowCoord, const QVector3D &diffColor, Sampler &sampler) {
+        const Material &material = hit.hitObject->material;
+        const Vector &n = hit.normal;
+        ShadeScratch &scratch = *ctx.scratch;
+        int strata = std::max(1, ctx.areaStrata);
+        int count = strata * strata;
+        float scale = light.La * weight / count;
+
+        scratch.lightTerms.assign(count, QVector3D(0, 0, 0));
+        scratch.sampleRays.resize(count);
+        scratch.sampleDistances.resize(count);
+        scratch.traced.assign(count, 0);
+        for (int j = 0; j < strata; j++) {
+            for (int i = 0; i < strata; i++) {
+                float u1, u2;
+                sampler.get_2d(u1, u2);
+                AreaLightSample sample;
+                if (!sample_area_light(light, hit.point, (i + u1) / strata, (j + u2) / strata, sample))
+                    continue;
+                float LdotN = std::max(0.f, static_cast<float>(sample.direction * n));
+                Vector reflectDir = normalize(reflect(-sample.direction, n));
+                float specular = powf(std::max(0.f, static_cast<float>(-(reflectDir * rayDir))), material.Shininess);
+                int k = j * strata + i;
+                scratch.lightTerms[k] = (diffColor * (LdotN * material.Kd) + QVector3D(1, 1, 1) *
+                    (specular * material.Ks)) * (sample.weight * scale);
+                scratch.sampleRays[k] = Ray(shadowCoord, sample.direction);
+                scratch.sampleDistances[k] = sample.squaredDistance;
+            }
+        }
+
+        // Test samples sit in the middle of a coarse grid over the strata
+        int test = std::min(std::max(1, ctx.testStrata), strata);
+        scratch.shadowSample.clear();
+        for (int b = 0; b < test; b++) {
+            for (int a = 0; a < test; a++)
+                queue_shadow_ray(scratch, (2 * b + 1) * strata / (2 * test) * strata + (2 * a + 1) * strata / (2 * test));
+        }
+        int tests = static_cast<int>(scratch.shadowSample.size());
+        int visible = trace_shadow_rays(ctx, scratch);
+
+        QVector3D result(0, 0, 0);
+        if (tests > 0 && (visible == 0 || visible == tests)) {
+            // Fully lit or fully shadowed: the rest count as the tests did
+            if (visible == tests) {
+                for (int k = 0; k < count; k++)
+                    result += scratch.lightTerms[k];
+            }
+            return result;
+        }
+
+        // A penumbra, or no test sample lit: trace the rest as well
+        result += visible_light(scratch);
+        scratch.shadowSample.clear();
+        for (int k = 0; k < count; k++)
+            queue_shadow_ray(scratch, k);
+        trace_shadow_rays(ctx, scratch);
+        return result + visible_light(scratch);
+    }
+
+    static void queue_shadow_ray(ShadeScratch &scratch, int k) {
+        if (scratch.traced[k] || scratch.lightTerms[k].isNull())
+            return;
+        scratch.traced[k] = 1;
+        scratch.shadowSample.push_back(k);
+    }
+
+    // One batched occlusion query over the queued rays; returns how many
+    // reach the light
+    static int trace_shadow_rays(const ShadeContext &ctx, ShadeScratch &scratch) {
+        int n = static_cast<int>(scratch.shadowSample.size());
+        scratch.shadowRays.resize(n);
+        scratch.shadowDistances.resize(n);
+        scratch.blocked.resize(n);
+        for (int t = 0; t < n; t++) {
+            scratch.shadowRays[t] = scratch.sampleRays[scratch.shadowSample[t]];
+            scratch.shadowDistances[t] = scratch.sampleDistances[scratch.shadowSample[t]];
+        }
+        if (n == 0)
+            return 0;
+        RT_STAT_ADD(STAT_SHADOW_RAYS, n);
+        return n - ctx.pScene->occluded(scratch.shadowRays.data(), scratch.shadowDistances.data(), n,
+            scratch.blocked.data());
+    }
+
+    static QVector3D visible_light(const ShadeScratch &scratch) {
+        QVector3D result(0, 0, 0);
+        for (int t = 0; t < static_cast<int>(scratch.shadowSample.size()); t++) {
+            if (!scratch.blocked[t])
+                result += scratch.lightTerms[scratch.shadowSample[t]];
+        }
+        return result;
+    }
+};
+
+// Glass: a reflected and a refracted ray, weighted by the Fresnel term
+template <>
+struct MaterialKernel<REFLECTION_AND_REFRACTION> {
+    template <int LightType>
+    static void shade_group(const ShadeContext &ctx, const ShadeRay *rays, const SceneHit *hits,
+        const int *order, int count) {
+        ShadeScratch &scratch = *ctx.scratch;
+        scratch.order.clear();
+        for (int i = 0; i < count; i++) {
+            const ShadeRay &r = rays[order[i]];
+            write_aov(ctx, r, hits[order[i]], QVector3D(1, 1, 1));
+            if (r.depth < ctx.maxDepth)
+                scratch.order.push_back(order[i]);
+        }
+        if (scratch.order.empty())
+            return;
+
+        gather_hits(scratch, rays, hits);
+        shade_fresnel(scratch.batch, scratch.materials, scratch.fresnel);
+        for (int i = 0; i < static_cast<int>(scratch.order.size()); i++)
+            shade(ctx, rays[scratch.order[i]], hits[scratch.order[i]], scratch.fresnel, i);
+    }
+
+private:
+    static void shade(const ShadeContext &ctx, const ShadeRay &r, const SceneHit &hit,
+        const FresnelTerms &terms, int i) {
+        float ior = hit.hitObject->material.ior;
+        const Vector &n = hit.normal;
+        Footprint fp(r, hit);
+        float kr = terms.kr[i];
+
+        Vector reflectDir(terms.rx[i], terms.ry[i], terms.rz[i]);
+        Point reflectCoord = (reflectDir * n) < 0 ? hit.point - n * bias : hit.point + n * bias;
+        RayDifferential reflectDiff;
+        bool hasReflectDiff = bounce_differential(r, hit, fp, false, ior, reflectDiff);
+        spawn(ctx, r, REFLECTED_RAY, STAT_REFLECTION_RAYS, reflectCoord, reflectDir, kr,
+            hasReflectDiff ? &reflectDiff : nullptr);
+
+        // Nothing is transmitted on total internal reflection
+        if (kr < 1) {
+            Vector refractDir(terms.tx[i], terms.ty[i], terms.tz[i]);
+            Point refractCoord = (refractDir * n) < 0 ? hit.point - n * bias : hit.point + n * bias;
+            RayDifferential refractDiff;
+            bool hasRefractDiff = bounce_differential(r, hit, fp, true, ior, refractDiff);
+            spawn(ctx, r, REFRACTED_RAY, STAT_REFRACTION_RAYS, refractCoord, refractDir, 1 - kr,
+                hasRefractDiff ? &refractDiff : nullptr);
+        }
+    }
+};
+
+// Perfect mirror
+template <>
+struct MaterialKernel<REFLECTION> {
+    template <int LightType>
+    static void shade_group(const ShadeContext &ctx, const ShadeRay *rays, const SceneHit *hits,
+        const int *order, int count) {
+        for (int i = 0; i < count; i++)
+            shade(ctx, rays[order[i]], hits[order[i]]);
+    }
+
+private:
+    static void shade(const ShadeContext &ctx, const ShadeRay &r, const SceneHit &hit) {
+        write_aov(ctx, r, hit, QVector3D(1, 1, 1));
+        if (r.depth >= ctx.maxDepth)
+            return;
+
+        Vector rayDir = normalize(r.ray.to_vector());
+        const Vector &n = hit.normal;
+        Vector reflectDir = normalize(reflect(rayDir, n));
+        Point reflectCoord = (reflectDir * n) < 0 ? hit.point - n * bias : hit.point + n * bias;
+        RayDifferential reflectDiff;
+        bool hasReflectDiff = bounce_differential(r, hit, Footprint(r, hit), false,
+            hit.hitObject->material.ior, reflectDiff);
+        spawn(ctx, r, REFLECTED_RAY, STAT_REFLECTION_RAYS, reflectCoord, reflectDir, 1,
+            hasReflectDiff ? &reflectDiff : nullptr);
+    }
+};
+
+// Shades the hits of one material group; order lists their ray indices
+typedef void (*BatchKernel)(const ShadeContext &ctx, const ShadeRay *rays, const SceneHit *hits,
+    const int *order, int count);
+
+template <int MaterialType, int LightType>
+void shade_batch(const ShadeContext &ctx, const ShadeRay *rays, const SceneHit *hits, const int *order, int count) {
+    MaterialKernel<MaterialType>::template shade_group<LightType>(ctx, rays, hits, order, count);
+}
+
+template <int... Types>
+struct MaterialList {};
+
+// Every material type with a kernel
+typedef MaterialList<DIFFUSE_AND_GLOSSY, REFLECTION_AND_REFRACTION, REFLECTION> ShadedMaterials;
+
+// Material types are dispatched through a table of this size; anything
+// else is shaded as DIFFUSE_AND_GLOSSY
+const int materialSlots = 8;
+
+inline int material_slot(int type) {
+    return type >= 0 && type < materialSlots ? type : DIFFUSE_AND_GLOSSY;
+}
+
+// The batch kernels of every material for one light type
+template <int LightType>
+struct KernelTable {
+    BatchKernel kernels[materialSlots];
+
+    template <int... Types>
+    explicit KernelTable(MaterialList<Types...>) {
+        for (BatchKernel &k : kernels)
+            k = &shade_batch<DIFFUSE_AND_GLOSSY, LightType>;
+        int expand[] = { 0, (kernels[Types] = &shade_batch<Types, LightType>, 0)... };
+        (void)expand;
+    }
+};
+
+} // namespace shading
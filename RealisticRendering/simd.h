@@ -0,0 +1,220 @@
+#pragma once
+
+// Thin wrapper over the widest float vector the compiler targets.
+// AVX2 builds get 8 lanes, everything else on x64 gets SSE2 (4 lanes).
+// Only the handful of operations the CPU render stages need are provided.
+
+#include <cstdint>
+
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define SIMD_WIDTH 8
+#else
+#  include <emmintrin.h>
+#  define SIMD_WIDTH 4
+#endif
+
+#if defined(_MSC_VER)
+#  define SIMD_ALIGN __declspec(align(32))
+#else
+#  define SIMD_ALIGN __attribute__((aligned(32)))
+#endif
+
+namespace simd {
+
+#if SIMD_WIDTH == 8
+
+struct vfloat {
+    __m256 v;
+    vfloat() {}
+    vfloat(__m256 x) : v(x) {}
+    vfloat(float x) : v(_mm256_set1_ps(x)) {}
+};
+
+struct vint {
+    __m256i v;
+    vint() {}
+    vint(__m256i x) : v(x) {}
+    vint(int x) : v(_mm256_set1_epi32(x)) {}
+};
+
+inline vfloat load(const float *p) { return _mm256_loadu_ps(p); }
+inline void store(float *p, vfloat a) { _mm256_storeu_ps(p, a.v); }
+inline vint load(const int32_t *p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+inline void store(int32_t *p, vint a) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), a.v); }
+
+inline vfloat operator+(vfloat a, vfloat b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a, vfloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat operator*(vfloat a, vfloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat operator/(vfloat a, vfloat b) { return _mm256_div_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)); }
+inline vfloat min(vfloat a, vfloat b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat max(vfloat a, vfloat b) { return _mm256_max_ps(a.v, b.v); }
+inline vfloat sqrt(vfloat a) { return _mm256_sqrt_ps(a.v); }
+inline vfloat rsqrt(vfloat a) { return _mm256_rsqrt_ps(a.v); }
+inline vfloat floor(vfloat a) { return _mm256_floor_ps(a.v); }
+
+// Comparisons produce all-ones lanes usable with select()
+inline vfloat operator<(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline vfloat operator>(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+inline vfloat operator<=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline vfloat operator>=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+inline vfloat operator&(vfloat a, vfloat b) { return _mm256_and_ps(a.v, b.v); }
+inline vfloat operator|(vfloat a, vfloat b) { return _mm256_or_ps(a.v, b.v); }
+inline vfloat select(vfloat mask, vfloat a, vfloat b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+inline int movemask(vfloat a) { return _mm256_movemask_ps(a.v); }
+
+inline vint operator+(vint a, vint b) { return _mm256_add_epi32(a.v, b.v); }
+inline vint operator*(vint a, vint b) { return _mm256_mullo_epi32(a.v, b.v); }
+inline vint operator^(vint a, vint b) { return _mm256_xor_si256(a.v, b.v); }
+inline vint operator&(vint a, vint b) { return _mm256_and_si256(a.v, b.v); }
+inline vint operator|(vint a, vint b) { return _mm256_or_si256(a.v, b.v); }
+inline vint shl(vint a, int n) { return _mm256_sll_epi32(a.v, _mm_cvtsi32_si128(n)); }
+inline vint shr(vint a, int n) { return _mm256_srl_epi32(a.v, _mm_cvtsi32_si128(n)); }
+inline vfloat to_float(vint a) { return _mm256_cvtepi32_ps(a.v); }
+inline vint to_int(vfloat a) { return _mm256_cvttps_epi32(a.v); }
+inline vfloat as_float(vint a) { return _mm256_castsi256_ps(a.v); }
+inline vint as_int(vfloat a) { return _mm256_castps_si256(a.v); }
+inline vfloat gather(const float *base, vint index) { return _mm256_i32gather_ps(base, index.v, 4); }
+
+#else
+
+struct vfloat {
+    __m128 v;
+    vfloat() {}
+    vfloat(__m128 x) : v(x) {}
+    vfloat(float x) : v(_mm_set1_ps(x)) {}
+};
+
+struct vint {
+    __m128i v;
+    vint() {}
+    vint(__m128i x) : v(x) {}
+    vint(int x) : v(_mm_set1_epi32(x)) {}
+};
+
+inline vfloat load(const float *p) { return _mm_loadu_ps(p); }
+inline void store(float *p, vfloat a) { _mm_storeu_ps(p, a.v); }
+inline vint load(const int32_t *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+inline void store(int32_t *p, vint a) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), a.v); }
+
+inline vfloat operator+(vfloat a, vfloat b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a, vfloat b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat operator*(vfloat a, vfloat b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat operator/(vfloat a, vfloat b) { return _mm_div_ps(a.v, b.v); }
+inline vfloat operator-(vfloat a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)); }
+inline vfloat min(vfloat a, vfloat b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat max(vfloat a, vfloat b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat sqrt(vfloat a) { return _mm_sqrt_ps(a.v); }
+inline vfloat rsqrt(vfloat a) { return _mm_rsqrt_ps(a.v); }
+
+inline vfloat operator<(vfloat a, vfloat b) { return _mm_cmplt_ps(a.v, b.v); }
+inline vfloat operator>(vfloat a, vfloat b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline vfloat operator<=(vfloat a, vfloat b) { return _mm_cmple_ps(a.v, b.v); }
+inline vfloat operator>=(vfloat a, vfloat b) { return _mm_cmpge_ps(a.v, b.v); }
+inline vfloat operator&(vfloat a, vfloat b) { return _mm_and_ps(a.v, b.v); }
+inline vfloat operator|(vfloat a, vfloat b) { return _mm_or_ps(a.v, b.v); }
+inline vfloat select(vfloat mask, vfloat a, vfloat b) {
+    return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+}
+inline int movemask(vfloat a) { return _mm_movemask_ps(a.v); }
+
+inline vint operator+(vint a, vint b) { return _mm_add_epi32(a.v, b.v); }
+inline vint operator*(vint a, vint b) {
+    // SSE2 has no 32-bit mullo; multiply even and odd lanes separately
+    __m128i even = _mm_mul_epu32(a.v, b.v);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a.v, 32), _mm_srli_epi64(b.v, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+        _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+inline vint operator^(vint a, vint b) { return _mm_xor_si128(a.v, b.v); }
+inline vint operator&(vint a, vint b) { return _mm_and_si128(a.v, b.v); }
+inline vint operator|(vint a, vint b) { return _mm_or_si128(a.v, b.v); }
+inline vint shl(vint a, int n) { return _mm_sll_epi32(a.v, _mm_cvtsi32_si128(n)); }
+inline vint shr(vint a, int n) { return _mm_srl_epi32(a.v, _mm_cvtsi32_si128(n)); }
+inline vfloat to_float(vint a) { return _mm_cvtepi32_ps(a.v); }
+inline vint to_int(vfloat a) { return _mm_cvttps_epi32(a.v); }
+inline vfloat as_float(vint a) { return _mm_castsi128_ps(a.v); }
+inline vint as_int(vfloat a) { return _mm_castps_si128(a.v); }
+inline vfloat gather(const float *base, vint index) {
+    SIMD_ALIGN int32_t i[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(i), index.v);
+    return _mm_setr_ps(base[i[0]], base[i[1]], base[i[2]], base[i[3]]);
+}
+
+inline vfloat floor(vfloat a) {
+    // Truncate, then step down where truncation rounded up (negative inputs)
+    vfloat t = to_float(to_int(a));
+    return t - (select(t > a, vfloat(1.0f), vfloat(0.0f)));
+}
+
+#endif
+
+inline vfloat& operator+=(vfloat &a, vfloat b) { a = a + b; return a; }
+inline vfloat& operator-=(vfloat &a, vfloat b) { a = a - b; return a; }
+inline vfloat& operator*=(vfloat &a, vfloat b) { a = a * b; return a; }
+
+inline vfloat clamp(vfloat x, vfloat lo, vfloat hi) { return min(max(x, lo), hi); }
+inline vfloat madd(vfloat a, vfloat b, vfloat c) { return a * b + c; }
+inline vfloat abs(vfloat a) { return as_float(as_int(a) & vint(0x7fffffff)); }
+
+// exp(x) to ~1e-5 relative error for x in [-87, 0], which covers all the
+// Gaussian-style weights the filters compute. Below that it returns 0, where
+// expf would only have denormals left.
+inline vfloat fast_exp(vfloat x) {
+    vfloat underflow = x < vfloat(-87.0f);
+    x = max(x, vfloat(-87.0f));
+    // exp(x) = 2^(x * log2(e)) = 2^i * 2^f with f in [-0.5, 0.5]
+    vfloat t = x * vfloat(1.442695041f);
+    vfloat i = floor(t + vfloat(0.5f));
+    vfloat f = t - i;
+    // Taylor series of 2^f, plenty on half the unit interval
+    vfloat p = vfloat(1.3333558e-3f);
+    p = madd(p, f, vfloat(9.6181291e-3f));
+    p = madd(p, f, vfloat(5.5504109e-2f));
+    p = madd(p, f, vfloat(2.4022651e-1f));
+    p = madd(p, f, vfloat(6.9314718e-1f));
+    p = madd(p, f, vfloat(1.0f));
+    vint e = shl(to_int(i) + vint(127), 23);
+    return select(underflow, vfloat(0.0f), p * as_float(e));
+}
+
+// Natural logarithm of positive, normal x to about one float ulp
+// (polynomial from Cephes logf)
+inline vfloat fast_log(vfloat x) {
+    // x = m * 2^e with m in [sqrt(1/2), sqrt(2))
+    vint bits = as_int(x);
+    vfloat e = to_float(shr(bits, 23) + vint(-127));
+    vfloat m = as_float((bits & vint(0x007fffff)) | vint(0x3f800000));
+    vfloat big = m > vfloat(1.41421356f);
+    m = select(big, m * vfloat(0.5f), m);
+    e = e + select(big, vfloat(1.0f), vfloat(0.0f));
+
+    vfloat t = m - vfloat(1.0f);
+    vfloat z = t * t;
+    vfloat p = vfloat(7.0376836292e-2f);
+    p = madd(p, t, vfloat(-1.1514610310e-1f));
+    p = madd(p, t, vfloat(1.1676998740e-1f));
+    p = madd(p, t, vfloat(-1.2420140846e-1f));
+    p = madd(p, t, vfloat(1.4249322787e-1f));
+    p = madd(p, t, vfloat(-1.6668057665e-1f));
+    p = madd(p, t, vfloat(2.0000714765e-1f));
+    p = madd(p, t, vfloat(-2.4999993993e-1f));
+    p = madd(p, t, vfloat(3.3333331174e-1f));
+    vfloat y = t * z * p - vfloat(0.5f) * z;
+    return t + y + e * vfloat(0.693147181f);
+}
+
+// x^e for x in [0, 1] and e >= 0, such as a Phong lobe raised to its
+// shininess. About 1e-5 relative error; results below exp(-87), about
+// 1.6e-38, flush to 0 like in fast_exp().
+inline vfloat fast_pow(vfloat x, vfloat e) {
+    x = min(x, vfloat(1.0f));
+    vfloat positive = x > vfloat(1e-30f);
+    vfloat r = fast_exp(e * fast_log(select(positive, x, vfloat(1.0f))));
+    // pow(0, 0) is 1, like powf
+    vfloat zero = select(e > vfloat(0.0f), vfloat(0.0f), vfloat(1.0f));
+    return select(positive, r, zero);
+}
+
+} // namespace simd
@@ -0,0 +1,268 @@
+#include "simdshading.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace simd;
+
+namespace {
+
+int padded(int n) {
+    return (n + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+}
+
+void resize_all(std::vector<float> *arrays[], int count, int n) {
+    for (int i = 0; i < count; i++)
+        arrays[i]->resize(n);
+}
+
+vfloat dot(vfloat ax, vfloat ay, vfloat az, vfloat bx, vfloat by, vfloat bz) {
+    return ax * bx + ay * by + az * bz;
+}
+
+// Scales (x, y, z) to unit length; the zero vector stays zero
+void normalize(vfloat &x, vfloat &y, vfloat &z) {
+    vfloat len2 = dot(x, y, z, x, y, z);
+    vfloat nonzero = len2 > vfloat(0.0f);
+    vfloat inv = vfloat(1.0f) / sqrt(select(nonzero, len2, vfloat(1.0f)));
+    x = x * inv;
+    y = y * inv;
+    z = z * inv;
+}
+
+} // namespace
+
+void HitBatch::resize(int n) {
+    count = n;
+    int size = padded(n);
+    std::vector<float> *arrays[] = { &px, &py, &pz, &nx, &ny, &nz, &dx, &dy, &dz };
+    resize_all(arrays, 9, size);
+    material.resize(size);
+    const float p[3] = { 0, 0, 0 }, normal[3] = { 0, 1, 0 }, d[3] = { 0, -1, 0 };
+    for (int i = n; i < size; i++)
+        set(i, p, normal, d, 0);
+}
+
+void HitBatch::set(int i, const float p[3], const float n[3], const float d[3], int materialId) {
+    px[i] = p[0];
+    py[i] = p[1];
+    pz[i] = p[2];
+    nx[i] = n[0];
+    ny[i] = n[1];
+    nz[i] = n[2];
+    dx[i] = d[0];
+    dy[i] = d[1];
+    dz[i] = d[2];
+    material[i] = materialId;
+}
+
+template <int LightType>
+void shade_phong(const HitBatch &hits, const ShadeMaterials &materials, const Light &light, PhongTerms &out) {
+    int size = padded(hits.size());
+    std::vector<float> *arrays[] = { &out.diffuse, &out.specular, &out.lx, &out.ly, &out.lz, &out.lightDistance2 };
+    resize_all(arrays, 6, size);
+
+    vfloat La(light.La);
+    vfloat lightX, lightY, lightZ;
+    if (LightType == DIRECTIONAL_LIGHT) {
+        vfloat x(-light.Direction.x()), y(-light.Direction.y()), z(-light.Direction.z());
+        normalize(x, y, z);
+        lightX = x;
+        lightY = y;
+        lightZ = z;
+    }
+    else {
+        lightX = vfloat(light.Position.x());
+        lightY = vfloat(light.Position.y());
+        lightZ = vfloat(light.Position.z());
+    }
+
+    for (int i = 0; i < size; i += SIMD_WIDTH) {
+        vint material = load(&hits.material[i]);
+        vfloat nx = load(&hits.nx[i]), ny = load(&hits.ny[i]), nz = load(&hits.nz[i]);
+        vfloat dx = load(&hits.dx[i]), dy = load(&hits.dy[i]), dz = load(&hits.dz[i]);
+
+        vfloat lx, ly, lz, distance2;
+        if (LightType == DIRECTIONAL_LIGHT) {
+            lx = lightX;
+            ly = lightY;
+            lz = lightZ;
+            distance2 = vfloat(1e30f);
+        }
+        else {
+            lx = lightX - load(&hits.px[i]);
+            ly = lightY - load(&hits.py[i]);
+            lz = lightZ - load(&hits.pz[i]);
+            distance2 = dot(lx, ly, lz, lx, ly, lz);
+            normalize(lx, ly, lz);
+        }
+
+        vfloat LdotN = dot(lx, ly, lz, nx, ny, nz);
+        vfloat diffuse = La * gather(materials.Kd.data(), material) * max(LdotN, vfloat(0.0f));
+
+        // R = reflect(-L, N); the lobe is around the mirror of the light
+        vfloat twoLdotN = vfloat(2.0f) * LdotN;
+        vfloat rx = twoLdotN * nx - lx, ry = twoLdotN * ny - ly, rz = twoLdotN * nz - lz;
+        vfloat RdotV = -dot(rx, ry, rz, dx, dy, dz);
+        vfloat lobe = fast_pow(max(RdotV, vfloat(0.0f)), gather(materials.shininess.data(), material));
+        vfloat specular = La * gather(materials.Ks.data(), material) * lobe;
+
+        store(&out.diffuse[i], diffuse);
+        store(&out.specular[i], specular);
+        store(&out.lx[i], lx);
+        store(&out.ly[i], ly);
+        store(&out.lz[i], lz);
+        store(&out.lightDistance2[i], distance2);
+    }
+}
+
+template void shade_phong<POINT_LIGHT>(const HitBatch &, const ShadeMaterials &, const Light &, PhongTerms &);
+template void shade_phong<DIRECTIONAL_LIGHT>(const HitBatch &, const ShadeMaterials &, const Light &, PhongTerms &);
+
+void shade_fresnel(const HitBatch &hits, const ShadeMaterials &materials, FresnelTerms &out) {
+    int size = padded(hits.size());
+    std::vector<float> *arrays[] = { &out.kr, &out.rx, &out.ry, &out.rz, &out.tx, &out.ty, &out.tz };
+    resize_all(arrays, 7, size);
+
+    const vfloat one(1.0f), zero(0.0f);
+    for (int i = 0; i < size; i += SIMD_WIDTH) {
+        vfloat ior = gather(materials.ior.data(), load(&hits.material[i]));
+        vfloat nx = load(&hits.nx[i]), ny = load(&hits.ny[i]), nz = load(&hits.nz[i]);
+        vfloat dx = load(&hits.dx[i]), dy = load(&hits.dy[i]), dz = load(&hits.dz[i]);
+        vfloat cosi = clamp(dot(dx, dy, dz, nx, ny, nz), vfloat(-1.0f), one);
+        vfloat absCosi = abs(cosi);
+
+        // Fresnel equations for unpolarized light; a ray arriving on the
+        // side the normal points to enters the medium
+        vfloat inside = cosi > zero;
+        vfloat etai = select(inside, ior, one), etat = select(inside, one, ior);
+        vfloat sint = etai / etat * sqrt(max(zero, one - cosi * cosi));
+        vfloat cost = sqrt(max(zero, one - sint * sint));
+        vfloat Rs = (etat * absCosi - etai * cost) / (etat * absCosi + etai * cost);
+        vfloat Rp = (etai * absCosi - etat * cost) / (etai * absCosi + etat * cost);
+        vfloat kr = select(sint >= one, one, (Rs * Rs + Rp * Rp) * vfloat(0.5f));
+
+        // Mirror direction
+        vfloat twoCosi = vfloat(2.0f) * cosi;
+        vfloat rx = dx - twoCosi * nx, ry = dy - twoCosi * ny, rz = dz - twoCosi * nz;
+        normalize(rx, ry, rz);
+
+        // Refraction through the normal flipped toward the far side
+        vfloat entering = cosi < zero;
+        vfloat eta = select(entering, one / ior, ior);
+        vfloat sign = select(entering, one, vfloat(-1.0f));
+        vfloat k = one - eta * eta * (one - absCosi * absCosi);
+        vfloat scale = (eta * absCosi - sqrt(max(k, zero))) * sign;
+        vfloat tx = eta * dx + scale * nx, ty = eta * dy + scale * ny, tz = eta * dz + scale * nz;
+        normalize(tx, ty, tz);
+        vfloat tir = k < zero;
+        tx = select(tir, zero, tx);
+        ty = select(tir, zero, ty);
+        tz = select(tir, zero, tz);
+
+        store(&out.kr[i], kr);
+        store(&out.rx[i], rx);
+        store(&out.ry[i], ry);
+        store(&out.rz[i], rz);
+        store(&out.tx[i], tx);
+        store(&out.ty[i], ty);
+        store(&out.tz[i], tz);
+    }
+}
+
+void shade_phong_reference(const HitBatch &hits, const ShadeMaterials &materials, const Light &light,
+    PhongTerms &out) {
+    int size = padded(hits.size());
+    std::vector<float> *arrays[] = { &out.diffuse, &out.specular, &out.lx, &out.ly, &out.lz, &out.lightDistance2 };
+    resize_all(arrays, 6, size);
+
+    for (int i = 0; i < hits.size(); i++) {
+        int m = hits.material[i];
+        double l[3], distance2;
+        if (light.Type == DIRECTIONAL_LIGHT) {
+            l[0] = -light.Direction.x();
+            l[1] = -light.Direction.y();
+            l[2] = -light.Direction.z();
+            distance2 = 1e30;
+        }
+        else {
+            l[0] = light.Position.x() - hits.px[i];
+            l[1] = light.Position.y() - hits.py[i];
+            l[2] = light.Position.z() - hits.pz[i];
+            distance2 = l[0] * l[0] + l[1] * l[1] + l[2] * l[2];
+        }
+        double len = std::sqrt(l[0] * l[0] + l[1] * l[1] + l[2] * l[2]);
+        for (int a = 0; a < 3; a++)
+            l[a] = len > 0 ? l[a] / len : 0;
+
+        double n[3] = { hits.nx[i], hits.ny[i], hits.nz[i] };
+        double d[3] = { hits.dx[i], hits.dy[i], hits.dz[i] };
+        double LdotN = l[0] * n[0] + l[1] * n[1] + l[2] * n[2];
+        double r[3], RdotV = 0;
+        for (int a = 0; a < 3; a++) {
+            r[a] = 2 * LdotN * n[a] - l[a];
+            RdotV -= r[a] * d[a];
+        }
+
+        out.diffuse[i] = static_cast<float>(light.La * materials.Kd[m] * std::max(0.0, LdotN));
+        out.specular[i] = light.La * materials.Ks[m]
+            * powf(static_cast<float>(std::max(0.0, RdotV)), materials.shininess[m]);
+        out.lx[i] = static_cast<float>(l[0]);
+        out.ly[i] = static_cast<float>(l[1]);
+        out.lz[i] = static_cast<float>(l[2]);
+        out.lightDistance2[i] = static_cast<float>(distance2);
+    }
+}
+
+void shade_fresnel_reference(const HitBatch &hits, const ShadeMaterials &materials, FresnelTerms &out) {
+    int size = padded(hits.size());
+    std::vector<float> *arrays[] = { &out.kr, &out.rx, &out.ry, &out.rz, &out.tx, &out.ty, &out.tz };
+    resize_all(arrays, 7, size);
+
+    for (int i = 0; i < hits.size(); i++) {
+        double ior = materials.ior[hits.material[i]];
+        double n[3] = { hits.nx[i], hits.ny[i], hits.nz[i] };
+        double d[3] = { hits.dx[i], hits.dy[i], hits.dz[i] };
+        double cosi = std::max(-1.0, std::min(1.0, d[0] * n[0] + d[1] * n[1] + d[2] * n[2]));
+
+        double etai = 1, etat = ior;
+        if (cosi > 0)
+            std::swap(etai, etat);
+        double sint = etai / etat * std::sqrt(std::max(0.0, 1 - cosi * cosi));
+        if (sint >= 1) {
+            out.kr[i] = 1;
+        }
+        else {
+            double cost = std::sqrt(std::max(0.0, 1 - sint * sint));
+            double c = std::fabs(cosi);
+            double Rs = (etat * c - etai * cost) / (etat * c + etai * cost);
+            double Rp = (etai * c - etat * cost) / (etai * c + etat * cost);
+            out.kr[i] = static_cast<float>((Rs * Rs + Rp * Rp) / 2);
+        }
+
+        double r[3], t[3];
+        for (int a = 0; a < 3; a++)
+            r[a] = d[a] - 2 * cosi * n[a];
+        double c = cosi, eta = 1 / ior, sign = 1;
+        if (c < 0) {
+            c = -c;
+        }
+        else {
+            eta = ior;
+            sign = -1;
+        }
+        double k = 1 - eta * eta * (1 - c * c);
+        for (int a = 0; a < 3; a++)
+            t[a] = k < 0 ? 0 : eta * d[a] + (eta * c - std::sqrt(k)) * sign * n[a];
+
+        double rLen = std::sqrt(r[0] * r[0] + r[1] * r[1] + r[2] * r[2]);
+        double tLen = std::sqrt(t[0] * t[0] + t[1] * t[1] + t[2] * t[2]);
+        out.rx[i] = static_cast<float>(rLen > 0 ? r[0] / rLen : 0);
+        out.ry[i] = static_cast<float>(rLen > 0 ? r[1] / rLen : 0);
+        out.rz[i] = static_cast<float>(rLen > 0 ? r[2] / rLen : 0);
+        out.tx[i] = static_cast<float>(tLen > 0 ? t[0] / tLen : 0);
+        out.ty[i] = static_cast<float>(tLen > 0 ? t[1] / tLen : 0);
+        out.tz[i] = static_cast<float>(tLen > 0 ? t[2] / tLen : 0);
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "light.h"
+
+#include <cstdint>
+#include <vector>
+
+// Vectorized shading terms for batches of hits, SIMD_WIDTH lanes at a time
+// (8 in AVX2 builds, 4 with SSE2; see simd.h). Everything is single
+// precision and the Phong exponent goes through simd::fast_pow. The
+// *_reference functions compute the same terms one hit at a time in double
+// precision with powf, as the tracer used to, to check the vector versions
+// against (RealisticRenderingBench --check-shading).
+
+// Structure of arrays; every array holds size() entries plus padding up to
+// a multiple of SIMD_WIDTH, so the kernels never need a scalar tail
+struct HitBatch {
+    std::vector<float> px, py, pz;      // hit position
+    std::vector<float> nx, ny, nz;      // unit geometric normal
+    std::vector<float> dx, dy, dz;      // unit direction of the incoming ray
+    std::vector<int32_t> material;      // index into a ShadeMaterials table
+
+    HitBatch() : count(0) {}
+
+    int size() const { return count; }
+    // Keeps capacity; padding lanes repeat a harmless hit
+    void resize(int n);
+    void set(int i, const float p[3], const float n[3], const float d[3], int materialId);
+
+private:
+    int count;
+};
+
+// Material parameters by index, as structure of arrays
+struct ShadeMaterials {
+    std::vector<float> Kd;
+    std::vector<float> Ks;
+    std::vector<float> shininess;
+    std::vector<float> ior;
+
+    int add(float kd, float ks, float shine, float eta) {
+        Kd.push_back(kd);
+        Ks.push_back(ks);
+        shininess.push_back(shine);
+        ior.push_back(eta);
+        return static_cast<int>(Kd.size()) - 1;
+    }
+    void clear() { Kd.clear(); Ks.clear(); shininess.clear(); ior.clear(); }
+};
+
+// Unshadowed Phong terms of the Whitted tracer: the surface is lit as
+// diffColor * diffuse * visibility + specular. lx..lz point toward the light
+// and lightDistance2 is how far a shadow ray has to go (squared).
+struct PhongTerms {
+    std::vector<float> diffuse;         // La * Kd * max(0, L.N)
+    std::vector<float> specular;        // La * Ks * max(0, R.V)^shininess
+    std::vector<float> lx, ly, lz;
+    std::vector<float> lightDistance2;
+};
+
+// Glass terms: the Fresnel reflectance, the unit mirror direction and the
+// unit refracted direction, which is zero on total internal reflection
+struct FresnelTerms {
+    std::vector<float> kr;
+    std::vector<float> rx, ry, rz;
+    std::vector<float> tx, ty, tz;
+};
+
+template <int LightType>
+void shade_phong(const HitBatch &hits, const ShadeMaterials &materials, const Light &light, PhongTerms &out);
+void shade_fresnel(const HitBatch &hits, const ShadeMaterials &materials, FresnelTerms &out);
+
+void shade_phong_reference(const HitBatch &hits, const ShadeMaterials &materials, const Light &light,
+    PhongTerms &out);
+void shade_fresnel_reference(const HitBatch &hits, const ShadeMaterials &materials, FresnelTerms &out);
@@ -0,0 +1,802 @@
+// Headless ray tracing benchmark.
+// Renders fixed camera orbits over the bundled scenes at fixed resolutions
+// and thread counts, and writes the timings as JSON. No window is created.
+//
+//   RealisticRenderingBench --scene-dir RealisticRendering/scene
+//       --size 320x240 --size 640x480 --threads 1,0 --frames 8 -o bench.json
+//
+// BVH build times are reported per builder and thread count, normalized to
+// milliseconds per million triangles. The bundled meshes are small; add
+// --bvh-soup 4 to also time a random soup of four million triangles.
+// With --bvh-cache DIR each scene also reports how long writing its BVH
+// snapshots takes and how long mapping them back does. --texture puts a
+// mip-mapped diffuse texture on every scene, like the interactive view.
+// Every run also reports shade_ms, the time spent in the Whitted shading
+// kernels alone.
+// Caustic photon maps are emitted and balanced at every thread count with
+// --photons photons (in millions), and gathered at random floor points.
+// --check-shading compares the vectorized Phong and Fresnel terms against
+// their scalar reference on random hits, times both, and exits with 1 if
+// they differ by more than 1e-3.
+// --lights N scatters N point lights over every scene, which then shades
+// through the light BVH instead of the single default light.
+// Every run also times one render after a light edit, which reuses the
+// primary hits of the render before it (relight_ms), along with the mirror
+// and glass rays it still had to trace (relight_secondary_rays).
+// --area-light adds a rectangle light over the floor of every scene; its
+// soft shadows trace --shadow-tests samples first and the rest only in
+// penumbrae, so comparing shadow ray counts against --shadow-tests 16 (all
+// of them) shows what the early out saves.
+// --check-determinism rebuilds the BVHs of every scene and renders it at the
+// first size with every --threads count, both for the build and for the
+// Whitted tracer and the path tracer in deterministic mode with an
+// irradiance cache, and exits with 1 unless the image hashes agree, e.g.
+// --threads 1,4,64 --check-determinism.
+// --check-sampler path traces every scene at 4, 16 and 64 spp with each
+// sampler, reports the RMSE against a 1024 spp reference, and exits with 1
+// unless Sobol and blue noise beat random numbers at every count.
+
+#include "scene.h"
+#include "raytracer.h"
+#include "pathtracer.h"
+#include "parallel.h"
+#include "mipmap.h"
+#include "aobake.h"
+#include "lightmap.h"
+#include "photonmap.h"
+#include "simdshading.h"
+#include "simd.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextStream>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <vector>
+
+namespace {
+
+struct BenchScene {
+    QString name;
+    std::function<bool(scene &)> load;      // fills the scene, without building trees
+};
+
+// One mesh on top of the floor, laid out like the bundled scene files
+BenchScene synthetic_scene(const QDir &dir, const QString &objName) {
+    BenchScene b;
+    b.name = objName.section('.', 0, 0).toLower();
+    b.load = [dir, objName](scene &s) {
+        QMatrix4x4 identity, floor;
+        floor.translate(0.f, -1.f, 0.f);
+        if (s.add_object(dir.filePath(objName).toStdString(), 2.0f, identity) == nullptr)
+            return false;
+        return s.add_object(dir.filePath("Plane.obj").toStdString(), 20.0f, floor) != nullptr;
+    };
+    return b;
+}
+
+BenchScene scene_file(const QDir &dir, const QString &fileName) {
+    BenchScene b;
+    b.name = fileName.section('.', 0, 0).toLower();
+    b.load = [dir, fileName](scene &s) {
+        return s.read_scene_file(dir.filePath(fileName).toStdString()) == 0 && !s.objects.empty();
+    };
+    return b;
+}
+
+// Frame i of an orbit around the origin, looking at it from radius 5
+Camera3D orbit_camera(int frame, int frames) {
+    float angle = 360.f * frame / std::max(frames, 1);
+    float rad = angle * 3.14159265f / 180.f;
+    Camera3D camera;
+    camera.setTranslation(5.f * std::sin(rad), 1.f, 5.f * std::cos(rad));
+    camera.setRotation(angle, 0.f, 1.f, 0.f);
+    return camera;
+}
+
+double percentile(std::vector<double> sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    std::sort(sorted.begin(), sorted.end());
+    size_t rank = static_cast<size_t>(std::ceil(p / 100.0 * sorted.size()));
+    return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+QJsonObject frame_time_summary(const std::vector<double> &ms) {
+    double sum = 0;
+    for (double t : ms)
+        sum += t;
+
+    QJsonObject o;
+    o["min"] = percentile(ms, 0);
+    o["p50"] = percentile(ms, 50);
+    o["p90"] = percentile(ms, 90);
+    o["p99"] = percentile(ms, 99);
+    o["max"] = percentile(ms, 100);
+    o["mean"] = ms.empty() ? 0 : sum / ms.size();
+    return o;
+}
+
+const char *builder_name(BvhBuilder builder) {
+    return builder == LBVH_BUILDER ? "lbvh" : "sah";
+}
+
+QJsonObject build_result(BvhBuilder builder, int threads, double ms, long long triangles, double sahCost) {
+    QJsonObject o;
+    o["builder"] = builder_name(builder);
+    o["threads"] = resolve_thread_count(threads);
+    o["ms"] = ms;
+    o["ms_per_million_triangles"] = triangles > 0 ? ms * 1e6 / triangles : 0;
+    o["sah_cost"] = sahCost;
+    return o;
+}
+
+// Small random triangles spread through a cube, for build scaling only
+QJsonArray soup_build_results(int triangles, const std::vector<int> &threadCounts) {
+    MeshBvh mesh;
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    mesh.triangles.reserve(triangles);
+    for (int i = 0; i < triangles; i++) {
+        float a[3] = { 10 * u(rng), 10 * u(rng), 10 * u(rng) };
+        float b[3] = { a[0] + 0.05f * u(rng), a[1] + 0.05f * u(rng), a[2] + 0.05f * u(rng) };
+        float c[3] = { a[0] + 0.05f * u(rng), a[1] + 0.05f * u(rng), a[2] + 0.05f * u(rng) };
+        mesh.triangles.push_back(BvhTriangle(a, b, c));
+    }
+
+    QJsonArray results;
+    for (BvhBuilder builder : { SAH_BUILDER, LBVH_BUILDER }) {
+        for (int threads : threadCounts) {
+            mesh.bvh.settings.builder = builder;
+            mesh.bvh.settings.numThreads = threads;
+            QElapsedTimer timer;
+            timer.start();
+            mesh.build();
+            double ms = timer.nsecsElapsed() * 1e-6;
+            results.append(build_result(builder, threads, ms, triangles, mesh.bvh.sah_cost()));
+            QTextStream(stderr) << "soup " << builder_name(builder) << " threads " << resolve_thread_count(threads)
+                << ": " << ms * 1e6 / triangles << " ms per million triangles\n";
+        }
+    }
+    return results;
+}
+
+void random_unit(std::mt19937 &rng, float v[3]) {
+    std::uniform_real_distribution<float> u(-1.f, 1.f);
+    float len2;
+    do {
+        v[0] = u(rng);
+        v[1] = u(rng);
+        v[2] = u(rng);
+        len2 = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+    } while (len2 > 1 || len2 < 1e-4f);
+    float inv = 1 / std::sqrt(len2);
+    v[0] *= inv;
+    v[1] *= inv;
+    v[2] *= inv;
+}
+
+float max_difference(const std::vector<float> &a, const std::vector<float> &b, int n) {
+    float d = 0;
+    for (int i = 0; i < n; i++)
+        d = std::max(d, std::fabs(a[i] - b[i]));
+    return d;
+}
+
+// Random hits with random materials through the vectorized shading terms and
+// their scalar reference. Refracted directions are compared weighted by the
+// share of light they carry, since right at the critical angle the two may
+// disagree about total internal reflection.
+QJsonObject shading_check(int hitCount, bool &passed) {
+    const float tolerance = 1e-3f;
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> u(0.f, 1.f);
+
+    ShadeMaterials materials;
+    for (int m = 0; m < 64; m++)
+        materials.add(u(rng), u(rng), 1 + 199 * u(rng), 1 + 1.5f * u(rng));
+    HitBatch batch;
+    batch.resize(hitCount);
+    for (int i = 0; i < hitCount; i++) {
+        float p[3] = { 10 * u(rng) - 5, 10 * u(rng) - 5, 10 * u(rng) - 5 }, n[3], d[3];
+        random_unit(rng, n);
+        random_unit(rng, d);
+        batch.set(i, p, n, d, static_cast<int>(rng() % 64));
+    }
+
+    QJsonObject result;
+    result["hits"] = hitCount;
+    result["simd_width"] = SIMD_WIDTH;
+    float worst = 0;
+
+    Light point, directional;
+    directional.Type = DIRECTIONAL_LIGHT;
+    directional.Direction = QVector3D(0.3f, -1.f, 0.2f);
+    for (const Light &light : { point, directional }) {
+        PhongTerms fast, reference;
+        QElapsedTimer timer;
+        timer.start();
+        if (light.Type == DIRECTIONAL_LIGHT)
+            shade_phong<DIRECTIONAL_LIGHT>(batch, materials, light, fast);
+        else
+            shade_phong<POINT_LIGHT>(batch, materials, light, fast);
+        double fastMs = timer.nsecsElapsed() * 1e-6;
+        timer.restart();
+        shade_phong_reference(batch, materials, light, reference);
+        double referenceMs = timer.nsecsElapsed() * 1e-6;
+
+        QJsonObject phong;
+        float diffuse = max_difference(fast.diffuse, reference.diffuse, hitCount);
+        float specular = max_difference(fast.specular, reference.specular, hitCount);
+        float direction = std::max({ max_difference(fast.lx, reference.lx, hitCount),
+            max_difference(fast.ly, reference.ly, hitCount), max_difference(fast.lz, reference.lz, hitCount) });
+        phong["diffuse_error"] = diffuse;
+        phong["specular_error"] = specular;
+        phong["light_direction_error"] = direction;
+        phong["simd_ms"] = fastMs;
+        phong["reference_ms"] = referenceMs;
+        result[light.Type == DIRECTIONAL_LIGHT ? "phong_directional" : "phong_point"] = phong;
+        worst = std::max({ worst, diffuse, specular, direction });
+    }
+
+    FresnelTerms fast, reference;
+    QElapsedTimer timer;
+    timer.start();
+    shade_fresnel(batch, materials, fast);
+    double fastMs = timer.nsecsElapsed() * 1e-6;
+    timer.restart();
+    shade_fresnel_reference(batch, materials, reference);
+    double referenceMs = timer.nsecsElapsed() * 1e-6;
+
+    float refracted = 0;
+    for (int i = 0; i < hitCount; i++) {
+        float d = std::max({ std::fabs(fast.tx[i] - reference.tx[i]), std::fabs(fast.ty[i] - reference.ty[i]),
+            std::fabs(fast.tz[i] - reference.tz[i]) });
+        refracted = std::max(refracted, d * (1 - reference.kr[i]));
+    }
+    QJsonObject fresnel;
+    float kr = max_difference(fast.kr, reference.kr, hitCount);
+    float reflected = std::max({ max_difference(fast.rx, reference.rx, hitCount),
+        max_difference(fast.ry, reference.ry, hitCount), max_difference(fast.rz, reference.rz, hitCount) });
+    fresnel["kr_error"] = kr;
+    fresnel["reflected_error"] = reflected;
+    fresnel["refracted_error"] = refracted;
+    fresnel["simd_ms"] = fastMs;
+    fresnel["reference_ms"] = referenceMs;
+    result["fresnel"] = fresnel;
+    worst = std::max({ worst, kr, reflected, refracted });
+
+    passed = worst <= tolerance;
+    result["max_error"] = worst;
+    result["passed"] = passed;
+    QTextStream(stderr) << "shading check: max error " << worst << (passed ? ", passed\n" : ", FAILED\n");
+    return result;
+}
+
+// Two passes of either tracer at each thread count, so that the jittered
+// passes and the records the cache gets in the first pass are covered. The
+// trees are rebuilt on as many threads first; s is left with default ones.
+QJsonObject determinism_check(scene &s, int width, int height, const std::vector<int> &threadCounts,
+    bool &passed) {
+    RayCamera camera(orbit_camera(0, 1), width, height);
+    Light light;
+    QJsonArray runs;
+    QString whittedFirst, pathFirst;
+    bool same = true;
+    for (int threads : threadCounts) {
+        s.bvhSettings.numThreads = threads;
+        s.build_aabb_trees();
+
+        FrameBuffer whitted(width, height), path(width, height);
+        RayTracer tracer(&s);
+        tracer.settings.numThreads = threads;
+        IrradianceCache cache;
+        PathTracer pathTracer(&s, &cache);
+        pathTracer.settings.numThreads = threads;
+        pathTracer.settings.deterministic = true;
+        for (int pass = 0; pass < 2; pass++) {
+            tracer.render(camera, light, whitted);
+            pathTracer.render_pass(camera, light, path);
+        }
+
+        QString whittedHash = QString::number(whitted.hash(), 16), pathHash = QString::number(path.hash(), 16);
+        if (runs.isEmpty()) {
+            whittedFirst = whittedHash;
+            pathFirst = pathHash;
+        }
+        same = same && whittedHash == whittedFirst && pathHash == pathFirst;
+        QJsonObject run;
+        run["threads"] = resolve_thread_count(threads);
+        run["whitted_hash"] = whittedHash;
+        run["path_hash"] = pathHash;
+        run["cache_records"] = cache.size();
+        runs.append(run);
+    }
+    s.bvhSettings = BvhSettings();
+    s.build_aabb_trees();
+
+    passed = passed && same;
+    QJsonObject result;
+    result["width"] = width;
+    result["height"] = height;
+    result["runs"] = runs;
+    result["passed"] = same;
+    return result;
+}
+
+// Root mean square difference of the averaged colors. reference holds
+// passes - referenceOffset passes, see sampler_check().
+double color_rmse(const FrameBuffer &fb, const FrameBuffer &reference, int referenceOffset) {
+    int n = fb.width * fb.height;
+    double sum = 0;
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < n; i++) {
+            double d = fb.color[c][i] / fb.passes - reference.color[c][i] / (reference.passes - referenceOffset);
+            sum += d * d;
+        }
+    }
+    return n > 0 ? std::sqrt(sum / (3.0 * n)) : 0;
+}
+
+// Path traced error of every sampler at fixed sample counts, against a
+// 1024 spp Sobol reference. Samples are indexed by the pass number, so the
+// reference starts its passes far past the ones under test rather than
+// sharing their first points. Fails unless Sobol and blue noise both beat
+// random numbers at every count.
+QJsonObject sampler_check(const scene &s, bool &passed) {
+    const int width = 64, height = 48, referenceSpp = 1024, referenceOffset = 1 << 16;
+    RayCamera camera(orbit_camera(0, 1), width, height);
+    Light light;
+
+    FrameBuffer reference(width, height);
+    reference.passes = referenceOffset;
+    PathTracer referenceTracer(&s);
+    referenceTracer.settings.sampler = SOBOL_SAMPLER;
+    for (int p = 0; p < referenceSpp; p++)
+        referenceTracer.render_pass(camera, light, reference);
+
+    const int counts[] = { 4, 16, 64 };
+    const int countCount = sizeof(counts) / sizeof(counts[0]);
+    double randomError[countCount] = {};
+    bool better = true;
+    QJsonArray samplers;
+    for (SamplerType type : { RANDOM_SAMPLER, SOBOL_SAMPLER, BLUE_NOISE_SAMPLER }) {
+        PathTracer tracer(&s);
+        tracer.settings.sampler = type;
+        FrameBuffer fb(width, height);
+        QJsonObject errors;
+        for (int k = 0; k < countCount; k++) {
+            while (fb.passes < counts[k])
+                tracer.render_pass(camera, light, fb);
+            double error = color_rmse(fb, reference, referenceOffset);
+            errors[QString("%1_spp").arg(counts[k])] = error;
+            if (type == RANDOM_SAMPLER)
+                randomError[k] = error;
+            else
+                better = better && error < randomError[k];
+        }
+        QJsonObject result;
+        result["sampler"] = type == RANDOM_SAMPLER ? "random" : type == SOBOL_SAMPLER ? "sobol" : "blue_noise";
+        result["rmse"] = errors;
+        samplers.append(result);
+    }
+
+    passed = passed && better;
+    QJsonObject result;
+    result["width"] = width;
+    result["height"] = height;
+    result["reference_spp"] = referenceSpp;
+    result["samplers"] = samplers;
+    result["passed"] = better;
+    return result;
+}
+
+// Point lights above the floor, dim enough that they add up to about the
+// default light
+void add_random_lights(scene &s, int count) {
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> u(0.f, 1.f);
+    for (int i = 0; i < count; i++) {
+        Light light;
+        light.Position = QVector3D(10 * u(rng) - 5, 0.5f + 3.5f * u(rng), 10 * u(rng) - 5);
+        light.La = light.Ld = light.Ls = 10.f / count;
+        light.Falloff = true;
+        s.lights.push_back(light);
+    }
+    s.build_light_bvh();
+}
+
+// Rectangle light facing down onto the floor, half its size and twice its
+// width above it
+void add_area_light(scene &s) {
+    if (s.instanceBounds.empty())
+        return;
+    const BvhBox &floor = s.instanceBounds.back();
+    float width = floor.hi[0] - floor.lo[0], depth = floor.hi[2] - floor.lo[2];
+    Light light;
+    light.Type = RECT_LIGHT;
+    light.Position = QVector3D(floor.centroid(0), floor.hi[1] + 2 * std::max(width, depth), floor.centroid(2));
+    light.Edge1 = QVector3D(0.5f * width, 0.f, 0.f);
+    light.Edge2 = QVector3D(0.f, 0.f, 0.5f * depth);
+    light.La = light.Ld = light.Ls = 1.f;
+    s.lights.push_back(light);
+    s.build_light_bvh();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("RealisticRenderingBench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless ray tracing benchmark");
+    parser.addHelpOption();
+    parser.addOption({ "scene-dir", "Directory with the bundled .scene and .obj files.", "dir", "scene" });
+    parser.addOption({ "size", "Image size WxH, may be repeated.", "size" });
+    parser.addOption({ "threads", "Comma separated thread counts, 0 for all cores.", "list", "1,0" });
+    parser.addOption({ "frames", "Frames per camera orbit.", "n", "8" });
+    parser.addOption({ "warmup", "Untimed frames before each run.", "n", "1" });
+    parser.addOption({ "scenes", "Comma separated subset of scene names to run.", "list" });
+    parser.addOption({ "bvh-soup", "Also time BVH builds of a random soup of this many million triangles.", "n" });
+    parser.addOption({ "texture", "Diffuse texture for every scene, e.g. texture/marble.jpg.", "file" });
+    parser.addOption({ "bvh-cache", "Also time saving and loading BVH snapshots in this directory.", "dir" });
+    parser.addOption({ "photons", "Millions of caustic photons to emit per scene.", "n", "1" });
+    parser.addOption({ "lights", "Scatter this many point lights over every scene.", "n", "0" });
+    parser.addOption({ "area-light", "Add a rectangle light over the floor of every scene." });
+    parser.addOption({ "shadow-tests", "Area light shadow rays traced before the rest.", "n", "4" });
+    parser.addOption({ "check-shading", "Check the vectorized shading terms against the scalar reference." });
+    parser.addOption({ "check-determinism", "Check that images do not depend on the thread count." });
+    parser.addOption({ "check-sampler", "Check that the Sobol and blue-noise samplers beat random numbers." });
+    parser.addOption({ { "o", "output" }, "Write JSON here instead of stdout.", "file" });
+    parser.process(app);
+
+    QDir dir(parser.value("scene-dir"));
+    int frames = std::max(1, parser.value("frames").toInt());
+    int warmup = std::max(0, parser.value("warmup").toInt());
+
+    std::vector<std::pair<int, int>> sizes;
+    QStringList sizeArgs = parser.values("size");
+    if (sizeArgs.isEmpty())
+        sizeArgs << "320x240" << "640x480";
+    for (const QString &s : sizeArgs) {
+        QStringList wh = s.split('x');
+        if (wh.size() != 2 || wh[0].toInt() <= 0 || wh[1].toInt() <= 0) {
+            QTextStream(stderr) << "Bad size " << s << "\n";
+            return 1;
+        }
+        sizes.push_back(std::make_pair(wh[0].toInt(), wh[1].toInt()));
+    }
+
+    std::vector<int> threadCounts;
+    for (const QString &t : parser.value("threads").split(',', QString::SkipEmptyParts))
+        threadCounts.push_back(std::max(0, t.toInt()));
+
+    std::vector<BenchScene> scenes;
+    scenes.push_back(scene_file(dir, "Scene_1.scene"));
+    scenes.push_back(scene_file(dir, "Scene_2.scene"));
+    for (const char *obj : { "Cow.obj", "Deer.obj", "Cat.obj", "Rock.obj", "Eight.obj" })
+        scenes.push_back(synthetic_scene(dir, obj));
+
+    QStringList only = parser.value("scenes").split(',', QString::SkipEmptyParts);
+
+    std::shared_ptr<const MipTexture> texture;
+    if (parser.isSet("texture")) {
+        texture = load_mip_texture(parser.value("texture"));
+        if (!texture) {
+            QTextStream(stderr) << "Cannot read texture " << parser.value("texture") << "\n";
+            return 1;
+        }
+    }
+
+    QJsonObject root;
+    root["benchmark"] = "ray_tracing";
+    root["date"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    root["hardware_threads"] = resolve_thread_count(0);
+    root["rt_stats"] = RT_STATS != 0;
+    root["frames"] = frames;
+    root["texture"] = parser.value("texture");
+
+    QJsonArray sceneResults;
+    bool deterministic = true, samplersBetter = true;
+    for (const BenchScene &b : scenes) {
+        if (!only.isEmpty() && !only.contains(b.name))
+            continue;
+
+        scene s;
+        QElapsedTimer timer;
+        timer.start();
+        if (!b.load(s)) {
+            QTextStream(stderr) << "Could not load scene " << b.name << " from " << dir.path() << "\n";
+            continue;
+        }
+        s.assign_default_materials();
+        s.set_diffuse_texture(texture);
+        if (parser.value("lights").toInt() > 0)
+            add_random_lights(s, parser.value("lights").toInt());
+        if (parser.isSet("area-light"))
+            add_area_light(s);
+        double loadMs = timer.nsecsElapsed() * 1e-6;
+
+        long long triangles = 0;
+        for (auto o : s.objects)
+            triangles += static_cast<long long>(o->get_faces().size());
+
+        // read_scene_file already built the trees; time a rebuild either way.
+        // The last build is the default one, which the renders below use.
+        QJsonArray builds;
+        double buildMs = 0;
+        for (BvhBuilder builder : { LBVH_BUILDER, SAH_BUILDER }) {
+            for (int threads : threadCounts) {
+                s.bvhSettings.builder = builder;
+                s.bvhSettings.numThreads = threads;
+                timer.restart();
+                s.build_aabb_trees();
+                buildMs = timer.nsecsElapsed() * 1e-6;
+
+                // Triangle weighted, like the chance of a ray ending up in each tree
+                double cost = 0;
+                for (auto t : s.aabbTrees)
+                    cost += t->mesh.bvh.sah_cost() * t->mesh.triangle_count();
+                builds.append(build_result(builder, threads, buildMs, triangles,
+                    triangles > 0 ? cost / triangles : 0));
+            }
+        }
+        s.bvhSettings = BvhSettings();
+        s.build_aabb_trees();
+
+        QJsonObject sceneResult;
+        sceneResult["name"] = b.name;
+        sceneResult["objects"] = static_cast<int>(s.objects.size());
+        sceneResult["lights"] = s.lightBvh.size();
+        sceneResult["triangles"] = static_cast<double>(triangles);
+        sceneResult["load_ms"] = loadMs;
+        sceneResult["bvh_build_ms"] = buildMs;
+        sceneResult["bvh_builds"] = builds;
+
+        // Per-vertex ambient occlusion bake on all cores, never cached here
+        {
+            AoBake ao;
+            AoBakeStats aoStats = ao.bake(s);
+            QJsonObject aoResult;
+            aoResult["samples"] = ao.settings.samples;
+            aoResult["rays"] = static_cast<double>(aoStats.rays);
+            aoResult["ms"] = aoStats.seconds * 1e3;
+            aoResult["rays_per_second"] = aoStats.rays_per_second();
+            sceneResult["ao_bake"] = aoResult;
+        }
+
+        // Lightmap bake at a reduced size, enough to compare texel throughput
+        {
+            Lightmap lightmap;
+            lightmap.settings.resolution = 256;
+            lightmap.settings.indirectSamples = 16;
+            LightmapStats lmStats;
+            QJsonObject lmResult;
+            if (lightmap.pack(s, &lmStats)) {
+                lightmap.bake(s, Light(), &lmStats);
+                lmResult["resolution"] = lightmap.width;
+                lmResult["charts"] = lmStats.charts;
+                lmResult["texels"] = static_cast<double>(lmStats.texels);
+                lmResult["pack_ms"] = lmStats.packSeconds * 1e3;
+                lmResult["bake_ms"] = lmStats.bakeSeconds * 1e3;
+                lmResult["texels_per_second"] = lmStats.bakeSeconds > 0 ? lmStats.texels / lmStats.bakeSeconds : 0;
+            }
+            sceneResult["lightmap_bake"] = lmResult;
+        }
+
+        // Caustic photon map: emission and kd-tree balancing per thread
+        // count, then nearest neighbour gathers over the floor (the last object)
+        {
+            QJsonArray photonRuns;
+            PhotonMap caustics;
+            caustics.settings.photons = static_cast<int>(std::min(2000.0, std::max(0.0,
+                parser.value("photons").toDouble())) * 1e6);
+            for (int threads : threadCounts) {
+                caustics.settings.numThreads = threads;
+                PhotonMapStats photonStats;
+                caustics.build(s, Light(), &photonStats);
+                QJsonObject run;
+                run["threads"] = resolve_thread_count(threads);
+                run["emitted"] = static_cast<double>(photonStats.emitted);
+                run["stored"] = static_cast<double>(photonStats.stored);
+                run["emit_ms"] = photonStats.emitSeconds * 1e3;
+                run["photons_per_second"] = photonStats.photons_per_second();
+                run["kd_build_ms"] = photonStats.buildSeconds * 1e3;
+                photonRuns.append(run);
+            }
+
+            QJsonObject photonResult;
+            photonResult["runs"] = photonRuns;
+            if (!caustics.empty() && !s.instanceBounds.empty()) {
+                const BvhBox &floor = s.instanceBounds.back();
+                std::mt19937 rng(7);
+                std::uniform_real_distribution<float> ux(floor.lo[0], floor.hi[0]), uz(floor.lo[2], floor.hi[2]);
+                const int queries = 100000;
+                std::vector<Point> points;
+                for (int q = 0; q < queries; q++)
+                    points.push_back(Point(ux(rng), floor.hi[1], uz(rng)));
+
+                double sum = 0;
+                timer.restart();
+                for (const Point &p : points)
+                    sum += caustics.irradiance(p, Vector(0, 1, 0));
+                double gatherSeconds = timer.nsecsElapsed() * 1e-9;
+                photonResult["gather_queries"] = queries;
+                photonResult["gathers_per_second"] = gatherSeconds > 0 ? queries / gatherSeconds : 0;
+                photonResult["mean_irradiance"] = sum / queries;
+            }
+            sceneResult["caustics"] = photonResult;
+        }
+
+        if (parser.isSet("bvh-cache")) {
+            // The first pass builds and writes the snapshots (unless an
+            // earlier run left them behind), the second only maps them
+            s.bvhCacheDir = parser.value("bvh-cache");
+            timer.restart();
+            s.build_aabb_trees();
+            sceneResult["bvh_snapshot_save_ms"] = timer.nsecsElapsed() * 1e-6;
+            timer.restart();
+            s.build_aabb_trees();
+            sceneResult["bvh_snapshot_load_ms"] = timer.nsecsElapsed() * 1e-6;
+        }
+
+        // Interactive edits: rigid motion of every object (top level refit)
+        // and in-place deformation of every mesh (per-object refit)
+        {
+            std::vector<double> moveMs, refitMs;
+            for (int f = 0; f < frames; f++) {
+                QMatrix4x4 motion;
+                motion.translate(0.1f * f, 0.f, 0.f);
+                timer.restart();
+                for (int i = 0; i < static_cast<int>(s.objects.size()); i++)
+                    s.set_object_motion(i, motion);
+                moveMs.push_back(timer.nsecsElapsed() * 1e-6);
+
+                timer.restart();
+                for (int i = 0; i < static_cast<int>(s.objects.size()); i++)
+                    s.update_object_geometry(i);
+                refitMs.push_back(timer.nsecsElapsed() * 1e-6);
+            }
+            for (int i = 0; i < static_cast<int>(s.objects.size()); i++)
+                s.set_object_motion(i, QMatrix4x4());
+            sceneResult["instance_motion_ms"] = frame_time_summary(moveMs);
+            sceneResult["mesh_refit_ms"] = frame_time_summary(refitMs);
+        }
+
+        QJsonArray runs;
+        Light light;
+        for (auto size : sizes) {
+            for (int threads : threadCounts) {
+                RayTracer tracer(&s);
+                tracer.settings.numThreads = threads;
+                tracer.settings.shadowTestSamples = parser.value("shadow-tests").toInt();
+
+                std::vector<double> frameMs, shadeMs;
+                RayStats totals;
+                double traceSeconds = 0;
+                long long primaryRays = 0;
+                int usedThreads = 1;
+                for (int f = -warmup; f < frames; f++) {
+                    Camera3D camera = orbit_camera(std::max(f, 0), frames);
+                    FrameBuffer fb(size.first, size.second);
+                    RayTraceStats stats = tracer.render(RayCamera(camera, size.first, size.second), light, fb);
+                    if (f < 0)
+                        continue;
+
+                    frameMs.push_back(stats.seconds * 1e3);
+                    shadeMs.push_back(stats.shadeSeconds * 1e3);
+                    traceSeconds += stats.seconds;
+                    usedThreads = stats.threads;
+                    totals.merge(stats.rays);
+                    primaryRays += stats.primaryRays;
+                }
+                // Known even when the counters are compiled out
+                totals.counters[STAT_PRIMARY_RAYS] = primaryRays;
+
+                // A light edit: the second render reuses the primary hits of the first
+                double relightMs = 0;
+                long long relightSecondaryRays = 0;
+                bool relightReused = false;
+                {
+                    PrimaryHitCache primaryHits;
+                    RayTracer relight(&s, nullptr, &primaryHits);
+                    relight.settings = tracer.settings;
+                    RayCamera camera(orbit_camera(0, frames), size.first, size.second);
+                    Light edited = light;
+                    FrameBuffer first(size.first, size.second), second(size.first, size.second);
+                    relight.render(camera, light, first);
+                    edited.La *= 0.5f;
+                    RayTraceStats stats = relight.render(camera, edited, second);
+                    relightMs = stats.seconds * 1e3;
+                    relightSecondaryRays = stats.secondaryRays;
+                    relightReused = stats.reusedPrimaryHits;
+                }
+
+                QJsonObject rays, raysPerSecond;
+                for (int c = 0; c < STAT_COUNTER_COUNT; c++) {
+                    QString key = QString(RayStats::counter_name(c)).replace(' ', '_');
+                    rays[key] = static_cast<double>(totals.counters[c]);
+                    if (c <= STAT_SHADOW_RAYS)
+                        raysPerSecond[key] = traceSeconds > 0 ? totals.counters[c] / traceSeconds : 0;
+                }
+                raysPerSecond["total"] = traceSeconds > 0 ? totals.rays() / traceSeconds : 0;
+
+                QJsonArray depth;
+                for (int d = 0; d < STAT_DEPTH_BUCKETS; d++)
+                    depth.append(static_cast<double>(totals.depthHistogram[d]));
+
+                QJsonObject run;
+                run["width"] = size.first;
+                run["height"] = size.second;
+                run["threads"] = usedThreads;
+                run["shadow_test_samples"] = tracer.settings.shadowTestSamples;
+                run["frame_ms"] = frame_time_summary(frameMs);
+                // Time inside the shading kernels, summed over threads
+                run["shade_ms"] = frame_time_summary(shadeMs);
+                run["relight_ms"] = relightMs;
+                // Only the camera rays are reused; these were traced again
+                run["relight_secondary_rays"] = static_cast<double>(relightSecondaryRays);
+                run["relight_reused_primary_hits"] = relightReused;
+                run["rays"] = rays;
+                run["rays_per_second"] = raysPerSecond;
+                run["depth_histogram"] = depth;
+                runs.append(run);
+
+                QTextStream(stderr) << b.name << " " << size.first << "x" << size.second
+                    << " threads " << usedThreads << ": p50 " << percentile(frameMs, 50) << " ms\n";
+            }
+        }
+        sceneResult["runs"] = runs;
+
+        if (parser.isSet("check-determinism")) {
+            bool passed = true;
+            sceneResult["determinism_check"] = determinism_check(s, sizes[0].first, sizes[0].second, threadCounts,
+                passed);
+            deterministic = deterministic && passed;
+            QTextStream(stderr) << b.name << " determinism check" << (passed ? " passed\n" : " FAILED\n");
+        }
+        if (parser.isSet("check-sampler")) {
+            bool passed = true;
+            sceneResult["sampler_check"] = sampler_check(s, passed);
+            samplersBetter = samplersBetter && passed;
+            QTextStream(stderr) << b.name << " sampler check" << (passed ? " passed\n" : " FAILED\n");
+        }
+        sceneResults.append(sceneResult);
+    }
+    root["scenes"] = sceneResults;
+
+    if (parser.isSet("bvh-soup")) {
+        int triangles = static_cast<int>(std::max(0.0, parser.value("bvh-soup").toDouble()) * 1e6);
+        if (triangles > 0)
+            root["bvh_soup"] = soup_build_results(triangles, threadCounts);
+    }
+
+    bool shadingPassed = true;
+    if (parser.isSet("check-shading"))
+        root["shading_check"] = shading_check(100000, shadingPassed);
+
+    QByteArray json = QJsonDocument(root).toJson(QJsonDocument::Indented);
+    if (parser.isSet("output")) {
+        QFile file(parser.value("output"));
+        if (!file.open(QIODevice::WriteOnly)) {
+            QTextStream(stderr) << "Cannot write " << file.fileName() << "\n";
+            return 1;
+        }
+        file.write(json);
+    }
+    else {
+        QTextStream(stdout) << json;
+    }
+    return shadingPassed && deterministic && samplersBetter ? 0 : 1;
+}
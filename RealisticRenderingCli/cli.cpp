@@ -0,0 +1,401 @@
+// Command-line batch renderer.
+// Loads a .scene file once and renders one or more camera keyframes with the
+// Whitted or path tracer, without any window or OpenGL context.
+//
+//   RealisticRenderingCli scene/Scene_1.scene --size 1920x1080 --spp 16
+//       --eye 0,0,5 --target 0,0,0 -o rt.png
+//   RealisticRenderingCli scene/Scene_2.scene --keyframes path.txt
+//       --inbetween 10 -o frames/frame_####.png
+//
+// A keyframe file has one camera per line: "eye_x eye_y eye_z target_x
+// target_y target_z [fov]", the field of view in degrees like --fov. Lines
+// starting with # are ignored.
+//
+// Distributed stills: one process coordinates and any number of workers,
+// local or remote, render tiles. --spawn-workers starts local ones.
+//   RealisticRenderingCli scene/Scene_1.scene --size 8000x6000 --serve 5555
+//       --spawn-workers 4 -o big.png
+//   RealisticRenderingCli --worker coordinator-host:5555 --threads 8
+//
+// --bvh-cache DIR keeps each object's BVH as a snapshot file there; later
+// runs, and all workers on the machine, map it instead of building again.
+//
+// --caustics N adds photon-mapped caustics of the glass objects to the
+// Whitted tracer, e.g. --caustics 2000000.
+//
+// --budget S stops refining a frame after S seconds and saves the passes
+// finished by then, at least one; --spp is the most it takes.
+//
+// --band-rows N renders each frame N rows at a time and streams the bands
+// to the output as they finish, so memory does not grow with the image:
+//   RealisticRenderingCli scene/Scene_1.scene --size 40000x30000 --band-rows 64
+//       -o huge.pfm
+// A .pfm output keeps the float radiance, any other name gets an
+// uncompressed PNG.
+//
+// --deterministic makes every frame bit for bit the same on any number of
+// threads or workers, also with --irradiance-cache, and prints a hash of
+// each whole frame to compare runs by.
+
+#include "scene.h"
+#include "denoiser.h"
+#include "distributed.h"
+#include "renderqueue.h"
+#include "imagestream.h"
+#include "parallel.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QProcess>
+#include <QTextStream>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace {
+
+struct Keyframe {
+    QVector3D eye;
+    QVector3D target;
+    float fov;
+};
+
+bool parse_vector(const QString &s, QVector3D &v) {
+    QStringList parts = s.split(',');
+    if (parts.size() != 3)
+        return false;
+
+    bool ok[3];
+    v = QVector3D(parts[0].toFloat(&ok[0]), parts[1].toFloat(&ok[1]), parts[2].toFloat(&ok[2]));
+    return ok[0] && ok[1] && ok[2];
+}
+
+bool read_keyframes(const QString &fileName, float defaultFov, std::vector<Keyframe> &keys) {
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        QString line = in.readLine().trimmed();
+        if (line.isEmpty() || line.startsWith("#"))
+            continue;
+
+        QStringList v = line.split(' ', QString::SkipEmptyParts);
+        if (v.size() != 6 && v.size() != 7)
+            return false;
+
+        Keyframe k;
+        k.eye = QVector3D(v[0].toFloat(), v[1].toFloat(), v[2].toFloat());
+        k.target = QVector3D(v[3].toFloat(), v[4].toFloat(), v[5].toFloat());
+        k.fov = v.size() == 7 ? v[6].toFloat() : defaultFov;
+        keys.push_back(k);
+    }
+    return !keys.empty();
+}
+
+// Linear in-betweens; the last keyframe is rendered as well
+std::vector<Keyframe> expand_keyframes(const std::vector<Keyframe> &keys, int inbetween) {
+    std::vector<Keyframe> frames;
+    for (size_t i = 0; i < keys.size(); i++) {
+        frames.push_back(keys[i]);
+        if (i + 1 == keys.size())
+            break;
+
+        for (int j = 1; j <= inbetween; j++) {
+            float t = static_cast<float>(j) / (inbetween + 1);
+            Keyframe k;
+            k.eye = keys[i].eye * (1 - t) + keys[i + 1].eye * t;
+            k.target = keys[i].target * (1 - t) + keys[i + 1].target * t;
+            k.fov = keys[i].fov * (1 - t) + keys[i + 1].fov * t;
+            frames.push_back(k);
+        }
+    }
+    return frames;
+}
+
+// Replaces the run of '#' in the pattern with the zero-padded frame number
+QString frame_file_name(const QString &pattern, int frame, int frameCount) {
+    int first = pattern.indexOf('#');
+    if (first < 0) {
+        if (frameCount == 1)
+            return pattern;
+        int dot = pattern.lastIndexOf('.');
+        QString number = QString("_%1").arg(frame, 4, 10, QChar('0'));
+        return dot < 0 ? pattern + number : pattern.left(dot) + number + pattern.mid(dot);
+    }
+
+    int last = first;
+    while (last + 1 < pattern.size() && pattern[last + 1] == '#')
+        last++;
+    int digits = last - first + 1;
+    return pattern.left(first) + QString("%1").arg(frame, digits, 10, QChar('0')) + pattern.mid(last + 1);
+}
+
+// Whole frames: .pfm through ImageStreamWriter, the rest through QImage
+bool save_frame(const FrameBuffer &fb, const QString &fileName) {
+    if (QFileInfo(fileName).suffix().toLower() != "pfm")
+        return fb.to_image().save(fileName);
+    ImageStreamWriter writer;
+    if (!writer.open(fileName, fb.width, fb.height))
+        return false;
+    writer.write_band(fb);
+    return writer.close();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("RealisticRenderingCli");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Batch ray tracer for .scene files");
+    parser.addHelpOption();
+    parser.addPositionalArgument("scene", "The .scene file to render.");
+    parser.addOption({ { "o", "output" }, "Output image; '#' runs are replaced by the frame number.", "file", "rt.png" });
+    parser.addOption({ "size", "Image size WxH.", "size", "960x640" });
+    parser.addOption({ "spp", "Samples (passes) per pixel.", "n", "1" });
+    parser.addOption({ "threads", "Worker threads, 0 for all cores.", "n", "0" });
+    parser.addOption({ "integrator", "whitted or path.", "name", "whitted" });
+    parser.addOption({ "max-depth", "Maximum bounce depth (default depends on the integrator).", "n" });
+    parser.addOption({ "denoise", "Run the A-Trous denoiser on the result." });
+    parser.addOption({ "texture", "Diffuse texture for the Whitted tracer, e.g. texture/marble.jpg.", "file" });
+    parser.addOption({ "irradiance-cache", "Path tracer: cache diffuse indirect light, shared by all frames." });
+    parser.addOption({ "caustics", "Whitted tracer: emit this many photons for glass and mirror caustics.", "n", "0" });
+    parser.addOption({ "eye", "Camera position x,y,z.", "vec", "0,0,5" });
+    parser.addOption({ "target", "Point the camera looks at x,y,z.", "vec", "0,0,0" });
+    parser.addOption({ "fov", "Vertical field of view in degrees, top to bottom.", "deg", "45" });
+    parser.addOption({ "keyframes", "File with one camera per line (overrides --eye/--target).", "file" });
+    parser.addOption({ "inbetween", "Interpolated frames between keyframes.", "n", "0" });
+    parser.addOption({ "light-type", "point or directional.", "type", "point" });
+    parser.addOption({ "light-pos", "Point light position x,y,z.", "vec", "0,3,0" });
+    parser.addOption({ "light-dir", "Directional light direction x,y,z.", "vec", "0,-1,0" });
+    parser.addOption({ "light", "Ambient, diffuse and specular intensity La,Ld,Ls.", "vec", "1,1,1" });
+    parser.addOption({ "serve", "Coordinate a distributed render on this port.", "port" });
+    parser.addOption({ "spawn-workers", "With --serve, start this many local worker processes.", "n", "0" });
+    parser.addOption({ "tile-size", "With --serve, tile edge length in pixels.", "n", "64" });
+    parser.addOption({ "worker", "Render tiles for the coordinator at host:port.", "address" });
+    parser.addOption({ "budget", "Seconds per frame; stop refining when they are up (no irradiance cache).", "s" });
+    parser.addOption({ "deterministic", "Same image on any number of threads and workers; prints frame hashes." });
+    parser.addOption({ "band-rows", "Render this many rows at a time and stream them to the output file.", "n", "0" });
+    parser.addOption({ "bvh-cache", "Load BVH snapshots from and save them to this directory.", "dir" });
+    parser.process(app);
+
+    QTextStream err(stderr);
+    QString bvhCacheDir = parser.isSet("bvh-cache") ? QFileInfo(parser.value("bvh-cache")).absoluteFilePath() : QString();
+
+    if (parser.isSet("worker")) {
+        QString address = parser.value("worker");
+        int colon = address.lastIndexOf(':');
+        bool ok = colon > 0;
+        quint16 port = ok ? address.mid(colon + 1).toUShort(&ok) : 0;
+        if (!ok) {
+            err << "Expected host:port, got " << address << "\n";
+            return 1;
+        }
+        return run_render_worker(address.left(colon), port, std::max(0, parser.value("threads").toInt()),
+            bvhCacheDir);
+    }
+
+    QStringList args = parser.positionalArguments();
+    if (args.size() != 1) {
+        err << "Expected exactly one .scene file\n";
+        parser.showHelp(1);
+    }
+
+    QStringList wh = parser.value("size").split('x');
+    int width = wh.size() == 2 ? wh[0].toInt() : 0;
+    int height = wh.size() == 2 ? wh[1].toInt() : 0;
+    if (width <= 0 || height <= 0) {
+        err << "Bad size " << parser.value("size") << "\n";
+        return 1;
+    }
+
+    int threads = std::max(0, parser.value("threads").toInt());
+    QString integrator = parser.value("integrator");
+    if (integrator != "whitted" && integrator != "path") {
+        err << "Unknown integrator " << integrator << "\n";
+        return 1;
+    }
+
+    RenderJob job;
+    job.sceneFile = QFileInfo(args[0]).absoluteFilePath();
+    if (parser.isSet("texture"))
+        job.textureFile = QFileInfo(parser.value("texture")).absoluteFilePath();
+    job.width = width;
+    job.height = height;
+    job.spp = std::max(1, parser.value("spp").toInt());
+    job.pathTracing = integrator == "path";
+    job.irradianceCache = parser.isSet("irradiance-cache");
+    job.deterministic = parser.isSet("deterministic");
+    job.causticPhotons = std::max(0, parser.value("caustics").toInt());
+    if (parser.isSet("max-depth"))
+        job.maxDepth = parser.value("max-depth").toInt();
+
+    Light &light = job.light;
+    QVector3D intensity;
+    if (!parse_vector(parser.value("light-pos"), light.Position)
+        || !parse_vector(parser.value("light-dir"), light.Direction)
+        || !parse_vector(parser.value("light"), intensity)) {
+        err << "Light options take three comma separated numbers\n";
+        return 1;
+    }
+    light.La = intensity.x();
+    light.Ld = intensity.y();
+    light.Ls = intensity.z();
+    light.Type = parser.value("light-type") == "directional" ? DIRECTIONAL_LIGHT : POINT_LIGHT;
+
+    float fov = parser.value("fov").toFloat();
+    std::vector<Keyframe> keys;
+    if (parser.isSet("keyframes")) {
+        if (!read_keyframes(parser.value("keyframes"), fov, keys)) {
+            err << "Cannot read keyframes from " << parser.value("keyframes") << "\n";
+            return 1;
+        }
+    }
+    else {
+        Keyframe k;
+        k.fov = fov;
+        if (!parse_vector(parser.value("eye"), k.eye) || !parse_vector(parser.value("target"), k.target)) {
+            err << "Camera options take three comma separated numbers\n";
+            return 1;
+        }
+        keys.push_back(k);
+    }
+    std::vector<Keyframe> frames = expand_keyframes(keys, std::max(0, parser.value("inbetween").toInt()));
+
+    Denoiser denoiser;
+    denoiser.settings.numThreads = threads;
+    FrameBuffer fb;
+
+    if (parser.isSet("serve")) {
+        if (frames.size() != 1) {
+            err << "--serve renders a single camera\n";
+            return 1;
+        }
+        job.eye = frames[0].eye;
+        job.target = frames[0].target;
+        job.fov = frames[0].fov;
+
+        quint16 port = parser.value("serve").toUShort();
+        RenderCoordinator coordinator(job);
+        coordinator.settings.tileSize = std::max(1, parser.value("tile-size").toInt());
+        if (!coordinator.listen(port)) {
+            err << "Cannot listen on port " << port << "\n";
+            return 1;
+        }
+
+        // Local workers split the cores between them unless told otherwise
+        int spawn = std::max(0, parser.value("spawn-workers").toInt());
+        int workerThreads = threads > 0 ? threads : std::max(1, resolve_thread_count(0) / std::max(1, spawn));
+        std::vector<QProcess*> spawned;
+        for (int i = 0; i < spawn; i++) {
+            QProcess *p = new QProcess(&app);
+            p->setProcessChannelMode(QProcess::ForwardedChannels);
+            QStringList workerArgs;
+            workerArgs << "--worker" << QString("127.0.0.1:%1").arg(port) << "--threads" << QString::number(workerThreads);
+            if (!bvhCacheDir.isEmpty())
+                workerArgs << "--bvh-cache" << bvhCacheDir;
+            p->start(QCoreApplication::applicationFilePath(), workerArgs);
+            spawned.push_back(p);
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        coordinator.run(fb);
+        for (auto p : spawned)
+            p->waitForFinished(10000);
+
+        QString fileName = frame_file_name(parser.value("output"), 0, 1);
+        bool saved = save_frame(fb, fileName);
+        err << "Distributed render -> " << fileName << (saved ? "" : " (save failed)")
+            << " in " << timer.elapsed() << " ms\n";
+        if (job.deterministic)
+            err << "Hash " << QString::number(fb.hash(), 16) << "\n";
+        return saved ? 0 : 1;
+    }
+
+    // Loading and tree building happen once for all frames
+    QElapsedTimer timer;
+    timer.start();
+    scene s;
+    s.bvhCacheDir = bvhCacheDir;
+    if (!load_job_scene(job, s)) {
+        err << "Cannot load scene " << args[0] << (job.textureFile.isEmpty() ? "" : " or its texture") << "\n";
+        return 1;
+    }
+    err << "Loaded " << args[0] << " (" << s.objects.size() << " objects) in " << timer.elapsed() << " ms\n";
+
+    // The scene is static across keyframes, so cached lighting carries over
+    IrradianceCache cache;
+    PhotonMap caustics;
+    if (job.causticPhotons > 0 && !job.pathTracing) {
+        timer.restart();
+        build_job_caustics(job, s, threads, caustics);
+        err << "Stored " << caustics.size() << " caustic photons in " << timer.elapsed() << " ms\n";
+    }
+    double budget = parser.value("budget").toDouble();
+    if (budget > 0 && job.deterministic) {
+        err << "--budget depends on timing and cannot be --deterministic\n";
+        return 1;
+    }
+    int bandRows = std::max(0, parser.value("band-rows").toInt());
+    if (bandRows > 0 && (budget > 0 || parser.isSet("denoise"))) {
+        err << "--band-rows cannot be combined with --budget or --denoise\n";
+        return 1;
+    }
+    std::unique_ptr<RenderQueue> queue(budget > 0 ? new RenderQueue(threads) : nullptr);
+    int failed = 0;
+    for (int f = 0; f < static_cast<int>(frames.size()); f++) {
+        timer.restart();
+        job.eye = frames[f].eye;
+        job.target = frames[f].target;
+        job.fov = frames[f].fov;
+        QString fileName = frame_file_name(parser.value("output"), f, static_cast<int>(frames.size()));
+        bool saved = false;
+        if (bandRows > 0) {
+            // The writer encodes one band while the next renders
+            ImageStreamWriter writer;
+            saved = writer.open(fileName, width, height);
+            for (int y = 0; saved && y < height; y += bandRows) {
+                FrameBuffer band;
+                render_tile(job, s, threads, 0, y, width, std::min(bandRows, height - y), band, &cache, &caustics);
+                writer.write_band(std::move(band));
+            }
+            saved = writer.close() && saved;
+        }
+        else if (queue != nullptr) {
+            RenderRequest request;
+            request.passes = job.spp;
+            request.pathTracing = job.pathTracing;
+            request.maxDepth = job.maxDepth;
+            request.budgetSeconds = budget;
+            request.caustics = caustics.empty() ? nullptr : &caustics;
+            std::shared_ptr<RenderHandle> handle = queue->submit(&s, job.camera(), job.light, request);
+            fb = handle->wait();
+            err << "Frame " << f + 1 << ": " << static_cast<int>(handle->progress() * 100 + 0.5f)
+                << "% of " << job.spp << " passes within the budget\n";
+        }
+        else {
+            render_tile(job, s, threads, 0, 0, width, height, fb, &cache, &caustics);
+        }
+        if (bandRows == 0) {
+            if (parser.isSet("denoise"))
+                denoiser.denoise(fb);
+            saved = save_frame(fb, fileName);
+            if (job.deterministic)
+                err << "Frame " << f + 1 << " hash " << QString::number(fb.hash(), 16) << "\n";
+        }
+        if (!saved)
+            failed++;
+        err << "Frame " << f + 1 << "/" << frames.size() << " -> " << fileName
+            << (saved ? "" : " (save failed)") << " in " << timer.elapsed() << " ms\n";
+    }
+
+    return failed == 0 ? 0 : 1;
+}